@@ -46,6 +46,105 @@ using std::min;
 GenomeIndex *g_index = NULL;
 char *g_indexDirectory = NULL;
 
+//
+// With -numa replicate there's a copy of the index on each NUMA node, and g_index is the one on node 0.
+//
+GenomeIndex *g_indexReplicas[MaxNumaNodes];
+int g_nIndexReplicas = 0;
+NumaIndexPlacement g_indexNumaPlacement = NumaPlacementNone;
+
+    static GenomeIndex *
+LoadIndexWithNumaPlacement(
+    AlignerOptions *options)
+/*++
+
+Routine Description:
+
+    Load the index, placing it on the NUMA nodes the way the options say.  For replicate, this loads a copy onto each node,
+    fills in g_indexReplicas and returns the copy on node 0.  When the placement can't be done, it says so and falls back
+    to interleaving, or to loading the index the usual way.
+
+Arguments:
+
+    options     - the options for this run
+
+Return Value:
+
+    The index, or NULL if it failed to load.
+
+--*/
+{
+    int nNodes = GetNumberOfNumaNodes();
+    NumaIndexPlacement placement = options->numaPlacement;
+
+    if (NumaPlacementNone != placement && (options->mapIndex || options->sharedMemoryIndex)) {
+        WriteStatusMessage("(-numa doesn't apply to a mapped or shared memory index) ");
+        placement = NumaPlacementNone;
+    } else if (1 == nNodes) {
+        placement = NumaPlacementNone;
+    }
+
+    if (NumaPlacementReplicate == placement) {
+        //
+        // Leave a quarter of each node for everything else.
+        //
+        const unsigned filenameBufferSize = MAX_PATH + 1;
+        char filenameBuffer[filenameBufferSize];
+        const char *indexFiles[] = {"GenomeIndexHash", "OverflowTable", "Genome"};
+        _int64 indexSize = 0;
+        for (size_t i = 0; i < sizeof(indexFiles) / sizeof(indexFiles[0]); i++) {
+            snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", options->indexDir, PATH_SEP, indexFiles[i]);
+            indexSize += QueryFileSize(filenameBuffer);
+        }
+
+        for (int node = 0; node < nNodes; node++) {
+            if (QueryNumaNodeMemorySize(node) / 4 * 3 < indexSize) {
+                WriteStatusMessage("(NUMA node %d doesn't have room for a copy of the index, so interleaving it instead) ", node);
+                placement = NumaPlacementInterleave;
+                break;
+            }
+        }
+
+        if (NumaPlacementReplicate == placement && !SetThreadMemoryPolicyToNumaNode(0)) {
+            WriteStatusMessage("(can't place memory on NUMA nodes, so not replicating the index) ");
+            placement = NumaPlacementNone;
+        }
+    }
+
+    if (NumaPlacementReplicate == placement) {
+        for (int node = 0; node < nNodes; node++) {
+            SetThreadMemoryPolicyToNumaNode(node);
+            g_indexReplicas[node] = GenomeIndex::loadFromDirectory((char*) options->indexDir, false, false, options->packGenome);
+            SetThreadMemoryPolicyToDefault();
+
+            if (NULL == g_indexReplicas[node]) {
+                for (int i = 0; i < node; i++) {
+                    delete g_indexReplicas[i];
+                }
+                return NULL;
+            }
+        }
+        g_nIndexReplicas = nNodes;
+        return g_indexReplicas[0];
+    }
+
+    bool interleaved = false;
+    if (NumaPlacementInterleave == placement) {
+        interleaved = SetThreadMemoryPolicyToInterleaved();
+        if (!interleaved) {
+            WriteStatusMessage("(can't interleave memory across NUMA nodes, so loading the index normally) ");
+        }
+    }
+
+    GenomeIndex *index = GenomeIndex::loadFromDirectory((char*) options->indexDir, options->mapIndex, options->prefetchIndex, options->packGenome, options->sharedMemoryIndex);
+
+    if (interleaved) {
+        SetThreadMemoryPolicyToDefault();
+    }
+
+    return index;
+}
+
 AlignerContext::AlignerContext(int i_argc, const char **i_argv, const char *i_version, AlignerExtension* i_extension)
     :
     index(NULL),
@@ -57,7 +156,8 @@ AlignerContext::AlignerContext(int i_argc, const char **i_argv, const char *i_ve
     argc(i_argc),
     argv(i_argv),
     version(i_version),
-    perfFile(NULL)
+    perfFile(NULL),
+    numaNode(0)
 {
 }
 
@@ -117,6 +217,10 @@ AlignerContext::initializeThread()
 {
     stats = newStats(); // separate copy per thread
     stats->extra = extension->extraStats();
+    numaNode = GetNumaNodeOfProcessor(threadNum % GetNumberOfProcessors());
+    if (numaNode < g_nIndexReplicas) {
+        index = g_indexReplicas[numaNode];
+    }
     readWriter = writerSupplier != NULL ? writerSupplier->getWriter() : NULL;
     extension = extension->copy();
 }
@@ -124,8 +228,25 @@ AlignerContext::initializeThread()
     void
 AlignerContext::runThread()
 {
+    if (NumaPlacementNone != options->numaPlacement) {
+        //
+        // Keep the thread and its working memory (its BigAllocator in particular) on its node.  A thread that's bound to a
+        // processor is already on the node.
+        //
+        if (!options->bindToProcessors) {
+            BindThreadToNumaNode(numaNode);
+        }
+        SetThreadMemoryPolicyToNumaNode(numaNode);
+    }
+
     extension->beginThread();
     runIterationThread();
+
+    stats->threadsFinished = 1;
+    stats->sumOfThreadFinishTimes = stats->lastThreadFinishTime = timeInMillis();
+    stats->threadsByNumaNode[numaNode] = 1;
+    stats->readsByNumaNode[numaNode] = stats->totalReads;
+
     if (readWriter != NULL) {
         readWriter->close();
         delete readWriter;
@@ -146,9 +267,14 @@ AlignerContext::finishThread(AlignerContext* common)
     bool
 AlignerContext::initialize()
 {
-    if (g_indexDirectory == NULL || strcmp(g_indexDirectory, options->indexDir) != 0) {
+    if (g_indexDirectory == NULL || strcmp(g_indexDirectory, options->indexDir) != 0 || g_indexNumaPlacement != options->numaPlacement) {
+        for (int i = 1; i < g_nIndexReplicas; i++) {
+            delete g_indexReplicas[i];  // [0] is g_index
+        }
+        g_nIndexReplicas = 0;
         delete g_index;
         g_index = NULL;
+        g_indexNumaPlacement = options->numaPlacement;
         delete g_indexDirectory;
         g_indexDirectory = new char [strlen(options->indexDir) + 1];
         strcpy(g_indexDirectory, options->indexDir);
@@ -158,7 +284,7 @@ AlignerContext::initialize()
  
             fflush(stdout);
             _int64 loadStart = timeInMillis();
-            index = GenomeIndex::loadFromDirectory((char*) options->indexDir, options->mapIndex, options->prefetchIndex);
+            index = LoadIndexWithNumaPlacement(options);
             if (index == NULL) {
                 WriteErrorMessage("Index load failed, aborting.\n");
 				return false;
@@ -199,6 +325,13 @@ AlignerContext::initialize()
     }
 
     DataSupplier::ThreadCount = options->numThreads;
+    DataSupplier::WriteGzipIndex = options->writeGzipIndex;
+    DataSupplier::GzipIndexDirectory = options->gzipIndexDirectory;
+#ifdef __linux__
+    AsyncFile::UseIoUring = options->ioUringOutput;
+    DataSupplier::SetDefault(!options->ioUringInput ? DataSupplier::MemMap :
+        options->directIoInput ? DataSupplier::IoUringDirect : DataSupplier::IoUringBuffered);
+#endif
 
     return true;
 }
@@ -246,6 +379,8 @@ AlignerContext::beginIteration()
             format = FileFormat::SAM[options->useM];
         } else if (BAMFile == options->outputFile.fileType) {
             format = FileFormat::BAM[options->useM];
+        } else if (RefCompressedFile == options->outputFile.fileType) {
+            format = FileFormat::RefCompressed[options->useM];
         } else {
             //
             // This shouldn't happen, because the command line parser should catch it.  Perhaps you've added a new output file format and just
@@ -341,6 +476,59 @@ AlignerContext::printStats()
 		FormatUIntWithCommas((alignTime + 500) / 1000, alignTimeString, strBufLen)
 		);
 
+    if (NumaPlacementNone != options->numaPlacement) {
+        for (int node = 0; node < MaxNumaNodes; node++) {
+            if (0 != stats->threadsByNumaNode[node]) {
+                char nodeReads[strBufLen];
+                char nodeReadsPerSecond[strBufLen];
+                WriteStatusMessage("NUMA node %d: %lld threads, %s reads, %s reads/s\n", node, stats->threadsByNumaNode[node],
+                    FormatUIntWithCommas(stats->readsByNumaNode[node], nodeReads, strBufLen),
+                    FormatUIntWithCommas((unsigned _int64)(1000 * stats->readsByNumaNode[node] / max(alignTime, (_int64)1)), nodeReadsPerSecond, strBufLen));
+            }
+        }
+    }
+
+    if (stats->exactMatchFastPathReads > 0) {
+        char fastPathReads[strBufLen];
+        WriteStatusMessage("%s reads (%.2f%%) were unique exact matches and skipped the full search\n",
+            FormatUIntWithCommas(stats->exactMatchFastPathReads, fastPathReads, strBufLen), 100.0 * stats->exactMatchFastPathReads / max(stats->totalReads, (_int64)1));
+    }
+
+    _int64 readsSeeded = 0, seedsLookedUp = 0;
+    for (unsigned i = 0; i <= AlignerStats::maxSeedsPerReadBucket; i++) {
+        readsSeeded += stats->seedsPerReadHistogram[i];
+        seedsLookedUp += i * stats->seedsPerReadHistogram[i];
+    }
+    if (readsSeeded > 0) {
+        WriteStatusMessage("%.2f seed lookups per read searched\n", (double)seedsLookedUp / readsSeeded);
+    }
+
+    if (options->adaptiveSeeding) {
+        WriteStatusMessage("Adaptive seeding stopped %lld reads early and gave %lld ambiguous reads more seeds\n",
+            stats->adaptiveSeedingEarlyStops, stats->adaptiveSeedingEscalations);
+        WriteStatusMessage("Seed lookups per read:\nseeds\treads\n");
+        for (unsigned i = 0; i <= AlignerStats::maxSeedsPerReadBucket; i++) {
+            if (0 != stats->seedsPerReadHistogram[i]) {
+                WriteStatusMessage("%s%d\t%lld\n", i == AlignerStats::maxSeedsPerReadBucket ? ">=" : "", i, stats->seedsPerReadHistogram[i]);
+            }
+        }
+    }
+
+    if (stats->seedLookupCacheLookups > 0) {
+        WriteStatusMessage("Seed lookup cache answered %lld of %lld seed lookups (%.2f%%)\n", stats->seedLookupCacheHits, stats->seedLookupCacheLookups,
+            100.0 * stats->seedLookupCacheHits / stats->seedLookupCacheLookups);
+    }
+
+    if (stats->threadsFinished > 1) {
+        WriteStatusMessage("%lld ranges of input stolen between threads, %.1f thread-seconds idle waiting for the last thread to finish\n",
+            stats->rangesStolen, (stats->threadsFinished * stats->lastThreadFinishTime - stats->sumOfThreadFinishTimes) / 1000.0);
+    }
+
+    if (DataReader::DecompressTime > 0) {
+        WriteStatusMessage("Decompressed %lld MB of input in %.1fs, %.1f MB/s\n", DataReader::DecompressedBytes / (1024 * 1024),
+            DataReader::DecompressTime / 1e9, DataReader::DecompressedBytes / (1024.0 * 1024.0) / (DataReader::DecompressTime / 1e9));
+    }
+
     if (NULL != perfFile) {
         fprintf(perfFile, "%d\t%d\t%0.2f%%\t%0.2f%%\t%0.2f%%\t%0.2f%%\t%0.2f%%\t%lld\t%lld\tt%.0f\n",
                 maxHits_, maxDist_, 
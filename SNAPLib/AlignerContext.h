@@ -127,6 +127,7 @@ public:
 
     // Per-thread context state used during alignment process
     ReadWriter         *readWriter;
+    int                 numaNode;
 };
 
 // abstract class for extending base context
@@ -32,6 +32,7 @@ Revision History:
 #include "Error.h"
 #include "BaseAligner.h"
 #include "CommandProcessor.h"
+#include "Deflate.h"
 
 AlignerOptions::AlignerOptions(
     const char* i_commandLine,
@@ -49,6 +50,8 @@ AlignerOptions::AlignerOptions(
     noDuplicateMarking(false),
     noQualityCalibration(false),
     sortMemory(0),
+    sortInMemory(0),
+    compressionLevel(-1),
     filterFlags(0),
     explorePopularSeeds(false),
     stopOnFirstHit(false),
@@ -74,7 +77,20 @@ AlignerOptions::AlignerOptions(
 	minReadLength(DEFAULT_MIN_READ_LENGTH),
     maxDistFraction(0.0),
 	mapIndex(false),
-	prefetchIndex(false)
+	prefetchIndex(false),
+    sharedMemoryIndex(false),
+    ioUringInput(false),
+    directIoInput(false),
+    ioUringOutput(false),
+    writeGzipIndex(false),
+    gzipIndexDirectory(NULL),
+    packGenome(false),
+    seedLookupCacheMB(0),
+    seedLookupCacheMinHits(16),
+    adaptiveSeeding(false),
+    exactMatchFastPath(false),
+    readsInFlight(DEFAULT_READS_IN_FLIGHT),
+    numaPlacement(NumaPlacementNone)
 {
     if (forPairedEnd) {
         maxDist                 = 15;
@@ -103,9 +119,11 @@ AlignerOptions::usageMessage()
 	WriteErrorMessage(
 		"Usage: \n%s\n"
 		"Options:\n"
-		"  -o   filename  output alignments to filename in SAM or BAM format, depending on the file extension or\n"
-		"       explicit type specifier (see below).  Use a dash with an explicit type specifier to write to\n"
-        "       stdout, so for example -o -sam - would write SAM output to stdout\n"
+		"  -o   filename  output alignments to filename in SAM, BAM or reference-compressed (.rca) format, depending on\n"
+		"       the file extension or explicit type specifier (see below).  Use a dash with an explicit type specifier to\n"
+        "       write to stdout, so for example -o -sam - would write SAM output to stdout.  Reference-compressed files\n"
+        "       hold BAM records with each read's bases stored as its differences from the reference, so they're smaller\n"
+        "       than BAM, but can only be read (by SNAP) with the same index they were aligned against\n"
 		"  -d   maximum edit distance allowed per read or pair (default: %d)\n"
 		"  -n   number of seeds to use per read\n"
 		"  -sc  Seed coverage (i.e., readSize/seedSize).  Floating point.  Exclusive with -n.  (default uses -n)\n"
@@ -118,6 +136,10 @@ AlignerOptions::usageMessage()
 		"       with small caches or lots of cores/cache\n"
 		"  -so  sort output file by alignment location\n"
 		"  -sm  memory to use for sorting in Gb\n"
+		"  -sim memory in Gb to hold sorted output in before spilling it to a temp file.  This comes on top of\n"
+		"       the index and -sm, so leave room for them (default 0, which always uses the temp file)\n"
+		"  -cl  compression level for BAM or .rca output, from 1 (fastest) to %d (smallest); default %d,\n"
+		"       compressing with %s\n"
 		"  -x   explore some hits of overly popular seeds (useful for filtering)\n"
 		"  -f   stop on first match within edit distance limit (filtering mode)\n"
 		"  -F   filter output (a=aligned only, s=single hit only (MAPQ >= %d), u=unaligned only, l=long enough to align (see -mrl))\n"
@@ -161,7 +183,39 @@ AlignerOptions::usageMessage()
 		"  -pre Prefetch the index into system cache.  This is only meaningful with -map, and only helps if the index is not\n"
 		"       already in memory and your operating system is slow at reading mapped files (i.e., some versions of Linux,\n"
 		"       but not Windows).\n"
+		"  -shm Use the copy of the index that 'snap shm load' put in shared memory, which takes no time to load.  If the index\n"
+		"       isn't in shared memory, or its files have changed since it was put there, it's loaded normally.\n"
+		"  -pg  Keep the reference genome packed two bits per base in memory.  This uses a quarter of the memory for the genome\n"
+		"       at some cost in alignment speed.  It works with any index, but loads fastest from one built with -packGenome, and\n"
+		"       only such an index can be used with -map in packed form.\n"
         "  -lp  Run SNAP at low scheduling priority (Only implemented on Windows)\n"
+		"  -iou Read input files with io_uring rather than by mapping them (Only implemented on Linux, and falls back to mapping\n"
+		"       if the kernel doesn't support io_uring)\n"
+		"  -iod Like -iou, but with O_DIRECT, so the input doesn't fill the page cache (where the file system allows it)\n"
+		"  -iouo Write output files (and the temporary files for sorting) with io_uring rather than POSIX AIO (Only implemented\n"
+		"       on Linux, and falls back to POSIX AIO if the kernel doesn't support io_uring)\n"
+		"  -gzi Write an index of places to start decompressing for plain (not BGZF) gzipped input that doesn't have one,\n"
+		"       so that later runs can decompress it on several threads.  See below\n"
+		"  -gziDir Like -gzi, but keep the indices in the given directory rather than next to the input\n"
+		"  -slc Size in MB of each thread's cache of seed lookups for popular seeds, which come up again and again in reads\n"
+		"       from repeats.  The output is the same either way.  Default 0 (no cache)\n"
+		"  -slcHits  The fewest hits (counting both directions) that a seed needs to go in the seed lookup cache (default %d)\n"
+		"  -ads Adaptive seeding (single only): stop looking up seeds for a read once they've covered it, nothing they haven't\n"
+		"       found could beat its best alignment, and its later seeds have found nothing new, so that the rest of its seed\n"
+		"       budget most likely wouldn't change its MAPQ; and give reads that are still ambiguous at the end of their seed\n"
+		"       budget (MAPQ below %d) more seeds, one lookup at a time, while a better alignment could still make them a\n"
+		"       single hit.  Only those reads can align differently, and rarely do.  The histogram of seeds looked up per read\n"
+		"       shows the difference.\n"
+		"  -efp Exact match fast path: let reads that match the genome exactly in one place take that hit straight away\n"
+		"       rather than going through the full search.  The output should be the same either way\n"
+		"  -rif Reads in flight (single only): how many reads each thread looks up the first seeds of together before it\n"
+		"       aligns them, so that their index and genome cache misses overlap.  The output is the same either way.\n"
+		"       Between 1 and %d, default %d\n"
+		"  -numa interleave|replicate  Place the index for machines with more than one NUMA node.  interleave spreads it evenly\n"
+		"       over the nodes; replicate loads a copy onto each node (if each node has the memory for it; otherwise it falls\n"
+		"       back to interleave), and each thread uses the copy on its own node.  Either way, aligner threads and their\n"
+		"       working memory are kept on their nodes, and the throughput of each node is reported.  Doesn't apply to -map\n"
+		"       or -shm.\n"
 #ifdef LONG_READS
         "  -dp  Edit distance as a percentage of read length (single only, overrides -d)\n"
 #endif
@@ -179,9 +233,16 @@ AlignerOptions::usageMessage()
             maxDist,
             maxHits,
 			minWeightToCheck,
+            GzipCompressor::MaxLevel,
+            GzipCompressor::DefaultLevel,
+            GzipCompressor::Library,
 			MAPQ_LIMIT_FOR_SINGLE_HIT,
             expansionFactor,
-			DEFAULT_MIN_READ_LENGTH);
+			DEFAULT_MIN_READ_LENGTH,
+            seedLookupCacheMinHits,
+            MAPQ_LIMIT_FOR_SINGLE_HIT,
+            MAX_READS_IN_FLIGHT,
+            DEFAULT_READS_IN_FLIGHT);
 
     if (extra != NULL) {
         extra->usageMessage();
@@ -207,6 +268,7 @@ AlignerOptions::usageMessage()
                       "    -compressedFastq\n"
                       "    -sam\n"
                       "    -bam\n"
+                      "    -rca\n"
                       "    -pairedFastq\n"
                       "    -pairedInterleavedFastq\n"
                       "    -pairedCompressedInterleavedFastq\n"
@@ -220,6 +282,11 @@ AlignerOptions::usageMessage()
                       "name and give an explicit type specifier.  So, for example, \n"
                       "snap single myIndex -fastq - -o -sam -\n"
                       "would read FASTQ from stdin and write SAM to stdout.\n"
+                      "With -gzi, the first time SNAP reads a gzipped FASTQ file that isn't BGZF, it writes an index of\n"
+                      "places to start decompressing next to it (or in the -gziDir directory) with .snapgzi added to the\n"
+                      "name, so that later runs can decompress it on several threads.  SNAP uses an index it finds there\n"
+                      "even without -gzi.  If the file changes, SNAP notices and ignores the index (and rebuilds it with\n"
+                      "-gzi).  If it can't write the index, it just decompresses serially.\n"
     );
 }
 
@@ -322,6 +389,70 @@ AlignerOptions::parse(
 	} else if (strcmp(argv[n], "-pre") == 0) {
 		prefetchIndex = true;
 		return true;
+	} else if (strcmp(argv[n], "-shm") == 0) {
+		sharedMemoryIndex = true;
+		return true;
+	} else if (strcmp(argv[n], "-iou") == 0) {
+		ioUringInput = true;
+		return true;
+	} else if (strcmp(argv[n], "-iod") == 0) {
+		ioUringInput = true;
+		directIoInput = true;
+		return true;
+	} else if (strcmp(argv[n], "-iouo") == 0) {
+		ioUringOutput = true;
+		return true;
+	} else if (strcmp(argv[n], "-gzi") == 0) {
+		writeGzipIndex = true;
+		return true;
+	} else if (strcmp(argv[n], "-gziDir") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            writeGzipIndex = true;
+            gzipIndexDirectory = argv[n];
+            return true;
+        }
+        return false;
+	} else if (strcmp(argv[n], "-pg") == 0) {
+		packGenome = true;
+		return true;
+	} else if (strcmp(argv[n], "-slc") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            seedLookupCacheMB = atoi(argv[n]);
+            return true;
+        }
+	} else if (strcmp(argv[n], "-ads") == 0) {
+        adaptiveSeeding = true;
+        return !isPaired();
+	} else if (strcmp(argv[n], "-efp") == 0) {
+        exactMatchFastPath = true;
+        return true;
+	} else if (strcmp(argv[n], "-rif") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            readsInFlight = atoi(argv[n]);
+            return (!isPaired()) && readsInFlight >= 1 && readsInFlight <= MAX_READS_IN_FLIGHT;
+        }
+        return false;
+	} else if (strcmp(argv[n], "-slcHits") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            seedLookupCacheMinHits = atoi(argv[n]);
+            return seedLookupCacheMinHits >= 1;
+        }
+	} else if (strcmp(argv[n], "-numa") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            if (strcmp(argv[n], "interleave") == 0) {
+                numaPlacement = NumaPlacementInterleave;
+            } else if (strcmp(argv[n], "replicate") == 0) {
+                numaPlacement = NumaPlacementReplicate;
+            } else {
+                return false;
+            }
+            return true;
+        }
 	}
 	else if (strcmp(argv[n], "-S") == 0) {
         if (n + 1 < argc) {
@@ -349,6 +480,23 @@ AlignerOptions::parse(
             n++;
             return true;
         }
+    } else if (strcmp(argv[n], "-sim") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            sortInMemory = atoi(argv[n+1]);
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-cl") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            compressionLevel = atoi(argv[n+1]);
+            if (compressionLevel < 1 || compressionLevel > GzipCompressor::MaxLevel) {
+                // level 0 would store blocks uncompressed, and they'd grow rather than shrink in the write buffer
+                WriteErrorMessage("Compression level (-cl) must be between 1 and %d\n", GzipCompressor::MaxLevel);
+                return false;
+            }
+            n++;
+            return true;
+        }
     } else if (strcmp(argv[n], "-F") == 0) {
         if (n + 1 < argc) {
             n++;
@@ -737,7 +885,7 @@ AlignerOptions::passFilter(
     PairedReadSupplierGenerator *
 SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpairedReads, const ReaderContext& context)
 {
-    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
+    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == RefCompressedFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
 
     switch (fileType) {
     case SAMFile:
@@ -746,6 +894,10 @@ SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpa
     case BAMFile:
         return BAMReader::createPairedReadSupplierGenerator(fileName,numThreads, quicklyDropUnpairedReads, context);
 
+    case RefCompressedFile:
+        return BAMReader::createPairedReadSupplierGenerator(fileName, numThreads, quicklyDropUnpairedReads, context, 5000,
+            DataSupplier::RefCompressed(isStdio ? DataSupplier::Stdio : DataSupplier::Default, context.genome));
+
     case FASTQFile:
         return PairedFASTQReader::createPairedReadSupplierGenerator(fileName, secondFileName, numThreads, context, isCompressed);
 
@@ -771,6 +923,10 @@ SNAPFile::createReadSupplierGenerator(int numThreads, const ReaderContext& conte
     case BAMFile:
         return BAMReader::createReadSupplierGenerator(fileName,numThreads, context);
 
+    case RefCompressedFile:
+        return BAMReader::createReadSupplierGenerator(fileName, numThreads, context,
+            DataSupplier::RefCompressed(isStdio ? DataSupplier::Stdio : DataSupplier::Default, context.genome));
+
     case FASTQFile:
         return FASTQReader::createReadSupplierGenerator(fileName, numThreads, context, isCompressed);
 
@@ -851,6 +1007,10 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
             snapFile->fileType = BAMFile;
             snapFile->isCompressed = true;
             *argsConsumed = 2;
+        } else if (!strcmp(args[0], "-rca")) {
+            snapFile->fileType = RefCompressedFile;
+            snapFile->isCompressed = true;
+            *argsConsumed = 2;
         } else if (!strcmp(args[0], "-pairedInterleavedFastq") || !strcmp(args[0], "-pairedCompressedInterleavedFastq")) {
             if (!paired) {
                 WriteErrorMessage("Specified %s for a single-end alignment.  To treat it as single-end, just use ordinary fastq (or compressed fastq, as appropriate)\n", args[0]);
@@ -884,11 +1044,14 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
     } else if (util::stringEndsWith(args[0], ".bam")) {
         snapFile->fileType = BAMFile;
         snapFile->isCompressed = true;
+    } else if (util::stringEndsWith(args[0], ".rca")) {
+        snapFile->fileType = RefCompressedFile;
+        snapFile->isCompressed = true;
     } else if (!isInput) {
         //
         // No default output file type.
         //
-        WriteErrorMessage("You specified an output file with name '%s', which doesn't end in .sam or .bam, and doesn't have an explicit type\n"
+        WriteErrorMessage("You specified an output file with name '%s', which doesn't end in .sam, .bam or .rca, and doesn't have an explicit type\n"
                           "specifier.  There is no default output file type.  Consider doing something like '-o -bam %s'\n", args[0], args[0]);
 		return false;
     } else if (util::stringEndsWith(args[0], ".fq") || util::stringEndsWith(args[0], ".fastq") ||
@@ -31,6 +31,8 @@ Revision History:
 
 #define MAPQ_LIMIT_FOR_SINGLE_HIT 10
 #define MAX_JUNCTION_TRIM 32
+#define MAX_READS_IN_FLIGHT 64
+#define DEFAULT_READS_IN_FLIGHT 1
 
 struct AbstractOptions
 {
@@ -39,7 +41,9 @@ struct AbstractOptions
     virtual bool parse(const char** argv, int argc, int& n, bool *done) = 0;
 };
 
-enum FileType {UnknownFileType, SAMFile, FASTQFile, BAMFile, InterleavedFASTQFile, CRAMFile};  // Add more as needed
+enum FileType {UnknownFileType, SAMFile, FASTQFile, BAMFile, InterleavedFASTQFile, CRAMFile, RefCompressedFile};  // Add more as needed
+
+enum NumaIndexPlacement {NumaPlacementNone, NumaPlacementInterleave, NumaPlacementReplicate};
 
 struct SNAPFile {
 	SNAPFile() : fileName(NULL), secondFileName(NULL), fileType(UnknownFileType), isStdio(false), omitSQLines(false) {}
@@ -81,6 +85,8 @@ struct AlignerOptions : public AbstractOptions
     bool                noDuplicateMarking;
     bool                noQualityCalibration;
     unsigned            sortMemory; // total output sorting buffer size in Gb
+    int                 sortInMemory; // sorted output to hold in memory rather than the temp file in Gb, 0 for none
+    int                 compressionLevel; // for BAM output, -1 for the default
     unsigned            filterFlags;
     bool                explorePopularSeeds;
     bool                stopOnFirstHit;
@@ -104,6 +110,19 @@ struct AlignerOptions : public AbstractOptions
 	unsigned			minReadLength;
 	bool				mapIndex;
 	bool				prefetchIndex;
+    bool                sharedMemoryIndex;  // Use the copy of the index that 'snap shm load' put in shared memory
+    bool                ioUringInput;       // Read input files with io_uring rather than mapping them (Linux only)
+    bool                directIoInput;      // And with O_DIRECT
+    bool                ioUringOutput;      // Write output and sort temporary files with io_uring rather than POSIX AIO (Linux only)
+    bool                writeGzipIndex;     // Write a .snapgzi index for plain gzip input that doesn't have one
+    const char         *gzipIndexDirectory; // Where .snapgzi indices go, NULL for next to the input
+    bool                packGenome;     // Keep the reference 2-bit packed in memory
+    unsigned            seedLookupCacheMB;      // Size of each thread's cache of popular seed lookups, 0 for none
+    unsigned            seedLookupCacheMinHits; // Fewest hits for a seed to go in the cache
+    bool                adaptiveSeeding;        // Let each read's seed budget depend on how sure we are of its alignment
+    bool                exactMatchFastPath;     // Let reads that match exactly in one place skip the full search
+    unsigned            readsInFlight;          // Reads each single-end aligner thread looks up the first seeds of at once
+    NumaIndexPlacement  numaPlacement;  // How to spread the index over NUMA nodes, and whether to keep threads on their nodes
     size_t              writeBufferSize;
     char junctionSeq[MAX_JUNCTION_TRIM]; // joining junction for HiC, Chicago, etc reads where we should trim read at.    
     static bool         useHadoopErrorMessages; // This is static because it's global (and I didn't want to push the options object to every place in the code)
@@ -38,12 +38,29 @@ AlignerStats::AlignerStats(AbstractStats* i_extra)
     notFound(0),
     alignedAsPairs(0),
     extra(i_extra),
-    lvCalls(0)
+    lvCalls(0),
+    exactMatchFastPathReads(0),
+    seedLookupCacheLookups(0),
+    seedLookupCacheHits(0),
+    adaptiveSeedingEarlyStops(0),
+    adaptiveSeedingEscalations(0),
+    rangesStolen(0),
+    threadsFinished(0),
+    sumOfThreadFinishTimes(0),
+    lastThreadFinishTime(0)
 {
     for (int i = 0; i <= AlignerStats::maxMapq; i++) {
         mapqHistogram[i] = 0;
      }
 
+    for (unsigned i = 0; i <= AlignerStats::maxSeedsPerReadBucket; i++) {
+        seedsPerReadHistogram[i] = 0;
+    }
+
+    for (int i = 0; i < MaxNumaNodes; i++) {
+        threadsByNumaNode[i] = readsByNumaNode[i] = 0;
+    }
+
     for (int i = 0; i < maxMaxHits; i++) {
         countOfBestHitsByWeightDepth[i] = 0;
         countOfAllHitsByWeightDepth[i] = 0;
@@ -87,6 +104,15 @@ AlignerStats::add(
     notFound += other->notFound;
     alignedAsPairs += other->alignedAsPairs;
     lvCalls += other->lvCalls;
+    exactMatchFastPathReads += other->exactMatchFastPathReads;
+    seedLookupCacheLookups += other->seedLookupCacheLookups;
+    seedLookupCacheHits += other->seedLookupCacheHits;
+    adaptiveSeedingEarlyStops += other->adaptiveSeedingEarlyStops;
+    adaptiveSeedingEscalations += other->adaptiveSeedingEscalations;
+    rangesStolen += other->rangesStolen;
+    threadsFinished += other->threadsFinished;
+    sumOfThreadFinishTimes += other->sumOfThreadFinishTimes;
+    lastThreadFinishTime = __max(lastThreadFinishTime, other->lastThreadFinishTime);
 
     if (extra != NULL && other->extra != NULL) {
         extra->add(other->extra);
@@ -96,6 +122,15 @@ AlignerStats::add(
         mapqHistogram[i] += other->mapqHistogram[i];
     }
 
+    for (unsigned i = 0; i <= AlignerStats::maxSeedsPerReadBucket; i++) {
+        seedsPerReadHistogram[i] += other->seedsPerReadHistogram[i];
+    }
+
+    for (int i = 0; i < MaxNumaNodes; i++) {
+        threadsByNumaNode[i] += other->threadsByNumaNode[i];
+        readsByNumaNode[i] += other->readsByNumaNode[i];
+    }
+
     for (int i = 0; i < maxMaxHits; i++) {
         countOfBestHitsByWeightDepth[i] += other->countOfBestHitsByWeightDepth[i];
         countOfAllHitsByWeightDepth[i] += other->countOfAllHitsByWeightDepth[i];
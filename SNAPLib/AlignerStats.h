@@ -51,9 +51,33 @@ struct AlignerStats : public AbstractStats
     _int64 notFound;
     _int64 alignedAsPairs;
     _int64 lvCalls;
+    _int64 exactMatchFastPathReads;   // Reads that the single end aligner found as unique exact matches without a full search
+    _int64 seedLookupCacheLookups;    // Seed lookups that went through a SeedLookupCache
+    _int64 seedLookupCacheHits;       // And the ones it had the answer for
+    _int64 adaptiveSeedingEarlyStops;     // Reads that adaptive seeding let stop looking up seeds before the usual limits
+    _int64 adaptiveSeedingEscalations;    // And ones it gave more seeds because they were still ambiguous
     static const unsigned maxMapq = 70;
     unsigned mapqHistogram[maxMapq+1];
 
+    //
+    // How many seeds the single end aligner looked up in the index for each read it searched.  The last bucket is for
+    // that many or more.
+    //
+    static const unsigned maxSeedsPerReadBucket = 64;
+    _int64 seedsPerReadHistogram[maxSeedsPerReadBucket + 1];
+
+    //
+    // How the work was spread over the threads.  Each thread records when it ran out of work, so the time the threads spent
+    // idle waiting for the last one to finish is threadsFinished * lastThreadFinishTime - sumOfThreadFinishTimes.
+    //
+    _int64 rangesStolen;
+    _int64 threadsFinished;
+    _int64 sumOfThreadFinishTimes;    // In ms
+    _int64 lastThreadFinishTime;      // In ms
+
+    _int64 threadsByNumaNode[MaxNumaNodes];
+    _int64 readsByNumaNode[MaxNumaNodes];
+
 #if TIME_HISTOGRAM
     //
     // Histogram of alignment times.  Time buckets are divided by powers-of-two nanoseconds, so time bucket 0 is 
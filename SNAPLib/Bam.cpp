@@ -33,6 +33,7 @@ Environment:
 #include "VariableSizeMap.h"
 #include "PairedAligner.h"
 #include "GzipDataWriter.h"
+#include "Deflate.h"
 #include "Error.h"
 
 using std::max;
@@ -63,11 +64,14 @@ BAMReader::init(
     const char *fileName,
     int bufferCount,
     _int64 startingOffset,
-    _int64 amountOfFileToProcess)
+    _int64 amountOfFileToProcess,
+    DataSupplier* supplier)
 {
     // todo: integrate supplier models
     // might need up to 3x extra for expanded sequence + quality + cigar data
-    if (!strcmp("-", fileName)) {
+    if (supplier != NULL) {
+        data = supplier->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor);
+    } else if (!strcmp("-", fileName)) {
         data = DataSupplier::GzipBamStdio->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor);
     } else {
         data = DataSupplier::GzipBamDefault->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor);
@@ -181,10 +185,11 @@ BAMReader::create(
     int bufferCount,
     _int64 startingOffset,
     _int64 amountOfFileToProcess,
-    const ReaderContext& context)
+    const ReaderContext& context,
+    DataSupplier* supplier)
 {
     BAMReader* reader = new BAMReader(context);
-    reader->init(fileName, bufferCount, startingOffset, amountOfFileToProcess);
+    reader->init(fileName, bufferCount, startingOffset, amountOfFileToProcess, supplier);
     return reader;
 }
 
@@ -201,9 +206,10 @@ BAMReader::reinit(
 BAMReader::createReadSupplierGenerator(
     const char *fileName,
     int numThreads,
-    const ReaderContext& context)
+    const ReaderContext& context,
+    DataSupplier* supplier)
 {
-    BAMReader* reader = create(fileName, ReadSupplierQueue::BufferCount(numThreads), 0, 0, context);
+    BAMReader* reader = create(fileName, ReadSupplierQueue::BufferCount(numThreads), 0, 0, context, supplier);
     ReadSupplierQueue* queue = new ReadSupplierQueue((ReadReader*)reader);
     queue->startReaders();
     return queue;
@@ -215,10 +221,11 @@ BAMReader::createPairedReadSupplierGenerator(
     int numThreads,
     bool quicklyDropUnmatchedReads,
     const ReaderContext& context,
-    int matchBufferSize)
+    int matchBufferSize,
+    DataSupplier* supplier)
 {
     BAMReader* reader = create(fileName, 
-        ReadSupplierQueue::BufferCount(numThreads) + PairedReadReader::MatchBuffers, 0, 0, context);
+        ReadSupplierQueue::BufferCount(numThreads) + PairedReadReader::MatchBuffers, 0, 0, context, supplier);
     PairedReadReader* matcher = PairedReadReader::PairMatcher(reader, quicklyDropUnmatchedReads);
     ReadSupplierQueue* queue = new ReadSupplierQueue(matcher);
     queue->startReaders();
@@ -307,7 +314,7 @@ BAMAlignment::l_ref()
     }
     _uint32* p = cigar();
     int len = 0;
-    static const int op_ref[16] = {1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+    static const int op_ref[16] = {1, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0}; // M, D, N, = and X
     for (int i = 0; i < n_cigar_op; i++) {
         _uint32 op = *p++;
         len += op_ref[(op & 15)] * (op >> 4);
@@ -331,14 +338,17 @@ BAMAlignment::_init::_init()
     int
 BAMAlignment::reg2bin(
     int beg,
-    int end)
+    int end,
+    int minShift,
+    int depth)
 {
     --end;
-    if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
-    if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
-    if (beg>>20 == end>>20) return ((1<<9)-1)/7 + (beg>>20);
-    if (beg>>23 == end>>23) return ((1<<6)-1)/7 + (beg>>23);
-    if (beg>>26 == end>>26) return ((1<<3)-1)/7 + (beg>>26);
+    int shift = minShift, first = ((1 << (3 * depth)) - 1) / 7;
+    for (int level = depth; level > 0; level--) {
+        if (beg >> shift == end >> shift) return first + (beg >> shift);
+        shift += 3;
+        first -= 1 << (3 * (level - 1));
+    }
     return 0;
 }
 
@@ -346,16 +356,19 @@ BAMAlignment::reg2bin(
 BAMAlignment::reg2bins(
     int beg,
     int end,
-    _uint16* list)
+    int* list,
+    int minShift,
+    int depth)
 {
     int i = 0, k;
     --end;
     list[i++] = 0;
-    for (k = 1 + (beg>>26); k <= 1 + (end>>26); ++k) list[i++] = k;
-    for (k = 9 + (beg>>23); k <= 9 + (end>>23); ++k) list[i++] = k;
-    for (k = 73 + (beg>>20); k <= 73 + (end>>20); ++k) list[i++] = k;
-    for (k = 585 + (beg>>17); k <= 585 + (end>>17); ++k) list[i++] = k;
-    for (k = 4681 + (beg>>14); k <= 4681 + (end>>14); ++k) list[i++] = k;
+    int shift = minShift + 3 * (depth - 1), first = 1;
+    for (int level = 1; level <= depth; level++) {
+        for (k = first + (beg >> shift); k <= first + (end >> shift); ++k) list[i++] = k;
+        first += 1 << (3 * level);
+        shift -= 3;
+    }
     return i;
 }
 
@@ -646,7 +659,7 @@ BAMFormat::getWriterSupplier(
 {
     DataWriterSupplier* dataSupplier;
     GzipWriterFilterSupplier* gzipSupplier =
-        DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false, options->sortOutput);
+        DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false, options->sortOutput, options->compressionLevel);
         // (leave a thread free for main, and let OS map threads to cores to allow system IO etc.)
     if (options->sortOutput) {
         size_t len = strlen(options->outputFile.fileName);
@@ -654,20 +667,18 @@ BAMFormat::getWriterSupplier(
         char* tempFileName = (char*) malloc(5 + len);
         strcpy(tempFileName, options->outputFile.fileName);
         strcpy(tempFileName + len, ".tmp");
-        // todo: make markDuplicates optional?
         DataWriter::FilterSupplier* filters = gzipSupplier;
-        if (! options->noDuplicateMarking) {
-            filters = DataWriterSupplier::markDuplicates(genome)->compose(filters);
-        }
         if (! options->noIndex) {
             char* indexFileName = (char*) malloc(5 + len);
             strcpy(indexFileName, options->outputFile.fileName);
-            strcpy(indexFileName + len, ".bai");
+            // BAI can't index contigs longer than 2^29 bases, but CSI can
+            strcpy(indexFileName + len, BAMIndex::depthFor(genome) > BAMIndex::BAIDepth ? ".csi" : ".bai");
             filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier)->compose(filters);
         }
         dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
             options->sortMemory * (1ULL << 30),
-            options->numThreads, options->outputFile.fileName, filters,
+            options->sortInMemory * (1LL << 30),
+            options->numThreads, ! options->noDuplicateMarking, options->outputFile.fileName, filters,
             FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors));
     } else {
         dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, gzipSupplier);
@@ -892,11 +903,15 @@ BAMFormat::writeRead(
     for (int i = 0; i < cigarOps; i++) {
         refLength += BAMAlignment::CigarCodeToRefBase[cigarBuf[i] & 0xf] * (cigarBuf[i] >> 4);
     }
-    bam->bin = genomeLocation != InvalidGenomeLocation ? BAMAlignment::reg2bin((int)positionInContig-1, (int)positionInContig-1 + refLength) :
+    if (genomeLocation != InvalidGenomeLocation && positionInContig - 1 + refLength <= (1 << 29)) {
+        bam->bin = BAMAlignment::reg2bin((int)positionInContig-1, (int)positionInContig-1 + refLength);
+    } else if (genomeLocation == InvalidGenomeLocation && mateLocation != InvalidGenomeLocation && matePositionInContig <= (1 << 29)) {
 		// unmapped is at mate's position, length 1
-		mateLocation != InvalidGenomeLocation ? BAMAlignment::reg2bin((int)matePositionInContig-1, (int)matePositionInContig) :
-		// otherwise at -1, length 1
-		BAMAlignment::reg2bin(-1, 0);
+        bam->bin = BAMAlignment::reg2bin((int)matePositionInContig-1, (int)matePositionInContig);
+    } else {
+		// otherwise at -1, length 1, as are reads past the 2^29 bases BAI bins cover (a CSI index bins those, see BAMIndex)
+		bam->bin = BAMAlignment::reg2bin(-1, 0);
+    }
     bam->n_cigar_op = cigarOps;
     bam->FLAG = flags;
     bam->l_seq = fullLength;
@@ -1207,312 +1222,267 @@ BAMFilter::tryFindRead(
     return NULL;
 }
 
-struct DuplicateReadKey
+BAMDuplicateMarker::LongPairs::LongPairs()
+    : best()
 {
-    DuplicateReadKey()
-    { memset(this, 0, sizeof(DuplicateReadKey)); }
+    InitializeExclusiveLock(&lock);
+}
 
-    DuplicateReadKey(const BAMAlignment* bam, const Genome* genome)
-    {
-        if (bam == NULL) {
-            locations[0] = locations[1] = UINT32_MAX;
-            isRC[0] = isRC[1] = false;
-        } else {
-            locations[0] = bam->getLocation(genome);
-            locations[1] = bam->getNextLocation(genome);
-            isRC[0] = (bam->FLAG & SAM_REVERSE_COMPLEMENT) != 0;
-            isRC[1] = (bam->FLAG & SAM_NEXT_REVERSED) != 0;
-            if (((((_uint64) GenomeLocationAsInt64(locations[0])) << 1) | (isRC[0] ? 1 : 0)) > ((((_uint64) GenomeLocationAsInt64(locations[1])) << 1) | (isRC[1] ? 1 : 0))) {
-                const GenomeLocation t = locations[1];
-                locations[1] = locations[0];
-                locations[0] = t;
-                const bool f = isRC[1];
-                isRC[1] = isRC[0];
-                isRC[0] = f;
-            }
-        }
-    }
+BAMDuplicateMarker::LongPairs::~LongPairs()
+{
+    DestroyExclusiveLock(&lock);
+}
 
-    bool operator==(const DuplicateReadKey& b) const
-    {
-        return locations[0] == b.locations[0] && locations[1] == b.locations[1] &&
-            isRC[0] == b.isRC[0] && isRC[1] == b.isRC[1];
-    }
+    void
+BAMDuplicateMarker::LongPairs::put(
+    DuplicateReadKey key,
+    _uint64 nameHash)
+{
+    AcquireExclusiveLock(&lock);
+    best.put(key, nameHash);
+    ReleaseExclusiveLock(&lock);
+}
 
-    bool operator!=(const DuplicateReadKey& b) const
-    {
-        return ! ((*this) == b);
+    bool
+BAMDuplicateMarker::LongPairs::mark(
+    BAMAlignment* bam,
+    const Genome* genome)
+{
+    DuplicateReadKey key(bam, genome);
+    _uint64 nameHash;
+    AcquireExclusiveLock(&lock);
+    bool found = best.tryGet(key, &nameHash);
+    ReleaseExclusiveLock(&lock);
+    // if the first reads weren't a set there's nothing to mark
+    if (found && nameHash != BAMDuplicateMarker::hashReadName(bam->read_name())) {
+        bam->FLAG |= SAM_DUPLICATE;
+        return true;
     }
+    return false;
+}
 
-    bool operator<(const DuplicateReadKey& b) const
-    {
-        return locations[0] < b.locations[0] ||
-            (locations[0] == b.locations[0] &&
-                (locations[1] < b.locations[1] ||
-                    (locations[1] == b.locations[1] &&
-                        isRC[0] * 2 + isRC[1] <  b.isRC[0] *2 + b.isRC[1])));
-    }
-
-
-    // required for use as a key in VariableSizeMap template
-    DuplicateReadKey(int x)
-    { locations[0] = locations[1] = x; isRC[0] = isRC[1] = false; }
-    bool operator==(int x) const
-    { return locations[0] == (_uint32) x && locations[1] == (_uint32) x; }
-    bool operator!=(int x) const
-    { return locations[0] != (_uint32) x || locations[1] != (_uint32) x; }
-    operator _uint64()
-    { return ((_uint64) (GenomeLocationAsInt64(locations[1]) ^ (isRC[1] ? 1 : 0))) << 32 | (_uint64) (GenomeLocationAsInt64(locations[0]) ^ (isRC[0] ? 1 : 0)); }
-
-    GenomeLocation locations[2];
-    bool isRC[2];
-};
-
-struct DuplicateMateInfo
+volatile _int64 BAMDuplicateMarker::DuplicatesMarked = 0;
+volatile _int64 BAMDuplicateMarker::Time = 0;
+
+BAMDuplicateMarker::BAMDuplicateMarker(
+    const Genome* i_genome,
+    LongPairs* i_longPairs,
+    bool i_deferLongPairs)
+    :
+    genome(i_genome),
+    longPairs(i_longPairs),
+    deferLongPairs(i_deferLongPairs),
+    bufferSize(1024 * 1024),
+    bufferUsed(0),
+    entries(1000),
+    head(0),
+    firstSequence(0),
+    sets(1000),
+    members(),
+    duplicates(0),
+    time(0)
 {
-    DuplicateMateInfo() { memset(this, 0, sizeof(DuplicateMateInfo)); }
-
-    size_t firstRunOffset; // first read in duplicate set
-    size_t firstRunEndOffset;
-    size_t bestReadOffset[4]; // file offsets of first/second/new first/old second best reads
-    int bestReadQuality[2]; // total quality of first/both best reads
-    char bestReadId[120];
-
-    void setBestReadId(const char* id) { strncpy(bestReadId, id, sizeof(bestReadId)); }
-    const char* getBestReadId() { return bestReadId; }
-};
+    buffer = new char[bufferSize];
+}
 
-class BAMDupMarkFilter : public BAMFilter
+BAMDuplicateMarker::~BAMDuplicateMarker()
 {
-public:
-    BAMDupMarkFilter(const Genome* i_genome) :
-        BAMFilter(DataWriter::ModifyFilter),
-        genome(i_genome), runOffset(0), runLocation(UINT32_MAX), runCount(0), mates()
-    {}
+    _ASSERT(head == entries.size());
+    delete[] buffer;
+    InterlockedAdd64AndReturnNewValue(&DuplicatesMarked, duplicates);
+    InterlockedAdd64AndReturnNewValue(&Time, time);
+}
 
-    ~BAMDupMarkFilter()
-    {
-#ifdef USE_DEVTEAM_OPTIONS
-        if (mates.size() > 0) {
-            WriteErrorMessage("duplicate matching ended with %d unmatched reads:\n", mates.size());
-            for (MateMap::iterator i = mates.begin(); i != mates.end(); i = mates.next(i)) {
-                WriteErrorMessage("%u%s/%u%s\n", i->key.locations[0], i->key.isRC[0] ? "rc" : "", i->key.locations[1], i->key.isRC[1] ? "rc" : "");
+    void
+BAMDuplicateMarker::add(
+    char* data,
+    GenomeDistance length,
+    GenomeLocation location,
+    bool context)
+{
+    _int64 start = timeInNanos();
+    emitReady(location, false);
+
+    // make room, first by dropping what's been passed on
+    if (bufferUsed + length > bufferSize) {
+        if (head > 0) {
+            size_t dropped = head < entries.size() ? entries[head].offset : bufferUsed;
+            for (_int64 i = head; i < entries.size(); i++) {
+                entries[i - head] = entries[i];
+                entries[i - head].offset -= dropped;
             }
+            memmove(buffer, buffer + dropped, bufferUsed - dropped);
+            bufferUsed -= dropped;
+            firstSequence += head;
+            entries.truncate((int) (entries.size() - head));
+            head = 0;
+        }
+        if (bufferUsed + length > bufferSize) {
+            size_t newSize = __max(2 * bufferSize, bufferUsed + length);
+            char* newBuffer = new char[newSize];
+            memcpy(newBuffer, buffer, bufferUsed);
+            delete[] buffer;
+            buffer = newBuffer;
+            bufferSize = newSize;
         }
-#endif
     }
+    Entry entry;
+    entry.offset = bufferUsed;
+    entry.length = length;
+    entry.context = context;
+    entry.nextInSet = -1;
+    memcpy(buffer + bufferUsed, data, length);
+    bufferUsed += length;
+
+    BAMAlignment* bam = (BAMAlignment*) (buffer + entry.offset);
+    GenomeLocation readLocation = bam->getLocation(genome);
+    if ((bam->FLAG & SAM_SECONDARY) != 0 || readLocation == UINT32_MAX) {
+        // secondary and unmapped reads are never marked
+        entry.kind = Unmarked;
+        entry.readyAt = -1;
+    } else {
+        entry.key = DuplicateReadKey(bam, genome);
+        entry.nameHash = hashReadName(bam->read_name());
+        entry.quality = getTotalQuality(bam);
+        if (entry.key.locations[1] != UINT32_MAX && entry.key.locations[1] - entry.key.locations[0] <= Window) {
+            entry.kind = ShortPair;
+            entry.readyAt = entry.key.locations[1];
+        } else if (readLocation == entry.key.locations[0]) {
+            // also reads whose mates are unmapped, and unpaired reads, which have no second read to wait for
+            entry.kind = LongFirst;
+            entry.readyAt = readLocation;
+        } else {
+            entry.kind = LongSecond;
+            entry.readyAt = -1;
+        }
+    }
+    _int64 sequence = firstSequence + entries.size();
+    if (entry.kind == ShortPair || entry.kind == LongFirst) {
+        DuplicateSet* set = sets.getOrAdd(entry.key);
+        if (set->last == -1) {
+            set->first = sequence;
+        } else {
+            getEntry(set->last)->nextInSet = sequence;
+        }
+        set->last = sequence;
+        set->pending++;
+    }
+    entries.push_back(entry);
+    time += timeInNanos() - start;
+}
 
-    static bool isDuplicate(const BAMAlignment* a, const BAMAlignment* b)
-    { return a->pos == b->pos && a->refID == b->refID &&
-        ((a->FLAG ^ b->FLAG) & (SAM_REVERSE_COMPLEMENT | SAM_NEXT_REVERSED)) == 0; }
-
-protected:
-    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+    void
+BAMDuplicateMarker::flush()
+{
+    _int64 start = timeInNanos();
+    emitReady(0, true);
+    firstSequence += entries.size();
+    entries.clear();
+    bufferUsed = 0;
+    head = 0;
+    time += timeInNanos() - start;
+}
 
-private:
-    static int getTotalQuality(BAMAlignment* bam);
-
-    const Genome* genome;
-    size_t runOffset; // offset in file of first read in run
-    GenomeLocation runLocation; // location in genome
-    int runCount; // number of aligned reads
-    typedef VariableSizeMap<DuplicateReadKey,DuplicateMateInfo,150,MapNumericHash<DuplicateReadKey>,70,0,-2> MateMap;
-    static const _uint64 RunKey = 0xffffffffc0000000UL;
-    static const _uint64 RunRC = 0x80000000;
-    static const _uint64 RunNextRC = 0x40000000;
-    static const _uint64 RunOffset = 0x3fffffff;
-    typedef VariableSizeVector<_uint64> RunVector;
-    RunVector run;
-    MateMap mates;
-};
+    void
+BAMDuplicateMarker::emitReady(
+    GenomeLocation location,
+    bool all)
+{
+    for (; head < entries.size(); head++) {
+        Entry* entry = &entries[head];
+        if (entry->readyAt >= location && ! all) {
+            break;
+        }
+        BAMAlignment* bam = (BAMAlignment*) (buffer + entry->offset);
+        if (entry->kind == ShortPair || entry->kind == LongFirst) {
+            DuplicateSet* set = sets.tryFind(entry->key);
+            _ASSERT(set != NULL);
+            if (! set->resolved) {
+                resolve(set, entry->key, entry->kind);
+            }
+            if (--set->pending == 0) {
+                sets.erase(entry->key);
+            }
+        } else if (entry->kind == LongSecond && ! (entry->context || deferLongPairs)) {
+            duplicates += longPairs->mark(bam, genome);
+        }
+        if (! entry->context) {
+            emit(buffer + entry->offset, entry->length, entry->kind == LongSecond && deferLongPairs);
+        }
+    }
+}
 
     void
-BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
+BAMDuplicateMarker::resolve(
+    DuplicateSet* set,
+    const DuplicateReadKey& key,
+    ReadKind kind)
 {
-    if ((lastBam->FLAG & SAM_SECONDARY) != 0) {
-        return; // ignore secondary aliignments; todo: mark them as dups too?
+    set->resolved = true;
+    if (set->first == set->last) {
+        return;
+    }
+    members.clear();
+    for (_int64 s = set->first; s != -1; s = getEntry(s)->nextInSet) {
+        Member member;
+        member.nameHash = getEntry(s)->nameHash;
+        member.sequence = s;
+        member.quality = getEntry(s)->quality;
+        members.push_back(member);
+    }
+    // group the reads into fragments by name, and find the best fragment
+    std::sort(members.begin(), members.end(), Member::comparator);
+    _uint64 bestHash = 0;
+    int bestQuality = -1;
+    _int64 bestLast = 0;
+    int nFragments = 0;
+    for (_int64 i = 0; i < members.size(); ) {
+        int quality = 0;
+        _int64 last = 0;
+        _int64 j = i;
+        for (; j < members.size() && members[j].nameHash == members[i].nameHash; j++) {
+            quality += members[j].quality;
+            last = members[j].sequence; // they're in sequence order
+        }
+        if (quality > bestQuality || (quality == bestQuality && last < bestLast)) {
+            bestHash = members[i].nameHash;
+            bestQuality = quality;
+            bestLast = last;
+        }
+        nFragments++;
+        i = j;
     }
-    GenomeLocation location = lastBam->getLocation(genome);
-    GenomeLocation nextLocation = lastBam->getNextLocation(genome);
-    GenomeLocation logicalLocation = location != InvalidGenomeLocation ? location : nextLocation;
-    if (logicalLocation == UINT32_MAX) {
+    if (nFragments < 2) {
         return;
     }
-    if (logicalLocation == runLocation) {
-        runCount++;
-    } else {
-        // if there was more than one read with same location, then analyze the run
-        if (runCount > 1) {
-            // partition by duplicate key, find best read in each partition
-            size_t offset = runOffset;
-            run.clear();
-            // sort run by other coordinate & RC flags to get sub-runs
-            for (BAMAlignment* record = getRead(offset); record != NULL && record != lastBam; record = getNextRead(record, &offset)) {
-                // use opposite of logical location to sort records
-                _uint64 entry = record->getLocation(genome) == UINT32_MAX
-                    ? (((_uint64) UINT32_MAX) << 32) |
-                        ((record->FLAG & SAM_REVERSE_COMPLEMENT) ? RunNextRC : 0) |
-                        ((record->FLAG & SAM_NEXT_REVERSED) ? RunRC : 0)
-                    : (((_uint64) GenomeLocationAsInt64(record->getNextLocation(genome))) << 32) |
-                        ((record->FLAG & SAM_REVERSE_COMPLEMENT) ? RunRC : 0) |
-                        ((record->FLAG & SAM_NEXT_REVERSED) ? RunNextRC : 0);
-                entry |= (_uint64) ((offset - runOffset) & RunOffset);
-                _ASSERT(offset - runOffset <= RunOffset);
-                run.push_back(entry);
-            }
-			if (run.size() == 0) {
-				goto done; // todo: handle runs > n buffers (but should be rare!)
-			}
-            // ensure that adjacent half-mapped pairs stay together
-            std::stable_sort(run.begin(), run.end());
-            bool foundRun = false;
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                _ASSERT(record->refID >= -1 && record->refID < genome->getNumContigs()); // simple sanity check
-                // skip adjacent half-mapped pairs, they're not really runs
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
-                    continue;
-                }
-                foundRun = true;
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator f = mates.find(key);
-                DuplicateMateInfo* info;
-                if (f == mates.end()) {
-                    mates.put(key, DuplicateMateInfo());
-                    info = &mates[key];
-                    //fprintf(stderr, "add %u%s/%u%s -> %d\n", key.locations[0], key.isRC[0] ? "rc" : "", key.locations[1], key.isRC[1] ? "rc" : "", mates.size());
-                    info->firstRunOffset = runOffset;
-                    info->firstRunEndOffset = lastOffset;
-                } else {
-                    info = &f->value;
-                }
-                int totalQuality = getTotalQuality(record);
-                size_t mateOffset = 0;
-                BAMAlignment* mate = NULL;
-                // optimize case for half-mapped pairs with adjacent reads
-                if ((record->FLAG & SAM_MULTI_SEGMENT) != 0) {
-                    mate = tryFindRead(info->firstRunOffset, info->firstRunEndOffset, record->read_name(), &mateOffset);
-                    if (mate == record) {
-                        mate = NULL;
-                    }
-                }
-                bool isSecond = mate != NULL;
-                if (isSecond) {
-                    totalQuality += getTotalQuality(mate);
-                }
-                if (totalQuality > info->bestReadQuality[isSecond]) {
-                    info->bestReadQuality[isSecond] = totalQuality;
-                    info->bestReadOffset[isSecond] = offset;
-                    if (isSecond) {
-                        info->bestReadOffset[2] = mateOffset;
-                    }
-                    info->setBestReadId(record->read_name());
-                }
-                if (isSecond && readIdsMatch(info->getBestReadId(), record->read_name())) {
-                    info->bestReadOffset[3] = offset;
-                }
-            }
-            if (! foundRun) {
-                goto done; // avoid useless looping
-            }
-            // go back and adjust flags
-            offset = runOffset;
-            VariableSizeVector<DuplicateMateInfo*>* failedBackpatch = NULL;
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
-                    continue;
-                }
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator m = mates.find(key);
-                if (m == mates.end()) {
-                    continue; // one end in a run, other not
-                }
-                DuplicateMateInfo* minfo = &m->value;
-                bool pass = minfo->bestReadQuality[1] != 0; // 1 for second pass, 0 for first pass
-                bool isSecond = minfo->firstRunOffset != runOffset;
-                static const int index[2][2] = {{0, 3}, {2, 1}};
-                if (offset != minfo->bestReadOffset[index[pass][isSecond]]) {
-                    // Picard markDuplicates will not mark unmapped reads
-                    if ((record->FLAG & SAM_UNMAPPED) == 0) {
-                        record->FLAG |= SAM_DUPLICATE;
-                    }
-                } else if (pass == 1 && minfo->bestReadOffset[2] != 0 && minfo->bestReadOffset[0] != 0 && minfo->bestReadOffset[2] != minfo->bestReadOffset[0]) {
-                    // backpatch reads in first matelist if they're still in memory
-                    BAMAlignment* oldBest = getRead(minfo->bestReadOffset[0]);
-                    BAMAlignment* newBest = getRead(minfo->bestReadOffset[2]);
-                    if (oldBest != NULL && newBest != NULL) {
-                        oldBest->FLAG &= ~SAM_DUPLICATE;
-                        newBest->FLAG |= SAM_DUPLICATE;
-                    } else {
-                        if (failedBackpatch == NULL) {
-                            failedBackpatch = new VariableSizeVector<DuplicateMateInfo*>();
-                        }
-                        failedBackpatch->push_back(minfo);
-                    }
-                }
-            }
-
-            // fixup any that failed
-            if (failedBackpatch != NULL) {
-                for (VariableSizeVector<DuplicateMateInfo*>::iterator i = failedBackpatch->begin(); i != failedBackpatch->end(); i++) {
-                    // couldn't go back and patch first set to have correct best for second set
-                    // so patch second set to have same best as first set even though it's not really the best
-                    BAMAlignment* trueBestSecond = getRead((*i)->bestReadOffset[1]);
-                    BAMAlignment* firstBestSecond = getRead((*i)->bestReadOffset[3]);
-                    _ASSERT(trueBestSecond != NULL && firstBestSecond != NULL);
-                    if (trueBestSecond != NULL && firstBestSecond != NULL) {
-                        trueBestSecond->FLAG &= ~SAM_DUPLICATE;
-                        firstBestSecond->FLAG |= ~SAM_DUPLICATE;
-                    }
-                }
-            }
-
-            // clean up
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
-                    continue;
-                }
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator m = mates.find(key);
-                if (m != mates.end() && m->value.firstRunOffset != runOffset) {
-                    mates.erase(key);
-                    //fprintf(stderr, "erase %u%s/%u%s -> %d\n", key.locations[0], key.isRC[0] ? "rc" : "", key.locations[1], key.isRC[1] ? "rc" : "", mates.size());
-                }
-            }
+    bool owned = false;
+    for (_int64 i = 0; i < members.size(); i++) {
+        Entry* entry = getEntry(members[i].sequence);
+        owned |= ! entry->context;
+        if (members[i].nameHash != bestHash) {
+            ((BAMAlignment*) (buffer + entry->offset))->FLAG |= SAM_DUPLICATE;
+            duplicates += ! entry->context;
         }
-done:
-        runLocation = logicalLocation;
-        runOffset = lastOffset;
-        runCount = 1;
     }
-    // todo: preserve this across batches - need to block-copy entire memory for reads
+    if (kind == LongFirst && owned && key.locations[1] != UINT32_MAX) {
+        longPairs->put(key, bestHash);
+    }
+}
+
+    _uint64
+BAMDuplicateMarker::hashReadName(
+    const char* name)
+{
+    // FNV-1a, stopping where readIdsMatch does
+    _uint64 hash = 14695981039346656037ULL;
+    for (const char* p = name; *p != 0 && *p != ' ' && *p != '/'; p++) {
+        hash = (hash ^ (_uint8) *p) * 1099511628211ULL;
+    }
+    return hash;
 }
 
     int
-BAMDupMarkFilter::getTotalQuality(
+BAMDuplicateMarker::getTotalQuality(
     BAMAlignment* bam)
 {
     int result = 0;
@@ -1524,28 +1494,6 @@ BAMDupMarkFilter::getTotalQuality(
     return result;
 }
 
-class BAMDupMarkSupplier : public DataWriter::FilterSupplier
-{
-public:
-    BAMDupMarkSupplier(const Genome* i_genome) :
-        FilterSupplier(DataWriter::ReadFilter), genome(i_genome) {}
-
-    virtual DataWriter::Filter* getFilter()
-    { return new BAMDupMarkFilter(genome); }
-
-    virtual void onClosing(DataWriterSupplier* supplier) {}
-    virtual void onClosed(DataWriterSupplier* supplier) {}
-
-private:
-    const Genome* genome;
-};
-
-    DataWriter::FilterSupplier*
-DataWriterSupplier::markDuplicates(const Genome* genome)
-{
-    return new BAMDupMarkSupplier(genome);
-}
-
 class BAMIndexSupplier;
 
 class BAMIndexFilter : public BAMFilter
@@ -1564,18 +1512,18 @@ private:
 class BAMIndexSupplier : public DataWriter::FilterSupplier
 {
 public:
-    BAMIndexSupplier(const char* i_indexFileName, const Genome* i_genome, GzipWriterFilterSupplier* i_gzipSupplier) :
+    BAMIndexSupplier(const char* i_indexFileName, const Genome* genome, GzipWriterFilterSupplier* i_gzipSupplier) :
         FilterSupplier(DataWriter::ReadFilter),
         indexFileName(i_indexFileName),
-        genome(i_genome),
-        gzipSupplier(i_gzipSupplier),
-        lastRefId(-1),
-        lastBin(0), binStart(0), lastBamEnd(0)
+        gzipSupplier(i_gzipSupplier)
     {
-        refs = genome ? new RefInfo[genome->getNumContigs()] : NULL;
-        readCounts[0] = readCounts[1] = 0;
+        int depth = BAMIndex::depthFor(genome);
+        index = new BAMIndex(genome->getNumContigs(), depth > BAMIndex::BAIDepth, depth);
     }
 
+    virtual ~BAMIndexSupplier()
+    { delete index; }
+
     virtual DataWriter::Filter* getFilter()
     { return new BAMIndexFilter(this); }
 
@@ -1586,37 +1534,8 @@ private:
 
     friend class BAMIndexFilter;
 
-    struct BAMChunk {
-        BAMChunk() : start(0), end(0) {}
-        BAMChunk(const BAMChunk& a) : start(a.start), end(a.end) {}
-
-        _uint64 start, end;
-    };
-    typedef VariableSizeVector<BAMChunk> ChunkVec;
-    typedef VariableSizeMap<_uint32,ChunkVec,150,MapNumericHash<_uint32>,80,-1,-2> BinMap;
-    typedef VariableSizeVector<_uint64> LinearMap;
-    struct RefInfo {
-        BinMap bins;
-        LinearMap intervals;
-    };
-
-    RefInfo* getRefInfo(int refId);
-
-    void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
-
-    void addChunk(int refId, _uint32 bin, _uint64 start, _uint64 end);
-
-    void addInterval(int refId, int begin, int end, _uint64 fileOffset);
-
     const char* indexFileName;
-    const Genome* genome;
-    int lastRefId;
-    _uint32 lastBin;
-    _uint64 binStart;
-    _uint64 firstBamStart;
-    _uint64 lastBamEnd;
-    _uint64 readCounts[2]; // mapped, unmapped
-    RefInfo* refs;
+    BAMIndex* index;
     GzipWriterFilterSupplier* gzipSupplier;
 };
 
@@ -1626,7 +1545,8 @@ BAMIndexFilter::onRead(
     size_t fileOffset,
     int batchIndex)
 {
-    supplier->onRead(bam, fileOffset, batchIndex);
+    //fprintf(stderr, "index onRead %d:%d+%d @ %lld %d\n", bam->refID, bam->pos, bam->l_ref(), fileOffset, batchIndex);
+    supplier->index->add(bam, fileOffset);
 }
 
     DataWriter::FilterSupplier*
@@ -1639,101 +1559,207 @@ DataWriterSupplier::bamIndex(
 }
 
     void
-BAMIndexSupplier::onRead(
+BAMIndexSupplier::onClosed(
+    DataWriterSupplier* supplier)
+{
+    if (! index->write(indexFileName, gzipSupplier)) {
+        WriteErrorMessage("Unable to write index file %s\n", indexFileName);
+        soft_exit(1);
+    }
+}
+
+    int
+BAMIndex::depthFor(
+    const Genome* genome)
+{
+    // the way samtools sizes CSI indices, with a little room past the end of the longest contig
+    GenomeDistance maxLength = 0;
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        maxLength = __max(maxLength, genome->getContigs()[i].length);
+    }
+    maxLength += 256;
+    int depth = 0;
+    for (_int64 size = (_int64) 1 << MinShift; maxLength > size; size <<= 3) {
+        depth++;
+    }
+    return __max(depth, BAIDepth);
+}
+
+BAMIndex::BAMIndex(
+    int i_numContigs,
+    bool i_csi,
+    int i_depth)
+    :
+    numContigs(i_numContigs),
+    csi(i_csi),
+    depth(i_depth),
+    lastRefId(-1),
+    lastBin(0), binStart(0), firstBamStart(0), lastBamEnd(0),
+    unplacedReads(0)
+{
+    _ASSERT(csi || depth == BAIDepth);
+    refs = new RefInfo[numContigs];
+    readCounts[0] = readCounts[1] = 0;
+}
+
+BAMIndex::~BAMIndex()
+{
+    delete [] refs;
+}
+
+    void
+BAMIndex::add(
     BAMAlignment* bam,
-    size_t fileOffset,
-    int batchIndex)
+    _uint64 fileOffset)
 {
-    //fprintf(stderr, "index onRead %d:%d+%d @ %lld %d\n", bam->refID, bam->pos, bam->l_ref(), fileOffset, batchIndex);
     if (bam->refID != lastRefId) {
         if (lastRefId != -1) {
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
+            addChunk(lastRefId, getMetadataBin(), firstBamStart, lastBamEnd);
+            addChunk(lastRefId, getMetadataBin(), readCounts[0], readCounts[1]);
             readCounts[0] = readCounts[1] = 0;
         }
         firstBamStart = fileOffset;
     }
     readCounts[(bam->FLAG & SAM_UNMAPPED) ? 1 : 0]++;
-    if (bam->refID != lastRefId || bam->bin != lastBin || lastRefId == -1) {
+    unplacedReads += bam->refID < 0;
+
+    // unmapped reads placed next to their mates cover one base there
+    int begin = bam->pos, end = bam->pos + __max(bam->l_ref(), 1);
+    _uint32 bin = bam->refID >= 0 && begin >= 0 ? BAMAlignment::reg2bin(begin, end, MinShift, depth) : BAMAlignment::reg2bin(-1, 0);
+    if (bam->refID != lastRefId || bin != lastBin || lastRefId == -1) {
         addChunk(lastRefId, lastBin, binStart, fileOffset);
-        lastBin = bam->bin;
+        lastBin = bin;
         lastRefId = bam->refID;
         binStart = fileOffset;
     }
-    if (! (bam->FLAG & SAM_UNMAPPED)) {
-        _ASSERT(bam->pos != -1 && bam->refID != -1);
-        addInterval(bam->refID, bam->pos, bam->pos + bam->l_ref() - 1, fileOffset);
+    if (bam->refID >= 0 && begin >= 0) {
+        addInterval(bam->refID, begin, end, fileOffset);
     }
     lastBamEnd = fileOffset + bam->size();
 }
 
-    void
-BAMIndexSupplier::onClosed(
-    DataWriterSupplier* supplier)
+template <typename T>
+    static void
+AppendToIndex(
+    VariableSizeVector<char>* index,
+    T value)
+{
+    // push_back grows the buffer geometrically, where extend would reallocate it each time
+    const char* bytes = (const char*) &value;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        index->push_back(bytes[i]);
+    }
+}
+
+    bool
+BAMIndex::write(
+    const char* fileName,
+    GzipWriterFilterSupplier* gzipSupplier)
 {
     // add final chunk
     if (lastRefId != -1) {
         addChunk(lastRefId, lastBin, binStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
-    }
-
-    // write out index file
-    FILE* index = fopen(indexFileName, "wb");
-    char magic[4] = {'B', 'A', 'I', 1};
-    fwrite(magic, sizeof(magic), 1, index);
-    _int32 n_ref = genome->getNumContigs();
-    fwrite(&n_ref, sizeof(n_ref), 1, index);
-
-    for (int i = 0; i < n_ref; i++) {
-        RefInfo* info = getRefInfo(i);
-        _int32 n_bin, n_intv;
-        if (info == NULL) {
-            n_bin = 0;
-            fwrite(&n_bin, sizeof(n_bin), 1, index);
-            n_intv = 0;
-            fwrite(&n_intv, sizeof(n_intv), 1, index);
-            continue;
-        }
-        n_bin = info->bins.size();
-        fwrite(&n_bin, sizeof(n_bin), 1, index);
+        addChunk(lastRefId, getMetadataBin(), firstBamStart, lastBamEnd);
+        addChunk(lastRefId, getMetadataBin(), readCounts[0], readCounts[1]);
+        lastRefId = -1;
+    }
+
+    VariableSizeVector<char> index(1 << 20);
+    AppendToIndex<_uint8>(&index, csi ? 'C' : 'B');
+    AppendToIndex<_uint8>(&index, csi ? 'S' : 'A');
+    AppendToIndex<_uint8>(&index, 'I');
+    AppendToIndex<_uint8>(&index, 1);
+    if (csi) {
+        AppendToIndex<_int32>(&index, MinShift);
+        AppendToIndex<_int32>(&index, depth);
+        AppendToIndex<_int32>(&index, 0); // l_aux
+    }
+    AppendToIndex<_int32>(&index, numContigs);
+
+    for (int i = 0; i < numContigs; i++) {
+        RefInfo* info = &refs[i];
+        fillIntervals(info);
+        AppendToIndex<_int32>(&index, (_int32) info->bins.size());
         for (BinMap::iterator j = info->bins.begin(); j != info->bins.end(); j = info->bins.next(j)) {
             _uint32 bin = j->key;
-            fwrite(&bin, sizeof(bin), 1, index);
-            _int32 n_chunk = (_int32) j->value.size();
-            fwrite(&n_chunk, sizeof(n_chunk), 1, index);
-            if (bin != BAMAlignment::BAM_EXTRA_BIN) {
+            AppendToIndex<_uint32>(&index, bin);
+            if (csi) {
+                //
+                // The first read that could overlap the bin, which BAI keeps in the linear index instead: the one
+                // for the window at its start, since reads are sorted by where they start.
+                //
+                _uint64 loffset = 0;
+                if (bin != getMetadataBin()) {
+                    int level = 0;
+                    for (int b = bin; b > 0; b = (b - 1) >> 3) {
+                        level++;
+                    }
+                    _int64 window = (_int64) (bin - ((1 << (3 * level)) - 1) / 7) << (3 * (depth - level));
+                    loffset = window < info->intervals.size() ? gzipSupplier->toVirtualOffset(info->intervals[window]) : 0;
+                }
+                AppendToIndex<_uint64>(&index, loffset);
+            }
+            AppendToIndex<_int32>(&index, (_int32) j->value.size());
+            if (bin != getMetadataBin()) {
                 for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
-                    _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(k->start), gzipSupplier->toVirtualOffset(k->end)};
-                    fwrite(&chunk, sizeof(chunk), 1, index);
+                    AppendToIndex<_uint64>(&index, gzipSupplier->toVirtualOffset(k->start));
+                    AppendToIndex<_uint64>(&index, gzipSupplier->toVirtualOffset(k->end));
                 }
             } else {
-                _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(j->value[0].start), gzipSupplier->toVirtualOffset(j->value[0].end)};
-                fwrite(&chunk, sizeof(chunk), 1, index);
-                chunk[0] = j->value[1].start;
-                chunk[1] = j->value[1].end;
-                fwrite(&chunk, sizeof(chunk), 1, index);
+                AppendToIndex<_uint64>(&index, gzipSupplier->toVirtualOffset(j->value[0].start));
+                AppendToIndex<_uint64>(&index, gzipSupplier->toVirtualOffset(j->value[0].end));
+                AppendToIndex<_uint64>(&index, j->value[1].start);
+                AppendToIndex<_uint64>(&index, j->value[1].end);
+            }
+        }
+        if (! csi) {
+            AppendToIndex<_int32>(&index, (_int32) info->intervals.size());
+            for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
+                AppendToIndex<_uint64>(&index, gzipSupplier->toVirtualOffset(*m));
             }
         }
-        n_intv = (_int32) info->intervals.size();
-        fwrite(&n_intv, sizeof(n_intv), 1, index);
-        for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
-            _uint64 ioffset = gzipSupplier->toVirtualOffset(*m);
-            fwrite(&ioffset, sizeof(ioffset), 1, index);
+    }
+    AppendToIndex<_uint64>(&index, unplacedReads);
+
+    FILE* file = fopen(fileName, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = true;
+    if (! csi) {
+        ok = (_int64) fwrite(&index[0], 1, index.size(), file) == index.size();
+    } else {
+        // CSI files are BGZF compressed
+        GzipCompressor* compressor = GzipCompressor::create();
+        char* block = new char[BAM_BLOCK];
+        const _int64 maxInput = BAM_BLOCK - 1024;
+        for (_int64 offset = 0; ok && offset < index.size(); offset += maxInput) {
+            size_t used = compressor->compress(true, block, BAM_BLOCK, &index[offset], (size_t) __min(maxInput, index.size() - offset));
+            ok = used > 0 && fwrite(block, 1, used, file) == used;
         }
+        ok = ok && fwrite(BgzfHeader::EofMarker, 1, sizeof(BgzfHeader::EofMarker), file) == sizeof(BgzfHeader::EofMarker);
+        delete [] block;
+        delete compressor;
     }
-    fclose(index);
+    return fclose(file) == 0 && ok;
 }
 
-   BAMIndexSupplier::RefInfo*
-BAMIndexSupplier::getRefInfo(
-    int refId)
+    void
+BAMIndex::fillIntervals(
+    RefInfo* info)
 {
-    return refId >= 0 && refId < genome->getNumContigs() ? &refs[refId] : NULL;
+    ChunkVec* metadata = info->bins.tryFind(getMetadataBin());
+    _uint64 previous = metadata != NULL ? (*metadata)[0].start : 0;
+    for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
+        if (*m == UINT64_MAX) {
+            *m = previous;
+        }
+        previous = *m;
+    }
 }
 
     void
-BAMIndexSupplier::addChunk(
+BAMIndex::addChunk(
     int refId,
     _uint32 bin,
     _uint64 start,
@@ -1748,14 +1774,14 @@ BAMIndexSupplier::addChunk(
         ChunkVec empty;
         info->bins.tryAdd(bin, empty, &chunks);
     }
-    BAMChunk chunk;
+    Chunk chunk;
     chunk.start = start;
     chunk.end = end;
     chunks->push_back(chunk);
 }
 
     void
-BAMIndexSupplier::addInterval(
+BAMIndex::addInterval(
     int refId,
     int begin,
     int end,
@@ -1765,15 +1791,23 @@ BAMIndexSupplier::addInterval(
     if (info == NULL) {
         return;
     }
-    int slot = end <= 0 ? 0 : ((end - 1) / 16384);
-    if (slot >= info->intervals.size()) {
-        for (_int64 i = info->intervals.size(); i < slot; i++) {
-            info->intervals.push_back(UINT64_MAX);
+    int last = (end - 1) >> MinShift;
+    while (info->intervals.size() <= last) {
+        info->intervals.push_back(UINT64_MAX);
+    }
+    // reads come in order of where they begin, so the first one to reach a window is the first that overlaps it
+    for (int window = begin >> MinShift; window <= last; window++) {
+        if (info->intervals[window] == UINT64_MAX) {
+            info->intervals[window] = fileOffset;
         }
-        info->intervals.push_back(fileOffset);
     }
 }
 
+const _uint8 BgzfHeader::EofMarker[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+    0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
     bool
 BgzfHeader::validate(char* buffer, size_t bytes)
 {
@@ -1797,7 +1831,7 @@ BgzfHeader::validate(
     size_t uncompressed)
 {
     return ID1 == 0x1f && ID2 == 0x8b && CM == 8 && FLG == 4 &&
-        MTIME == 0 && XFL == 0 && OS == 0 &&
+        MTIME == 0 && OS == 0 &&
         ISIZE() == uncompressed&&
         BSIZE() + 1 == compressed;
 }
@@ -23,6 +23,7 @@ Environment:
 #include "LandauVishkin.h"
 #include "PairedEndAligner.h"
 #include "VariableSizeVector.h"
+#include "VariableSizeMap.h"
 #include "BufferedAsync.h"
 #include "SAM.h"
 #include "Read.h"
@@ -38,6 +39,9 @@ Environment:
 
 #define BAM_BLOCK 65536
 
+// most uncompressed data written into one BGZF block, so even incompressible data stays within BAM_BLOCK
+#define BAM_BLOCK_INPUT 0xff00
+
 #pragma pack(push, 1)
 struct BAMHeaderRefSeq;
 struct BAMHeader
@@ -156,10 +160,11 @@ struct BAMAlignment
     static const _uint32 BAM_EXTRA_BIN = 37450; // extra bin for metadata
 
     /* calculate bin given an alignment covering [beg,end) (zero-based, half-close-half-open) */
-    static int reg2bin(int beg, int end);
+    /* the defaults are BAI's; CSI indices can have more levels (see BAMIndex) */
+    static int reg2bin(int beg, int end, int minShift = 14, int depth = 5);
     /* calculate the list of bins that may overlap with region [beg,end) (zero-based) */
     static const int MAX_BIN = (((1<<18)-1)/7);
-    static int reg2bins(int beg, int end, _uint16* list/*[MAX_BIN]*/);
+    static int reg2bins(int beg, int end, int* list/*[MAX_BIN], or more for deeper CSI*/, int minShift = 14, int depth = 5);
 
     // absoluate genome locations
 
@@ -349,11 +354,260 @@ struct BgzfHeader
     bool validate(size_t compressed, size_t uncompressed);
 
     static bool validate(char* buffer, size_t bytes);
+
+    // empty block that marks the end of a BGZF file
+    static const _uint8 EofMarker[28];
 };
 
 
 #pragma pack(pop)
 
+// identifies a set of possible duplicates: the locations and directions of both ends, lower one first
+struct DuplicateReadKey
+{
+    DuplicateReadKey()
+    { memset(this, 0, sizeof(DuplicateReadKey)); }
+
+    DuplicateReadKey(const BAMAlignment* bam, const Genome* genome)
+    {
+        if (bam == NULL) {
+            locations[0] = locations[1] = UINT32_MAX;
+            isRC[0] = isRC[1] = false;
+        } else {
+            locations[0] = bam->getLocation(genome);
+            locations[1] = bam->getNextLocation(genome);
+            isRC[0] = (bam->FLAG & SAM_REVERSE_COMPLEMENT) != 0;
+            isRC[1] = (bam->FLAG & SAM_NEXT_REVERSED) != 0;
+            if (((((_uint64) GenomeLocationAsInt64(locations[0])) << 1) | (isRC[0] ? 1 : 0)) > ((((_uint64) GenomeLocationAsInt64(locations[1])) << 1) | (isRC[1] ? 1 : 0))) {
+                const GenomeLocation t = locations[1];
+                locations[1] = locations[0];
+                locations[0] = t;
+                const bool f = isRC[1];
+                isRC[1] = isRC[0];
+                isRC[0] = f;
+            }
+        }
+    }
+
+    bool operator==(const DuplicateReadKey& b) const
+    {
+        return locations[0] == b.locations[0] && locations[1] == b.locations[1] &&
+            isRC[0] == b.isRC[0] && isRC[1] == b.isRC[1];
+    }
+
+    bool operator!=(const DuplicateReadKey& b) const
+    {
+        return ! ((*this) == b);
+    }
+
+    bool operator<(const DuplicateReadKey& b) const
+    {
+        return locations[0] < b.locations[0] ||
+            (locations[0] == b.locations[0] &&
+                (locations[1] < b.locations[1] ||
+                    (locations[1] == b.locations[1] &&
+                        isRC[0] * 2 + isRC[1] <  b.isRC[0] *2 + b.isRC[1])));
+    }
+
+
+    // required for use as a key in VariableSizeMap template
+    // (compare as locations, so that the tombstone key really is one once it's sign extended)
+    DuplicateReadKey(int x)
+    { locations[0] = locations[1] = x; isRC[0] = isRC[1] = false; }
+    bool operator==(int x) const
+    { return locations[0] == (GenomeLocation) x && locations[1] == (GenomeLocation) x; }
+    bool operator!=(int x) const
+    { return locations[0] != (GenomeLocation) x || locations[1] != (GenomeLocation) x; }
+    operator _uint64()
+    { return ((_uint64) (GenomeLocationAsInt64(locations[1]) ^ (isRC[1] ? 1 : 0))) << 32 | (_uint64) (GenomeLocationAsInt64(locations[0]) ^ (isRC[0] ? 1 : 0)); }
+
+    GenomeLocation locations[2];
+    bool isRC[2];
+};
+
+//
+// Marks duplicates in a stream of location-sorted BAM reads.  Reads with the same key are a duplicate set, and all
+// but the best fragment in it (by the total quality of its reads, and then by which one ends first) are marked.
+// Only the reads near the current location are kept, so memory is bounded by the window, not by the file, and the
+// stream can be cut into pieces that are marked independently, as long as each piece also sees the reads within a
+// window either side of it (as context, which is looked at but not passed on).  Pairs whose ends are more than a
+// window apart can't be decided that way, so for them the best first read is chosen by its own quality and put in
+// a LongPairs table, and the second reads are marked from that once every piece before them has been marked.
+//
+class BAMDuplicateMarker
+{
+public:
+    static const GenomeDistance Window = 10000;
+
+    // best first reads of duplicate sets of widely separated pairs; thread safe
+    class LongPairs
+    {
+    public:
+        LongPairs();
+        ~LongPairs();
+
+        void put(DuplicateReadKey key, _uint64 nameHash);
+
+        // for the second read of a pair, once the first reads are in; marks it and returns true if it's a duplicate
+        bool mark(BAMAlignment* bam, const Genome* genome);
+
+    private:
+        ExclusiveLock lock;
+        typedef VariableSizeMap<DuplicateReadKey,_uint64,150,MapNumericHash<DuplicateReadKey>,70,0,-2> BestMap;
+        BestMap best;
+    };
+
+    // deferLongPairs means the second reads of long pairs are passed on unmarked, for the caller to mark later
+    BAMDuplicateMarker(const Genome* i_genome, LongPairs* i_longPairs, bool i_deferLongPairs);
+
+    virtual ~BAMDuplicateMarker();
+
+    // the next read in location order; it's passed on to emit unless it's just context
+    void add(char* data, GenomeDistance length, GenomeLocation location, bool context);
+
+    // pass on everything that's left
+    void flush();
+
+    static _uint64 hashReadName(const char* name);
+
+    static int getTotalQuality(BAMAlignment* bam);
+
+    static volatile _int64 DuplicatesMarked;
+    static volatile _int64 Time; // nanoseconds, over all threads
+
+protected:
+    // called in order with each read whose flags are final (except for deferred ones)
+    virtual void emit(char* data, GenomeDistance length, bool deferred) = 0;
+
+private:
+    enum ReadKind { Unmarked, ShortPair, LongFirst, LongSecond };
+
+    struct Entry
+    {
+        size_t              offset;     // in buffer
+        GenomeDistance      length;
+        GenomeLocation      readyAt;    // can be passed on once the stream is past here
+        DuplicateReadKey    key;
+        _uint64             nameHash;
+        int                 quality;
+        _int64              nextInSet;  // sequence number of the next read with the same key, or -1
+        ReadKind            kind;
+        bool                context;
+    };
+
+    struct DuplicateSet
+    {
+        DuplicateSet() : first(-1), last(-1), pending(0), resolved(false) {}
+
+        _int64              first, last; // sequence numbers
+        int                 pending;    // reads not passed on yet
+        bool                resolved;
+    };
+
+    struct Member
+    {
+        _uint64             nameHash;
+        _int64              sequence;
+        int                 quality;
+
+        static bool comparator(const Member& a, const Member& b)
+        { return a.nameHash < b.nameHash || (a.nameHash == b.nameHash && a.sequence < b.sequence); }
+    };
+
+    // pass on reads up to the first one that needs to see reads past location
+    void emitReady(GenomeLocation location, bool all);
+
+    void resolve(DuplicateSet* set, const DuplicateReadKey& key, ReadKind kind);
+
+    Entry* getEntry(_int64 sequence)
+    { return &entries[sequence - firstSequence]; }
+
+    const Genome*           genome;
+    LongPairs*              longPairs;
+    const bool              deferLongPairs;
+    char*                   buffer;     // copies of the reads being held
+    size_t                  bufferSize;
+    size_t                  bufferUsed;
+    VariableSizeVector<Entry> entries;
+    _int64                  head;       // index in entries of the next read to pass on
+    _int64                  firstSequence; // of entries[0]
+    typedef VariableSizeMap<DuplicateReadKey,DuplicateSet,150,MapNumericHash<DuplicateReadKey>,70,0,-2> SetMap;
+    SetMap                  sets;
+    VariableSizeVector<Member> members;
+    _int64                  duplicates; // counts for this marker, added to the static ones when it's done
+    _int64                  time;
+};
+
+class GzipWriterFilterSupplier;
+
+//
+// Coordinate index of a sorted BAM file, built from its reads as they're written.  A BAI index has a fixed depth
+// of bins that only reaches 2^29 bases; a CSI index has the same smallest bins but as many levels as the longest
+// contig needs, and keeps the offset of the first read overlapping each bin in place of BAI's linear index.
+//
+class BAMIndex
+{
+public:
+    static const int MinShift = 14;
+    static const int BAIDepth = 5;
+
+    // levels of bins the longest contig needs (at least BAIDepth); the index has to be CSI if it's more
+    static int depthFor(const Genome* genome);
+
+    BAMIndex(int i_numContigs, bool i_csi, int i_depth);
+
+    ~BAMIndex();
+
+    // the next read in sorted order, at a logical (uncompressed) offset in the file
+    void add(BAMAlignment* bam, _uint64 fileOffset);
+
+    // call after the last read; translates offsets to virtual ones and returns false if the file can't be written
+    bool write(const char* fileName, GzipWriterFilterSupplier* gzipSupplier);
+
+    // the pseudo bin holding the extent of a contig's reads and their counts
+    _uint32 getMetadataBin()
+    { return (((1 << (3 * (depth + 1))) - 1) / 7) + 1; }
+
+private:
+    struct Chunk
+    {
+        Chunk() : start(0), end(0) {}
+        Chunk(const Chunk& a) : start(a.start), end(a.end) {}
+
+        _uint64 start, end;
+    };
+    typedef VariableSizeVector<Chunk> ChunkVec;
+    typedef VariableSizeMap<_uint32,ChunkVec,150,MapNumericHash<_uint32>,80,-1,-2> BinMap;
+    typedef VariableSizeVector<_uint64> LinearMap;
+    struct RefInfo
+    {
+        BinMap bins;
+        LinearMap intervals; // first offset overlapping each 2^MinShift window, UINT64_MAX for none so far
+    };
+
+    RefInfo* getRefInfo(int refId)
+    { return refId >= 0 && refId < numContigs ? &refs[refId] : NULL; }
+
+    void addChunk(int refId, _uint32 bin, _uint64 start, _uint64 end);
+
+    void addInterval(int refId, int begin, int end, _uint64 fileOffset);
+
+    // fill in windows that no read overlaps with the offset of the one before, as samtools does
+    void fillIntervals(RefInfo* info);
+
+    const int numContigs;
+    const bool csi;
+    const int depth;
+    RefInfo* refs;
+    int lastRefId;
+    _uint32 lastBin;
+    _uint64 binStart;
+    _uint64 firstBamStart;
+    _uint64 lastBamEnd;
+    _uint64 readCounts[2]; // mapped, unmapped
+    _uint64 unplacedReads;
+};
+
 
 class BAMReader : public PairedReadReader, public ReadReader {
 public:
@@ -362,7 +616,8 @@ public:
 
         virtual ~BAMReader();
 
-        void init(const char *fileName, int bufferCount, _int64 startingOffset, _int64 amountOfFileToProcess);
+        // supplier reads the file, or NULL for the BAM suppliers
+        void init(const char *fileName, int bufferCount, _int64 startingOffset, _int64 amountOfFileToProcess, DataSupplier* supplier = NULL);
 
         virtual bool getNextRead(Read *readToUpdate)
         {
@@ -399,14 +654,15 @@ public:
 
         static BAMReader* create(const char *fileName, int bufferCount,
             _int64 startingOffset, _int64 amountOfFileToProcess, 
-            const ReaderContext& context);
+            const ReaderContext& context, DataSupplier* supplier = NULL);
         
         virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
         
-        static ReadSupplierGenerator *createReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context);
+        static ReadSupplierGenerator *createReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context,
+            DataSupplier* supplier = NULL);
         
         static PairedReadSupplierGenerator *createPairedReadSupplierGenerator(const char *fileName, int numThreads, bool quicklyDropUnmatchedReads, 
-            const ReaderContext& context, int matchBufferSize = 5000);
+            const ReaderContext& context, int matchBufferSize = 5000, DataSupplier* supplier = NULL);
 
         static const int MAX_SEQ_LENGTH;
         static const int MAX_RECORD_LENGTH;
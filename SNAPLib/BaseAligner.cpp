@@ -63,7 +63,7 @@ BaseAligner::BaseAligner(
         genomeIndex(i_genomeIndex), maxHitsToConsider(i_maxHitsToConsider), maxK(i_maxK),
         maxReadSize(i_maxReadSize), maxSeedsToUseFromCommandLine(i_maxSeedsToUseFromCommandLine),
         maxSeedCoverage(i_maxSeedCoverage), readId(-1), extraSearchDepth(i_extraSearchDepth),
-        explorePopularSeeds(false), stopOnFirstHit(false), stats(i_stats), 
+        explorePopularSeeds(false), seedLookupCache(NULL), stopOnFirstHit(false), adaptiveSeeding(false), exactMatchFastPath(false), stats(i_stats), 
         noUkkonen(i_noUkkonen), noOrderedEvaluation(i_noOrderedEvaluation), noTruncation(i_noTruncation),
 		minWeightToCheck(max(1u, i_minWeightToCheck))
 /*++
@@ -101,6 +101,10 @@ Arguments:
     nHitsIgnoredBecauseOfTooHighPopularity = 0;
     nReadsIgnoredBecauseOfTooManyNs = 0;
     nIndelsMerged = 0;
+    nReadsTakingExactMatchFastPath = 0;
+    nReadsStoppingSeedingEarly = 0;
+    nReadsWithEscalatedSeeds = 0;
+    memset(seedsPerReadHistogram, 0, sizeof(seedsPerReadHistogram));
 
     genome = genomeIndex->getGenome();
     seedLen = genomeIndex->getSeedLength();
@@ -140,6 +144,12 @@ Arguments:
     candidateHashTablesSize = (maxHitsToConsider * maxSeedsToUse * 3)/2;    // *1.5 for hash table slack
     hashTableElementPoolSize = maxHitsToConsider * maxSeedsToUse * 2 ;   // *2 for RC
 
+    //
+    // Each seed we apply adds at most maxHitsToConsider elements, so this is as far as adaptive seeding can raise a
+    // read's budget.
+    //
+    largestSeedBudget = 0 == maxHitsToConsider ? 0 : hashTableElementPoolSize / maxHitsToConsider;
+
     if (allocator) {
         rcReadData = (char *)allocator->allocate(sizeof(char) * maxReadSize * 2); // The *2 is to allocte space for the quality string
     } else {
@@ -162,6 +172,7 @@ Arguments:
         rcTranslationTable[i] = 'N';
     }
     reversedRead[RC] = reversedRead[FORWARD] + maxReadSize;
+    genomeDecodeBuffer = reversedRead[RC] + maxReadSize;  // MAX_K before the read, MAX_K after it and the read itself (only used for packed genomes)
 
     rcTranslationTable['A'] = 'T';
     rcTranslationTable['G'] = 'C';
@@ -226,7 +237,8 @@ BaseAligner::AlignRead(
         int                      maxEditDistanceForSecondaryResults,
         int                      secondaryResultBufferSize,
         int                     *nSecondaryResults,
-        SingleAlignmentResult   *secondaryResults             // The caller passes in a buffer of secondaryResultBufferSize and it's filled in by AlignRead()
+        SingleAlignmentResult   *secondaryResults,            // The caller passes in a buffer of secondaryResultBufferSize and it's filled in by AlignRead()
+        FirstSeedLookups        *firstSeedLookups
     )      // Retun value is true if there was enough room in the secondary alignment buffer for everything that was found.
 
 /*++
@@ -243,6 +255,7 @@ Arguments:
     secondaryResultBufferSize           - the size of the secondaryResults buffer.  If provided, it must be at least maxK * maxSeeds * 2.
     nRescondaryResults                  - returns the number of secondary results found
     secondaryResults                    - returns the secondary results
+    firstSeedLookups                    - the read's first seeds, already looked up by lookupFirstSeeds, or NULL
 
 
 Return Value:
@@ -261,12 +274,7 @@ Return Value:
     smallestSkippedSeed[FORWARD] = smallestSkippedSeed[RC] = 0x8fffffffffffffff;
     highestWeightListChecked = 0;
 
-    unsigned maxSeedsToUse;
-    if (0 != maxSeedsToUseFromCommandLine) {
-        maxSeedsToUse = maxSeedsToUseFromCommandLine;
-    } else {
-        maxSeedsToUse = (int)(2 * maxSeedCoverage * inputRead->getDataLength() / genomeIndex->getSeedLength()); // 2x is for FORWARD/RC
-    }
+    unsigned maxSeedsToUse = getMaxSeedsToUse(inputRead->getDataLength());
 
     primaryResult->location = InvalidGenomeLocation; // Value to return if we don't find a location.
     primaryResult->direction = FORWARD;              // So we deterministically print the read forward in this case.
@@ -274,8 +282,21 @@ Return Value:
     primaryResult->status = NotFound;
 
     unsigned lookupsThisRun = 0;
+    _int64 lookupsBeforeThisRead = nHashTableLookups;
+
+    if (NULL != firstSeedLookups) {
+        firstSeeds = firstSeedLookups;
+        nHashTableLookups += firstSeeds->nLookups;  // They're this read's, even though they were done before it started
+    } else {
+        firstSeeds = &ownFirstSeeds;
+        firstSeeds->nLookups = 0;
+    }
+    worstMismatchProbability = -1.0;
+    seedBudgetEscalated = false;
 
     popularSeedsSkipped = 0;
+    newLocationsFromLaterSeeds = 0;
+    bestFoundByLaterSeed = false;
 
     //
     // A bitvector for used seeds, indexed on the starting location of the seed within the read.
@@ -309,6 +330,7 @@ Return Value:
     // Clear out the seed used array.
     //
     memset(seedUsed, 0, (inputRead->getDataLength() + 7) / 8);
+    nSeedPositionsUsed = 0;
 
     unsigned readLen = inputRead->getDataLength();
     const char *readData = inputRead->getData();
@@ -354,6 +376,13 @@ Return Value:
     read[RC] = &reverseComplimentRead;
     read[RC]->init(NULL, 0, rcReadData, rcReadQuality, readLen);
 
+    if (0 == countOfNs && alignExactUniqueMatch(read, maxSeedsToUse, primaryResult)) {
+        nReadsTakingExactMatchFastPath++;
+        finalizeSecondaryResults(nSecondaryResults, secondaryResults, maxEditDistanceForSecondaryResults, bestScore);
+        recordSeedsUsed(lookupsBeforeThisRead);
+        return;
+    }
+
     clearCandidates();
 
     //
@@ -410,6 +439,7 @@ Return Value:
                                             primaryResult->score, primaryResult->mapq, probabilityOfBestCandidate, probabilityOfAllCandidates, primaryResult->location);
 #endif  // _DEBUG
                 finalizeSecondaryResults(nSecondaryResults, secondaryResults, maxEditDistanceForSecondaryResults, bestScore);
+                recordSeedsUsed(lookupsBeforeThisRead);
                 return;
             }
             nextSeedToTest = GetWrappedNextSeedToTest(seedLen, wrapCount);
@@ -446,13 +476,21 @@ Return Value:
 
         const unsigned *hits32[NUM_DIRECTIONS];
 
-        if (doesGenomeIndexHave64BitLocations) {
-            genomeIndex->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], &singletonHits[FORWARD], &singletonHits[RC]);
+        if (0 == wrapCount && nextSeedToTest / seedLen < firstSeeds->nLookups) {
+            //
+            // alignExactUniqueMatch or lookupFirstSeeds already looked this one up.  There are no Ns (or neither
+            // of them would have), so the first pass seeds are at multiples of seedLen, just like they used.
+            //
+            const SeedLookup *lookup = &firstSeeds->lookups[nextSeedToTest / seedLen];
+            for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+                nHits[direction] = lookup->nHits[direction];
+                hits[direction] = lookup->hits[direction];
+                hits32[direction] = lookup->hits32[direction];
+            }
         } else {
-            genomeIndex->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
+            lookupSeed(seed, nHits, hits, singletonHits, hits32);
+            nHashTableLookups++;
         }
-
-        nHashTableLookups++;
         lookupsThisRun++;
 
 
@@ -564,6 +602,10 @@ Return Value:
                             _ASSERT(offset <= readLen - seedLen);
                             allocateNewCandidate(genomeLocationOfThisHit, direction, lowestPossibleScoreOfAnyUnseenLocation[direction],
                                     offset, &candidate, &hashTableElement);
+                            hashTableElement->foundByLaterSeed = 0 != nSeedsApplied[direction];
+                            if (hashTableElement->foundByLaterSeed) {
+                                newLocationsFromLaterSeeds++;
+                            }
                         }
                     }
                 }
@@ -607,8 +649,35 @@ Return Value:
 #endif  // _DEBUG
 
                 finalizeSecondaryResults(nSecondaryResults, secondaryResults, maxEditDistanceForSecondaryResults, bestScore);
+                recordSeedsUsed(lookupsBeforeThisRead);
                 return;
             }
+
+            if (adaptiveSeeding && nSeedsApplied[FORWARD] + nSeedsApplied[RC] < maxSeedsToUse &&
+                (0 != wrapCount || nextSeedToTest >= nPossibleSeeds) && unseenLocationsCannotWin(maxEditDistanceForSecondaryResults) &&
+                moreSeedsShouldNotChangeMAPQ(read, maxSeedsToUse, nPossibleSeeds, lookupsThisRun, maxEditDistanceForSecondaryResults)) {
+                //
+                // The seeds have covered the whole read, and judging by what they've found, the rest wouldn't
+                // change the alignment or its MAPQ.  Leave the loop and score what we have, just as we would have
+                // once the seeds ran out.
+                //
+                nReadsStoppingSeedingEarly++;
+                break;
+            }
+
+            if (adaptiveSeeding && nSeedsApplied[FORWARD] + nSeedsApplied[RC] >= maxSeedsToUse) {
+                //
+                // Out of seeds.  Score everything first (again, we'd have to anyway) so that deciding whether to
+                // look up more goes by the read's real MAPQ.
+                //
+                if (scoreRemainingCandidates(read, primaryResult, maxEditDistanceForSecondaryResults, secondaryResultBufferSize, nSecondaryResults, secondaryResults)) {
+                    finalizeSecondaryResults(nSecondaryResults, secondaryResults, maxEditDistanceForSecondaryResults, bestScore);
+                    recordSeedsUsed(lookupsBeforeThisRead);
+                    return;
+                }
+
+                escalateSeedBudget(read, &maxSeedsToUse);
+            }
         }
     }
 
@@ -632,9 +701,624 @@ Return Value:
 #endif  // _DEBUG
 
     finalizeSecondaryResults(nSecondaryResults, secondaryResults, maxEditDistanceForSecondaryResults, bestScore);
+    recordSeedsUsed(lookupsBeforeThisRead);
     return;
 }
 
+    bool
+BaseAligner::unseenLocationsCannotWin(int maxEditDistanceForSecondaryResults)
+/*++
+
+Routine Description:
+
+    For adaptive seeding, check whether every location we haven't seen yet scores worse than the best alignment we
+    have, and too badly to be reported as a secondary alignment, so that looking up more seeds couldn't change the
+    alignment itself.  Scoring the candidates we have already can only lower bestScore, so this stays true.
+
+--*/
+{
+    return scoreCannotWin(__min(lowestPossibleScoreOfAnyUnseenLocation[FORWARD], lowestPossibleScoreOfAnyUnseenLocation[RC]), maxEditDistanceForSecondaryResults);
+}
+
+    bool
+BaseAligner::scoreCannotWin(unsigned lowestPossibleScore, int maxEditDistanceForSecondaryResults)
+/*++
+
+Routine Description:
+
+    Whether an alignment scoring lowestPossibleScore or more would be neither better than (or as good as) the best
+    one we have, nor close enough to it to be reported as a secondary alignment.
+
+--*/
+{
+    return bestScore <= maxK && lowestPossibleScore > bestScore &&
+        (maxEditDistanceForSecondaryResults < 0 || (int)lowestPossibleScore > __min((int)maxK, (int)bestScore + maxEditDistanceForSecondaryResults));
+}
+
+    bool
+BaseAligner::allCandidatesScored()
+{
+    for (unsigned weight = highestUsedWeightList; weight > 0; weight--) {
+        if (weightLists[weight].weightNext != &weightLists[weight]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+    bool
+BaseAligner::scoreRemainingCandidates(
+        Read                    *read[NUM_DIRECTIONS],
+        SingleAlignmentResult   *primaryResult,
+        int                      maxEditDistanceForSecondaryResults,
+        int                      secondaryResultBufferSize,
+        int                     *nSecondaryResults,
+        SingleAlignmentResult   *secondaryResults)
+/*++
+
+Routine Description:
+
+    Run score() until every candidate on the weight lists has been scored (it does one element per call).
+
+Return Value:
+
+    true if score() finished the read along the way, in which case the caller should return the result
+
+--*/
+{
+    while (!allCandidatesScored()) {
+        if (score(
+                false,
+                read,
+                primaryResult,
+                maxEditDistanceForSecondaryResults,
+                secondaryResultBufferSize,
+                nSecondaryResults,
+                secondaryResults)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+    double
+BaseAligner::mostLikelyAlignmentWithScoreAtLeast(Read *read, unsigned minScore)
+/*++
+
+Routine Description:
+
+    An upper bound on the match probability of an alignment of this read with a score of minScore or more (but no
+    more than scoreLimit, since nothing worse than that gets counted): the likeliest set of that many edits, whether
+    mismatches at the read's worst quality or indels (which the LV probabilities charge by length), with the rest of
+    the read matching.
+
+--*/
+{
+    unsigned readLen = read->getDataLength();
+    if (worstMismatchProbability < 0) {
+        const char *quality = read->getQuality();
+        worstMismatchProbability = 0;
+        for (unsigned i = 0; i < readLen; i++) {
+            worstMismatchProbability = __max(worstMismatchProbability, lv_phredToProbability[(unsigned char)quality[i]]);
+        }
+    }
+
+    //
+    // mostLikely[s] is the probability of the likeliest set of s edits.
+    //
+    double mostLikely[MAX_K + 1];
+    double result = 0;
+    mostLikely[0] = 1.0;
+    if (0 == minScore) {
+        result = lv_perfectMatchProbability[readLen];
+    }
+    for (unsigned s = 1; s <= __min(scoreLimit, (unsigned)MAX_K); s++) {
+        mostLikely[s] = mostLikely[s - 1] * worstMismatchProbability;
+        for (unsigned indelLength = 1; indelLength <= s; indelLength++) {
+            mostLikely[s] = __max(mostLikely[s], mostLikely[s - indelLength] * lv_indelProbabilities[indelLength]);
+        }
+        if (s >= minScore) {
+            result = __max(result, mostLikely[s] * lv_perfectMatchProbability[readLen - __min(s, readLen)]);
+        }
+    }
+
+    return result;
+}
+
+    bool
+BaseAligner::moreSeedsShouldNotChangeMAPQ(
+        Read                    *read[NUM_DIRECTIONS],
+        unsigned                 maxSeedsToUse,
+        unsigned                 nPossibleSeeds,
+        unsigned                 lookupsSoFar,
+        int                      maxEditDistanceForSecondaryResults)
+/*++
+
+Routine Description:
+
+    For adaptive seeding, once the first pass of seeds has covered the read and unseenLocationsCannotWin, decide
+    whether the rest of the read's seed budget is worth looking up.
+
+    Nothing unseen can change the alignment, and neither can the candidates we've found but not scored yet, as long
+    as they can't win either (their elements' lowestPossibleScore says how well they could do).  So what's left is
+    the MAPQ, which moves only with probability mass coming or going, and with popular seeds.  Neither can be known
+    without doing the lookups: any seed could be popular, and any could find a location at the unseen limit, so a
+    bound that holds for every possible genome never lets a read stop much before the seed loop does on its own.
+    Instead we expect the rest of the seeds to behave like the ones we've looked up:
+
+        Down: the seeds left bring in new locations and popular seeds at the rate the seeds after the first in
+        each direction did, not counting the best alignment, each new location and each unscored candidate as
+        likely as the likeliest alignment with its lowest possible score.  A read whose later seeds found nothing
+        new but its own location and none of whose seeds were popular expects nothing more, which is the common
+        case for reads from unique sequence.
+
+        Up: a new location can take the place of a scored one nearby (see the indel merging in score()), but only
+        one that it beats, so scored elements at least as bad as the lowest possible score of anything not scored
+        yet can lose their probability.
+
+    If the MAPQ is the same at both extremes, we stop.  This doesn't score anything, so if it says no, the read goes
+    on exactly as it would without adaptive seeding.
+
+    The cheap tests come first and the walks over the candidates last, since this runs after every seed.
+
+Arguments:
+
+    read                                - the read we're aligning in both directions
+    maxSeedsToUse                       - the read's seed budget
+    nPossibleSeeds                      - the number of seed positions in the read
+    lookupsSoFar                        - how many seeds we've looked up for this read
+    maxEditDistanceForSecondaryResults  - how far from the best a secondary alignment can be, or -1 if we don't want them
+
+Return Value:
+
+    true if we should stop looking up seeds
+
+--*/
+{
+    _ASSERT(unseenLocationsCannotWin(maxEditDistanceForSecondaryResults));
+    _ASSERT(lookupsSoFar > 0);
+    unsigned lowestPossibleScore = __min(lowestPossibleScoreOfAnyUnseenLocation[FORWARD], lowestPossibleScoreOfAnyUnseenLocation[RC]);
+
+    //
+    // What's left of the budget.  The loop can apply both directions of its last seed, so it can go one over.
+    //
+    unsigned seedsApplied = nSeedsApplied[FORWARD] + nSeedsApplied[RC];
+    unsigned seedPositionsLeft = nPossibleSeeds - nSeedPositionsUsed;
+    unsigned seedsLeft = __min(seedsApplied < maxSeedsToUse ? maxSeedsToUse - seedsApplied + 1 : 0, NUM_DIRECTIONS * seedPositionsLeft);
+
+    //
+    // Popular seeds don't use up the budget, so the fewer seeds are applied per lookup, the more lookups it takes
+    // to use up the rest of it.
+    //
+    unsigned morePopularSeeds = 0;
+    if (!explorePopularSeeds && popularSeedsSkipped > 0) {
+        unsigned appliedPerLookups = NUM_DIRECTIONS * lookupsSoFar - popularSeedsSkipped;
+        unsigned lookupsLeft = 0 == appliedPerLookups ? seedPositionsLeft : __min(seedPositionsLeft, (seedsLeft * lookupsSoFar + appliedPerLookups - 1) / appliedPerLookups);
+        morePopularSeeds = (popularSeedsSkipped * lookupsLeft + lookupsSoFar - 1) / lookupsSoFar;
+    }
+
+    //
+    // When the first seed in a direction has a mismatch in it, the read's own location turns up only in a later one, which
+    // isn't a sign of more to come, so the best alignment doesn't count.
+    //
+    unsigned laterSeedsApplied = seedsApplied - (0 != nSeedsApplied[FORWARD]) - (0 != nSeedsApplied[RC]);
+    unsigned otherNewLocationsFromLaterSeeds = newLocationsFromLaterSeeds - (bestFoundByLaterSeed ? 1 : 0);
+    double moreNewLocations = 0 == otherNewLocationsFromLaterSeeds ? 0 :
+        0 == laterSeedsApplied ? (double)seedsLeft * maxHitsToConsider : (double)otherNewLocationsFromLaterSeeds * seedsLeft / laterSeedsApplied;
+
+    int mapq = computeMAPQ(probabilityOfAllCandidates, probabilityOfBestCandidate, bestScore, popularSeedsSkipped);
+    if (0 != morePopularSeeds && computeMAPQ(probabilityOfAllCandidates, probabilityOfBestCandidate, bestScore, popularSeedsSkipped + morePopularSeeds) != mapq) {
+        return false;
+    }
+
+    //
+    // The candidates we haven't scored yet are the ones on the weight lists.
+    //
+    _int64 nUnscoredCandidates = 0;
+    unsigned lowestPossibleScoreOfUnscoredCandidate = UnusedScoreValue;
+    for (unsigned weight = highestUsedWeightList; weight > 0; weight--) {
+        for (HashTableElement *element = weightLists[weight].weightNext; element != &weightLists[weight]; element = element->weightNext) {
+            _uint64 unscored = element->candidatesUsed & ~element->candidatesScored;
+            if (0 == unscored) {
+                continue;
+            }
+
+            if (!scoreCannotWin(element->lowestPossibleScore, maxEditDistanceForSecondaryResults)) {
+                return false;
+            }
+
+            for (; 0 != unscored; unscored &= unscored - 1) {
+                nUnscoredCandidates++;
+            }
+            lowestPossibleScoreOfUnscoredCandidate = __min(lowestPossibleScoreOfUnscoredCandidate, element->lowestPossibleScore);
+        }
+    }
+
+    double mostProbabilityToCome = 0;
+    if (0 != nUnscoredCandidates) {
+        mostProbabilityToCome += (double)nUnscoredCandidates * mostLikelyAlignmentWithScoreAtLeast(read[FORWARD], lowestPossibleScoreOfUnscoredCandidate);
+    }
+    if (0 != moreNewLocations) {
+        mostProbabilityToCome += moreNewLocations * mostLikelyAlignmentWithScoreAtLeast(read[FORWARD], lowestPossibleScore);
+    }
+
+    if (0 != mostProbabilityToCome &&
+        computeMAPQ(probabilityOfAllCandidates + mostProbabilityToCome, probabilityOfBestCandidate, bestScore, popularSeedsSkipped + morePopularSeeds) != mapq) {
+        return false;
+    }
+
+    unsigned lowestPossibleScoreOfAnythingNotScored = __min(lowestPossibleScore, lowestPossibleScoreOfUnscoredCandidate);
+    double probabilityThatCouldBeReplaced = 0;
+    for (unsigned i = 0; i < nUsedHashTableElements; i++) {
+        if (hashTableElementPool[i].bestScore >= lowestPossibleScoreOfAnythingNotScored) {
+            probabilityThatCouldBeReplaced += hashTableElementPool[i].matchProbabilityForBestScore;
+        }
+    }
+
+    return probabilityThatCouldBeReplaced == 0 ||
+        computeMAPQ(probabilityOfAllCandidates - probabilityThatCouldBeReplaced, probabilityOfBestCandidate, bestScore, popularSeedsSkipped) == mapq;
+}
+
+    bool
+BaseAligner::escalateSeedBudget(
+        Read                    *read[NUM_DIRECTIONS],
+        unsigned                *maxSeedsToUse)
+/*++
+
+Routine Description:
+
+    For adaptive seeding, called when a read has used up its seed budget and every candidate has been scored, to
+    decide whether to give it one more seed lookup (in both directions).  We do only if more seeds could make the
+    read a single hit: its MAPQ is below MAPQ_LIMIT_FOR_SINGLE_HIT, an unseen location could still score better than
+    the best we have, and if one did (as likely as an alignment with the lowest score an unseen location could have)
+    it would take the read to at least MAPQ_LIMIT_FOR_SINGLE_HIT.  A read whose best and second best alignments are
+    both at the unseen limit, or that's lost too much to popular seeds, gets nothing.  The budget never goes past
+    largestSeedBudget, which is what the candidate pool has room for.
+
+Arguments:
+
+    read            - the read we're aligning in both directions
+    maxSeedsToUse   - in/out the read's seed budget
+
+Return Value:
+
+    true if the budget grew
+
+--*/
+{
+    unsigned lowestPossibleScore = __min(lowestPossibleScoreOfAnyUnseenLocation[FORWARD], lowestPossibleScoreOfAnyUnseenLocation[RC]);
+
+    if (*maxSeedsToUse + NUM_DIRECTIONS > largestSeedBudget || bestScore > maxK || lowestPossibleScore >= bestScore ||
+        computeMAPQ(probabilityOfAllCandidates, probabilityOfBestCandidate, bestScore, popularSeedsSkipped) >= MAPQ_LIMIT_FOR_SINGLE_HIT) {
+        return false;
+    }
+
+    double probabilityOfNewBest = mostLikelyAlignmentWithScoreAtLeast(read[FORWARD], lowestPossibleScore);
+    if (computeMAPQ(probabilityOfAllCandidates + probabilityOfNewBest, probabilityOfNewBest, lowestPossibleScore, popularSeedsSkipped) < MAPQ_LIMIT_FOR_SINGLE_HIT) {
+        return false;
+    }
+
+    if (!seedBudgetEscalated) {
+        nReadsWithEscalatedSeeds++;
+        seedBudgetEscalated = true;
+    }
+    *maxSeedsToUse += NUM_DIRECTIONS;
+    return true;
+}
+
+    void
+BaseAligner::recordSeedsUsed(_int64 lookupsBeforeThisRead)
+{
+    seedsPerReadHistogram[__min(nHashTableLookups - lookupsBeforeThisRead, (_int64)AlignerStats::maxSeedsPerReadBucket)]++;
+}
+
+    void
+BaseAligner::lookupSeed(
+        Seed                     seed,
+        _int64                   nHits[NUM_DIRECTIONS],
+        const GenomeLocation    *hits[NUM_DIRECTIONS],
+        GenomeLocation           singletonHits[NUM_DIRECTIONS],
+        const unsigned          *hits32[NUM_DIRECTIONS])
+/*++
+
+Routine Description:
+
+    Look up a seed in whichever form the index has, through the seed lookup cache if we have one.
+
+--*/
+{
+    if (doesGenomeIndexHave64BitLocations) {
+        if (NULL != seedLookupCache) {
+            seedLookupCache->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], &singletonHits[FORWARD], &singletonHits[RC]);
+        } else {
+            genomeIndex->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], &singletonHits[FORWARD], &singletonHits[RC]);
+        }
+    } else {
+        if (NULL != seedLookupCache) {
+            seedLookupCache->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
+        } else {
+            genomeIndex->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
+        }
+    }
+}
+
+    void
+BaseAligner::lookupSeedBatch(
+        unsigned                 nSeeds,
+        const Seed              *seeds,
+        SeedLookup             **lookups)
+/*++
+
+Routine Description:
+
+    Look up a group of seeds together, the way lookupSeed looks up one, and put the results in lookups.
+
+--*/
+{
+    static const unsigned maxSeedsPerBatch = maxFirstSeeds * 8;
+    _ASSERT(nSeeds <= maxSeedsPerBatch);
+
+    _int64 nHits[NUM_DIRECTIONS][maxSeedsPerBatch];
+    const GenomeLocation *hits[NUM_DIRECTIONS][maxSeedsPerBatch];
+    GenomeLocation singletonHits[NUM_DIRECTIONS][maxSeedsPerBatch];
+    const unsigned *hits32[NUM_DIRECTIONS][maxSeedsPerBatch];
+
+    if (doesGenomeIndexHave64BitLocations) {
+        if (NULL != seedLookupCache) {
+            seedLookupCache->lookupSeedBatch(nSeeds, seeds, nHits[FORWARD], hits[FORWARD], nHits[RC], hits[RC], singletonHits[FORWARD], singletonHits[RC]);
+        } else {
+            genomeIndex->lookupSeedBatch(nSeeds, seeds, nHits[FORWARD], hits[FORWARD], nHits[RC], hits[RC], singletonHits[FORWARD], singletonHits[RC]);
+        }
+    } else {
+        if (NULL != seedLookupCache) {
+            seedLookupCache->lookupSeedBatch32(nSeeds, seeds, nHits[FORWARD], hits32[FORWARD], nHits[RC], hits32[RC]);
+        } else {
+            genomeIndex->lookupSeedBatch32(nSeeds, seeds, nHits[FORWARD], hits32[FORWARD], nHits[RC], hits32[RC]);
+        }
+    }
+
+    for (unsigned i = 0; i < nSeeds; i++) {
+        for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+            SeedLookup *lookup = lookups[i];
+            lookup->nHits[direction] = nHits[direction][i];
+            if (doesGenomeIndexHave64BitLocations) {
+                //
+                // A single hit points at where we were told to keep it, which is on our stack.  Move it into the lookup.
+                //
+                lookup->singletonHits[direction] = singletonHits[direction][i];
+                lookup->hits[direction] = hits[direction][i] == &singletonHits[direction][i] ? &lookup->singletonHits[direction] : hits[direction][i];
+            } else {
+                lookup->hits32[direction] = hits32[direction][i];
+            }
+        }
+    }
+}
+
+    unsigned
+BaseAligner::getMaxSeedsToUse(unsigned readLen)
+{
+    if (0 != maxSeedsToUseFromCommandLine) {
+        return maxSeedsToUseFromCommandLine;
+    }
+    return (int)(2 * maxSeedCoverage * readLen / genomeIndex->getSeedLength()); // 2x is for FORWARD/RC
+}
+
+    unsigned
+BaseAligner::getNFirstSeeds(unsigned readLen, unsigned maxSeedsToUse)
+/*++
+
+Routine Description:
+
+    How many seeds at the start of a read lookupFirstSeeds looks up.  The seed loop always uses at least this many
+    before the lowest possible score of an unseen location gets past extraSearchDepth and it can stop, as long as
+    it doesn't run out of seeds first.  They're all in the first pass, which doesn't overlap them.
+
+--*/
+{
+    if (readLen < seedLen) {
+        return 0;
+    }
+    unsigned nPossibleSeeds = readLen - seedLen + 1;
+    return __min(__min(extraSearchDepth + 1, (maxSeedsToUse + 1) / 2), __min((nPossibleSeeds + seedLen - 1) / seedLen, maxFirstSeeds));
+}
+
+    void
+BaseAligner::lookupFirstSeeds(
+        unsigned                 nReads,
+        Read                   **reads,
+        FirstSeedLookups        *firstSeedLookups)
+/*++
+
+Routine Description:
+
+    Look up the first seeds of a group of reads together, so that their cache misses overlap, and get the genome
+    data for reads whose first seed hits just once on its way too, since that's the next thing AlignRead touches.
+
+    Reads with Ns don't get any, since an N moves the first pass seeds away from multiples of seedLen.  Neither do
+    reads that AlignRead would turn away without looking anything up.
+
+Arguments:
+
+    nReads              - how many reads
+    reads               - the reads
+    firstSeedLookups    - returns the lookups for each read, for it to pass to AlignRead
+
+--*/
+{
+    static const unsigned maxSeedsPerBatch = maxFirstSeeds * 8;
+    Seed seeds[maxSeedsPerBatch];
+    SeedLookup *lookups[maxSeedsPerBatch];
+    unsigned nSeeds = 0;
+
+    for (unsigned whichRead = 0; whichRead < nReads; whichRead++) {
+        FirstSeedLookups *first = &firstSeedLookups[whichRead];
+        first->nLookups = 0;
+
+        unsigned readLen = reads[whichRead]->getDataLength();
+        const char *readData = reads[whichRead]->getData();
+        if (readLen > maxReadSize) {
+            continue;
+        }
+        unsigned countOfNs = 0;
+        for (unsigned i = 0; i < readLen; i++) {
+            countOfNs += nTable[readData[i]];
+        }
+        if (countOfNs > 0) {
+            continue;
+        }
+
+        unsigned nFirstSeeds = getNFirstSeeds(readLen, getMaxSeedsToUse(readLen));
+        if (nSeeds + nFirstSeeds > maxSeedsPerBatch) {
+            lookupSeedBatch(nSeeds, seeds, lookups);
+            nSeeds = 0;
+        }
+        for (unsigned i = 0; i < nFirstSeeds; i++) {
+            seeds[nSeeds] = Seed(readData + i * seedLen, seedLen);
+            lookups[nSeeds] = &first->lookups[i];
+            nSeeds++;
+        }
+        first->nLookups = nFirstSeeds;
+    }
+    lookupSeedBatch(nSeeds, seeds, lookups);
+
+    if (doAlignerPrefetch) {
+        for (unsigned whichRead = 0; whichRead < nReads; whichRead++) {
+            const SeedLookup *lookup = &firstSeedLookups[whichRead].lookups[0];
+            if (0 == firstSeedLookups[whichRead].nLookups || 1 != lookup->nHits[FORWARD] + lookup->nHits[RC]) {
+                continue;
+            }
+            Direction direction = 1 == lookup->nHits[FORWARD] ? FORWARD : RC;
+            GenomeLocation hitLocation;
+            if (doesGenomeIndexHave64BitLocations) {
+                hitLocation = lookup->hits[direction][0];
+            } else {
+                hitLocation = lookup->hits32[direction][0];
+            }
+            genomeIndex->prefetchGenomeData(hitLocation - (direction == FORWARD ? 0 : reads[whichRead]->getDataLength() - seedLen));
+        }
+    }
+}
+
+    bool
+BaseAligner::alignExactUniqueMatch(
+        Read                    *read[NUM_DIRECTIONS],
+        unsigned                 maxSeedsToUse,
+        SingleAlignmentResult   *primaryResult)
+/*++
+
+Routine Description:
+
+    A fast path for reads that match the genome exactly in exactly one place, which are most of the reads in a
+    typical run.  This is a private method of the BaseAligner class that's used only by AlignRead.
+
+    For such a read, the seed loop in AlignRead finds the same single candidate with every seed, scores it on the
+    first one, and then keeps looking up seeds until the lowest possible score of any unseen location is more than
+    extraSearchDepth, which takes extraSearchDepth + 1 seeds.  Here we look up the same seeds in the same order, and
+    if each of them hits exactly once in the genome (counting both directions) and the read is identical to the
+    genome at the location of the first hit, then that location is the only candidate AlignRead would ever have
+    seen.  We fill in the result that score() would have computed for it without building the candidate hash
+    table or running Landau-Vishkin.
+
+    Anything else, including options that change when the seed loop stops, falls back to the full search, so the
+    results are always the same as without the fast path.  The lookups we did are left in firstSeeds for the seed
+    loop to pick up, so falling back doesn't cost any extra lookups.  If the caller already did some of them with
+    lookupFirstSeeds, we use those.
+
+Arguments:
+
+    read            - the read we're aligning in both directions.  It must not contain any Ns.
+    maxSeedsToUse   - the limit on seeds for this read that AlignRead computed
+    primaryResult   - returns the result if we took the fast path
+
+Return Value:
+
+    true iff we took the fast path and filled in primaryResult
+
+--*/
+{
+    if (!exactMatchFastPath || noUkkonen || noTruncation || stopOnFirstHit || 0 == maxHitsToConsider) {
+        return false;
+    }
+
+    unsigned readLen = read[FORWARD]->getDataLength();
+
+    //
+    // The seed loop applies the seed in both directions each time around, and stops early (forcing a result that's
+    // the same as the one it would have reached) if it runs out of seeds first.  If it would have to wrap around
+    // to seeds that overlap the first pass, we don't try to follow it.
+    //
+    unsigned nSeedsNeeded = __min(extraSearchDepth + 1, (maxSeedsToUse + 1) / 2);
+    if (0 == nSeedsNeeded || nSeedsNeeded != getNFirstSeeds(readLen, maxSeedsToUse)) {
+        return false;
+    }
+
+    GenomeLocation readLocation = InvalidGenomeLocation;
+    Direction readDirection = FORWARD;
+
+    for (unsigned i = 0; i < nSeedsNeeded; i++) {
+        unsigned seedOffset = i * seedLen;
+        if (!Seed::DoesTextRepresentASeed(read[FORWARD]->getData() + seedOffset, seedLen)) {
+            return false;
+        }
+        SeedLookup *lookup = &firstSeeds->lookups[i];
+        if (i == firstSeeds->nLookups) {
+            Seed seed(read[FORWARD]->getData() + seedOffset, seedLen);
+            lookupSeed(seed, lookup->nHits, lookup->hits, lookup->singletonHits, lookup->hits32);
+            nHashTableLookups++;
+            firstSeeds->nLookups++;
+        }
+
+        if (lookup->nHits[FORWARD] + lookup->nHits[RC] != 1) {
+            return false;
+        }
+
+        Direction direction = lookup->nHits[FORWARD] == 1 ? FORWARD : RC;
+        GenomeLocation hitLocation;
+        if (doesGenomeIndexHave64BitLocations) {
+            hitLocation = lookup->hits[direction][0];
+        } else {
+            hitLocation = lookup->hits32[direction][0];
+        }
+        GenomeLocation location = hitLocation - (direction == FORWARD ? seedOffset : readLen - seedLen - seedOffset);
+
+        if (0 == i) {
+            //
+            // Check the whole read against the genome now, before spending any more lookups on it.  memcmp
+            // compares a vector at a time.
+            //
+            const char *data = genome->getSubstring(location, readLen + MAX_K, genomeDecodeBuffer, MAX_K);
+            if (NULL == data || 0 != memcmp(data, read[direction]->getData(), readLen)) {
+                return false;
+            }
+            readLocation = location;
+            readDirection = direction;
+        } else if (location != readLocation || direction != readDirection) {
+            return false;
+        }
+    }
+
+    //
+    // This is what score() computes for the lone candidate: an exact match on both sides of the first seed (which
+    // is at the start of the read going forward, and at the end for RC), and nothing else to share the probability.
+    //
+    unsigned firstSeedOffset = readDirection == FORWARD ? 0 : readLen - seedLen;
+    double matchProbability = lv_perfectMatchProbability[readLen - (firstSeedOffset + seedLen)] * lv_perfectMatchProbability[firstSeedOffset] *
+        pow(1 - SNP_PROB, (int)seedLen);
+
+    bestScore = 0;
+    bestScoreGenomeLocation = readLocation;
+    probabilityOfBestCandidate = matchProbability;
+    probabilityOfAllCandidates = matchProbability;
+
+    primaryResult->location = readLocation;
+    primaryResult->direction = readDirection;
+    primaryResult->score = 0;
+    primaryResult->mapq = computeMAPQ(probabilityOfAllCandidates, probabilityOfBestCandidate, 0, 0);
+    primaryResult->status = primaryResult->mapq >= MAPQ_LIMIT_FOR_SINGLE_HIT ? SingleHit : MultipleHits;
+
+    return true;
+}
+
     bool
 BaseAligner::score(
         bool                     forceResult,
@@ -817,7 +1501,7 @@ Return Value:
                 double matchProbability = 0;
                 unsigned readDataLength = read[elementToScore->direction]->getDataLength();
                 GenomeDistance genomeDataLength = readDataLength + MAX_K; // Leave extra space in case the read has deletions
-                const char *data = genome->getSubstring(genomeLocation, genomeDataLength);
+                const char *data = genome->getSubstring(genomeLocation, genomeDataLength, genomeDecodeBuffer, MAX_K);   // MAX_K before for the reverse LV
 
 #if 0 // This only happens when we're in the padding region, and genomeLocations there just lead to problems.  Just say no.
                 if (NULL == data) {
@@ -1028,6 +1712,7 @@ Return Value:
                     probabilityOfBestCandidate = matchProbability;
                     _ASSERT(probabilityOfBestCandidate <= probabilityOfAllCandidates);
                     bestScoreGenomeLocation = genomeLocation;
+                    bestFoundByLaterSeed = elementToScore->foundByLaterSeed;
                     primaryResult->location = bestScoreGenomeLocation;
                     primaryResult->score = bestScore;
                     primaryResult->direction = elementToScore->direction;
@@ -1247,6 +1932,7 @@ Return Value:
     element->baseGenomeLocation = highOrderGenomeLocation;
     element->bestScore = UnusedScoreValue;
     element->allExtantCandidatesScored = false;
+    element->foundByLaterSeed = false;
     element->matchProbabilityForBestScore = 0;
 
     //
@@ -1354,6 +2040,7 @@ BaseAligner::HashTableElement::init()
     bestScore = UnusedScoreValue;
     direction = FORWARD;
     allExtantCandidatesScored = false;
+    foundByLaterSeed = false;
     matchProbabilityForBestScore = 0;
 }
 
@@ -34,6 +34,7 @@ Revision History:
 #include "AlignerStats.h"
 #include "directions.h"
 #include "GenomeIndex.h"
+#include "SeedLookupCache.h"
 
 extern bool doAlignerPrefetch;
 
@@ -61,6 +62,35 @@ public:
 
     virtual ~BaseAligner();
 
+    //
+    // A seed looked up in the index, in both directions.  Singleton hits point into singletonHits, so it has to stay
+    // put until the read is done.
+    //
+    struct SeedLookup {
+        _int64                   nHits[NUM_DIRECTIONS];
+        const GenomeLocation    *hits[NUM_DIRECTIONS];
+        GenomeLocation           singletonHits[NUM_DIRECTIONS];
+        const unsigned          *hits32[NUM_DIRECTIONS];
+    };
+
+    //
+    // The lookups for a read's first seeds: the first pass seeds at the start of the read, as many as the seed loop
+    // (or alignExactUniqueMatch) always looks up before it can stop.  The seed loop uses these rather than looking the
+    // seeds up again.
+    //
+    static const unsigned maxFirstSeeds = 8;
+    struct FirstSeedLookups {
+        unsigned    nLookups;
+        SeedLookup  lookups[maxFirstSeeds];
+    };
+
+    //
+    // Look up the first seeds of a group of reads all at once, and prefetch the genome data where the first seed
+    // hits just once.  Nearly all of these are cache misses in a big index, and doing them together lets them
+    // overlap rather than each read waiting on its own.  Pass each read's lookups to AlignRead with the read.
+    //
+    void lookupFirstSeeds(unsigned nReads, Read **reads, FirstSeedLookups *firstSeedLookups);
+
         void
     AlignRead(
         Read                    *read,
@@ -68,7 +98,8 @@ public:
         int                      maxEditDistanceForSecondaryResults,
         int                      secondaryResultBufferSize,
         int                     *nSecondaryResults,
-        SingleAlignmentResult   *secondaryResults             // The caller passes in a buffer of secondaryResultBufferSize and it's filled in by AlignRead()
+        SingleAlignmentResult   *secondaryResults,            // The caller passes in a buffer of secondaryResultBufferSize and it's filled in by AlignRead()
+        FirstSeedLookups        *firstSeedLookups = NULL      // From lookupFirstSeeds, or NULL to look the first seeds up here
     );      // Retun value is true if there was enough room in the secondary alignment buffer for everything that was found.
 
         
@@ -81,6 +112,10 @@ public:
     _int64 getNHitsIgnoredBecauseOfTooHighPopularity() const {return nHitsIgnoredBecauseOfTooHighPopularity;}
     _int64 getNReadsIgnoredBecauseOfTooManyNs() const {return nReadsIgnoredBecauseOfTooManyNs;}
     _int64 getNIndelsMerged() const {return nIndelsMerged;}
+    _int64 getNReadsTakingExactMatchFastPath() const {return nReadsTakingExactMatchFastPath;}
+    _int64 getNReadsStoppingSeedingEarly() const {return nReadsStoppingSeedingEarly;}
+    _int64 getNReadsWithEscalatedSeeds() const {return nReadsWithEscalatedSeeds;}
+    const _int64 *getSeedsPerReadHistogram() const {return seedsPerReadHistogram;}   // AlignerStats::maxSeedsPerReadBucket + 1 entries
     void addIgnoredReads(_int64 newlyIgnoredReads) {nReadsIgnoredBecauseOfTooManyNs += newlyIgnoredReads;}
 
     const char *getRCTranslationTable() const {return rcTranslationTable;}
@@ -107,6 +142,27 @@ public:
     inline bool getStopOnFirstHit() {return stopOnFirstHit;}
     inline void setStopOnFirstHit(bool newValue) {stopOnFirstHit = newValue;}
 
+    //
+    // Look up seeds through a cache of popular ones (see SeedLookupCache.h) rather than going straight to the index.
+    // The cache belongs to the caller, and it's fine to share it with other aligners on the same thread.
+    //
+    inline void setSeedLookupCache(SeedLookupCache *newValue) {seedLookupCache = newValue;}
+
+    //
+    // Adaptive seeding lets the seed budget vary from read to read.  A read stops looking up seeds once they've covered
+    // it, nothing unseen could beat its best alignment, and judging by what its seeds have found so far the rest
+    // wouldn't change its MAPQ (see moreSeedsShouldNotChangeMAPQ), and a read that runs out of seeds while below
+    // MAPQ_LIMIT_FOR_SINGLE_HIT gets more, one at a time, for as long as a better alignment that it hasn't seen could
+    // still take it over that limit.
+    //
+    inline void setAdaptiveSeeding(bool newValue) {adaptiveSeeding = newValue;}
+
+    //
+    // Whether reads that match the genome exactly in one place skip the full search (see alignExactUniqueMatch).
+    // Off by default; the results are meant to be the same either way.
+    //
+    inline void setExactMatchFastPath(bool newValue) {exactMatchFastPath = newValue;}
+
     static size_t getBigAllocatorReservation(bool ownLandauVishkin, unsigned maxHitsToConsider, unsigned maxReadSize, unsigned seedLen, unsigned numSeedsFromCommandLine, double seedCoverage);
 
 private:
@@ -132,6 +188,10 @@ private:
     _int64 nHitsIgnoredBecauseOfTooHighPopularity;
     _int64 nReadsIgnoredBecauseOfTooManyNs;
     _int64 nIndelsMerged;
+    _int64 nReadsTakingExactMatchFastPath;
+    _int64 nReadsStoppingSeedingEarly;
+    _int64 nReadsWithEscalatedSeeds;
+    _int64 seedsPerReadHistogram[AlignerStats::maxSeedsPerReadBucket + 1];
 
     //
     // A bitvector indexed by offset in the read indicating whether this seed is used.
@@ -145,9 +205,21 @@ private:
     }
 
     inline void SetSeedUsed(unsigned indexInRead) {
-        seedUsed[indexInRead / 8] |= (1 << (indexInRead % 8));
+        if (!IsSeedUsed(indexInRead)) {
+            seedUsed[indexInRead / 8] |= (1 << (indexInRead % 8));
+            nSeedPositionsUsed++;
+        }
     }
 
+    unsigned nSeedPositionsUsed;    // Bits set in seedUsed
+
+    //
+    // The first seed lookups for the current read: either the caller's from lookupFirstSeeds, or our own, which
+    // alignExactUniqueMatch fills in as it goes.
+    //
+    FirstSeedLookups *firstSeeds;
+    FirstSeedLookups ownFirstSeeds;
+
     struct Candidate {
         Candidate() {init();}
         void init();
@@ -191,6 +263,7 @@ private:
         GenomeLocation       bestScoreGenomeLocation;
         Direction            direction;
         bool                 allExtantCandidatesScored;
+        bool                 foundByLaterSeed;  // Allocated by a seed after the first one applied in its direction
         double               matchProbabilityForBestScore;
  
         Candidate            candidates[hashTableElementSize];
@@ -257,6 +330,8 @@ private:
     int firstPassSeedsNotSkipped[NUM_DIRECTIONS];
     _int64 smallestSkippedSeed[NUM_DIRECTIONS];
     unsigned highestWeightListChecked;
+    double worstMismatchProbability;     // Over the bases of this read, or -1 if we haven't needed it yet
+    bool seedBudgetEscalated;
 
     double totalProbabilityByDepth[AlignerStats::maxMaxHits];
     void updateProbabilityMass();
@@ -271,6 +346,41 @@ private:
         int                     *nSecondaryResults,
         SingleAlignmentResult   *secondaryResults);
 
+    void lookupSeed(
+        Seed                     seed,
+        _int64                   nHits[NUM_DIRECTIONS],
+        const GenomeLocation    *hits[NUM_DIRECTIONS],
+        GenomeLocation           singletonHits[NUM_DIRECTIONS],
+        const unsigned          *hits32[NUM_DIRECTIONS]);
+
+    void lookupSeedBatch(unsigned nSeeds, const Seed *seeds, SeedLookup **lookups);
+
+    unsigned getMaxSeedsToUse(unsigned readLen);
+    unsigned getNFirstSeeds(unsigned readLen, unsigned maxSeedsToUse);
+
+    bool unseenLocationsCannotWin(int maxEditDistanceForSecondaryResults);
+    bool scoreCannotWin(unsigned lowestPossibleScore, int maxEditDistanceForSecondaryResults);
+    bool allCandidatesScored();
+    bool moreSeedsShouldNotChangeMAPQ(Read *read[NUM_DIRECTIONS], unsigned maxSeedsToUse, unsigned nPossibleSeeds, unsigned lookupsSoFar, int maxEditDistanceForSecondaryResults);
+    double mostLikelyAlignmentWithScoreAtLeast(Read *read, unsigned minScore);
+
+    bool scoreRemainingCandidates(
+        Read                    *read[NUM_DIRECTIONS],
+        SingleAlignmentResult   *primaryResult,
+        int                      maxEditDistanceForSecondaryResults,
+        int                      secondaryResultBufferSize,
+        int                     *nSecondaryResults,
+        SingleAlignmentResult   *secondaryResults);
+
+    bool escalateSeedBudget(Read *read[NUM_DIRECTIONS], unsigned *maxSeedsToUse);
+
+    void recordSeedsUsed(_int64 lookupsBeforeThisRead);
+
+    bool alignExactUniqueMatch(
+        Read                    *read[NUM_DIRECTIONS],
+        unsigned                 maxSeedsToUse,
+        SingleAlignmentResult   *primaryResult);
+
     void clearCandidates();
 
     bool findElement(GenomeLocation genomeLocation, Direction direction, HashTableElement **hashTableElement);
@@ -298,6 +408,7 @@ private:
     char *rcReadData;
     char *rcReadQuality;
     char *reversedRead[NUM_DIRECTIONS];
+    char *genomeDecodeBuffer;   // Where we unpack the reference if the genome is packed
 
     unsigned nTable[256];
 
@@ -306,13 +417,23 @@ private:
     // How many overly popular (> maxHits) seeds we skipped this run
     unsigned popularSeedsSkipped;
 
+    // For adaptive seeding, how many new locations seeds found after the first one applied in each direction
+    unsigned newLocationsFromLaterSeeds;
+    bool bestFoundByLaterSeed;  // And whether the best alignment so far is one of them
+
     bool explorePopularSeeds; // Whether we should explore the first maxHits hits even for overly
                               // popular seeds (useful for filtering reads that come from a database
                               // with many very similar sequences).
 
+    SeedLookupCache *seedLookupCache;   // NULL if we look seeds up in the index directly
+
     bool stopOnFirstHit;      // Whether to stop the first time a location matches with less than
                               // maxK edit distance (useful when using SNAP for filtering only).
 
+    bool adaptiveSeeding;       // See setAdaptiveSeeding
+    bool exactMatchFastPath;    // See setExactMatchFastPath
+    unsigned largestSeedBudget; // The most seeds a read can use before it might run out of hash table elements
+
     AlignerStats *stats;
 
     unsigned *hitCountByExtraSearchDepth;   // How many hits at each depth bigger than the current best edit distance.
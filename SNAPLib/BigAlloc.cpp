@@ -315,6 +315,12 @@ bool BigCommit(
 
 #else /* no _MSC_VER */
 
+//
+// The size of the allocation goes in a header just ahead of the memory we hand out.  The header is a whole cache line
+// so that the memory we return stays cache line aligned, which the bucketed hash tables rely on.
+//
+static const size_t BigAllocHeaderSize = 64;
+
 #ifdef PROFILE_BIGALLOC
 void *BigAllocInternal(
 #else
@@ -325,14 +331,14 @@ void *BigAlloc(
 {
     // Make space to include the allocated size at the start of our region; this is necessary
     // so that we can BigDealloc the memory later.
-    sizeToAllocate += sizeof(size_t);
+    sizeToAllocate += BigAllocHeaderSize;
 
     const size_t ALIGN_SIZE = 4096;
     if (sizeToAllocate % ALIGN_SIZE != 0) {
         sizeToAllocate += ALIGN_SIZE - (sizeToAllocate % ALIGN_SIZE);
     }
     if (sizeAllocated != NULL) {
-      *sizeAllocated = sizeToAllocate - sizeof(size_t);
+      *sizeAllocated = sizeToAllocate - BigAllocHeaderSize;
     }
 
     int flags = MAP_PRIVATE|MAP_ANONYMOUS;
@@ -354,9 +360,9 @@ void *BigAlloc(
     }
 #endif
 
-    // Remember the size allocated in the first sizeof(size_t) bytes
+    // Remember the size allocated at the start of the header
     *((size_t *) mem) = sizeToAllocate;
-    return (void *) (mem + sizeof(size_t));
+    return (void *) (mem + BigAllocHeaderSize);
 }
 
 
@@ -364,7 +370,7 @@ void BigDealloc(void *memory)
 {
     if (NULL == memory) return;
     // Figure out the size we had allocated
-    char *startAddress = ((char *) memory) - sizeof(size_t);
+    char *startAddress = ((char *) memory) - BigAllocHeaderSize;
     size_t sizeAllocated = *((size_t *) startAddress);
     if (munmap(startAddress, sizeAllocated) != 0) {
         perror("munmap");
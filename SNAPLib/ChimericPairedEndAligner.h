@@ -81,6 +81,15 @@ public:
         return underlyingPairedEndAligner->getLocationsScored() + singleAligner->getLocationsScored();
     }
 
+    // For the single end aligner we fall back to; the underlying paired end aligner has its own setting.
+    void setSeedLookupCache(SeedLookupCache *seedLookupCache) {
+        singleAligner->setSeedLookupCache(seedLookupCache);
+    }
+
+    void setExactMatchFastPath(bool exactMatchFastPath) {
+        singleAligner->setExactMatchFastPath(exactMatchFastPath);
+    }
+
 protected:
    
     bool        forceSpacing;
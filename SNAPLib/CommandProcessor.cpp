@@ -45,6 +45,7 @@ static void usage()
 		"   index    build a genome index\n"
 		"   single   align single-end reads\n"
 		"   paired   align paired-end reads\n"
+		"   shm      load an index into shared memory for later runs to use, or unload it\n"
 		"   daemon   run in daemon mode--accept commands remotely\n"
 		"Type a command without arguments to see its help.\n");
 }
@@ -59,6 +60,8 @@ void ProcessNonDaemonCommands(int argc, const char **argv) {
 			//
 			WriteErrorMessage("The index command is not available in daemon mode.  Please run 'snap index' directly.\n");
 		}
+	} else if (strcmp(argv[1], "shm") == 0) {
+		GenomeIndex::runSharedMemoryCommand(argc - 2, argv + 2);
 	} else if (strcmp(argv[1], "single") == 0 || strcmp(argv[1], "paired") == 0) {
 		for (int i = 1; i < argc; /* i is increased below */) {
 			unsigned nArgsConsumed;
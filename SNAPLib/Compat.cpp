@@ -31,6 +31,22 @@ Revision History:
 #include <err.h>
 #include <unistd.h>
 #include <signal.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#else   // _MSC_VER
+#include <intrin.h>
 #endif
 #include "exit.h"
 #ifdef PROFILE_WAIT
@@ -319,6 +335,14 @@ _int64 QueryFileSize(const char *fileName) {
     return fileSize.QuadPart;
 }
 
+_int64 QueryFileModificationTime(const char *fileName) {
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesEx(fileName, GetFileExInfoStandard, &attributes)) {
+        return -1;
+    }
+    return ((_int64)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+}
+
     bool
 DeleteSingleFile(
     const char* filename)
@@ -476,6 +500,28 @@ void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile)
   // No-op on WIndows.
 }
 
+//
+// Windows named file mappings go away when the last handle to them closes, so they can't hold an index between runs.
+//
+    MemoryMappedFile *
+CreateSharedMemorySegment(const char *name, size_t size, void **o_contents)
+{
+    WriteErrorMessage("Shared memory segments that persist between runs aren't supported on Windows\n");
+    return NULL;
+}
+
+    MemoryMappedFile *
+OpenSharedMemorySegment(const char *name, size_t *o_size, void **o_contents)
+{
+    return NULL;
+}
+
+    bool
+DeleteSharedMemorySegment(const char *name)
+{
+    return false;
+}
+
 
 class WindowsAsyncFile : public AsyncFile
 {
@@ -1087,7 +1133,7 @@ public:
 
     bool waitWithTimeout(_int64 timeoutInMillis) {
         struct timespec wakeTime;
-#ifdef __LINUX__
+#ifdef __linux__
         clock_gettime(CLOCK_REALTIME, &wakeTime);
         wakeTime.tv_nsec += timeoutInMillis * 1000000;
 #elif defined(__MACH__)
@@ -1119,6 +1165,7 @@ public:
     bool destroy() {
         pthread_cond_destroy(&cond);
         pthread_mutex_destroy(&lock);
+        return true;
     }
 };
 
@@ -1305,6 +1352,15 @@ _int64 QueryFileSize(const char *fileName)
     return fileSize;
 }
 
+_int64 QueryFileModificationTime(const char *fileName)
+{
+    struct stat sb;
+    if (stat(fileName, &sb) != 0) {
+        return -1;
+    }
+    return sb.st_mtime;
+}
+
     bool
 DeleteSingleFile(
     const char* filename)
@@ -1436,6 +1492,93 @@ void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile)
   }
 }
 
+    static void
+SharedMemorySegmentPath(const char *name, char *path, size_t pathSize)
+{
+    snprintf(path, pathSize, "/%s", name);  // shm_open wants names that look like "/foo"
+}
+
+    MemoryMappedFile *
+CreateSharedMemorySegment(const char *name, size_t size, void **o_contents)
+{
+    char path[NAME_MAX + 1];
+    SharedMemorySegmentPath(name, path, sizeof(path));
+
+    int fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        WriteErrorMessage("Unable to create shared memory segment '%s', errno %d\n", name, errno);
+        return NULL;
+    }
+
+    if (0 != ftruncate(fd, size)) {
+        WriteErrorMessage("Unable to set the size of shared memory segment '%s' to %lld, errno %d\n", name, (_int64)size, errno);
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, __max(size, (size_t)1), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == NULL || map == MAP_FAILED) {
+        WriteErrorMessage("Unable to map shared memory segment '%s', errno %d\n", name, errno);
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    madvise(map, size, MADV_HUGEPAGE);     // Only an optimization, for when /dev/shm is mounted with huge=advise
+#endif // MADV_HUGEPAGE
+
+    MemoryMappedFile* result = new MemoryMappedFile();
+    result->fd = fd;
+    result->map = map;
+    result->length = __max(size, (size_t)1);
+    *o_contents = map;
+    return result;
+}
+
+    MemoryMappedFile *
+OpenSharedMemorySegment(const char *name, size_t *o_size, void **o_contents)
+{
+    char path[NAME_MAX + 1];
+    SharedMemorySegmentPath(name, path, sizeof(path));
+
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat statBuffer;
+    if (0 != fstat(fd, &statBuffer)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = statBuffer.st_size;
+
+    void *map = mmap(NULL, __max(size, (size_t)1), PROT_READ, MAP_SHARED, fd, 0);
+    if (map == NULL || map == MAP_FAILED) {
+        WriteErrorMessage("Unable to map shared memory segment '%s', errno %d\n", name, errno);
+        close(fd);
+        return NULL;
+    }
+
+    MemoryMappedFile* result = new MemoryMappedFile();
+    result->fd = fd;
+    result->map = map;
+    result->length = __max(size, (size_t)1);
+    *o_size = size;
+    *o_contents = map;
+    return result;
+}
+
+    bool
+DeleteSharedMemorySegment(const char *name)
+{
+    char path[NAME_MAX + 1];
+    SharedMemorySegmentPath(name, path, sizeof(path));
+    return 0 == shm_unlink(path);
+}
+
 #ifdef __linux__
 
 class PosixAsyncFile : public AsyncFile
@@ -1670,6 +1813,487 @@ PosixAsyncFile::Reader::waitForCompletion()
     return true;
 }
 
+
+//
+// io_uring.  The submission and completion rings are shared with the kernel, so the indices that the other side
+// updates are read with acquire semantics and the ones that we update are written with release semantics.
+//
+
+    bool
+IoUring::IsSupported()
+{
+#ifdef HAVE_IO_URING
+    static int supported = -1;      // Don't know yet
+
+    if (supported < 0) {
+        IoUring *ring = create(1);
+        if (NULL == ring) {
+            supported = 0;
+        } else {
+            //
+            // Make sure that the kernel knows the plain read and write operations (5.6 and later).
+            //
+            const unsigned nOps = 256;
+            size_t probeSize = sizeof(struct io_uring_probe) + nOps * sizeof(struct io_uring_probe_op);
+            struct io_uring_probe *probe = (struct io_uring_probe *)malloc(probeSize);
+            memset(probe, 0, probeSize);
+            supported = 0 == syscall(__NR_io_uring_register, ring->ringFd, IORING_REGISTER_PROBE, probe, nOps) &&
+                probe->last_op >= IORING_OP_WRITE &&
+                (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+            free(probe);
+            delete ring;
+        }
+    }
+
+    return 0 != supported;
+#else   // HAVE_IO_URING
+    return false;
+#endif  // HAVE_IO_URING
+}
+
+    IoUring *
+IoUring::create(
+    unsigned entries)
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+
+    int fd = (int)syscall(__NR_io_uring_setup, __max(entries, 1u), &params);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    IoUring *ring = new IoUring();
+    ring->ringFd = fd;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqRingSize = ring->cqRingSize = __max(ring->sqRingSize, ring->cqRingSize);
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (MAP_FAILED == ring->sqRing || MAP_FAILED == ring->cqRing || MAP_FAILED == ring->sqes) {
+        if (MAP_FAILED != ring->sqes) {
+            munmap(ring->sqes, ring->sqesSize);
+        }
+        if (MAP_FAILED != ring->cqRing && ring->cqRing != ring->sqRing) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        if (MAP_FAILED != ring->sqRing) {
+            munmap(ring->sqRing, ring->sqRingSize);
+        }
+        ::close(fd);
+        ring->ringFd = -1;
+        ring->sqRing = ring->cqRing = ring->sqes = NULL;
+        delete ring;
+        return NULL;
+    }
+
+    char *sq = (char *)ring->sqRing;
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = (char *)ring->cqRing;
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    return ring;
+#else   // HAVE_IO_URING
+    return NULL;
+#endif  // HAVE_IO_URING
+}
+
+IoUring::~IoUring()
+{
+    if (NULL != sqes) {
+        munmap(sqes, sqesSize);
+    }
+    if (NULL != cqRing && cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    if (NULL != sqRing) {
+        munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0) {
+        ::close(ringFd);
+    }
+}
+
+    bool
+IoUring::submit(
+    unsigned char opcode,
+    int fd,
+    void *buffer,
+    unsigned length,
+    _int64 offset,
+    _uint64 userData)
+{
+#ifdef HAVE_IO_URING
+    unsigned tail = *sqTail;    // Only we write it
+    unsigned index = tail & sqMask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (_uint64)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    sqArray[index] = index;
+
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    int submitted;
+    do {
+        submitted = (int)syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, NULL, 0);
+    } while (submitted < 0 && EINTR == errno);
+
+    return 1 == submitted;
+#else   // HAVE_IO_URING
+    return false;
+#endif  // HAVE_IO_URING
+}
+
+    bool
+IoUring::submitRead(
+    int fd,
+    void *buffer,
+    unsigned length,
+    _int64 offset,
+    _uint64 userData)
+{
+#ifdef HAVE_IO_URING
+    return submit(IORING_OP_READ, fd, buffer, length, offset, userData);
+#else   // HAVE_IO_URING
+    return false;
+#endif  // HAVE_IO_URING
+}
+
+    bool
+IoUring::submitWrite(
+    int fd,
+    const void *buffer,
+    unsigned length,
+    _int64 offset,
+    _uint64 userData)
+{
+#ifdef HAVE_IO_URING
+    return submit(IORING_OP_WRITE, fd, (void *)buffer, length, offset, userData);
+#else   // HAVE_IO_URING
+    return false;
+#endif  // HAVE_IO_URING
+}
+
+    bool
+IoUring::waitForCompletion(
+    _uint64 *o_userData,
+    int *o_result)
+{
+#ifdef HAVE_IO_URING
+    for (;;) {
+        unsigned head = *cqHead;    // Only we write it
+        if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)cqes + (head & cqMask);
+            *o_userData = cqe->user_data;
+            *o_result = cqe->res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && EINTR != errno) {
+            return false;
+        }
+    }
+#else   // HAVE_IO_URING
+    return false;
+#endif  // HAVE_IO_URING
+}
+
+//
+// An AsyncFile that does its IO with io_uring rather than with POSIX AIO, which glibc implements with helper threads.
+// Each reader and writer has its own ring, since they're each used by one thread and have at most one IO outstanding.
+//
+class IoUringAsyncFile : public AsyncFile
+{
+public:
+    static IoUringAsyncFile* open(const char* filename, bool write);
+
+    IoUringAsyncFile(int i_fd);
+
+    virtual bool close();
+
+    class Writer : public AsyncFile::Writer
+    {
+    public:
+        Writer(IoUringAsyncFile* i_file);
+
+        virtual bool close();
+
+        virtual bool beginWrite(void* buffer, size_t length, size_t offset, size_t *bytesWritten);
+
+        virtual bool waitForCompletion();
+    
+    private:
+        IoUringAsyncFile*   file;
+        IoUring*            ring;
+        bool                writing;
+        char*               pendingBuffer;
+        size_t              pendingLength;
+        size_t              pendingOffset;
+        size_t*             result;
+    };
+
+    virtual AsyncFile::Writer* getWriter();
+    
+    class Reader : public AsyncFile::Reader
+    {
+    public:
+        Reader(IoUringAsyncFile* i_file);
+
+        virtual bool close();
+
+        virtual bool beginRead(void* buffer, size_t length, size_t offset, size_t *bytesRead);
+
+        virtual bool waitForCompletion();
+    
+    private:
+        IoUringAsyncFile*   file;
+        IoUring*            ring;
+        bool                reading;
+        char*               pendingBuffer;
+        size_t              pendingLength;
+        size_t              pendingOffset;
+        size_t*             result;
+    };
+
+    virtual AsyncFile::Reader* getReader();
+
+private:
+    int         fd;
+};
+
+    IoUringAsyncFile*
+IoUringAsyncFile::open(
+    const char* filename,
+    bool write)
+{
+    int fd = ::open(filename, write ? O_CREAT | O_RDWR | O_TRUNC : O_RDONLY, write ? S_IRWXU | S_IRGRP : 0);
+    if (fd < 0) {
+        WriteErrorMessage("Unable to create SAM file '%s', %d\n",filename,errno);
+        return NULL;
+    }
+    return new IoUringAsyncFile(fd);
+}
+
+IoUringAsyncFile::IoUringAsyncFile(
+    int i_fd)
+    : fd(i_fd)
+{
+}
+
+    bool
+IoUringAsyncFile::close()
+{
+    return ::close(fd) == 0;
+}
+
+    AsyncFile::Writer*
+IoUringAsyncFile::getWriter()
+{
+    return new Writer(this);
+}
+
+    static IoUring *
+CreateAsyncFileRing()
+{
+    IoUring *ring = IoUring::create(1);
+    if (NULL == ring) {
+        WriteErrorMessage("IoUringAsyncFile: cannot create io_uring, %d\n", errno);
+        soft_exit(1);
+    }
+    return ring;
+}
+
+//
+// Writes and reads of regular files only come up short at EOF or when the disk is full, but we don't give the ring IOs
+// bigger than the kernel will do in one go, so finish anything that's left synchronously.
+//
+static const size_t MaxIoUringAsyncFileIo = 0x7ffff000;
+
+    static ssize_t
+FinishShortIo(
+    int fd,
+    bool write,
+    char *buffer,
+    size_t length,
+    size_t offset,
+    ssize_t done)
+{
+    while (done >= 0 && (size_t)done < length) {
+        ssize_t n = write ? ::pwrite(fd, buffer + done, length - done, offset + done) : ::pread(fd, buffer + done, length - done, offset + done);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? n : done;
+        }
+        done += n;
+    }
+    return done;
+}
+
+IoUringAsyncFile::Writer::Writer(IoUringAsyncFile* i_file)
+    : file(i_file), writing(false), result(NULL)
+{
+    ring = CreateAsyncFileRing();
+}
+
+    bool
+IoUringAsyncFile::Writer::close()
+{
+    bool worked = waitForCompletion();
+    delete ring;
+    ring = NULL;
+    return worked;
+}
+
+    bool
+IoUringAsyncFile::Writer::beginWrite(
+    void* buffer,
+    size_t length,
+    size_t offset,
+    size_t *bytesWritten)
+{
+    if (! waitForCompletion()) {
+        return false;
+    }
+    pendingBuffer = (char *)buffer;
+    pendingLength = length;
+    pendingOffset = offset;
+    result = bytesWritten;
+    if (! ring->submitWrite(file->fd, buffer, (unsigned)__min(length, MaxIoUringAsyncFileIo), offset, 0)) {
+        warn("IoUringAsyncFile submitWrite failed");
+        return false;
+    }
+    writing = true;
+    return true;
+}
+
+    bool
+IoUringAsyncFile::Writer::waitForCompletion()
+{
+    if (writing) {
+        writing = false;
+        _uint64 userData;
+        int ret;
+        if (! ring->waitForCompletion(&userData, &ret)) {
+            warn("IoUringAsyncFile Writer wait failed");
+            return false;
+        }
+        if (ret < 0) {
+            errno = -ret;
+            warn("IoUringAsyncFile Writer write failed");
+            return false;
+        }
+        ssize_t written = FinishShortIo(file->fd, true, pendingBuffer, pendingLength, pendingOffset, ret);
+        if (written < 0) {
+            warn("IoUringAsyncFile Writer write failed");
+            return false;
+        }
+        if (result != NULL) {
+            *result = written;
+        }
+    }
+    return true;
+}
+
+    AsyncFile::Reader*
+IoUringAsyncFile::getReader()
+{
+    return new Reader(this);
+}
+
+IoUringAsyncFile::Reader::Reader(
+    IoUringAsyncFile* i_file)
+    : file(i_file), reading(false), result(NULL)
+{
+    ring = CreateAsyncFileRing();
+}
+
+    bool
+IoUringAsyncFile::Reader::close()
+{
+    bool worked = waitForCompletion();
+    delete ring;
+    ring = NULL;
+    return worked;
+}
+
+    bool
+IoUringAsyncFile::Reader::beginRead(
+    void* buffer,
+    size_t length,
+    size_t offset,
+    size_t* bytesRead)
+{
+    if (! waitForCompletion()) {
+        return false;
+    }
+    pendingBuffer = (char *)buffer;
+    pendingLength = length;
+    pendingOffset = offset;
+    result = bytesRead;
+    if (! ring->submitRead(file->fd, buffer, (unsigned)__min(length, MaxIoUringAsyncFileIo), offset, 0)) {
+        warn("IoUringAsyncFile submitRead failed");
+        return false;
+    }
+    reading = true;
+    return true;
+}
+
+    bool
+IoUringAsyncFile::Reader::waitForCompletion()
+{
+    if (reading) {
+        reading = false;
+        _uint64 userData;
+        int ret;
+        if (! ring->waitForCompletion(&userData, &ret)) {
+            warn("IoUringAsyncFile Reader wait failed");
+            return false;
+        }
+        if (ret < 0) {
+            errno = -ret;
+            warn("IoUringAsyncFile Reader read failed");
+            return false;
+        }
+        ssize_t bytes = ret == 0 ? 0 : FinishShortIo(file->fd, false, pendingBuffer, pendingLength, pendingOffset, ret);
+        if (bytes < 0) {
+            warn("IoUringAsyncFile Reader read failed");
+            return false;
+        }
+        if (result != NULL) {
+            *result = bytes;
+        }
+    }
+    return true;
+}
+
 #else
 
 // todo: make this actually async!
@@ -2200,6 +2824,8 @@ const char *DEFAULT_NAMED_PIPE_NAME = "SNAP";
 
 #endif  // _MSC_VER
 
+bool AsyncFile::UseIoUring = false;
+
 AsyncFile* AsyncFile::open(const char* filename, bool write)
 {
     if (!strcmp("-", filename) && write) {
@@ -2209,9 +2835,323 @@ AsyncFile* AsyncFile::open(const char* filename, bool write)
     return WindowsAsyncFile::open(filename, write);
 #else
 #ifdef __linux__
+    if (UseIoUring && IoUring::IsSupported()) {
+        return IoUringAsyncFile::open(filename, write);
+    }
     return PosixAsyncFile::open(filename, write);
 #else
     return OsxAsyncFile::open(filename, write);
 #endif
 #endif
 }
+
+    static void
+ReadCpuid(unsigned leaf, unsigned subleaf, unsigned *registers)
+/*++
+
+Routine Description:
+
+    Run the cpuid instruction and return eax, ebx, ecx and edx in registers[0..3].  Returns all zeroes on processors
+    that aren't x86 (or when the leaf is past the largest one the processor supports), which looks like "no features."
+
+--*/
+{
+    registers[0] = registers[1] = registers[2] = registers[3] = 0;
+#ifdef  _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if ((unsigned)info[0] < leaf) {
+        return;
+    }
+    __cpuidex(info, leaf, subleaf);
+    for (int i = 0; i < 4; i++) {
+        registers[i] = (unsigned)info[i];
+    }
+#elif defined(__x86_64__) || defined(__i386__)
+    if (__get_cpuid_max(0, NULL) < leaf) {
+        return;
+    }
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+    bool
+ProcessorSupports(ProcessorFeature feature)
+{
+    unsigned leaf1[4];
+    ReadCpuid(1, 0, leaf1);
+
+    switch (feature) {
+        case ProcessorFeatureSSE2:
+            return 0 != (leaf1[3] & (1 << 26));
+
+        case ProcessorFeatureSSSE3:
+            return 0 != (leaf1[2] & (1 << 9));
+
+        case ProcessorFeatureSSE42:
+            return 0 != (leaf1[2] & (1 << 20));
+
+        case ProcessorFeatureAVX2: {
+            //
+            // AVX2 needs both the processor and the OS (which has to save the upper halves of the ymm registers
+            // on context switches).  Check OSXSAVE and AVX in leaf 1, then ask XGETBV whether the OS has enabled
+            // the xmm and ymm state.
+            //
+            const unsigned osxsaveAndAvx = (1 << 27) | (1 << 28);
+            if ((leaf1[2] & osxsaveAndAvx) != osxsaveAndAvx) {
+                return false;
+            }
+            _uint64 xcr0;
+#ifdef  _MSC_VER
+            xcr0 = _xgetbv(0);
+#elif defined(__x86_64__) || defined(__i386__)
+            unsigned xcr0Low, xcr0High;
+            __asm__ __volatile__ ("xgetbv" : "=a" (xcr0Low), "=d" (xcr0High) : "c" (0));
+            xcr0 = ((_uint64)xcr0High << 32) | xcr0Low;
+#else
+            xcr0 = 0;
+#endif
+            if ((xcr0 & 6) != 6) {
+                return false;
+            }
+            unsigned leaf7[4];
+            ReadCpuid(7, 0, leaf7);
+            return 0 != (leaf7[1] & (1 << 5));
+        }
+
+        default:
+            return false;
+    }
+}
+
+#ifdef  _MSC_VER
+
+    int
+GetNumberOfNumaNodes()
+{
+    ULONG highestNode;
+    if (!GetNumaHighestNodeNumber(&highestNode)) {
+        return 1;
+    }
+    return __min((int)highestNode + 1, MaxNumaNodes);
+}
+
+    int
+GetNumaNodeOfProcessor(unsigned processorNumber)
+{
+    UCHAR node;
+    if (processorNumber > 255 || !GetNumaProcessorNode((UCHAR)processorNumber, &node) || node >= MaxNumaNodes) {
+        return 0;
+    }
+    return node;
+}
+
+    _int64
+QueryNumaNodeMemorySize(int node)
+{
+    //
+    // Windows will tell us what's available on the node, but not its total, which is close enough for deciding
+    // whether something will fit.
+    //
+    ULONGLONG availableBytes;
+    if (!GetNumaAvailableMemoryNodeEx((USHORT)node, &availableBytes)) {
+        return 0;
+    }
+    return (_int64)availableBytes;
+}
+
+    void
+BindThreadToNumaNode(int node)
+{
+    ULONGLONG processorMask;
+    if (!GetNumaNodeProcessorMask((UCHAR)node, &processorMask) || 0 == processorMask) {
+        WriteErrorMessage("Unable to get the processors for NUMA node %d, %d\n", node, GetLastError());
+        return;
+    }
+    if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)processorMask)) {
+        WriteErrorMessage("Binding thread to NUMA node %d failed, %d\n", node, GetLastError());
+    }
+}
+
+//
+// Windows doesn't have per-thread memory policies.  It allocates pages on the node of the processor that first touches them,
+// so a thread that's bound to a node gets local memory anyway.
+//
+    bool
+SetThreadMemoryPolicyToNumaNode(int node)
+{
+    return false;
+}
+
+    bool
+SetThreadMemoryPolicyToInterleaved()
+{
+    return false;
+}
+
+    void
+SetThreadMemoryPolicyToDefault()
+{
+}
+
+#else   // _MSC_VER
+
+#ifdef __linux__
+//
+// The memory policy calls go straight to the system calls rather than through libnuma, so we don't need it to build
+// or run.  These are the values from numaif.h.
+//
+const int SNAP_MPOL_DEFAULT = 0;
+const int SNAP_MPOL_PREFERRED = 1;
+const int SNAP_MPOL_INTERLEAVE = 3;
+
+    static bool
+SetThreadMemoryPolicy(int mode, int nodeToSet)
+/*++
+
+Routine Description:
+
+    Call set_mempolicy with a mask that has either just nodeToSet or, if it's -1, all of the nodes.
+
+--*/
+{
+#ifdef SYS_set_mempolicy
+    unsigned long nodeMask[MaxNumaNodes / (8 * sizeof(unsigned long))];
+    memset(nodeMask, 0, sizeof(nodeMask));
+    if (-1 == nodeToSet) {
+        for (int node = 0; node < GetNumberOfNumaNodes(); node++) {
+            nodeMask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+        }
+    } else {
+        nodeMask[nodeToSet / (8 * sizeof(unsigned long))] |= 1ul << (nodeToSet % (8 * sizeof(unsigned long)));
+    }
+
+    return 0 == syscall(SYS_set_mempolicy, mode, SNAP_MPOL_DEFAULT == mode ? NULL : nodeMask, SNAP_MPOL_DEFAULT == mode ? 0 : MaxNumaNodes + 1);
+#else   // SYS_set_mempolicy
+    return false;
+#endif  // SYS_set_mempolicy
+}
+#endif  // __linux__
+
+    int
+GetNumberOfNumaNodes()
+{
+#ifdef __linux__
+    static int nNodes = 0;
+    if (0 == nNodes) {
+        int node = 0;
+        char path[100];
+        for (; node < MaxNumaNodes; node++) {
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+            if (0 != access(path, F_OK)) {
+                break;
+            }
+        }
+        nNodes = __max(node, 1);
+    }
+    return nNodes;
+#else   // __linux__
+    return 1;
+#endif  // __linux__
+}
+
+    int
+GetNumaNodeOfProcessor(unsigned processorNumber)
+{
+#ifdef __linux__
+    //
+    // Each processor's directory in sysfs has a link named for its node.
+    //
+    char path[100];
+    for (int node = 0; node < GetNumberOfNumaNodes(); node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/node%d", processorNumber, node);
+        if (0 == access(path, F_OK)) {
+            return node;
+        }
+    }
+#endif  // __linux__
+    return 0;
+}
+
+    _int64
+QueryNumaNodeMemorySize(int node)
+{
+#ifdef __linux__
+    char path[100];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/meminfo", node);
+    FILE *meminfo = fopen(path, "r");
+    if (NULL == meminfo) {
+        if (0 == node && 1 == GetNumberOfNumaNodes()) {
+            return (_int64)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+        }
+        return 0;
+    }
+
+    //
+    // The line we want looks like "Node 0 MemTotal:       65843488 kB"
+    //
+    char line[200];
+    _int64 kb = 0;
+    while (NULL != fgets(line, sizeof(line), meminfo)) {
+        const char *memTotal = strstr(line, "MemTotal:");
+        if (NULL != memTotal && 1 == sscanf(memTotal + strlen("MemTotal:"), "%lld", &kb)) {
+            break;
+        }
+    }
+    fclose(meminfo);
+    return kb * 1024;
+#else   // __linux__
+    return 0;
+#endif  // __linux__
+}
+
+    void
+BindThreadToNumaNode(int node)
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    unsigned nProcessors = GetNumberOfProcessors();
+    for (unsigned processor = 0; processor < nProcessors; processor++) {
+        if (GetNumaNodeOfProcessor(processor) == node) {
+            CPU_SET(processor, &cpuset);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) {
+        perror("sched_setaffinity");
+    }
+#endif  // __linux__
+}
+
+    bool
+SetThreadMemoryPolicyToNumaNode(int node)
+{
+#ifdef __linux__
+    //
+    // Preferred rather than bound, so that running out of memory on the node spills to the other ones rather than failing.
+    //
+    return SetThreadMemoryPolicy(SNAP_MPOL_PREFERRED, node);
+#else   // __linux__
+    return false;
+#endif  // __linux__
+}
+
+    bool
+SetThreadMemoryPolicyToInterleaved()
+{
+#ifdef __linux__
+    return SetThreadMemoryPolicy(SNAP_MPOL_INTERLEAVE, -1);
+#else   // __linux__
+    return false;
+#endif  // __linux__
+}
+
+    void
+SetThreadMemoryPolicyToDefault()
+{
+#ifdef __linux__
+    SetThreadMemoryPolicy(SNAP_MPOL_DEFAULT, -1);
+#endif  // __linux__
+}
+
+#endif  // _MSC_VER
@@ -171,6 +171,16 @@ inline _uint64 bit_rotate_left64(_uint64 value, unsigned shift)
 
 #endif  // _MSC_VER
 
+//
+// SSE2 is part of x64, so when we're built for it we use it to look at text 16 bytes at a time.
+//
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2 1
+#else
+#define USE_SSE2 0
+#endif
+
 struct NamedPipe;	// It's bi-directional, which in Unix means it's actually two pipes
 
 extern NamedPipe *OpenNamedPipe(const char *pipeName, bool serverSide);
@@ -354,8 +364,41 @@ void SleepForMillis(unsigned millis);
 
 unsigned GetNumberOfProcessors();
 
+//
+// Processor feature detection, so that vectorized code paths can be chosen at run time and
+// fall back to plain C on processors (or compilers) that don't have the instructions.
+//
+enum ProcessorFeature {
+    ProcessorFeatureSSE2,
+    ProcessorFeatureSSSE3,
+    ProcessorFeatureSSE42,
+    ProcessorFeatureAVX2
+};
+
+bool ProcessorSupports(ProcessorFeature feature);
+
+//
+// NUMA support.  Nodes are numbered from 0.  On machines without NUMA, or where we can't tell, everything is on node 0.
+// The memory policy functions apply to memory the calling thread touches for the first time after the call.  They
+// return false if the OS won't do it, in which case memory goes wherever the OS would have put it anyway.
+//
+const int MaxNumaNodes = 64;
+int GetNumberOfNumaNodes();
+int GetNumaNodeOfProcessor(unsigned processorNumber);
+_int64 QueryNumaNodeMemorySize(int node);      // Total memory on the node in bytes, or 0 if we can't tell
+void BindThreadToNumaNode(int node);           // Let the thread run on any of the node's processors (but only them)
+bool SetThreadMemoryPolicyToNumaNode(int node);
+bool SetThreadMemoryPolicyToInterleaved();     // Spread memory round robin across all of the nodes
+void SetThreadMemoryPolicyToDefault();
+
 _int64 QueryFileSize(const char *fileName);
 
+//
+// When the file was last written, in units that depend on the platform; it's only good for comparing with another
+// value from the same call.  Returns -1 if the file can't be found.
+//
+_int64 QueryFileModificationTime(const char *fileName);
+
 // returns true on success
 bool DeleteSingleFile(const char* filename); // DeleteFile is a Windows macro...
 
@@ -387,6 +430,16 @@ void CloseMemoryMappedFile(MemoryMappedFile* mappedFile);
 //
 void AdviseMemoryMappedFilePrefetch(const MemoryMappedFile *mappedFile);
 
+//
+// Named shared memory segments.  They outlive the process that creates them (on Linux they live in /dev/shm) until they're
+// deleted, so one process can load something big and later ones can just map it.  Create makes a new, writable segment and
+// fails if one with the name already exists; open maps an existing one read-only and returns NULL if there isn't one.
+// Close them with CloseMemoryMappedFile.  Names are short, without slashes.
+//
+MemoryMappedFile *CreateSharedMemorySegment(const char *name, size_t size, void **o_contents);
+MemoryMappedFile *OpenSharedMemorySegment(const char *name, size_t *o_size, void **o_contents);
+bool DeleteSharedMemorySegment(const char *name);
+
 class AsyncFile
 {
 public:
@@ -394,6 +447,11 @@ public:
     // open a new file for reading and/or writing
     static AsyncFile* open(const char* filename, bool write);
 
+    // hack: global for opening files with io_uring rather than POSIX AIO where the kernel supports it (Linux only)
+    static bool UseIoUring;
+
+    virtual ~AsyncFile() {}
+
     // free resources; must have destroyed all readers & writers first
     virtual bool close() = 0;
 
@@ -401,6 +459,8 @@ public:
     class Writer
     {
     public:
+        virtual ~Writer() {}
+
         // waits for all writes to complete, frees resources
         virtual bool close() = 0;
 
@@ -418,6 +478,8 @@ public:
     class Reader
     {
     public:
+        virtual ~Reader() {}
+
         // waits for alls reads to complete, frees resources
         virtual bool close() = 0;
 
@@ -432,6 +494,52 @@ public:
     virtual Reader* getReader() = 0;
 };
 
+#ifdef __linux__
+//
+// A minimal io_uring: one submission queue and one completion queue, driven with the raw system calls so that we don't
+// depend on liburing.  It isn't thread safe; each user has its own ring, or holds a lock around it.  Kernels older than
+// 5.6 (which don't have the plain read and write operations) and containers that block the system calls don't support
+// it, so check IsSupported() (or for a NULL return from create()) and fall back to something else.
+//
+class IoUring
+{
+public:
+    static bool IsSupported();
+
+    // Returns NULL if the kernel won't give us a ring
+    static IoUring *create(unsigned entries);
+
+    ~IoUring();
+
+    // Queue and submit a read or write.  There may be at most entries of them outstanding.
+    bool submitRead(int fd, void *buffer, unsigned length, _int64 offset, _uint64 userData);
+    bool submitWrite(int fd, const void *buffer, unsigned length, _int64 offset, _uint64 userData);
+
+    // Wait for any one submitted IO to finish.  result is the number of bytes transferred, or -errno.
+    bool waitForCompletion(_uint64 *o_userData, int *o_result);
+
+private:
+    IoUring() {}
+    bool submit(unsigned char opcode, int fd, void *buffer, unsigned length, _int64 offset, _uint64 userData);
+
+    int         ringFd;
+    void        *sqRing;
+    size_t      sqRingSize;
+    void        *cqRing;
+    size_t      cqRingSize;
+    void        *sqes;
+    size_t      sqesSize;
+
+    unsigned    *sqTail;
+    unsigned    sqMask;
+    unsigned    *sqArray;
+    unsigned    *cqHead;
+    unsigned    *cqTail;
+    unsigned    cqMask;
+    void        *cqes;
+};
+#endif // __linux__
+
 
 //
 // Macro for counting trailing zeros of a 64-bit value
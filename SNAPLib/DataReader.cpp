@@ -25,6 +25,7 @@ Environment:
 #include "DataReader.h"
 #include "Bam.h"
 #include "zlib.h"
+#include "Deflate.h"
 #include "exit.h"
 #include "Error.h"
 
@@ -45,7 +46,7 @@ class ReadBasedDataReader : public DataReader
 {
 public:
 
-    ReadBasedDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor);
+    ReadBasedDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, unsigned i_ioAlignment = 0);
 
     virtual ~ReadBasedDataReader();
     
@@ -124,6 +125,20 @@ protected:
 
     unsigned            nBuffers;
     const unsigned      maxBuffers;
+    //
+    // Each buffer lives in a slot of bufferStride bytes.  Normally the buffer is the start of the slot, but if ioAlignment
+    // isn't zero the slots are aligned to it and have an extra ioAlignment bytes both before and after the buffer, so a subclass
+    // can read whole aligned blocks into the slot and then point the buffer at the right place in them.
+    //
+    unsigned            ioAlignment;
+    _int64              bufferStride;
+    char*               allocatedBuffers;
+    char*               firstBufferSlot;
+
+    char* bufferSlot(unsigned bufferNumber) {
+        return firstBufferSlot + bufferNumber * bufferStride;
+    }
+
 	int					headerBuffersOutstanding;
 	bool				startedReadingHeader;
     _int64              extraBytes;
@@ -160,8 +175,9 @@ private:
 ReadBasedDataReader::ReadBasedDataReader(
     unsigned i_nBuffers,
     _int64 i_overflowBytes,
-    double extraFactor)
-    : DataReader(), nBuffers(i_nBuffers), overflowBytes(i_overflowBytes), maxBuffers(i_nBuffers * (i_nBuffers == 1 ? 2 : 4)),
+    double extraFactor,
+    unsigned i_ioAlignment)
+    : DataReader(), nBuffers(i_nBuffers), overflowBytes(i_overflowBytes), maxBuffers(i_nBuffers * (i_nBuffers == 1 ? 2 : 4)), ioAlignment(i_ioAlignment),
 	headerBuffer(NULL), headerBufferSize(0), amountAdvancedThroughUnderlyingStoreByUs(0), 
 	headerExtra(NULL), headerExtraSize(0), startedReadingHeader(false), headerBuffersOutstanding(0), nHeaderBuffersAllocated(0),
 	hitEOFReadingHeader(false)
@@ -175,17 +191,24 @@ ReadBasedDataReader::ReadBasedDataReader(
     _ASSERT(extraFactor >= 0 && i_nBuffers > 0);
     bufferInfo = new BufferInfo[maxBuffers];
     extraBytes = max((_int64) 0, (_int64) ((bufferSize + overflowBytes) * extraFactor));
-    char* allocated = (char*) BigReserve(maxBuffers * (bufferSize + extraBytes + overflowBytes));
-    BigCommit(allocated, nBuffers * (bufferSize + extraBytes + overflowBytes));
-    if (NULL == allocated) {
+    bufferStride = bufferSize + extraBytes + overflowBytes;
+    if (0 != ioAlignment) {
+        _ASSERT(0 == (ioAlignment & (ioAlignment - 1)));
+        bufferStride = (bufferStride + 2 * ioAlignment + ioAlignment - 1) & ~((_int64)ioAlignment - 1);
+    }
+    allocatedBuffers = (char*) BigReserve(maxBuffers * bufferStride + ioAlignment);
+    if (NULL == allocatedBuffers) {
         WriteErrorMessage("ReadBasedDataReader: unable to allocate IO buffer\n");
         soft_exit(1);
     }
+    firstBufferSlot = allocatedBuffers;
+    if (0 != ioAlignment) {
+        firstBufferSlot = (char *)(((size_t)firstBufferSlot + ioAlignment - 1) & ~((size_t)ioAlignment - 1));
+    }
+    BigCommit(firstBufferSlot, nBuffers * bufferStride);
     for (unsigned i = 0 ; i < nBuffers; i++) {
-        bufferInfo[i].buffer = allocated;
-        allocated += bufferSize + overflowBytes;
-        bufferInfo[i].extra = extraBytes > 0 ? allocated : NULL;
-        allocated += extraBytes;
+        bufferInfo[i].buffer = bufferSlot(i) + ioAlignment;
+        bufferInfo[i].extra = extraBytes > 0 ? bufferSlot(i) + bufferSize + overflowBytes + 2 * ioAlignment : NULL;
 
         bufferInfo[i].state = Empty;
         bufferInfo[i].isEOF = false;
@@ -208,7 +231,7 @@ ReadBasedDataReader::ReadBasedDataReader(
 
 ReadBasedDataReader::~ReadBasedDataReader()
 {
-    BigDealloc(bufferInfo[0].buffer);
+    BigDealloc(allocatedBuffers);
     for (unsigned i = 0; i < nBuffers; i++) {
         bufferInfo[i].buffer = bufferInfo[i].extra = NULL;
     }
@@ -723,13 +746,12 @@ ReadBasedDataReader::addBuffer()
     }
     _ASSERT(nBuffers < maxBuffers);
     //fprintf(stderr, "ReadBasedDataReader: addBuffer %d of %d\n", nBuffers, maxBuffers);
-    size_t bytes = bufferSize + extraBytes + overflowBytes;
-    bufferInfo[nBuffers].buffer = bufferInfo[nBuffers-1].buffer + bytes;
-    if (! BigCommit(bufferInfo[nBuffers].buffer, bytes)) {
+    bufferInfo[nBuffers].buffer = bufferSlot(nBuffers) + ioAlignment;
+    if (! BigCommit(bufferSlot(nBuffers), bufferStride)) {
         WriteErrorMessage("ReadBasedDataReader: unable to commit IO buffer\n");
         soft_exit(1);
     }
-    bufferInfo[nBuffers].extra = extraBytes > 0 ? bufferInfo[nBuffers].buffer + bytes - extraBytes : NULL;
+    bufferInfo[nBuffers].extra = extraBytes > 0 ? bufferSlot(nBuffers) + bufferSize + overflowBytes + 2 * ioAlignment : NULL;
 
 
     bufferInfo[nBuffers].state = Empty;
@@ -991,6 +1013,345 @@ private:
 bool StdioDataSupplier::supplied = false;
 
 
+#ifdef __linux__
+//
+// A reader that keeps reads outstanding on all of its empty buffers with io_uring, the way the Windows overlapped reader
+// does with overlapped IO.  All of the ring calls are made holding the lock.  With O_DIRECT the reads have to be of whole
+// aligned blocks into aligned memory, so we read from the start of the block that holds the buffer's first byte into the
+// start of the buffer's slot, and point the buffer that far into the slot.
+//
+class IoUringDataReader : public ReadBasedDataReader
+{
+public:
+
+    IoUringDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool i_directIo);
+
+    virtual ~IoUringDataReader();
+    
+    virtual bool init(const char* i_fileName);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual const char* getFilename()
+    { return fileName; }
+
+ protected:
+    
+    // must hold the lock to call
+    virtual void startIo();
+
+    // must hold the lock to call
+    virtual void waitForBuffer(unsigned bufferNumber);
+
+private:
+
+    // must hold the lock to call
+    void reapCompletion();
+
+    static const unsigned DirectIoAlignment = 4096;
+
+    IoUring             *ring;
+    bool                directIo;   // Asked for; openedDirect says whether the file system let us
+
+    struct BufferRead {
+        _int64          ioOffset;   // Offset in the file that the read started at
+        unsigned        ioLength;
+        unsigned        slack;      // Bytes read before the buffer's data
+    };
+    BufferRead          *bufferReads;
+
+    const char*         fileName;
+    int                 fd;
+    bool                openedDirect;
+    _int64              fileSize;
+  
+    _int64              readOffset;
+    _int64              endingOffset;
+};
+
+IoUringDataReader::IoUringDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool i_directIo) :
+    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, i_directIo ? DirectIoAlignment : 0), directIo(i_directIo), fileName(NULL),
+    fd(-1), openedDirect(false), fileSize(0), readOffset(0), endingOffset(0)
+{
+    ring = IoUring::create(maxBuffers);
+    if (NULL == ring) {
+        WriteErrorMessage("IoUringDataReader: unable to create io_uring, %d\n", errno);
+        soft_exit(1);
+    }
+    bufferReads = new BufferRead[maxBuffers];
+}
+
+IoUringDataReader::~IoUringDataReader()
+{
+    //
+    // The kernel may still be writing into buffers, which the base class is about to free.
+    //
+    AcquireExclusiveLock(&lock);
+    for (unsigned i = 0; i < nBuffers; i++) {
+        while (bufferInfo[i].state == Reading) {
+            reapCompletion();
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+
+    delete ring;
+    delete[] bufferReads;
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool
+IoUringDataReader::init(const char* i_fileName)
+{
+    fileName = i_fileName;
+    fd = -1;
+    if (directIo) {
+        //
+        // Not every file system does O_DIRECT (tmpfs doesn't, for one).  If this one doesn't, just use the page cache.
+        //
+        fd = open(fileName, O_RDONLY | O_DIRECT);
+        openedDirect = fd >= 0;
+    }
+    if (fd < 0) {
+        fd = open(fileName, O_RDONLY);
+    }
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat sb;
+    if (0 != fstat(fd, &sb)) {
+        WriteErrorMessage("IoUringDataReader: unable to get file size of '%s', %d\n", fileName, errno);
+        return false;
+    }
+    fileSize = sb.st_size;
+
+    if (!openedDirect) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return true;
+}
+
+    void
+IoUringDataReader::reinit(
+    _int64 i_startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    _ASSERT(-1 != fd);  // Must call init() before reinit()
+
+    AcquireExclusiveLock(&lock);
+
+    //
+    // First let any pending IO complete.
+    //
+    for (unsigned i = 0; i < nBuffers; i++) {
+        while (bufferInfo[i].state == Reading) {
+            reapCompletion();
+        }
+        bufferInfo[i].state = Empty;
+        bufferInfo[i].isEOF= false;
+        bufferInfo[i].offset = 0;
+        bufferInfo[i].next = i < nBuffers - 1 ? i + 1 : -1;
+        bufferInfo[i].previous = i > 0 ? i - 1 : -1;
+    }
+
+    nextBufferForConsumer = -1; 
+    lastBufferForConsumer = -1;
+    nextBufferForReader = 0;
+
+    readOffset = i_startingOffset;
+    if (amountOfFileToProcess == 0) {
+        //
+        // This means just read the whole file.
+        //
+        endingOffset = fileSize;
+    } else {
+        endingOffset = min(fileSize, i_startingOffset + amountOfFileToProcess);
+    }
+
+    //
+    // Kick off IO, wait for the first buffer to be read
+    //
+    startIo();
+    waitForBuffer(nextBufferForConsumer);
+
+    ReleaseExclusiveLock(&lock);
+}
+
+        void
+IoUringDataReader::startIo()
+{
+    //
+    // Launch reads on whatever buffers are ready.
+    //
+    AssertExclusiveLockHeld(&lock);
+
+    while (nextBufferForReader != -1) {
+        // remove from free list
+        BufferInfo* info = &bufferInfo[nextBufferForReader];
+        _ASSERT(info->state == Empty);
+        int index = nextBufferForReader;
+        nextBufferForReader = info->next;
+        info->batchID = nextBatchID++;
+        // add to end of consumer list
+        if (lastBufferForConsumer != -1) {
+            _ASSERT(bufferInfo[lastBufferForConsumer].next == -1);
+            bufferInfo[lastBufferForConsumer].next = index;
+        }
+        info->next = -1;
+        info->previous = lastBufferForConsumer;
+        lastBufferForConsumer = index;
+
+		if (nextBufferForConsumer == -1) {
+				nextBufferForConsumer = index;
+		}
+
+        if (readOffset >= fileSize || readOffset >= endingOffset) {
+            info->validBytes = 0;
+            info->nBytesThatMayBeginARead = 0;
+            info->isEOF = true;
+            info->state = Full;
+            return;
+        }
+
+        unsigned amountToRead;
+        _int64 finalOffset = min(fileSize, endingOffset + overflowBytes);
+        _int64 finalStartOffset = min(fileSize, endingOffset);
+        amountToRead = (unsigned)min(finalOffset - readOffset, (_int64) bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
+        info->isEOF = readOffset + amountToRead == finalOffset;
+        info->nBytesThatMayBeginARead = (unsigned)min(bufferSize - overflowBytes, finalStartOffset - readOffset);
+
+        _ASSERT(amountToRead >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset + amountToRead));
+        info->fileOffset = readOffset;
+        info->validBytes = amountToRead;    // What we want; the completion fills in what we got
+
+        BufferRead *read = &bufferReads[index];
+        if (openedDirect) {
+            read->slack = (unsigned)(readOffset % DirectIoAlignment);
+            read->ioLength = (read->slack + amountToRead + DirectIoAlignment - 1) / DirectIoAlignment * DirectIoAlignment;
+        } else {
+            read->slack = 0;
+            read->ioLength = amountToRead;
+        }
+        read->ioOffset = readOffset - read->slack;
+        if (openedDirect) {
+            info->buffer = bufferSlot(index) + read->slack;
+        }
+
+        readOffset += info->nBytesThatMayBeginARead;
+        info->state = Reading;
+        info->offset = 0;
+         
+        if (!ring->submitRead(fd, info->buffer - read->slack, read->ioLength, read->ioOffset, index)) {
+            WriteErrorMessage("IoUringDataReader::startIo(): submitting read failed, %d\n", errno);
+            soft_exit(1);
+        }
+    }
+    if (nextBufferForConsumer == -1) {
+        PreventEventWaitersFromProceeding(&releaseEvent);
+    }
+}
+
+    void
+IoUringDataReader::reapCompletion()
+{
+    _uint64 index;
+    int result;
+    if (!ring->waitForCompletion(&index, &result)) {
+        WriteErrorMessage("IoUringDataReader: waiting for IO failed, %d\n", errno);
+        soft_exit(1);
+    }
+
+    _ASSERT(index < nBuffers && bufferInfo[index].state == Reading);
+    BufferInfo *info = &bufferInfo[index];
+    BufferRead *read = &bufferReads[index];
+    if (result < 0) {
+        WriteErrorMessage("Error reading input file '%s', %d\n", fileName, -result);
+        soft_exit(1);
+    }
+
+    //
+    // Reads of regular files only come up short at EOF, which we know better than to read past unless we're
+    // rounding up to the O_DIRECT block size.  Just in case, get the rest synchronously.  It's still aligned, since short
+    // O_DIRECT reads are whole blocks.
+    //
+    _int64 bytesRead = result;
+    while (bytesRead < read->slack + info->validBytes) {
+        ssize_t n = pread(fd, info->buffer - read->slack + bytesRead, read->ioLength - bytesRead, read->ioOffset + bytesRead);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            WriteErrorMessage("Error reading input file '%s', got %lld bytes at offset %lld rather than %u, %d\n", fileName, bytesRead - read->slack, 
+                info->fileOffset, info->validBytes, n < 0 ? errno : 0);
+            soft_exit(1);
+        }
+        bytesRead += n;
+    }
+
+    info->state = Full;
+    info->buffer[info->validBytes] = 0;
+}
+
+    void
+IoUringDataReader::waitForBuffer(
+    unsigned bufferNumber)
+{
+    _ASSERT(bufferNumber >= 0 && bufferNumber < nBuffers);
+    BufferInfo *info = &bufferInfo[bufferNumber];
+
+    while (info->state == InUse) {
+        // must already have lock to call, release & wait & reacquire
+        ReleaseExclusiveLock(&lock);
+        _int64 start = timeInNanos();
+        bool waitSucceeded = WaitForEventWithTimeout(&releaseEvent, releaseWaitInMillis);
+        InterlockedAdd64AndReturnNewValue(&ReleaseWaitTime, timeInNanos() - start);
+        AcquireExclusiveLock(&lock);
+        if (!waitSucceeded) {
+            // this isn't going to directly make this buffer available, but will reduce pressure
+            addBuffer();
+        }
+    }
+
+    if (info->state == Full) {
+        return;
+    }
+
+    if (info->state != Reading) {
+        startIo();
+    }
+
+    _int64 start = timeInNanos();
+    while (info->state == Reading) {
+        reapCompletion();
+    }
+    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, timeInNanos() - start);
+}
+
+class IoUringDataSupplier : public DataSupplier
+{
+public:
+    IoUringDataSupplier(bool i_directIo) : DataSupplier(), directIo(i_directIo) {}
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor)
+    {
+        if (!IoUring::IsSupported()) {
+            return DataSupplier::MemMap->getDataReader(bufferCount, overflowBytes, extraFactor);
+        }
+
+        // add some buffers for read-ahead
+        return new IoUringDataReader(bufferCount + (bufferCount > 1 ? 4 : 0), overflowBytes, extraFactor, directIo);
+    }
+
+private:
+    bool directIo;
+};
+
+DataSupplier* DataSupplier::IoUringBuffered = new IoUringDataSupplier(false);
+DataSupplier* DataSupplier::IoUringDirect = new IoUringDataSupplier(true);
+
+#endif // __linux__
+
 #ifdef _MSC_VER
 class WindowsOverlappedDataReader : public ReadBasedDataReader
 {
@@ -1284,6 +1645,408 @@ static const int ENABLE_ZLIB_GZIP = 32;
 static const double MIN_FACTOR = 1.2;
 static const double MAX_FACTOR = 10.0;
 
+//
+// Checkpoints for decompressing a plain gzip file in parallel, in the style of zlib's zran example.  Inflating a
+// deflate stream from the middle needs the bit position of a block boundary and the 32KB of output before it that the
+// following blocks may refer back to.  The start of a gzip member needs neither, so files made of many members (like
+// BGZF, or the output of parallel compressors) give us checkpoints for free.
+//
+// If DataSupplier::WriteGzipIndex is set, the first time we read a gzip file from the beginning we record a checkpoint
+// about every DataSupplier::GzipCheckpointSpacing bytes of compressed input and save them with GzipIndexExtension
+// appended to the file's name, next to it or in DataSupplier::GzipIndexDirectory.  If we can't write there, we just
+// go on without one.  Later reads of the file load them and inflate the pieces of each batch between checkpoints
+// on separate threads.  The index records the size and modification time of the file it was made from, and CRCs of
+// its first and last GzipIdentityBlockSize bytes; if any of them doesn't match, the index is ignored (and rebuilt, if
+// we're writing them).
+//
+
+static const char* GzipIndexExtension = ".snapgzi";
+static const unsigned GzipWindowSize = 32 * 1024;
+static const int GzipTrailerSize = 8;
+static const int GzipIdentityBlockSize = 64 * 1024;
+
+struct GzipFileIdentity
+{
+    _int64          size;
+    _int64          modificationTime;
+    _uint32         headCrc;            // of the first GzipIdentityBlockSize bytes
+    _uint32         tailCrc;            // of the last GzipIdentityBlockSize bytes
+
+    bool compute(const char* fileName);
+
+    inline bool operator==(const GzipFileIdentity& other) const
+    { return size == other.size && modificationTime == other.modificationTime && headCrc == other.headCrc && tailCrc == other.tailCrc; }
+};
+
+    bool
+GzipFileIdentity::compute(
+    const char* fileName)
+{
+    size = QueryFileSize(fileName);
+    modificationTime = QueryFileModificationTime(fileName);
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char* block = new char[GzipIdentityBlockSize];
+    size_t headBytes = fread(block, 1, GzipIdentityBlockSize, file);
+    headCrc = (_uint32) crc32(0, (const Bytef*) block, (uInt) headBytes);
+    _int64 tailStart = max((_int64)0, size - GzipIdentityBlockSize);
+    size_t tailBytes = _fseek64bit(file, tailStart, SEEK_SET) == 0 ? fread(block, 1, GzipIdentityBlockSize, file) : 0;
+    tailCrc = (_uint32) crc32(0, (const Bytef*) block, (uInt) tailBytes);
+    delete [] block;
+    fclose(file);
+    return headBytes == (size_t) min(size, (_int64) GzipIdentityBlockSize) && tailBytes == (size_t) (size - tailStart);
+}
+
+struct GzipCheckpoint
+{
+    _int64          compressedOffset;   // of the first byte that's all in the following block or member
+    _int64          decompressedOffset;
+    int             bits;               // of the block that are in the byte before compressedOffset; 0 for a member start
+    bool            memberStart;        // if true, starts a gzip member rather than a deflate block
+    unsigned        windowSize;
+    unsigned char*  window;             // the output just before decompressedOffset, NULL for a member start
+};
+
+class GzipIndex
+{
+public:
+    GzipIndex(const GzipFileIdentity& i_identity) : identity(i_identity), lastCompressedOffset(0) {}
+
+    ~GzipIndex();
+
+    //
+    // Returns NULL if there isn't an index for the file with this identity.
+    //
+    static GzipIndex* load(const char* indexFileName, const GzipFileIdentity& identity);
+
+    bool save(const char* indexFileName);
+
+    // whether we've come far enough since the last checkpoint to record another one
+    inline bool wantCheckpoint(_int64 compressedOffset)
+    { return compressedOffset - lastCompressedOffset >= DataSupplier::GzipCheckpointSpacing; }
+
+    void addMemberStart(_int64 compressedOffset, _int64 decompressedOffset);
+
+    void addBlockBoundary(z_stream* zstream, _int64 compressedOffset, _int64 decompressedOffset);
+
+    inline int getCount()
+    { return (int) checkpoints.size(); }
+
+    inline const GzipCheckpoint* getCheckpoint(int i)
+    { return &checkpoints[i]; }
+
+private:
+
+    static const _uint64 Magic = 0x32495a4750414e53; // "SNAPGZI2"
+
+    const GzipFileIdentity identity;
+    _int64 lastCompressedOffset;
+    VariableSizeVector<GzipCheckpoint> checkpoints;
+};
+
+GzipIndex::~GzipIndex()
+{
+    for (_int64 i = 0; i < checkpoints.size(); i++) {
+        if (checkpoints[i].window != NULL) {
+            delete [] checkpoints[i].window;
+        }
+    }
+}
+
+    GzipIndex*
+GzipIndex::load(
+    const char* indexFileName,
+    const GzipFileIdentity& identity)
+{
+    FILE* file = fopen(indexFileName, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    _uint64 magic;
+    GzipFileIdentity indexedIdentity;
+    _int64 count;
+    if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != Magic ||
+        fread(&indexedIdentity.size, sizeof(indexedIdentity.size), 1, file) != 1 ||
+        fread(&indexedIdentity.modificationTime, sizeof(indexedIdentity.modificationTime), 1, file) != 1 ||
+        fread(&indexedIdentity.headCrc, sizeof(indexedIdentity.headCrc), 1, file) != 1 ||
+        fread(&indexedIdentity.tailCrc, sizeof(indexedIdentity.tailCrc), 1, file) != 1 ||
+        fread(&count, sizeof(count), 1, file) != 1 || count < 0) {
+        fclose(file);
+        return NULL;
+    }
+    if (! (indexedIdentity == identity)) {
+        WriteStatusMessage("gzip index %s is out of date, %s\n", indexFileName, DataSupplier::WriteGzipIndex ? "rebuilding it" : "ignoring it");
+        fclose(file);
+        return NULL;
+    }
+    GzipIndex* index = new GzipIndex(identity);
+    for (_int64 i = 0; i < count; i++) {
+        GzipCheckpoint checkpoint;
+        int memberStart;
+        checkpoint.window = NULL;
+        if (fread(&checkpoint.compressedOffset, sizeof(checkpoint.compressedOffset), 1, file) != 1 ||
+            fread(&checkpoint.decompressedOffset, sizeof(checkpoint.decompressedOffset), 1, file) != 1 ||
+            fread(&checkpoint.bits, sizeof(checkpoint.bits), 1, file) != 1 ||
+            fread(&memberStart, sizeof(memberStart), 1, file) != 1 ||
+            fread(&checkpoint.windowSize, sizeof(checkpoint.windowSize), 1, file) != 1 ||
+            checkpoint.windowSize > GzipWindowSize || checkpoint.bits < 0 || checkpoint.bits > 7) {
+            fclose(file);
+            delete index;
+            return NULL;
+        }
+        checkpoint.memberStart = memberStart != 0;
+        if (! checkpoint.memberStart) {
+            checkpoint.window = new unsigned char[GzipWindowSize];
+            if (fread(checkpoint.window, 1, checkpoint.windowSize, file) != checkpoint.windowSize) {
+                delete [] checkpoint.window;
+                fclose(file);
+                delete index;
+                return NULL;
+            }
+        }
+        index->checkpoints.push_back(checkpoint);
+    }
+    fclose(file);
+    return index;
+}
+
+    bool
+GzipIndex::save(
+    const char* indexFileName)
+{
+    //
+    // Write it under a temporary name and then rename it, so that nobody ever sees half of an index.
+    //
+    size_t tempFileNameSize = strlen(indexFileName) + 5;
+    char* tempFileName = new char[tempFileNameSize];
+    snprintf(tempFileName, tempFileNameSize, "%s.tmp", indexFileName);
+    FILE* file = fopen(tempFileName, "wb");
+    if (file == NULL) {
+        delete [] tempFileName;
+        return false;
+    }
+    _uint64 magic = Magic;
+    _int64 count = checkpoints.size();
+    bool ok = fwrite(&magic, sizeof(magic), 1, file) == 1 &&
+        fwrite(&identity.size, sizeof(identity.size), 1, file) == 1 &&
+        fwrite(&identity.modificationTime, sizeof(identity.modificationTime), 1, file) == 1 &&
+        fwrite(&identity.headCrc, sizeof(identity.headCrc), 1, file) == 1 &&
+        fwrite(&identity.tailCrc, sizeof(identity.tailCrc), 1, file) == 1 &&
+        fwrite(&count, sizeof(count), 1, file) == 1;
+    for (_int64 i = 0; ok && i < count; i++) {
+        GzipCheckpoint* checkpoint = &checkpoints[i];
+        int memberStart = checkpoint->memberStart ? 1 : 0;
+        ok = fwrite(&checkpoint->compressedOffset, sizeof(checkpoint->compressedOffset), 1, file) == 1 &&
+            fwrite(&checkpoint->decompressedOffset, sizeof(checkpoint->decompressedOffset), 1, file) == 1 &&
+            fwrite(&checkpoint->bits, sizeof(checkpoint->bits), 1, file) == 1 &&
+            fwrite(&memberStart, sizeof(memberStart), 1, file) == 1 &&
+            fwrite(&checkpoint->windowSize, sizeof(checkpoint->windowSize), 1, file) == 1 &&
+            (checkpoint->memberStart || fwrite(checkpoint->window, 1, checkpoint->windowSize, file) == checkpoint->windowSize);
+    }
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+        ok = rename(tempFileName, indexFileName) == 0;
+    }
+    if (! ok) {
+        remove(tempFileName);
+    }
+    delete [] tempFileName;
+    return ok;
+}
+
+    void
+GzipIndex::addMemberStart(
+    _int64 compressedOffset,
+    _int64 decompressedOffset)
+{
+    GzipCheckpoint checkpoint;
+    checkpoint.compressedOffset = compressedOffset;
+    checkpoint.decompressedOffset = decompressedOffset;
+    checkpoint.bits = 0;
+    checkpoint.memberStart = true;
+    checkpoint.windowSize = 0;
+    checkpoint.window = NULL;
+    checkpoints.push_back(checkpoint);
+    lastCompressedOffset = compressedOffset;
+}
+
+    void
+GzipIndex::addBlockBoundary(
+    z_stream* zstream,
+    _int64 compressedOffset,
+    _int64 decompressedOffset)
+{
+    GzipCheckpoint checkpoint;
+    checkpoint.compressedOffset = compressedOffset;
+    checkpoint.decompressedOffset = decompressedOffset;
+    checkpoint.bits = zstream->data_type & 7;
+    checkpoint.memberStart = false;
+    checkpoint.window = new unsigned char[GzipWindowSize];
+    uInt windowSize = GzipWindowSize;
+    if (inflateGetDictionary(zstream, checkpoint.window, &windowSize) != Z_OK) {
+        delete [] checkpoint.window;
+        return;
+    }
+    checkpoint.windowSize = windowSize;
+    checkpoints.push_back(checkpoint);
+    lastCompressedOffset = compressedOffset;
+}
+
+//
+// Inflates a gzip file a piece at a time, carrying on from one member to the next.  It can start at the beginning of
+// the file or at any checkpoint in a GzipIndex, and can record checkpoints as it goes.
+//
+class GzipInflater
+{
+public:
+    GzipInflater() : initialized(false), raw(false), atMemberStart(true), trailerBytesToSkip(0) {}
+
+    ~GzipInflater()
+    {
+        if (initialized) {
+            inflateEnd(&zstream);
+        }
+    }
+
+    void startAtBeginning();
+
+    // input points to the byte at the checkpoint's compressed offset
+    void startAtCheckpoint(const GzipCheckpoint* checkpoint, char* input);
+
+    //
+    // Inflate until the input is used up or the output is full, recording checkpoints in index if it's not NULL.
+    // The offsets are those of input and output in the compressed and decompressed file.
+    //
+    void inflate(char* input, _int64 inputBytes, char* output, _int64 outputBytes, _int64* o_inputUsed, _int64* o_outputWritten,
+        GzipIndex* index = NULL, _int64 compressedOffset = 0, _int64 decompressedOffset = 0);
+
+private:
+
+    void init(int bits);
+
+    z_stream zstream;
+    bool initialized;
+    bool raw; // started at a block boundary, so the deflate stream ends before the member's trailer
+    bool atMemberStart;
+    int trailerBytesToSkip;
+};
+
+    void
+GzipInflater::init(
+    int bits)
+{
+    if (initialized) {
+        inflateEnd(&zstream);
+    } else {
+        zstream.zalloc = NULL;
+        zstream.zfree = NULL;
+        zstream.opaque = NULL;
+    }
+    int status = inflateInit2(&zstream, bits);
+    if (status != Z_OK) {
+        WriteErrorMessage("GzipDataReader: inflateInit2 failed with %d\n", status);
+        soft_exit(1);
+    }
+    initialized = true;
+}
+
+    void
+GzipInflater::startAtBeginning()
+{
+    atMemberStart = true;
+    trailerBytesToSkip = 0;
+}
+
+    void
+GzipInflater::startAtCheckpoint(
+    const GzipCheckpoint* checkpoint,
+    char* input)
+{
+    trailerBytesToSkip = 0;
+    if (checkpoint->memberStart) {
+        atMemberStart = true;
+        return;
+    }
+    atMemberStart = false;
+    raw = true;
+    zstream.next_in = NULL;
+    zstream.avail_in = 0;
+    init(-windowBits);
+    if (checkpoint->bits != 0) {
+        inflatePrime(&zstream, checkpoint->bits, ((unsigned char) input[-1]) >> (8 - checkpoint->bits));
+    }
+    if (checkpoint->windowSize > 0) {
+        inflateSetDictionary(&zstream, checkpoint->window, checkpoint->windowSize);
+    }
+}
+
+    void
+GzipInflater::inflate(
+    char* input,
+    _int64 inputBytes,
+    char* output,
+    _int64 outputBytes,
+    _int64* o_inputUsed,
+    _int64* o_outputWritten,
+    GzipIndex* index,
+    _int64 compressedOffset,
+    _int64 decompressedOffset)
+{
+    if (inputBytes > 0xffffffff || outputBytes > 0xffffffff) {
+        WriteErrorMessage("GzipDataReader: inputBytes or outputBytes > max unsigned int\n");
+        soft_exit(1);
+    }
+    zstream.next_in = (Bytef*) input;
+    zstream.avail_in = (uInt) inputBytes;
+    zstream.next_out = (Bytef*) output;
+    zstream.avail_out = (uInt) outputBytes;
+    while (zstream.avail_in > 0 && zstream.avail_out > 0) {
+        if (trailerBytesToSkip > 0) {
+            uInt skip = __min((uInt) trailerBytesToSkip, zstream.avail_in);
+            zstream.next_in += skip;
+            zstream.avail_in -= skip;
+            trailerBytesToSkip -= skip;
+            atMemberStart = trailerBytesToSkip == 0;
+            continue;
+        }
+        if (atMemberStart) {
+            _int64 memberOffset = compressedOffset + ((char*) zstream.next_in - input);
+            if (index != NULL && index->wantCheckpoint(memberOffset)) {
+                index->addMemberStart(memberOffset, decompressedOffset + ((char*) zstream.next_out - output));
+            }
+            init(windowBits | ENABLE_ZLIB_GZIP);
+            raw = false;
+            atMemberStart = false;
+        }
+        int status = ::inflate(&zstream, index != NULL ? Z_BLOCK : Z_NO_FLUSH);
+        if (status == Z_STREAM_END) {
+            if (raw) {
+                trailerBytesToSkip = GzipTrailerSize;
+            } else {
+                atMemberStart = true;
+            }
+            continue;
+        }
+        if (status == Z_BUF_ERROR) {
+            break;
+        }
+        if (status < 0) {
+            WriteErrorMessage("GzipDataReader: inflate failed with %d\n", status);
+            soft_exit(1);
+        }
+        if (index != NULL && (zstream.data_type & 128) && ! (zstream.data_type & 64)) {
+            _int64 blockOffset = compressedOffset + ((char*) zstream.next_in - input);
+            if (index->wantCheckpoint(blockOffset)) {
+                index->addBlockBoundary(&zstream, blockOffset, decompressedOffset + ((char*) zstream.next_out - output));
+            }
+        }
+    }
+    *o_inputUsed = inputBytes - zstream.avail_in;
+    *o_outputWritten = outputBytes - zstream.avail_out;
+}
+
 class DecompressDataReader : public DataReader
 {
 public:
@@ -1319,7 +2082,7 @@ public:
     virtual const char* getFilename()
     { return inner->getFilename(); }
 
-    enum DecompressMode { SingleBlock, ContinueMultiBlock, StartMultiBlock };
+    enum DecompressMode { ContinueMultiBlock, StartMultiBlock };
 
     static bool decompress(z_stream* zstream, ThreadHeap* heap, char* input, _int64 inputSize, _int64* o_inputUsed,
         char* output, _int64 outputSize, _int64* o_outputUsed, DecompressMode mode);
@@ -1386,6 +2149,14 @@ private:
     Entry* available; // first non-ready buffer (head of freelist), NULL if none
     EventObject availableEvent; // signalled by main thread when available goes NULL->non-NULL
     ExclusiveLock lock; // lock on linked list pointers in this object and in Entry
+
+    // plain gzip input
+    bool bgzf; // made of BGZF blocks, so decompress it a block at a time like BAM
+    char* indexFileName; // for the checkpoint index, NULL if the input isn't a file
+    _int64 compressedFileSize;
+    GzipFileIdentity fileIdentity; // of the input, to tell whether an index was made from it
+    GzipIndex* index; // checkpoints to decompress between in parallel, NULL if none
+    GzipIndex* newIndex; // being built while decompressing serially, NULL if none
 };
 
 
@@ -1398,7 +2169,8 @@ DecompressDataReader::DecompressDataReader(
     int i_chunkSize)
     : DataReader(), inner(i_inner), count(i_count), offset(i_overflowBytes),
     totalExtra(i_totalExtra), extraBytes(i_extraBytes), overflowBytes(i_overflowBytes),
-    chunkSize(i_chunkSize), threadStarted(false), eof(false), stopping(false)
+    chunkSize(i_chunkSize), threadStarted(false), eof(false), stopping(false),
+    bgzf(false), indexFileName(NULL), compressedFileSize(0), index(NULL), newIndex(NULL)
 {
     entries = new Entry[count];
     for (int i = 0; i < count; i++) {
@@ -1434,13 +2206,65 @@ DecompressDataReader::~DecompressDataReader()
     }
     DestroyExclusiveLock(&lock);
     delete inner;
+    if (index != NULL) {
+        delete index;
+    }
+    if (newIndex != NULL) {
+        delete newIndex;
+    }
+    if (indexFileName != NULL) {
+        delete [] indexFileName;
+    }
 }
 
     bool
 DecompressDataReader::init(
     const char* fileName)
 {
-    return inner->init(fileName);
+    if (! inner->init(fileName)) {
+        return false;
+    }
+    if (chunkSize != 0 || ! strcmp(fileName, "-")) {
+        return true;
+    }
+    //
+    // A plain gzip file.  If the first member is a BGZF block we can find all of the blocks without decompressing
+    // them, otherwise see if we've already made a checkpoint index for it.
+    //
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return true;
+    }
+    char header[sizeof(BgzfHeader) + sizeof(BgzfExtra)];
+    BgzfHeader* zip = (BgzfHeader*) header;
+    bgzf = fread(header, 1, sizeof(header), file) == sizeof(header) &&
+        zip->ID1 == 0x1f && zip->ID2 == 0x8b && zip->CM == 8 && (zip->FLG & 4) != 0 && zip->XLEN >= sizeof(BgzfExtra) + 2 &&
+        zip->firstExtra()->SI1 == 66 && zip->firstExtra()->SI2 == 67 && zip->firstExtra()->SLEN == 2;
+    fclose(file);
+    if (bgzf) {
+        return true;
+    }
+    if (! fileIdentity.compute(fileName)) {
+        return true;
+    }
+    compressedFileSize = fileIdentity.size;
+    const char* indexBaseName = fileName;
+    const char* indexDirectory = "";
+    const char* separator = "";
+    if (DataSupplier::GzipIndexDirectory != NULL) {
+        for (const char* p = fileName; *p != '\0'; p++) {
+            if (*p == '/' || *p == '\\') {
+                indexBaseName = p + 1;
+            }
+        }
+        indexDirectory = DataSupplier::GzipIndexDirectory;
+        separator = "/";
+    }
+    size_t indexFileNameSize = strlen(indexDirectory) + strlen(separator) + strlen(indexBaseName) + strlen(GzipIndexExtension) + 1;
+    indexFileName = new char[indexFileNameSize];
+    snprintf(indexFileName, indexFileNameSize, "%s%s%s%s", indexDirectory, separator, indexBaseName, GzipIndexExtension);
+    index = GzipIndex::load(indexFileName, fileIdentity);
+    return true;
 }
 
     char*
@@ -1483,8 +2307,12 @@ DecompressDataReader::reinit(
     }
     // todo: transform start/amount to add for compression? I don't think so...
     inner->reinit(startingOffset, amountOfFileToProcess);
+    if (DataSupplier::WriteGzipIndex && indexFileName != NULL && index == NULL && startingOffset == 0 &&
+        compressedFileSize >= 2 * DataSupplier::GzipCheckpointSpacing) {
+        newIndex = new GzipIndex(fileIdentity);
+    }
     threadStarted = true;
-    if (! StartNewThread(chunkSize > 0 ? decompressThread : decompressThreadContinuous, this)) {
+    if (! StartNewThread(chunkSize > 0 || bgzf ? decompressThread : decompressThreadContinuous, this)) {
         WriteErrorMessage("failed to start decompressThread\n");
         soft_exit(1);
     }
@@ -1646,7 +2474,7 @@ DecompressDataReader::decompress(
         }
         oldAvailOut = zstream->avail_out;
         oldAvailIn = zstream->avail_in;
-        status = inflate(zstream, mode == SingleBlock ? Z_NO_FLUSH : Z_FINISH);
+        status = inflate(zstream, Z_FINISH);
         // fprintf(stderr, "decompress block #%d %lld -> %lld = %d\n", block, zstream.next_in - lastIn, zstream.next_out - lastOut, status);
         block++;
         if (status < 0 && status != Z_BUF_ERROR) {
@@ -1657,7 +2485,7 @@ DecompressDataReader::decompress(
             WriteErrorMessage("insufficient decompression buffer space - increase expansion factor, currently -xf %.1f\n", DataSupplier::ExpansionFactor);
             soft_exit(1);
         }
-    } while (zstream->avail_in != 0 && (zstream->avail_out != oldAvailOut || zstream->avail_in != oldAvailIn) && mode != SingleBlock);
+    } while (zstream->avail_in != 0 && (zstream->avail_out != oldAvailOut || zstream->avail_in != oldAvailIn));
     // fprintf(stderr, "end decompress status=%d, avail_in=%lld, last block=%lld->%lld, avail_out=%lld\n", status, zstream.avail_in, zstream.next_in - lastIn, zstream.next_out - lastOut, zstream.avail_out);
     if (o_inputRead) {
         *o_inputRead = inputBytes - zstream->avail_in;
@@ -1697,13 +2525,14 @@ typedef VariableSizeVector<_int64> OffsetVector;
 class DecompressWorker : public ParallelWorker
 {
 public:
-    DecompressWorker();
+    DecompressWorker() : decompressor(GzipDecompressor::create()) {}
+
+    virtual ~DecompressWorker() { delete decompressor; }
 
     virtual void step();
 
 private:
-    z_stream zstream;
-    ThreadHeap heap;
+    GzipDecompressor* decompressor;
 };
     
 class DecompressManager: public ParallelWorkerManager
@@ -1723,31 +2552,19 @@ public:
     friend class DecompressWorker;
 };
 
-DecompressWorker::DecompressWorker()
-    : heap(BAM_BLOCK)
-{
-    zstream.zalloc = zalloc;
-    zstream.zfree = zfree;
-    zstream.opaque = &heap;
-}
-
     void
 DecompressWorker::step()
 {
     DecompressManager* manager = (DecompressManager*) getManager();
     for (int i = getThreadNum(); i < manager->inputs->size() - 1; i += getNumThreads()) {
-        _int64 inputUsed, outputUsed;
-        DecompressDataReader::decompress(&zstream,
-            &heap,
-            manager->entry->compressed + (*manager->inputs)[i],
-            (*manager->inputs)[i + 1] - (*manager->inputs)[i],
-            &inputUsed,
-            manager->entry->decompressed + (*manager->outputs)[i],
-            (*manager->outputs)[i + 1] - (*manager->outputs)[i],
-            &outputUsed,
-            DecompressDataReader::SingleBlock);
-        _ASSERT(inputUsed == (*manager->inputs)[i + 1] - (*manager->inputs)[i] &&
-            outputUsed == (*manager->outputs)[i + 1] - (*manager->outputs)[i]);
+        if (! decompressor->decompress(
+                manager->entry->compressed + (*manager->inputs)[i],
+                (*manager->inputs)[i + 1] - (*manager->inputs)[i],
+                manager->entry->decompressed + (*manager->outputs)[i],
+                (*manager->outputs)[i + 1] - (*manager->outputs)[i])) {
+            WriteErrorMessage("GzipDataReader: corrupt BGZF block\n");
+            soft_exit(1);
+        }
     }
 }
 
@@ -1813,6 +2630,7 @@ DecompressDataReader::decompressThread(
             inputs.push_back(input);
             outputs.push_back(output);
             //fprintf(stderr, "decompressThread read #%d %lld->%lld\n", index, input, output);
+            _int64 start = timeInNanos();
             reader->inner->advance(input);
             entry->decompressedValid = output;
             entry->decompressedStart = output - reader->overflowBytes;
@@ -1822,6 +2640,8 @@ DecompressDataReader::decompressThread(
             // decompress all chunks synchronously on multiple threads
             manager.entry = entry;
             coworker.step();
+            InterlockedAdd64AndReturnNewValue(&DecompressTime, timeInNanos() - start);
+            InterlockedAdd64AndReturnNewValue(&DecompressedBytes, output - reader->overflowBytes);
         }
         // make buffer available for clients & go on to next
         //fprintf(stderr, "decompressThread #%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
@@ -1831,13 +2651,85 @@ DecompressDataReader::decompressThread(
     AllowEventWaitersToProceed(&reader->decompressThreadDone);
 }
 
+//
+// One piece of a batch of plain gzip input that can be inflated at the same time as the others: the part carrying on
+// from the previous batch, the parts between checkpoints and the part from the last checkpoint to the end of the batch.
+// All but the last stop when their output reaches the next checkpoint.
+//
+struct GzipSegment
+{
+    GzipInflater*           inflater;   // carrying on into or out of the batch, or NULL to use the worker's own
+    const GzipCheckpoint*   checkpoint; // to start at, or NULL to carry on
+    char*                   input;
+    _int64                  inputBytes;
+    char*                   output;
+    _int64                  outputBytes;
+    _int64                  inputUsed;
+    _int64                  outputWritten;
+};
+
+typedef VariableSizeVector<GzipSegment> SegmentVector;
+
+class GzipSegmentWorker : public ParallelWorker
+{
+public:
+    GzipSegmentWorker() {}
+
+    virtual void step();
+
+private:
+    GzipInflater inflater;
+};
+
+class GzipSegmentManager : public ParallelWorkerManager
+{
+public:
+    GzipSegmentManager(SegmentVector* i_segments)
+        : segments(i_segments)
+    {}
+
+    virtual ParallelWorker* createWorker()
+    { return new GzipSegmentWorker(); }
+
+    SegmentVector* segments;
+};
+
+    void
+GzipSegmentWorker::step()
+{
+    SegmentVector* segments = ((GzipSegmentManager*) getManager())->segments;
+    for (int i = getThreadNum(); i < segments->size(); i += getNumThreads()) {
+        GzipSegment* segment = &(*segments)[i];
+        GzipInflater* segmentInflater = segment->inflater != NULL ? segment->inflater : &inflater;
+        if (segment->checkpoint != NULL) {
+            segmentInflater->startAtCheckpoint(segment->checkpoint, segment->input);
+        }
+        segmentInflater->inflate(segment->input, segment->inputBytes, segment->output, segment->outputBytes,
+            &segment->inputUsed, &segment->outputWritten);
+    }
+}
+
     void
 DecompressDataReader::decompressThreadContinuous(
     void* context)
 {
     DecompressDataReader* reader = (DecompressDataReader*) context;
-    z_stream zstream;
-    bool first = true;
+    //
+    // Two inflaters take turns carrying the stream over from one batch to the next: while one finishes the segment
+    // that the previous batch started, the other starts the one that the next batch will finish.
+    //
+    GzipInflater carry[2];
+    int carryIndex = 0;
+    carry[0].startAtBeginning();
+    _int64 compressedOffset = 0, decompressedOffset = 0;
+    int nextCheckpoint = 0;
+    SegmentVector segments;
+    GzipSegmentManager manager(&segments);
+    ParallelCoworker* coworker = NULL;
+    if (reader->index != NULL) {
+        coworker = new ParallelCoworker(min(8, DataSupplier::ThreadCount), false, &manager);
+        coworker->start();
+    }
     bool stop = false;
     while (! stop) {
         Entry* entry = reader->dequeueAvailable();
@@ -1860,29 +2752,95 @@ DecompressDataReader::decompressThreadContinuous(
             entry->decompressed = (char*) BigAlloc(reader->totalExtra);
             entry->allocated = true;
             stop = true;
+            if (reader->newIndex != NULL && compressedOffset == reader->compressedFileSize) {
+                reader->newIndex->save(reader->indexFileName); // If we can't, later runs just decompress serially
+            }
         } else {
-            // figure out offsets and advance inner data
+            // figure out offsets and advance inner data; the rest is overflow that starts the next batch
             _int64 ignore;
             reader->inner->getExtra(&entry->decompressed, &ignore);
             _ASSERT(ignore >= reader->extraBytes && ignore >= reader->overflowBytes);
+            _int64 compressedBytes = entry->compressedStart;
             _int64 compressedRead, decompressedWritten;
             entry->batch = reader->inner->getBatch();
             reader->holdBatch(entry->batch); // hold batch while decompressing
-            reader->inner->advance(entry->compressedValid);
+            reader->inner->advance(compressedBytes);
             reader->inner->nextBatch(); // start reading next batch
-            decompress(&zstream, NULL,
-                entry->compressed, entry->compressedValid, &compressedRead,
-                entry->decompressed + reader->overflowBytes, reader->extraBytes - reader->overflowBytes, &decompressedWritten,
-                first ? StartMultiBlock : ContinueMultiBlock);
-            _ASSERT(compressedRead == entry->compressedValid && decompressedWritten <= reader->extraBytes - reader->overflowBytes);
+            _int64 start = timeInNanos();
+            char* output = entry->decompressed + reader->overflowBytes;
+            _int64 outputBytes = reader->extraBytes - reader->overflowBytes;
+            if (coworker == NULL) {
+                carry[0].inflate(entry->compressed, compressedBytes, output, outputBytes, &compressedRead, &decompressedWritten,
+                    reader->newIndex, compressedOffset, decompressedOffset);
+            } else {
+                //
+                // Split the batch at the checkpoints in it.  One whose block starts partway through a byte needs that
+                // byte too, so it has to be after the start of the batch.
+                //
+                _int64 batchEnd = compressedOffset + compressedBytes;
+                while (nextCheckpoint < reader->index->getCount()) {
+                    const GzipCheckpoint* checkpoint = reader->index->getCheckpoint(nextCheckpoint);
+                    if (checkpoint->compressedOffset - (checkpoint->bits != 0 ? 1 : 0) >= compressedOffset) {
+                        break;
+                    }
+                    nextCheckpoint++;
+                }
+                segments.clear();
+                GzipSegment continuation = {&carry[carryIndex], NULL, entry->compressed, compressedBytes, output, outputBytes, 0, 0};
+                segments.push_back(continuation);
+                while (nextCheckpoint < reader->index->getCount()) {
+                    const GzipCheckpoint* checkpoint = reader->index->getCheckpoint(nextCheckpoint);
+                    if (checkpoint->compressedOffset >= batchEnd) {
+                        break;
+                    }
+                    _int64 outputOffset = checkpoint->decompressedOffset - decompressedOffset;
+                    if (outputOffset < segments[segments.size() - 1].output - output || outputOffset > outputBytes) {
+                        WriteErrorMessage("gzip index %s doesn't match %s; delete it and try again\n", reader->indexFileName, reader->getFilename());
+                        soft_exit(1);
+                    }
+                    segments[segments.size() - 1].outputBytes = output + outputOffset - segments[segments.size() - 1].output;
+                    _int64 inputOffset = checkpoint->compressedOffset - compressedOffset;
+                    GzipSegment segment = {NULL, checkpoint, entry->compressed + inputOffset, compressedBytes - inputOffset,
+                        output + outputOffset, outputBytes - outputOffset, 0, 0};
+                    segments.push_back(segment);
+                    nextCheckpoint++;
+                }
+                if (segments.size() > 1) {
+                    segments[segments.size() - 1].inflater = &carry[1 - carryIndex];
+                }
+                coworker->step();
+                for (int i = 0; i < segments.size() - 1; i++) {
+                    if (segments[i].outputWritten != segments[i].outputBytes) {
+                        WriteErrorMessage("gzip index %s doesn't match %s; delete it and try again\n", reader->indexFileName, reader->getFilename());
+                        soft_exit(1);
+                    }
+                }
+                GzipSegment* last = &segments[segments.size() - 1];
+                compressedRead = last->input + last->inputUsed - entry->compressed;
+                decompressedWritten = last->output + last->outputWritten - output;
+                if (segments.size() > 1) {
+                    carryIndex = 1 - carryIndex;
+                }
+            }
+            if (compressedRead != compressedBytes) {
+                WriteErrorMessage("insufficient decompression buffer space - increase expansion factor, currently -xf %.1f\n", DataSupplier::ExpansionFactor);
+                soft_exit(1);
+            }
+            InterlockedAdd64AndReturnNewValue(&DecompressTime, timeInNanos() - start);
+            InterlockedAdd64AndReturnNewValue(&DecompressedBytes, decompressedWritten);
+            compressedOffset += compressedBytes;
+            decompressedOffset += decompressedWritten;
             entry->decompressedValid = reader->overflowBytes + decompressedWritten;
             entry->decompressedStart = decompressedWritten;
-            first = false;
         }
         // make buffer available for clients & go on to next
         //fprintf(stderr, "decompressThreadContinuous#%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
         reader->enqueueReady(entry);
     }
+    if (coworker != NULL) {
+        coworker->stop();
+        delete coworker;
+    }
     AllowEventWaitersToProceed(&reader->decompressThreadDone);
 }
 
@@ -1999,9 +2957,9 @@ DecompressDataReaderSupplier::getDataReader(
     // adjust extra factor for compression ratio
     double expand = MAX_FACTOR * DataSupplier::ExpansionFactor;
     double totalFactor = expand * (1.0 + extraFactor);
-    // get inner reader with no overflow since zlib can't deal with it
+    // get inner reader with overflow for a whole block, so BGZF blocks can span batches even in plain gzip input
     // add 2 buffers for compression thread
-    DataReader* data = inner->getDataReader(bufferCount + 2, blockSize, totalFactor);
+    DataReader* data = inner->getDataReader(bufferCount + 2, BAM_BLOCK, totalFactor);
     // compute how many extra bytes are owned by this layer
     char* p;
     _int64 totalExtra;
@@ -2519,10 +3477,29 @@ DataSupplier* DataSupplier::GzipStdio = DataSupplier::Gzip(DataSupplier::Stdio);
 
 DataSupplier* DataSupplier::GzipBamStdio = DataSupplier::GzipBam(DataSupplier::Stdio);
 
+    void
+DataSupplier::SetDefault(
+    DataSupplier* supplier)
+{
+    if (supplier != Default) {
+        Default = supplier;
+        GzipDefault = Gzip(supplier);
+        GzipBamDefault = GzipBam(supplier);
+    }
+}
+
 
 int DataSupplier::ThreadCount = 1;
 
 double DataSupplier::ExpansionFactor = 1.0;
 
+_int64 DataSupplier::GzipCheckpointSpacing = 512 * 1024;
+
+bool DataSupplier::WriteGzipIndex = false;
+
+const char* DataSupplier::GzipIndexDirectory = NULL;
+
 volatile _int64 DataReader::ReadWaitTime = 0;
 volatile _int64 DataReader::ReleaseWaitTime = 0;
+volatile _int64 DataReader::DecompressTime = 0;
+volatile _int64 DataReader::DecompressedBytes = 0;
@@ -24,6 +24,8 @@ Revision History:
 
 #include "Compat.h"
 #include "VariableSizeMap.h"
+
+class Genome;
 //
 // This defines a family of composable classes for efficiently reading data with flow control.
 //
@@ -145,6 +147,10 @@ public:
     // timing for performance tuning (in nanos)
     static volatile _int64 ReadWaitTime;
     static volatile _int64 ReleaseWaitTime;
+
+    // time spent decompressing input (in nanos) and the number of bytes it produced
+    static volatile _int64 DecompressTime;
+    static volatile _int64 DecompressedBytes;
 };
 
 class DataSupplier
@@ -165,6 +171,9 @@ public:
     static DataSupplier* Gzip(DataSupplier* inner);
     static DataSupplier* StdioSupplier();
 
+    // decodes reference-compressed files (see RefCompressed.h) read by inner; needs the genome they were written against
+    static DataSupplier* RefCompressed(DataSupplier* inner, const Genome* genome);
+
     // memmap works on both platforms (but better on Linux)
     static DataSupplier* MemMap;
 
@@ -173,6 +182,13 @@ public:
     static DataSupplier* WindowsOverlapped;
 #endif
 
+#ifdef __linux__
+    // io_uring is only on Linux; these hand out memmap readers if the kernel doesn't support it.
+    // Direct bypasses the page cache with O_DIRECT if the file system allows it.
+    static DataSupplier* IoUringBuffered;
+    static DataSupplier* IoUringDirect;
+#endif
+
     // default raw data supplier for platform
     static DataSupplier* Default;
     static DataSupplier* GzipDefault;
@@ -182,11 +198,22 @@ public:
     static DataSupplier* Stdio;
     static DataSupplier* GzipBamStdio;
 
+    // make Default and the gzip and BAM suppliers layered on it read files with supplier
+    static void SetDefault(DataSupplier* supplier);
+
     // hack: must be set to communicate thread count into suppliers
     static int ThreadCount;
 
     // hack: global for additional expansion factor
     static double ExpansionFactor;
+
+    // hack: global for compressed bytes between checkpoints in a gzip index
+    static _int64 GzipCheckpointSpacing;
+
+    // whether to write a gzip index for plain gzip files that don't have one, and the directory it goes in
+    // (NULL for next to the file)
+    static bool WriteGzipIndex;
+    static const char* GzipIndexDirectory;
 };
 
 // manages lifetime tracking for batches of reads
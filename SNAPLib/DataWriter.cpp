@@ -32,7 +32,7 @@ class AsyncDataWriterSupplier : public DataWriterSupplier
 {
 public:
     AsyncDataWriterSupplier(const char* i_filename, DataWriter::FilterSupplier* i_filterSupplier,
-        FileEncoder* i_encoder, int i_bufferCount, size_t i_bufferSize);
+        FileEncoder* i_encoder, int i_bufferCount, size_t i_bufferSize, AsyncFile* i_file);
 
     virtual DataWriter* getWriter();
 
@@ -452,7 +452,8 @@ AsyncDataWriterSupplier::AsyncDataWriterSupplier(
     DataWriter::FilterSupplier* i_filterSupplier,
     FileEncoder* i_encoder,
     int i_bufferCount,
-    size_t i_bufferSize)
+    size_t i_bufferSize,
+    AsyncFile* i_file)
     :
     filename(i_filename),
     filterSupplier(i_filterSupplier),
@@ -463,7 +464,7 @@ AsyncDataWriterSupplier::AsyncDataWriterSupplier(
     sharedLogical(0),
     closing(false)
 {
-    file = AsyncFile::open(filename, true);
+    file = i_file != NULL ? i_file : AsyncFile::open(filename, true);
     if (file == NULL) {
         WriteErrorMessage("failed to open %s for write\n", filename);
         soft_exit(1);
@@ -514,9 +515,10 @@ DataWriterSupplier::create(
     DataWriter::FilterSupplier* filterSupplier,
     FileEncoder* encoder,
     int count,
-    size_t bufferSize)
+    size_t bufferSize,
+    AsyncFile* file)
 {
-    return new AsyncDataWriterSupplier(filename, filterSupplier, encoder, count, bufferSize);
+    return new AsyncDataWriterSupplier(filename, filterSupplier, encoder, count, bufferSize, file);
 }
 
 class ComposeFilter : public DataWriter::Filter
@@ -134,28 +134,35 @@ public:
     // call when all threads are done, all filters destroyed
     virtual void close() = 0;
     
+    // writes go to file if it's given (which must stay open until the supplier closes it), else to a new filename
     static DataWriterSupplier* create(
         const char* filename,
         DataWriter::FilterSupplier* filterSupplier = NULL,
         FileEncoder* encoder = NULL,
-        int count = 4, size_t bufferSize = 16 * 1024 * 1024);
+        int count = 4, size_t bufferSize = 16 * 1024 * 1024,
+        AsyncFile* file = NULL);
     
+    // inMemoryBudget is how many bytes of sorted blocks to hold in memory before spilling to the temp file
+    // (0 to always use the temp file).  markDuplicates (BAM only) marks them as the sorted file is written.
     static DataWriterSupplier* sorted(
         const FileFormat* format,
         const Genome* genome,
         const char* tempFileName,
         size_t tempBufferMemory,
+        _int64 inMemoryBudget,
         int numThreads,
+        bool markDuplicates,
         const char* sortedFileName,
         DataWriter::FilterSupplier* sortedFilterSupplier,
         FileEncoder* encoder = NULL);
 
-    // defaults follow BAM output spec
-    static GzipWriterFilterSupplier* gzip(bool bamFormat, size_t chunkSize, int numThreads, bool bindToProcessors, bool multiThreaded);
-
-    static DataWriter::FilterSupplier* markDuplicates(const Genome* genome);
+    // defaults follow BAM output spec; level is the compression level (see GzipCompressor), or -1 for the default
+    static GzipWriterFilterSupplier* gzip(bool bamFormat, size_t chunkSize, int numThreads, bool bindToProcessors, bool multiThreaded, int level);
 
     static DataWriter::FilterSupplier* bamIndex(const char* indexFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier);
+
+    // encodes BAM output into reference-compressed containers (see RefCompressed.h) on each writer's thread
+    static DataWriter::FilterSupplier* refCompressed(const Genome* genome, int level);
 };
 
 class AsyncDataWriter;
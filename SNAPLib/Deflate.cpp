@@ -0,0 +1,230 @@
+/*++
+
+Module Name:
+
+    Deflate.cpp
+
+Abstract:
+
+    Gzip member compression and decompression over zlib.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Deflate.h"
+#include "zlib.h"
+#include "exit.h"
+#include "Error.h"
+
+//
+// Gzip framing (RFC 1952).  BGZF adds a BC extra field holding the member size - 1, which has to fit in 16 bits.
+//
+static const size_t GzipHeaderSize = 10;
+static const size_t BgzfHeaderSize = 18;
+static const size_t GzipTrailerSize = 8;
+static const size_t MaxBgzfBlock = 65536;
+
+static const _uint8 GzipFlagHeaderCrc = 2;
+static const _uint8 GzipFlagExtra = 4;
+static const _uint8 GzipFlagName = 8;
+static const _uint8 GzipFlagComment = 16;
+
+    size_t
+GzipCompressor::compress(
+    bool bgzf,
+    char* output,
+    size_t outputSize,
+    const char* input,
+    size_t inputSize)
+{
+    size_t headerSize = bgzf ? BgzfHeaderSize : GzipHeaderSize;
+    if (inputSize > 0xffffffff || outputSize < headerSize + GzipTrailerSize) {
+        return 0;
+    }
+    if (bgzf) {
+        outputSize = __min(outputSize, MaxBgzfBlock);
+    }
+    size_t deflated = deflate(output + headerSize, outputSize - headerSize - GzipTrailerSize, input, inputSize);
+    if (deflated == 0) {
+        return 0;
+    }
+    size_t total = headerSize + deflated + GzipTrailerSize;
+
+    //
+    // The same header zlib writes for its gzip encoding, including the extra flags it sets by level, so that
+    // output from zlib is bit for bit what it was when zlib did the framing.
+    //
+    _uint8* header = (_uint8*) output;
+    header[0] = 0x1f;
+    header[1] = 0x8b;
+    header[2] = Z_DEFLATED;
+    header[3] = bgzf ? GzipFlagExtra : 0;
+    * (_uint32*) (header + 4) = 0; // MTIME
+    header[8] = level >= 9 ? 2 : level < 2 ? 4 : 0;
+    header[9] = bgzf ? 0 : 255; // OS
+    if (bgzf) {
+        * (_uint16*) (header + 10) = 6; // XLEN
+        header[12] = 'B';
+        header[13] = 'C';
+        * (_uint16*) (header + 14) = 2;
+        * (_uint16*) (header + 16) = (_uint16) (total - 1);
+    }
+
+    char* trailer = output + headerSize + deflated;
+    * (_uint32*) trailer = crc32(input, inputSize);
+    * (_uint32*) (trailer + 4) = (_uint32) inputSize;
+    return total;
+}
+
+    bool
+GzipDecompressor::decompress(
+    const char* input,
+    size_t inputSize,
+    char* output,
+    size_t outputSize)
+{
+    const _uint8* header = (const _uint8*) input;
+    if (inputSize < GzipHeaderSize + GzipTrailerSize || inputSize > 0xffffffff || outputSize > 0xffffffff ||
+        header[0] != 0x1f || header[1] != 0x8b || header[2] != Z_DEFLATED) {
+        return false;
+    }
+    size_t offset = GzipHeaderSize;
+    if (header[3] & GzipFlagExtra) {
+        offset += 2 + * (_uint16*) (header + 10);
+    }
+    for (_uint8 flag = GzipFlagName; flag <= GzipFlagComment; flag <<= 1) {
+        if (header[3] & flag) {
+            while (offset < inputSize && header[offset] != 0) {
+                offset++;
+            }
+            offset++;
+        }
+    }
+    if (header[3] & GzipFlagHeaderCrc) {
+        offset += 2;
+    }
+    if (offset + GzipTrailerSize > inputSize) {
+        return false;
+    }
+
+    size_t inflated;
+    if (! inflate(input + offset, inputSize - offset - GzipTrailerSize, &inflated, output, outputSize) ||
+            offset + inflated + GzipTrailerSize != inputSize) {
+        return false;
+    }
+    const char* trailer = input + offset + inflated;
+    return * (_uint32*) trailer == crc32(output, outputSize) && * (_uint32*) (trailer + 4) == (_uint32) outputSize;
+}
+
+const char* GzipCompressor::Library = "zlib";
+
+//
+// The zlib streams are set up once and reset for each member, rather than initialized and ended every time, which
+// is most of the cost of small members like BGZF blocks at the faster levels.
+//
+class ZlibCompressor : public GzipCompressor
+{
+public:
+    ZlibCompressor(int i_level) : GzipCompressor(i_level)
+    {
+        zstream.zalloc = NULL;
+        zstream.zfree = NULL;
+        zstream.opaque = NULL;
+        int status = deflateInit2(&zstream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        if (status != Z_OK) {
+            WriteErrorMessage("GzipCompressor: deflateInit2 failed with %d for level %d\n", status, level);
+            soft_exit(1);
+        }
+    }
+
+    virtual ~ZlibCompressor()
+    {
+        deflateEnd(&zstream);
+    }
+
+protected:
+    virtual size_t deflate(char* output, size_t outputSize, const char* input, size_t inputSize)
+    {
+        deflateReset(&zstream);
+        zstream.next_in = (Bytef*) input;
+        zstream.avail_in = (uInt) inputSize;
+        zstream.next_out = (Bytef*) output;
+        zstream.avail_out = (uInt) __min(outputSize, (size_t) 0xffffffff);
+        if (::deflate(&zstream, Z_FINISH) != Z_STREAM_END) {
+            return 0;
+        }
+        return (char*) zstream.next_out - output;
+    }
+
+    virtual _uint32 crc32(const char* data, size_t bytes)
+    {
+        return (_uint32) ::crc32(0, (const Bytef*) data, (uInt) bytes);
+    }
+
+private:
+    z_stream zstream;
+};
+
+class ZlibDecompressor : public GzipDecompressor
+{
+public:
+    ZlibDecompressor()
+    {
+        zstream.zalloc = NULL;
+        zstream.zfree = NULL;
+        zstream.opaque = NULL;
+        zstream.next_in = NULL;
+        zstream.avail_in = 0;
+        int status = inflateInit2(&zstream, -MAX_WBITS);
+        if (status != Z_OK) {
+            WriteErrorMessage("GzipDecompressor: inflateInit2 failed with %d\n", status);
+            soft_exit(1);
+        }
+    }
+
+    virtual ~ZlibDecompressor()
+    {
+        inflateEnd(&zstream);
+    }
+
+protected:
+    virtual bool inflate(const char* input, size_t inputSize, size_t* o_inputUsed, char* output, size_t outputSize)
+    {
+        inflateReset(&zstream);
+        zstream.next_in = (Bytef*) input;
+        zstream.avail_in = (uInt) inputSize;
+        zstream.next_out = (Bytef*) output;
+        zstream.avail_out = (uInt) outputSize;
+        if (::inflate(&zstream, Z_FINISH) != Z_STREAM_END || zstream.avail_out != 0) {
+            return false;
+        }
+        *o_inputUsed = inputSize - zstream.avail_in;
+        return true;
+    }
+
+    virtual _uint32 crc32(const char* data, size_t bytes)
+    {
+        return (_uint32) ::crc32(0, (const Bytef*) data, (uInt) bytes);
+    }
+
+private:
+    z_stream zstream;
+};
+
+    GzipCompressor*
+GzipCompressor::create(
+    int level)
+{
+    return new ZlibCompressor(level < 0 ? DefaultLevel : level);
+}
+
+    GzipDecompressor*
+GzipDecompressor::create()
+{
+    return new ZlibDecompressor();
+}
+
@@ -0,0 +1,85 @@
+/*++
+
+Module Name:
+
+    Deflate.h
+
+Abstract:
+
+    Compressing and decompressing single gzip members, such as BGZF blocks, with zlib behind an interface that
+    another deflate library could implement.  The library only does raw deflate; the gzip header and trailer are
+    written and checked here, so the framing of BAM and gzip output doesn't depend on it.
+
+Environment:
+
+    User mode service.
+
+    Each object is used by one thread at a time.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class GzipCompressor
+{
+public:
+
+    static const int DefaultLevel = 6;
+
+    static const int MaxLevel = 9;
+
+    // name of the library doing the deflating, for messages
+    static const char* Library;
+
+    //
+    // Level 0 just stores the data, 1 is the fastest real compression and MaxLevel the best.  -1 means DefaultLevel.
+    //
+    static GzipCompressor* create(int level = -1);
+
+    virtual ~GzipCompressor() {}
+
+    //
+    // Compresses the input into a single gzip member, with the BGZF extra field (and its block size filled in) if
+    // bgzf.  Returns the size of the member, or 0 if it doesn't fit in outputSize (or, for BGZF, in a BAM block).
+    //
+    size_t compress(bool bgzf, char* output, size_t outputSize, const char* input, size_t inputSize);
+
+    int getLevel() { return level; }
+
+protected:
+
+    GzipCompressor(int i_level) : level(i_level) {}
+
+    // raw deflate stream; returns its size, or 0 if it doesn't fit
+    virtual size_t deflate(char* output, size_t outputSize, const char* input, size_t inputSize) = 0;
+
+    virtual _uint32 crc32(const char* data, size_t bytes) = 0;
+
+    const int level;
+};
+
+class GzipDecompressor
+{
+public:
+
+    static GzipDecompressor* create();
+
+    virtual ~GzipDecompressor() {}
+
+    //
+    // Decompresses a single gzip member whose size and uncompressed size are known exactly, as they are for BGZF
+    // blocks.  Returns false if it's corrupt: a bad header, a bad deflate stream, the wrong length or the wrong CRC.
+    //
+    bool decompress(const char* input, size_t inputSize, char* output, size_t outputSize);
+
+protected:
+
+    GzipDecompressor() {}
+
+    // raw deflate stream, which must decompress to exactly outputSize bytes
+    virtual bool inflate(const char* input, size_t inputSize, size_t* o_inputUsed, char* output, size_t outputSize) = 0;
+
+    virtual _uint32 crc32(const char* data, size_t bytes) = 0;
+};
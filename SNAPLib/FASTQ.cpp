@@ -97,6 +97,7 @@ FASTQReader::reinit(
     _int64 amountOfFileToProcess)
 {
     data->reinit(startingOffset, amountOfFileToProcess);
+    scanner.reset();
     char* buffer;
     _int64 bytes;
     if (! data->getData(&buffer, &bytes)) {
@@ -153,13 +154,13 @@ FASTQReader::skipPartialRecord(DataReader *data)
         }
 
         //
-        // Scan through the second line making sure it's all bases (or 'N').  We don't have to
+        // Scan through the second line making sure it's all bases (or 'N', 'n' or '.').  We don't have to
         // check for end-of-buffer because we know there's a null there.
         //
         char *thirdLineCandidate = secondLineCandidate;
         while (*thirdLineCandidate == 'A' || *thirdLineCandidate == 'C' || *thirdLineCandidate == 'T' || *thirdLineCandidate == 'G' ||
                 *thirdLineCandidate == 'N' || *thirdLineCandidate == 'a' || *thirdLineCandidate == 'c' || *thirdLineCandidate == 't' || 
-                *thirdLineCandidate == 'g') {
+                *thirdLineCandidate == 'g' || *thirdLineCandidate == 'n' || *thirdLineCandidate == '.') {
             thirdLineCandidate++;
         }
 
@@ -209,12 +210,13 @@ FASTQReader::getNextRead(Read *readToUpdate)
     _int64 validBytes;
     if (! data->getData(&buffer, &validBytes)) {
         data->nextBatch();
+        scanner.reset();
         if (! data->getData(&buffer, &validBytes)) {
             return false;
         }
     }
     
-    _int64 bytesConsumed = getReadFromBuffer(buffer, validBytes, readToUpdate, fileName, data, context);
+    _int64 bytesConsumed = getReadFromBuffer(buffer, validBytes, readToUpdate, fileName, data, context, &scanner);
     if (bytesConsumed == 0) {
         return false;
     }
@@ -226,7 +228,8 @@ FASTQReader::getNextRead(Read *readToUpdate)
 // static char LAST[100000]; static int LASTLEN = 0;
 
     _int64
-FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpdate, const char *fileName, DataReader *data, const ReaderContext &context)
+FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpdate, const char *fileName, DataReader *data, const ReaderContext &context,
+                                FASTQLineScanner *scanner)
 {
     //
     // Get the next four lines.
@@ -237,7 +240,7 @@ FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpda
 
     for (unsigned i = 0; i < nLinesPerFastqQuery; i++) {
 
-        char *newLine = strnchr(scan, '\n', validBytes - (scan - buffer));
+        char *newLine = scanner->findNewline(scan, validBytes - (scan - buffer));
         if (NULL == newLine) {
             if (validBytes - (scan - buffer) == 1 && *scan == 0x1a && data->isEOF()) {
                 // sometimes DOS files will have extra ^Z at end
@@ -272,7 +275,7 @@ FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpda
     }
 
     const char *id = lines[0] + 1; // The '@' on the first line is not part of the ID
-    const char* space = strnchr(id, ' ', lineLengths[0] - 1);
+    const char* space = (const char *)memchr(id, ' ', lineLengths[0] - 1);   // There are no NULs in the line, since findNewline() stops at them
     readToUpdate->init(id, space != NULL ? (unsigned) (space - id) : (unsigned) lineLengths[0] - 1, lines[1], lines[3], lineLengths[1]);
     readToUpdate->clip(context.clipping);
     readToUpdate->truncateJunction(context.junctionSeq);
@@ -285,6 +288,60 @@ FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpda
 
 }
 
+    void
+FASTQLineScanner::scan(char *start, char *end)
+{
+    scanStart = start;
+    nLines = nextLine = 0;
+    sawNul = false;
+    char *p = start;
+
+#if USE_SSE2
+    const __m128i newlines = _mm_set1_epi8('\n');
+    const __m128i nuls = _mm_setzero_si128();
+    while (end - p >= 16 && nLines <= maxLines - 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        unsigned newlineMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newlines));
+        unsigned nulMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nuls));
+        unsigned long bit;
+        if (0 != nulMask) {
+            _BitScanForward64(&bit, nulMask);
+            newlineMask &= (1u << bit) - 1;     // Only the ones before the NUL
+            sawNul = true;
+            scanEnd = p + bit;
+        }
+        while (0 != newlineMask) {
+            _BitScanForward64(&bit, newlineMask);
+            lineEnds[nLines++] = p + bit;
+            newlineMask &= newlineMask - 1;
+        }
+        if (sawNul) {
+            return;
+        }
+        p += 16;
+    }
+    if (end - p >= 16) {
+        //
+        // The table's full.
+        //
+        scanEnd = p;
+        return;
+    }
+#endif  // USE_SSE2
+
+    while (p < end && nLines < maxLines) {
+        if (0 == *p) {
+            sawNul = true;
+            break;
+        }
+        if ('\n' == *p) {
+            lineEnds[nLines++] = p;
+        }
+        p++;
+    }
+    scanEnd = p;
+}
+
 //
 // static data & initialization
 //
@@ -377,17 +434,18 @@ PairedInterleavedFASTQReader::getNextReadPair(Read *read0, Read *read1)
     _int64 validBytes;
     if (! data->getData(&buffer, &validBytes)) {
         data->nextBatch();
+        scanner.reset();
         if (! data->getData(&buffer, &validBytes)) {
             return false;
         }
     }
     
-    _int64 bytesConsumed = FASTQReader::getReadFromBuffer(buffer, validBytes, read0, fileName, data, context);
+    _int64 bytesConsumed = FASTQReader::getReadFromBuffer(buffer, validBytes, read0, fileName, data, context, &scanner);
     if (bytesConsumed == validBytes) {
         WriteErrorMessage("Input file seems to have an odd number of reads.  Ignoring the last one.");
         return false;
     }
-    bytesConsumed += FASTQReader::getReadFromBuffer(buffer + bytesConsumed, validBytes - bytesConsumed, read1, fileName, data, context);
+    bytesConsumed += FASTQReader::getReadFromBuffer(buffer + bytesConsumed, validBytes - bytesConsumed, read1, fileName, data, context, &scanner);
 
     //
     // Validate the Read IDs.
@@ -410,6 +468,7 @@ PairedInterleavedFASTQReader::getNextReadPair(Read *read0, Read *read1)
 PairedInterleavedFASTQReader::reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
 {
     data->reinit(startingOffset, amountOfFileToProcess);
+    scanner.reset();
     char* buffer;
     _int64 bytes;
     if (! data->getData(&buffer, &bytes)) {
@@ -421,6 +480,10 @@ PairedInterleavedFASTQReader::reinit(_int64 startingOffset, _int64 amountOfFileT
     // there can be '@' signs in the quality string (and maybe even in read names?).
     if (startingOffset != 0) {
         if (!FASTQReader::skipPartialRecord(data)) {
+            //
+            // There wasn't a whole record in our range.  Skip over what we had.
+            //
+            data->advance(bytes);
             return;
         }
     }
@@ -433,7 +496,7 @@ PairedInterleavedFASTQReader::reinit(_int64 startingOffset, _int64 amountOfFileT
     }
 
     Read read;
-    _int64 bytesForFirstRead = FASTQReader::getReadFromBuffer(buffer, bytes, &read, fileName, data, context);
+    _int64 bytesForFirstRead = FASTQReader::getReadFromBuffer(buffer, bytes, &read, fileName, data, context, &scanner);
     if (read.getIdLength() < 2 || read.getId()[read.getIdLength() - 2] != '/' || (read.getId()[read.getIdLength() - 1] != '1' && read.getId()[read.getIdLength() -1] != '2') ) {
         WriteErrorMessage("PairedInterleavedFASTQReader: read ID doesn't appear to end with /1 or /2, you can't use this as a paired FASTQ file: '%.*s'\n", read.getIdLength(), read.getId());
         soft_exit(1);
@@ -455,7 +518,7 @@ PairedInterleavedFASTQReader::reinit(_int64 startingOffset, _int64 amountOfFileT
             return;
         }
 
-        FASTQReader::getReadFromBuffer(buffer, bytes, &read, fileName, data, context);
+        FASTQReader::getReadFromBuffer(buffer, bytes, &read, fileName, data, context, &scanner);
         if (read.getIdLength() < 2 || read.getId()[read.getIdLength()-2] != '/' || read.getId()[read.getIdLength()-1] != '1') {
             WriteErrorMessage("PairedInterleavedFASTQReader: first read of pair doesn't appear to have an ID that ends in /1: '%.*s'\n", read.getIdLength(), read.getId());
             soft_exit(1);
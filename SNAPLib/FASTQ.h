@@ -34,6 +34,65 @@ Revision History:
 #include "DataReader.h"
 #include "Error.h"
 
+//
+// Finds the newlines in a FASTQ buffer a few thousand lines ahead of the parser, 16 bytes at a time, so that parsing a
+// record is just picking its four lines out of a table.  Its owner has to reset() it whenever the data in the buffer
+// can change, which is to say on reinit() and nextBatch().
+//
+class FASTQLineScanner {
+public:
+        FASTQLineScanner()
+        { reset(); }
+
+        void reset()
+        {
+            scanStart = scanEnd = NULL;
+            nLines = nextLine = 0;
+            sawNul = false;
+        }
+
+        //
+        // Same as strnchr(p, '\n', maxLen): the first newline in the maxLen bytes starting at p, or NULL if there isn't
+        // one or there's a NUL before it.
+        //
+        inline char *findNewline(char *p, size_t maxLen)
+        {
+            char *end = p + maxLen;
+            if (p < scanStart || p > scanEnd) {
+                scan(p, end);
+            }
+            for (;;) {
+                while (nextLine > 0 && lineEnds[nextLine - 1] >= p) {
+                    nextLine--;     // Someone backed up, like PairedInterleavedFASTQReader::reinit does.
+                }
+                while (nextLine < nLines && lineEnds[nextLine] < p) {
+                    nextLine++;
+                }
+                if (nextLine < nLines) {
+                    return lineEnds[nextLine] < end ? lineEnds[nextLine] : NULL;
+                }
+                if (sawNul || scanEnd >= end) {
+                    return NULL;
+                }
+                scan(p, end);
+            }
+        }
+
+private:
+
+        // Record the newlines from start up to end, a NUL or maxLines newlines, whichever comes first.
+        void scan(char *start, char *end);
+
+        static const int maxLines = 4096;
+
+        char    *scanStart;
+        char    *scanEnd;       // Everything from scanStart up to here has been scanned
+        bool    sawNul;         // There's a NUL at scanEnd
+        int     nLines;
+        int     nextLine;       // The first one that might be at or after the last place we looked
+        char    *lineEnds[maxLines];
+};
+
 class   FASTQReader : public ReadReader {
 public:
 
@@ -64,7 +123,8 @@ public:
         virtual bool releaseBatch(DataBatch batch)
         { return data->releaseBatch(batch); }
         
-        static _int64 getReadFromBuffer(char *buffer, _int64 bufferSize, Read *readToUpdate, const char *fileName, DataReader *data, const ReaderContext &context);    // Returns the number of bytes consumed.
+        static _int64 getReadFromBuffer(char *buffer, _int64 bufferSize, Read *readToUpdate, const char *fileName, DataReader *data, const ReaderContext &context,
+                                        FASTQLineScanner *scanner);    // Returns the number of bytes consumed.
 
         static bool skipPartialRecord(DataReader *data);
 
@@ -74,6 +134,7 @@ private:
 
         DataReader*         data;
         const char*         fileName;
+        FASTQLineScanner    scanner;
 
         static const unsigned maxLineLen = MAX_READ_LENGTH + 500;
         static const unsigned nLinesPerFastqQuery = 4;
@@ -128,6 +189,7 @@ private:
         DataReader*             data;
         const char*             fileName;
         ReaderContext           context;
+        FASTQLineScanner        scanner;
 };
 
 class PairedFASTQReader: public PairedReadReader {
@@ -102,6 +102,7 @@ public:
 
     static const FileFormat* SAM[2]; // 0 for =, 1 for M (useM flag)
     static const FileFormat* BAM[2];
+    static const FileFormat* RefCompressed[2]; // BAM records compressed against the reference, see RefCompressed.h
     static const FileFormat* FASTQ;
     static const FileFormat* FASTQZ;
 };
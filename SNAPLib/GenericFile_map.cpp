@@ -35,6 +35,18 @@ GenericFile_map *GenericFile_map::open(const char *filename)
 	return new GenericFile_map(mappedFile, contents, fileSize);
 }
 
+GenericFile_map *GenericFile_map::openSharedMemory(const char *segmentName)
+{
+	size_t segmentSize;
+	void *contents;
+	MemoryMappedFile *mappedFile = OpenSharedMemorySegment(segmentName, &segmentSize, &contents);
+	if (NULL == mappedFile) {
+		return NULL;
+	}
+
+	return new GenericFile_map(mappedFile, contents, segmentSize);
+}
+
 GenericFile_map::GenericFile_map(MemoryMappedFile *i_mappedFile, void *i_contents, size_t i_fileSize) : mappedFile(i_mappedFile), contents((const char *)i_contents), fileSize(i_fileSize), GenericFile_Blob(i_contents, i_fileSize)
 {
 }
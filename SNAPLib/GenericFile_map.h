@@ -30,9 +30,11 @@ class GenericFile_map : public GenericFile_Blob
 {
 public:
 	static GenericFile_map *open(const char *filename);
+	static GenericFile_map *openSharedMemory(const char *segmentName);	// Returns NULL if there's no such segment
 	virtual ~GenericFile_map();
 	virtual _int64 prefetch();	// Ignore the return value, it's just to trick the compiler into not optimizing it away.
 	virtual void close();
+	size_t getFileSize() {return fileSize;}
 
 private:
 	GenericFile_map(MemoryMappedFile *i_mappedFile, void *i_contents, size_t i_fileSize);
@@ -30,10 +30,11 @@ Revision History:
 #include "BigAlloc.h"
 #include "exit.h"
 #include "Error.h"
+#include "Tables.h"
 
 Genome::Genome(GenomeDistance i_maxBases, GenomeDistance nBasesStored, unsigned i_chromosomePadding, unsigned i_maxContigs)
 : maxBases(i_maxBases), minLocation(0), maxLocation(i_maxBases), chromosomePadding(i_chromosomePadding), maxContigs(i_maxContigs),
-  mappedFile(NULL)
+  mappedFile(NULL), packedBases(NULL), packedExceptions(NULL), nPackedExceptions(0)
 {
     bases = ((char *) BigAlloc(nBasesStored + 2 * N_PADDING)) + N_PADDING;
     if (NULL == bases) {
@@ -107,7 +108,13 @@ Genome::startContig(const char *contigName)
 
 Genome::~Genome()
 {
-    BigDealloc(bases - N_PADDING);
+    if (NULL != bases) {
+        BigDealloc(bases - N_PADDING);
+    }
+    if (NULL != packedBases && NULL == mappedFile) {
+        BigDealloc(packedBases);
+    }
+    delete [] packedExceptions;
     for (int i = 0; i < nContigs; i++) {
         delete [] contigs[i].name;
         contigs[i].name = NULL;
@@ -126,12 +133,38 @@ Genome::~Genome()
 }
 
 
+//
+// Write it out in (big) chunks.  For whatever reason, fwrite with really big sizes seems not to
+// work as well as one would like.
+//
+    static bool
+WriteInChunks(FILE *saveFile, const void *data, size_t size)
+{
+	const size_t max_chunk_size = 1 * 1024 * 1024 * 1024;	// 1 GB (or GiB for the obsessively precise)
+
+	size_t bytes_to_write = size;
+	size_t bytes_written = 0;
+	while (bytes_to_write > 0) {
+		size_t bytes_this_write = __min(bytes_to_write, max_chunk_size);
+		if (bytes_this_write != fwrite((const char *)data + bytes_written, 1, bytes_this_write, saveFile)) {
+			WriteErrorMessage("Genome::saveToFile: fwrite failed\n");
+			return false;
+		}
+		bytes_to_write -= bytes_this_write;
+		bytes_written += bytes_this_write;
+	}
+
+	_ASSERT(bytes_written == size);
+    return true;
+}
+
     bool
-Genome::saveToFile(const char *fileName) const
+Genome::saveToFile(const char *fileName, bool packed) const
 {
     //
     // Save file format is (in binary) the number of bases, the number of contigs, followed by
-    //  the contigs themselves, rounded up to 4K, followed by the bases.
+    //  the contigs themselves, rounded up to 4K, followed by the bases.  The packed format is
+    // described in Genome.h.
     //
 
     FILE *saveFile = fopen(fileName,"wb");
@@ -140,7 +173,28 @@ Genome::saveToFile(const char *fileName) const
         return false;
     } 
 
-    fprintf(saveFile,"%lld %d\n",nBases, nContigs);
+    //
+    // If we're saving packed and aren't already, pack the whole thing first, since we need the count
+    // of exceptions for the header.
+    //
+    _uint8 *basesToSave = packedBases;
+    const PackedException *exceptionsToSave = packedExceptions;
+    _int64 nExceptionsToSave = nPackedExceptions;
+    std::vector<PackedException> exceptions;
+    size_t packedSize = (nBases + 3) / 4;
+
+    if (packed && NULL == packedBases) {
+        basesToSave = (_uint8 *)BigAlloc(packedSize);
+        packBases(bases, 0, nBases, basesToSave, &exceptions);
+        exceptionsToSave = exceptions.empty() ? NULL : &exceptions[0];
+        nExceptionsToSave = exceptions.size();
+    }
+
+    if (packed) {
+        fprintf(saveFile,"P %lld %d %lld\n", nBases, nContigs, nExceptionsToSave);
+    } else {
+        fprintf(saveFile,"%lld %d\n",nBases, nContigs);
+    }
     char *curChar = NULL;
 
     for (int i = 0; i < nContigs; i++) {
@@ -151,45 +205,62 @@ Genome::saveToFile(const char *fileName) const
         fprintf(saveFile,"%lld %s\n",contigs[i].beginningLocation, contigs[i].name);
     }
 
-	//
-	// Write it out in (big) chunks.  For whatever reason, fwrite with really big sizes seems not to
-	// work as well as one would like.
-	//
-	const size_t max_chunk_size = 1 * 1024 * 1024 * 1024;	// 1 GB (or GiB for the obsessively precise)
-
-	size_t bases_to_write = nBases;
-	size_t bases_written = 0;
-	while (bases_to_write > 0) {
-		size_t bases_this_write = __min(bases_to_write, max_chunk_size);
-		if (bases_this_write != fwrite(bases + bases_written, 1, bases_this_write, saveFile)) {
-			WriteErrorMessage("Genome::saveToFile: fwrite failed\n");
-			fclose(saveFile);
-			return false;
-		}
-		bases_to_write -= bases_this_write;
-		bases_written += bases_this_write;
-	}
+    bool worked;
+    if (packed) {
+        for (_int64 i = 0; i < nExceptionsToSave; i++) {
+            fprintf(saveFile, "%lld %lld %c\n", GenomeLocationAsInt64(exceptionsToSave[i].start), exceptionsToSave[i].length, exceptionsToSave[i].base);
+        }
 
-	_ASSERT(bases_written == nBases);
+        worked = WriteInChunks(saveFile, basesToSave, packedSize);
+        if (basesToSave != packedBases) {
+            BigDealloc(basesToSave);
+        }
+    } else if (NULL != bases) {
+        worked = WriteInChunks(saveFile, bases, nBases);
+    } else {
+        //
+        // Unpacking a packed genome.  Do it a piece at a time so we don't need the memory for the whole thing.
+        //
+        const GenomeDistance decodeChunkSize = 16 * 1024 * 1024;
+        char *decodeBuffer = (char *)BigAlloc(decodeChunkSize);
+        worked = true;
+        for (GenomeDistance offset = 0; worked && offset < nBases; offset += decodeChunkSize) {
+            GenomeDistance basesThisChunk = __min(decodeChunkSize, nBases - offset);
+            decodePackedBases(offset, basesThisChunk, decodeBuffer);
+            worked = WriteInChunks(saveFile, decodeBuffer, basesThisChunk);
+        }
+        BigDealloc(decodeBuffer);
+    }
 
     fclose(saveFile);
-    return true;
+    return worked;
 }
 
     const Genome *
-Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation minLocation, GenomeDistance length, bool map)
+Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation minLocation, GenomeDistance length, bool map, bool keepPacked,
+    const char *sharedMemorySegmentName)
 {    
     GenericFile *loadFile;
     GenomeDistance nBases;
     unsigned nContigs;
+    bool packedFile;
+    _int64 nExceptions;
+
+    if (NULL != sharedMemorySegmentName) {
+        map = true;     // A shared memory segment is always mapped
+    }
 
-    if (!openFileAndGetSizes(fileName, &loadFile, &nBases, &nContigs, map)) {
+    if (!openFileAndGetSizes(fileName, &loadFile, &nBases, &nContigs, map, &packedFile, &nExceptions, sharedMemorySegmentName)) {
         //
         // It already printed an error.  Just fail.
         //
         return NULL;
     }
 
+    if (0 != minLocation || 0 != length) {
+        keepPacked = false; // Packed genomes are always whole.
+    }
+
     GenomeLocation maxLocation(nBases);
 
     if (0 == length) {
@@ -202,7 +273,7 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLoc
         maxLocation = minLocation + length;
     }
 
-    Genome *genome = new Genome(nBases, length, chromosomePadding);
+    Genome *genome = new Genome(nBases, keepPacked ? 0 : length, chromosomePadding);
    
     genome->nBases = nBases;
     genome->nContigs = genome->maxContigs = nContigs;
@@ -253,12 +324,30 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLoc
         curName[contigSize] = '\0';
     }
 
+    size_t readSize;
+    if (packedFile || keepPacked) {
+        if (!genome->loadPackedBases(loadFile, fileName, packedFile, nExceptions, minLocation, length, map && packedFile && keepPacked, keepPacked)) {
+            if (genome->mappedFile != loadFile) {
+                loadFile->close();
+                delete loadFile;
+            }
+            delete genome;
+            return NULL;
+        }
+        if (!genome->isPacked() || NULL == genome->mappedFile) {
+            loadFile->close();
+            delete loadFile;
+        }
+        genome->fillInContigLengths();
+        genome->sortContigsByName();
+        return genome;
+    }
+
     if (0 != loadFile->advance(GenomeLocationAsInt64(minLocation))) {
         WriteErrorMessage("Genome::loadFromFile: _fseek64bit failed\n");
         soft_exit(1);
     }
 
-    size_t readSize;
 	if (map) {
 		GenericFile_map *mappedFile = (GenericFile_map *)loadFile;
 		genome->bases = (char *)mappedFile->mapAndAdvance(length, &readSize);
@@ -304,9 +393,245 @@ Genome::sortContigsByName()
 }
 
     bool
-Genome::openFileAndGetSizes(const char *filename, GenericFile **file, GenomeDistance *nBases, unsigned *nContigs, bool map)
+Genome::loadPackedBases(GenericFile *loadFile, const char *fileName, bool packedFile, _int64 nExceptions, GenomeLocation minLocation, GenomeDistance length, bool map, bool keepPacked)
+/*++
+
+Routine Description:
+
+    Read the bases of a genome where either the file or the in-memory representation (or both) are packed.  The file must be
+    positioned just after the contig descriptions.
+
+--*/
 {
-	if (map) {
+    size_t packedSize = (nBases + 3) / 4;
+    size_t readSize;
+
+    if (!packedFile) {
+        //
+        // Pack an unpacked genome a chunk at a time as we read it, so we never need the memory for the whole unpacked genome.
+        //
+        _ASSERT(keepPacked);
+        std::vector<PackedException> exceptions;
+        const GenomeDistance readChunkSize = 16 * 1024 * 1024;  // Must be a multiple of 4 so that chunks start on a byte boundary
+        char *readBuffer = (char *)BigAlloc(readChunkSize);
+
+        packedBases = (_uint8 *)BigAlloc(packedSize);
+        for (GenomeDistance offset = 0; offset < nBases; offset += readChunkSize) {
+            GenomeDistance basesThisChunk = __min(readChunkSize, nBases - offset);
+            readSize = loadFile->read(readBuffer, basesThisChunk);
+            if (readSize != (size_t)basesThisChunk) {
+                WriteErrorMessage("Genome::loadFromFile: read of bases from '%s' failed; wanted %lld, got %lld\n", fileName, basesThisChunk, (_int64)readSize);
+                BigDealloc(readBuffer);
+                return false;
+            }
+            packBases(readBuffer, offset, basesThisChunk, packedBases, &exceptions);
+        }
+        BigDealloc(readBuffer);
+
+        nPackedExceptions = exceptions.size();
+        packedExceptions = new PackedException[nPackedExceptions];
+        for (_int64 i = 0; i < nPackedExceptions; i++) {
+            packedExceptions[i] = exceptions[i];
+        }
+    } else {
+        nPackedExceptions = nExceptions;
+        packedExceptions = new PackedException[nPackedExceptions];
+
+        char exceptionBuffer[200];
+        for (_int64 i = 0; i < nPackedExceptions; i++) {
+            _int64 exceptionStart;
+            if (NULL == loadFile->gets(exceptionBuffer, sizeof(exceptionBuffer)) ||
+                3 != sscanf(exceptionBuffer, "%lld %lld %c", &exceptionStart, &packedExceptions[i].length, &packedExceptions[i].base)) {
+                WriteErrorMessage("Genome::loadFromFile: unable to parse packed base exception %lld in genome file '%s'\n", i, fileName);
+                return false;
+            }
+            packedExceptions[i].start = exceptionStart;
+        }
+
+        if (map) {
+            GenericFile_map *mappedGenomeFile = (GenericFile_map *)loadFile;
+            packedBases = (_uint8 *)mappedGenomeFile->mapAndAdvance(packedSize, &readSize);
+            mappedFile = mappedGenomeFile;
+            mappedGenomeFile->prefetch();
+        } else {
+            packedBases = (_uint8 *)BigAlloc(packedSize);
+            readSize = loadFile->read(packedBases, packedSize);
+        }
+
+        if (readSize != packedSize) {
+            WriteErrorMessage("Genome::loadFromFile: read of packed bases from '%s' failed; wanted %lld, got %lld\n", fileName, (_int64)packedSize, (_int64)readSize);
+            return false;
+        }
+
+        if (!keepPacked) {
+            //
+            // Unpack the part that the caller asked for and throw away the packed version.
+            //
+            decodePackedBases(minLocation, length, bases);
+            BigDealloc(packedBases);
+            packedBases = NULL;
+            delete [] packedExceptions;
+            packedExceptions = NULL;
+            nPackedExceptions = 0;
+        }
+    }
+
+    if (keepPacked) {
+        BigDealloc(bases - N_PADDING);
+        bases = NULL;
+    }
+
+    return true;
+}
+
+    void
+Genome::packBases(const char *basesToPack, GenomeLocation start, GenomeDistance length, _uint8 *packed, std::vector<PackedException> *exceptions)
+{
+    _int64 startOffset = GenomeLocationAsInt64(start);
+    _ASSERT(startOffset % 4 == 0);
+
+    memset(packed + startOffset / 4, 0, (length + 3) / 4);
+    for (GenomeDistance i = 0; i < length; i++) {
+        char base = basesToPack[i];
+        _int64 location = startOffset + i;
+
+        if (BASE_VALUE[(unsigned char)base] > 3) {
+            //
+            // Not ACGT.  Extend the previous run if we can, otherwise start a new one.  It gets packed as 'A' (0), which is already there.
+            //
+            if (!exceptions->empty() && GenomeLocationAsInt64(exceptions->back().start) + exceptions->back().length == location && exceptions->back().base == base) {
+                exceptions->back().length++;
+            } else {
+                PackedException exception;
+                exception.start = location;
+                exception.length = 1;
+                exception.base = base;
+                exceptions->push_back(exception);
+            }
+            continue;
+        }
+
+        packed[location / 4] |= BASE_VALUE_NO_N[(unsigned char)base] << (2 * (location % 4));
+    }
+}
+
+    _int64
+Genome::findFirstPackedExceptionEndingAfter(GenomeLocation location) const
+{
+    //
+    // Binary search for the first exception run that ends after location.  The runs don't overlap, so they're sorted by end as well as start.
+    //
+    _int64 low = 0;
+    _int64 high = nPackedExceptions;
+    while (low < high) {
+        _int64 mid = (low + high) / 2;
+        if (packedExceptions[mid].start + packedExceptions[mid].length <= location) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+    char
+Genome::getPackedBase(GenomeLocation location) const
+{
+    _int64 offset = GenomeLocationAsInt64(location);
+    if (offset < 0 || offset >= nBases) {
+        return 'n';
+    }
+
+    _int64 whichException = findFirstPackedExceptionEndingAfter(location);
+    if (whichException < nPackedExceptions && packedExceptions[whichException].start <= location) {
+        return packedExceptions[whichException].base;
+    }
+
+    return VALUE_BASE[(packedBases[offset / 4] >> (2 * (offset % 4))) & 3];
+}
+
+    void
+Genome::decodePackedBases(GenomeLocation start, GenomeDistance length, char *decodeBuffer) const
+{
+    _int64 offset = GenomeLocationAsInt64(start);
+    _int64 end = offset + length;
+    _int64 basesEnd = __min(end, nBases);
+    char *nextBase = decodeBuffer;
+
+    //
+    // Anything before or after the genome is padding.
+    //
+    while (offset < end && offset < 0) {
+        *nextBase = 'n';
+        nextBase++;
+        offset++;
+    }
+
+    while (offset < basesEnd && offset % 4 != 0) {
+        *nextBase = VALUE_BASE[(packedBases[offset / 4] >> (2 * (offset % 4))) & 3];
+        nextBase++;
+        offset++;
+    }
+
+    while (offset + 4 <= basesEnd) {
+        memcpy(nextBase, PACKED_GENOME_BYTE_BASES + 4 * packedBases[offset / 4], 4);
+        nextBase += 4;
+        offset += 4;
+    }
+
+    while (offset < basesEnd) {
+        *nextBase = VALUE_BASE[(packedBases[offset / 4] >> (2 * (offset % 4))) & 3];
+        nextBase++;
+        offset++;
+    }
+
+    if (offset < end) {
+        memset(nextBase, 'n', end - offset);
+    }
+
+    //
+    // Now fill in the Ns (and anything else that's not ACGT) over what we decoded.
+    //
+    for (_int64 i = findFirstPackedExceptionEndingAfter(start); i < nPackedExceptions && packedExceptions[i].start < GenomeLocation(end); i++) {
+        _int64 runStart = __max(GenomeLocationAsInt64(packedExceptions[i].start), GenomeLocationAsInt64(start));
+        _int64 runEnd = __min(GenomeLocationAsInt64(packedExceptions[i].start) + packedExceptions[i].length, end);
+        memset(decodeBuffer + (runStart - GenomeLocationAsInt64(start)), packedExceptions[i].base, runEnd - runStart);
+    }
+}
+
+    const char *
+Genome::getPackedSubstring(GenomeLocation location, GenomeDistance lengthNeeded, char *decodeBuffer, GenomeDistance basesBefore, GenomeDistance basesAfter) const
+{
+    //
+    // This follows the same rules about what's legal as the unpacked getSubstring in Genome.h.
+    //
+    if (location > nBases || location + lengthNeeded > nBases + N_PADDING) {
+        return NULL;
+    }
+
+    if (lengthNeeded != 0 && (lengthNeeded > chromosomePadding || getPackedBase(location) == 'n')) {
+        const Contig *contig = getContigAtLocation(location);
+        if (NULL == contig) {
+            return NULL;
+        }
+
+        _ASSERT(contig->beginningLocation <= location && contig->beginningLocation + contig->length >= location);
+        if (contig->beginningLocation + contig->length <= location + lengthNeeded) {
+            return NULL;
+        }
+    }
+
+    decodePackedBases(location - basesBefore, basesBefore + lengthNeeded + basesAfter, decodeBuffer);
+    return decodeBuffer + basesBefore;
+}
+
+    bool
+Genome::openFileAndGetSizes(const char *filename, GenericFile **file, GenomeDistance *nBases, unsigned *nContigs, bool map, bool *packed, _int64 *nPackedExceptions,
+    const char *sharedMemorySegmentName)
+{
+    if (NULL != sharedMemorySegmentName) {
+        *file = GenericFile_map::openSharedMemory(sharedMemorySegmentName);
+    } else if (map) {
 		*file = GenericFile_map::open(filename);
 	} else {
 		*file = GenericFile::open(filename, GenericFile::ReadOnly);
@@ -320,13 +645,24 @@ Genome::openFileAndGetSizes(const char *filename, GenericFile **file, GenomeDist
     char linebuf[2000];
     char *retval = (*file)->gets(linebuf, sizeof(linebuf));
 
-    if (NULL == retval || 2 != sscanf(linebuf,"%lld %d\n", nBases, nContigs)) {
+    bool isPacked = NULL != retval && 'P' == linebuf[0];
+    _int64 nExceptions = 0;
+
+    if (NULL != packed) {
+        *packed = isPacked;
+    }
+
+    if (NULL == retval || (isPacked ? 3 != sscanf(linebuf, "P %lld %d %lld\n", nBases, nContigs, &nExceptions) : 2 != sscanf(linebuf,"%lld %d\n", nBases, nContigs))) {
         (*file)->close();
         delete *file;
         *file = NULL;
         WriteErrorMessage("Genome::openFileAndGetSizes: unable to read header\n");
         return false;
     }
+
+    if (NULL != nPackedExceptions) {
+        *nPackedExceptions = nExceptions;
+    }
     return true;
 }
 
@@ -26,6 +26,7 @@ Revision History:
 #include "Compat.h"
 #include "GenericFile.h"
 #include "GenericFile_map.h"
+#include <vector>
 
 //
 // We have two different classes to represent a place in a genome and a distance between places in a genome.
@@ -193,19 +194,29 @@ public:
         //
         // minOffset and length are used to read in only a part of a whole genome.
         //
-        static const Genome *loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation i_minLocation = 0, GenomeDistance length = 0, bool map = false);
+        // A genome can be saved either one base per byte or 2-bit packed (see the comment on packedBases below).
+        // loadFromFile understands both formats.  If keepPacked is set, the genome stays packed in memory, which
+        // uses a quarter of the space but means that the bases have to be read with the decoding version of
+        // getSubstring.  keepPacked only applies to whole-genome loads; it's ignored if minLocation or length are set.
+        //
+        // If sharedMemorySegmentName is set, the genome is mapped from that shared memory segment (which holds a copy of the file)
+        // rather than from the file itself.
+        //
+        static const Genome *loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation i_minLocation = 0, GenomeDistance length = 0, bool map = false,
+                                          bool keepPacked = false, const char *sharedMemorySegmentName = NULL);
                                                                   // This loads from a genome save
                                                                   // file, not a FASTA file.  Use
                                                                   // FASTA.h for FASTA loads.
 
         static bool getSizeFromFile(const char *fileName, GenomeDistance *nBases, unsigned *nContigs);
 
-        bool saveToFile(const char *fileName) const;
+        bool saveToFile(const char *fileName, bool packed = false) const;
 
         //
         // Methods to read the genome.
         //
 		inline const char *getSubstring(GenomeLocation location, GenomeDistance lengthNeeded) const {
+            _ASSERT(NULL != bases); // Genomes that are kept packed must use the decoding version below.
 			if (location > nBases || location + lengthNeeded > nBases + N_PADDING) {
 				// The first part of the test is for the unsigned version of a negative offset.
 				return NULL;
@@ -235,11 +246,36 @@ public:
 			return bases + (location - minLocation);
 		}
 
+        //
+        // The decoding version of getSubstring.  It's valid for both packed and unpacked genomes, and returns NULL in exactly
+        // the cases that the plain version does.  For unpacked genomes it just returns a pointer into the genome and ignores
+        // the buffer.  For packed genomes, it decodes basesBefore + lengthNeeded + basesAfter bases starting at
+        // location - basesBefore into decodeBuffer and returns a pointer to location within it, so the caller may look backward
+        // basesBefore and forward lengthNeeded + basesAfter just as it could with an unpacked genome.  The result is only valid
+        // until the next time the caller uses decodeBuffer.
+        //
+        inline const char *getSubstring(GenomeLocation location, GenomeDistance lengthNeeded, char *decodeBuffer, GenomeDistance basesBefore, GenomeDistance basesAfter = 0) const {
+            if (NULL == packedBases) {
+                return getSubstring(location, lengthNeeded);
+            }
+            return getPackedSubstring(location, lengthNeeded, decodeBuffer, basesBefore, basesAfter);
+        }
+
+        inline bool isPacked() const {return NULL != packedBases;}
+
         inline GenomeDistance getCountOfBases() const {return nBases;}
 
         bool getLocationOfContig(const char *contigName, GenomeLocation *location, int* index = NULL) const;
 
         inline void prefetchData(GenomeLocation genomeLocation) const {
+            if (NULL != packedBases) {
+                //
+                // A cache line holds 256 packed bases, so one prefetch covers the read unless it straddles a line.
+                //
+                _mm_prefetch((const char *)packedBases + GenomeLocationAsInt64(genomeLocation) / 4, _MM_HINT_T2);
+                _mm_prefetch((const char *)packedBases + GenomeLocationAsInt64(genomeLocation) / 4 + 64, _MM_HINT_T2);
+                return;
+            }
             _mm_prefetch(bases + GenomeLocationAsInt64(genomeLocation), _MM_HINT_T2);
             _mm_prefetch(bases + GenomeLocationAsInt64(genomeLocation) + 64, _MM_HINT_T2);
         }
@@ -294,11 +330,41 @@ private:
         Contig      *contigsByName;
         Genome *copy(bool copyX, bool copyY, bool copyM) const;
 
-        static bool openFileAndGetSizes(const char *filename, GenericFile **file, GenomeDistance *nBases, unsigned *nContigs, bool map);
+        static bool openFileAndGetSizes(const char *filename, GenericFile **file, GenomeDistance *nBases, unsigned *nContigs, bool map,
+                                        bool *packed = NULL, _int64 *nPackedExceptions = NULL, const char *sharedMemorySegmentName = NULL);
 
         const unsigned chromosomePadding;
 
 		GenericFile_map *mappedFile;
+
+        //
+        // The 2-bit packed representation.  When a genome is kept packed in memory, bases is NULL and packedBases holds
+        // four bases per byte, low order bits first, using the BASE_VALUE_NO_N encoding.  Anything that isn't ACGT
+        // (the n padding between contigs and the N runs within them) is stored as 'A' in packedBases and recorded as a run in
+        // packedExceptions, which is sorted by location and has no overlapping runs.  There are few enough of these (a few
+        // thousand for a human reference) that a binary search through them is cheap compared to the decode.
+        //
+        // The packed save file format is a header line of the form "P nBases nContigs nPackedExceptions", followed by
+        // the contig lines just as in the unpacked format, followed by one line per exception run ("start length base"),
+        // followed by the packed bases themselves.  The leading P makes older versions fail cleanly on the header.
+        //
+        struct PackedException {
+            GenomeLocation  start;
+            GenomeDistance  length;
+            char            base;
+        };
+
+        _uint8              *packedBases;
+        PackedException     *packedExceptions;
+        _int64               nPackedExceptions;
+
+        bool loadPackedBases(GenericFile *loadFile, const char *fileName, bool packedFile, _int64 nExceptions, GenomeLocation minLocation, GenomeDistance length, bool map, bool keepPacked);
+        const char *getPackedSubstring(GenomeLocation location, GenomeDistance lengthNeeded, char *decodeBuffer, GenomeDistance basesBefore, GenomeDistance basesAfter) const;
+        char getPackedBase(GenomeLocation location) const;
+        void decodePackedBases(GenomeLocation start, GenomeDistance length, char *decodeBuffer) const;
+        _int64 findFirstPackedExceptionEndingAfter(GenomeLocation location) const;
+
+        static void packBases(const char *bases, GenomeLocation start, GenomeDistance length, _uint8 *packedBases, std::vector<PackedException> *exceptions);
 };
 
 GenomeDistance DistanceBetweenGenomeLocations(GenomeLocation locationA, GenomeLocation locationB);
@@ -23,6 +23,7 @@ Revision History:
 --*/
 
 #include "stdafx.h"
+#include <functional>
 #include "ApproximateCounter.h"
 #include "BigAlloc.h"
 #include "Compat.h"
@@ -31,6 +32,7 @@ Revision History:
 #include "FixedSizeVector.h"
 #include "GenericFile.h"
 #include "GenericFile_stdio.h"
+#include "GenericFile_map.h"
 #include "Genome.h"
 #include "GenomeIndex.h"
 #include "HashTable.h"
@@ -38,6 +40,7 @@ Revision History:
 #include "exit.h"
 #include "Error.h"
 #include "directions.h"
+#include "HitListSearch.h"
 
 using namespace std;
 
@@ -81,6 +84,19 @@ static void usage()
 		"                   In particular, this will generally use less memory than the index will use once it's built, so if this doesn't work you\n"
 		"                   won't be able to use the index anyway. However, if you've got sufficient memory to begin with, this option will just\n"
 		"                   slow down the index build by doing extra, useless IO.\n"
+		" -packGenome       Save the reference genome with two bits per base rather than one byte.  This makes the Genome file (and its load\n"
+		"                   time) about four times smaller, and is required to get the full benefit of -pg when aligning.  Indices built with\n"
+		"                   this option can't be used by older versions of SNAP.\n"
+		" -cacheLineBuckets Lay out the hash tables as cache line sized buckets of several entries, so that looking up a seed usually\n"
+		"                   touches only one cache line.  This makes aligning faster but the hash tables bigger (how much bigger depends\n"
+		"                   on -keysize, -locationSize and -large).  Indices built with this option can't be used by older versions of SNAP.\n"
+		" -memoryBudget GB  Build the index out of core, using about this many gigabytes of memory (plus the genome itself) and sorted\n"
+		"                   temporary files in the output directory for the rest.  This is for references too big to index in the\n"
+		"                   memory you have.  It's slower than the normal build, but produces exactly the same index.\n"
+		" -searchHits N     Also lay out each seed's list of hits for fast searching if it has at least N hits (64 is a good\n"
+		"                   place to start).  This makes the paired-end aligner quicker on repetitive seeds, more so the larger\n"
+		"                   its -h, at a cost of up to an eighth of the size of the overflow table (a quarter with locations over\n"
+		"                   4 bytes).  The layouts go in a separate file, so older versions of SNAP can still use the index.\n"
 			,
             DEFAULT_SEED_SIZE,
             DEFAULT_SLACK,
@@ -117,6 +133,10 @@ GenomeIndex::runIndexer(
 	bool large = false;
     unsigned locationSize = DEFAULT_LOCATION_SIZE;
 	bool smallMemory = false;
+    bool packGenome = false;
+    bool cacheLineBuckets = false;
+    size_t memoryBudget = 0;
+    _int64 searchHits = 0;
 
     for (int n = 2; n < argc; n++) {
         if (strcmp(argv[n], "-s") == 0) {
@@ -150,6 +170,33 @@ GenomeIndex::runIndexer(
             }
         } else if (strcmp(argv[n], "-large") == 0) {
             large = true;
+        } else if (strcmp(argv[n], "-packGenome") == 0) {   // This has to come before the -p<padding> check
+            packGenome = true;
+        } else if (strcmp(argv[n], "-cacheLineBuckets") == 0) {
+            cacheLineBuckets = true;
+        } else if (strcmp(argv[n], "-memoryBudget") == 0) {
+            if (n + 1 < argc) {
+                double gigabytes = atof(argv[n+1]);
+                if (gigabytes <= 0) {
+                    WriteErrorMessage("The memory budget must be a positive number of gigabytes\n");
+                    soft_exit(1);
+                }
+                memoryBudget = (size_t)(gigabytes * 1024 * 1024 * 1024);
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-searchHits") == 0) {
+            if (n + 1 < argc) {
+                searchHits = atoll(argv[n+1]);
+                if (searchHits < 2) {
+                    WriteErrorMessage("-searchHits must be at least 2\n");
+                    soft_exit(1);
+                }
+                n++;
+            } else {
+                usage();
+            }
         } else if (argv[n][0] == '-' && argv[n][1] == 'H') {
             histogramFileName = argv[n] + 2;
         } else if (argv[n][0] == '-' && argv[n][1] == 'O') {
@@ -229,12 +276,26 @@ GenomeIndex::runIndexer(
     GenomeDistance nBases = genome->getCountOfBases();
 
     if (!GenomeIndex::BuildIndexToDirectory(genome, seedLen, slack, computeBias, outputDir, maxThreads, chromosomePadding, forceExact, keySizeInBytes, 
-		large, histogramFileName, locationSize, smallMemory)) {
+		large, histogramFileName, locationSize, smallMemory, packGenome, cacheLineBuckets, memoryBudget)) {
         WriteErrorMessage("Genome index build failed\n");
         soft_exit(1);
     }
     genome = NULL;  // It's deleted by BuildIndexToDirectory.
 
+    if (searchHits > 0) {
+        if (!GenomeIndex::WriteHitListSearchFile(outputDir, locationSize, searchHits)) {
+            WriteErrorMessage("Failed to write the hit list search layouts\n");
+            soft_exit(1);
+        }
+    } else {
+        //
+        // Don't leave behind layouts from an earlier index in this directory.
+        //
+        char filenameBuffer[MAX_PATH+1];
+        snprintf(filenameBuffer, sizeof(filenameBuffer), "%s%cHitListSearch", outputDir, PATH_SEP);
+        remove(filenameBuffer);
+    }
+
     _int64 end = timeInMillis();
     WriteStatusMessage("Index build and save took %llds (%lld bases/s)\n",
            (end - start) / 1000, nBases / max((end - start) / 1000, (_int64) 1)); 
@@ -257,7 +318,8 @@ SetInvalidGenomeLocation(unsigned locationSize)
     bool
 GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double slack, bool computeBias, const char *directoryName,
                                     unsigned maxThreads, unsigned chromosomePaddingSize, bool forceExact, unsigned hashTableKeySize, 
-									bool large, const char *histogramFileName, unsigned locationSize, bool smallMemory)
+									bool large, const char *histogramFileName, unsigned locationSize, bool smallMemory, bool packGenome, bool cacheLineBuckets,
+                                    size_t memoryBudget)
 {
 	PreventMachineHibernationWhileThisThreadIsAlive();
 
@@ -284,11 +346,12 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 	fprintf(stderr,"Saving genome...");
 	_int64 start = timeInMillis();
     snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
-    if (!genome->saveToFile(filenameBuffer)) {
+    if (!genome->saveToFile(filenameBuffer, packGenome)) {
         WriteErrorMessage("GenomeIndex::saveToDirectory: Failed to save the genome itself\n");
         return false;
     }
-	fprintf(stderr,"%llds\n", (timeInMillis() + 500 - start) / 1000);
+    _int64 genomeSaveTime = timeInMillis() - start;
+	fprintf(stderr,"%llds\n", (genomeSaveTime + 500) / 1000);
 
 	GenomeIndex *index = new GenomeIndex();
     index->genome = NULL;   // We always delete the index when we're done, but we delete the genome first to save space during the overflow table build.
@@ -314,17 +377,54 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         }
     }
     
+    _int64 biasTableTime = 0;
     if (computeBias) {
+        start = timeInMillis();
         unsigned nHashTables = 1 << ((max((unsigned)seedLen, hashTableKeySize * 4) - hashTableKeySize * 4) * 2);
         biasTable = new double[nHashTables];
         ComputeBiasTable(genome, seedLen, biasTable, maxThreads, forceExact, hashTableKeySize, large);
+        biasTableTime = timeInMillis() - start;
+    }
+
+    if (0 != memoryBudget) {
+        delete index;
+        index = NULL;
+
+        start = timeInMillis();
+        SeedHistogram *histogram = buildHistogram ? new SeedHistogram : NULL;
+        unsigned nHashTables;
+        _int64 overflowTableSize;
+        size_t totalBytesWritten;
+
+        bool worked = BuildTablesOutOfCore(genome, seedLen, slack, directoryName, hashTableKeySize, large, locationSize, cacheLineBuckets, biasTable, 
+                        memoryBudget, histogram, &nHashTables, &overflowTableSize, &totalBytesWritten);
+        genome = NULL;  // BuildTablesOutOfCore deleted it
+        if (computeBias) {
+            delete[] biasTable;
+        }
+
+        if (buildHistogram) {
+            histogram->write(histogramFile);
+            fclose(histogramFile);
+            delete histogram;
+        }
+
+        if (!worked) {
+            return false;
+        }
+
+        WriteStatusMessage("Index build phase times: genome save %.1fs, bias table %.1fs, out of core table build %.1fs\n",
+            genomeSaveTime / 1000.0, biasTableTime / 1000.0, (timeInMillis() - start) / 1000.0);
+
+        return WriteIndexHeaderFile(directoryName, cacheLineBuckets, nHashTables, overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize, 
+                    totalBytesWritten, large, locationSize);
     }
 
     WriteStatusMessage("Allocating memory for hash tables...");
     start = timeInMillis();
     unsigned nHashTables;
     SNAPHashTable** hashTables = index->hashTables =
-        allocateHashTables(&nHashTables, countOfBases, slack, seedLen, hashTableKeySize, large, locationSize, biasTable);
+        allocateHashTables(&nHashTables, countOfBases, slack, seedLen, hashTableKeySize, large, locationSize, cacheLineBuckets, biasTable);
     index->nHashTables = nHashTables;
 
     //
@@ -336,35 +436,34 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     // AGCT), in which case only the first integer is used.
     //
 
-	OverflowBackpointerAnchor *overflowAnchor = new OverflowBackpointerAnchor(__min(((locationSize == 8) ? (_int64)0x8effffffffffffff : GenomeLocationAsInt64(InvalidGenomeLocation)) - countOfBases, countOfBases));   // i.e., as much as the address space will allow.
+    unsigned nThreads = __min(GetNumberOfProcessors(), maxThreads);
+
+	OverflowBackpointerAnchor *overflowAnchor = new OverflowBackpointerAnchor(__min(((locationSize == 8) ? (_int64)0x8effffffffffffff : GenomeLocationAsInt64(InvalidGenomeLocation)) - countOfBases, 
+        countOfBases + (_int64)nThreads * BuildHashTablesThreadContext::backpointerBlockSize));   // i.e., as much as the address space will allow, with room for each thread's partly used backpointer block.
    
-    WriteStatusMessage("%llds\nBuilding hash tables.\n", (timeInMillis() + 500 - start) / 1000);
+    _int64 allocationTime = timeInMillis() - start;
+    WriteStatusMessage("%llds\nBuilding hash tables.\n", (allocationTime + 500) / 1000);
   
     start = timeInMillis();
     volatile _int64 nextOverflowBackpointer = 0;
-
-    volatile _int64 nonSeeds = 0;
-    volatile _int64 seedsWithMultipleOccurrences = 0;
-    volatile _int64 genomeLocationsInOverflowTable = 0;     // Number of extra hits on duplicate indices.  This should come out once we implement the overflow table.
-    volatile _int64 bothComplementsUsed = 0;    // Number of hash buckets where both complements are used
-    volatile _int64 noBaseAvailable = 0;        // Number of places where getSubstring returned null.
-    volatile _int64 nBasesProcessed = 0;
     volatile int runningThreadCount;
+    volatile int nextHashTableGroup;
 
     SingleWaiterObject doneObject;
     CreateSingleWaiterObject(&doneObject);
 
-    unsigned nThreads = __min(GetNumberOfProcessors(), maxThreads);
     BuildHashTablesThreadContext *threadContexts = new BuildHashTablesThreadContext[nThreads];
 
-    ExclusiveLock *hashTableLocks = new ExclusiveLock[nHashTables];
+    //
+    // Hand the hash tables out in more groups than there are threads, because they're not all the same size.
+    //
+    unsigned hashTablesPerGroup = __max(1u, nHashTables / (nThreads * 16));
+
+    _int64 *overflowEntriesForHashTable = new _int64[nHashTables];
     for (unsigned i = 0; i < nHashTables; i++) {
-        InitializeExclusiveLock(&hashTableLocks[i]);
+        overflowEntriesForHashTable[i] = 0;
     }
 
-    runningThreadCount = nThreads;
-
-    GenomeDistance nextChunkToProcess = 0;
 	_int64 * lastBackpointerIndexUsedByThread = NULL;
 	ExclusiveLock backpointerSpillLock;
 	FILE *backpointerSpillFile = NULL;
@@ -374,7 +473,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 	if (smallMemory) {
 		lastBackpointerIndexUsedByThread = new _int64[nThreads];
 		for (unsigned i = 0; i < nThreads; i++) {
-			lastBackpointerIndexUsedByThread[i] = 0;
+			lastBackpointerIndexUsedByThread[i] = INT64_MAX;   // A thread that doesn't have a block yet will get one past anything that's been handed out so far
 		}
 #define	BACKPOINTER_TABLE_SPILL_FILE_NAME	"BackpointerTableSpillFile"
 		backpointerSpillFileName = new char[strlen(directoryName) + 1 + strlen(BACKPOINTER_TABLE_SPILL_FILE_NAME) + 1];
@@ -386,45 +485,90 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 		}
 	}
 
+    GenomeDistance basesToIndex = countOfBases - seedLen - 1;
+    GenomeDistance maxSliceSize = __min(basesToIndex, hashTableBuildWindowSize) / nThreads + nThreads;
+
     for (unsigned i = 0; i < nThreads; i++) {
 		threadContexts[i].whichThread = i;
 		threadContexts[i].nThreads = nThreads;
         threadContexts[i].doneObject = &doneObject;
         threadContexts[i].genome = genome;
-        threadContexts[i].genomeChunkStart = nextChunkToProcess;
-        if (i == nThreads - 1) {
-            nextChunkToProcess = countOfBases - seedLen - 1;
-        } else {
-            nextChunkToProcess += (countOfBases - seedLen) / nThreads;
-        }
-        threadContexts[i].genomeChunkEnd = nextChunkToProcess;
-        threadContexts[i].nBasesProcessed = &nBasesProcessed;
         threadContexts[i].index = index;
         threadContexts[i].runningThreadCount = &runningThreadCount;
         threadContexts[i].seedLen = seedLen;
-        threadContexts[i].noBaseAvailable = &noBaseAvailable;
-        threadContexts[i].nonSeeds = &nonSeeds;
-        threadContexts[i].seedsWithMultipleOccurrences = &seedsWithMultipleOccurrences;
-        threadContexts[i].genomeLocationsInOverflowTable = &genomeLocationsInOverflowTable;
-        threadContexts[i].bothComplementsUsed = &bothComplementsUsed;
 		threadContexts[i].overflowAnchor = overflowAnchor;
         threadContexts[i].nextOverflowBackpointer = &nextOverflowBackpointer;
-        threadContexts[i].hashTableLocks = hashTableLocks;
         threadContexts[i].hashTableKeySize = hashTableKeySize;
 		threadContexts[i].large = large;
         threadContexts[i].locationSize = locationSize;
+        threadContexts[i].entries = (IndexBuildEntry *)BigAlloc(maxSliceSize * sizeof(IndexBuildEntry));
+        threadContexts[i].unsortedEntries = (IndexBuildEntry *)BigAlloc(maxSliceSize * sizeof(IndexBuildEntry));
+        threadContexts[i].hashTableForEntry = (unsigned *)BigAlloc(maxSliceSize * sizeof(unsigned));
+        threadContexts[i].firstEntryForHashTable = new unsigned[nHashTables + 1];
+        threadContexts[i].nextEntryForHashTable = new unsigned[nHashTables];
+        threadContexts[i].allContexts = threadContexts;
+        threadContexts[i].nextHashTableGroup = &nextHashTableGroup;
+        threadContexts[i].hashTablesPerGroup = hashTablesPerGroup;
+        threadContexts[i].overflowEntriesForHashTable = overflowEntriesForHashTable;
+        threadContexts[i].nextBackpointerInBlock = 0;
+        threadContexts[i].backpointerBlockEnd = 0;
 		threadContexts[i].backpointerSpillLock = &backpointerSpillLock;
 		threadContexts[i].lastBackpointerIndexUsedByThread = lastBackpointerIndexUsedByThread;
 		threadContexts[i].backpointerSpillFile = backpointerSpillFile;
+    }
 
-        StartNewThread(BuildHashTablesWorkerThreadMain, &threadContexts[i]);
+    _int64 partitionTime = 0;
+    _int64 insertTime = 0;
+    for (GenomeDistance windowStart = 0; windowStart < basesToIndex; windowStart += hashTableBuildWindowSize) {
+        GenomeDistance windowSize = __min(hashTableBuildWindowSize, basesToIndex - windowStart);
+        GenomeDistance sliceStart = windowStart;
+        for (unsigned i = 0; i < nThreads; i++) {
+            threadContexts[i].genomeChunkStart = sliceStart;
+            if (i == nThreads - 1) {
+                sliceStart = windowStart + windowSize;
+            } else {
+                sliceStart += windowSize / nThreads;
+            }
+            threadContexts[i].genomeChunkEnd = sliceStart;
+        }
+
+        _int64 phaseStart = timeInMillis();
+        RunBuildHashTablesPhase(threadContexts, nThreads, PartitionSeedsPhase);
+        partitionTime += timeInMillis() - phaseStart;
+
+        phaseStart = timeInMillis();
+        nextHashTableGroup = 0;
+        RunBuildHashTablesPhase(threadContexts, nThreads, InsertSeedsPhase);
+        insertTime += timeInMillis() - phaseStart;
+
+        if ((windowStart + windowSize) / printPeriod > windowStart / printPeriod) {
+            WriteStatusMessage("Indexing %lld / %lld\n", ((windowStart + windowSize) / printPeriod) * printPeriod, countOfBases);
+        }
     }
 
-    WaitForSingleWaiterObject(&doneObject);
     DestroySingleWaiterObject(&doneObject);
 	DestroyExclusiveLock(&backpointerSpillLock);
 	delete[] lastBackpointerIndexUsedByThread;
 
+    IndexBuildStats stats;
+    for (unsigned i = 0; i < nThreads; i++) {
+        stats.noBaseAvailable += threadContexts[i].stats.noBaseAvailable;
+        stats.nonSeeds += threadContexts[i].stats.nonSeeds;
+        stats.bothComplementsUsed += threadContexts[i].stats.bothComplementsUsed;
+        stats.genomeLocationsInOverflowTable += threadContexts[i].stats.genomeLocationsInOverflowTable;
+        stats.seedsWithMultipleOccurrences += threadContexts[i].stats.seedsWithMultipleOccurrences;
+
+        BigDealloc(threadContexts[i].entries);
+        BigDealloc(threadContexts[i].unsortedEntries);
+        BigDealloc(threadContexts[i].hashTableForEntry);
+        delete[] threadContexts[i].firstEntryForHashTable;
+        delete[] threadContexts[i].nextEntryForHashTable;
+    }
+    delete[] threadContexts;
+
+    _int64 seedsWithMultipleOccurrences = stats.seedsWithMultipleOccurrences;
+    _int64 genomeLocationsInOverflowTable = stats.genomeLocationsInOverflowTable;
+
     if (locationSize != 8 && seedsWithMultipleOccurrences + genomeLocationsInOverflowTable + (_int64)genome->getCountOfBases() > ((_int64)1 << (8 * locationSize)) - 15) { // Only really need -1 for InvalidGenomeLocation, the rest is just spare
         WriteErrorMessage("Ran out of overflow table namespace. This genome cannot be indexed with this seed and location size.  Increase at least one.\n");
         exit(1);
@@ -442,10 +586,10 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         (seedsWithMultipleOccurrences * 100) / countOfBases,
         genomeLocationsInOverflowTable,
         genomeLocationsInOverflowTable * 100 / countOfBases,
-        nonSeeds,
-        (nonSeeds * 100) / countOfBases,
-        bothComplementsUsed,
-        noBaseAvailable);
+        stats.nonSeeds,
+        (stats.nonSeeds * 100) / countOfBases,
+        stats.bothComplementsUsed,
+        stats.noBaseAvailable);
 
     WriteStatusMessage("Hash table build took %llds\n",(timeInMillis() + 500 - start) / 1000);
 
@@ -457,6 +601,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     genome = NULL;
 
 	char *halfBuiltHashTableSpillFileName = NULL;
+    _int64 spillTime = 0;
 
 	if (smallMemory) {
 		//
@@ -467,15 +612,18 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 		_int64 startSpill = timeInMillis();
 		WriteStatusMessage("Spilling half-built hash tables to disk..");
 #define	HALF_BUILT_HASH_TABLE_SPILL_FILE_NAME "HalfBuiltHashTables"
-		halfBuiltHashTableSpillFileName = new char[strlen(directoryName) + 1 + strlen(HALF_BUILT_HASH_TABLE_SPILL_FILE_NAME) + 20];	// +20 is for the number and trailing null
+		halfBuiltHashTableSpillFileName = new char[strlen(directoryName) + 1 + strlen(HALF_BUILT_HASH_TABLE_SPILL_FILE_NAME) + 1];
 
+		sprintf(halfBuiltHashTableSpillFileName, "%s%c%s", directoryName, PATH_SEP, HALF_BUILT_HASH_TABLE_SPILL_FILE_NAME);
+		char *spillFileNameBuffer = new char[strlen(halfBuiltHashTableSpillFileName) + 20];	// +20 is for the number and trailing null
 		for (unsigned i = 1; i < nHashTables; i++) {
-			sprintf(halfBuiltHashTableSpillFileName, "%s%c%s.%d", directoryName, PATH_SEP, HALF_BUILT_HASH_TABLE_SPILL_FILE_NAME, i);
+			sprintf(spillFileNameBuffer, "%s.%d", halfBuiltHashTableSpillFileName, i);
 			size_t bytesWritten;
-			hashTables[i]->saveToFile(halfBuiltHashTableSpillFileName, &bytesWritten);
+			hashTables[i]->saveToFile(spillFileNameBuffer, &bytesWritten);
 			delete hashTables[i];
 			hashTables[i] = NULL;
 		}
+		delete[] spillFileNameBuffer;
 
 		_int64 spillDone = timeInMillis();
 		WriteStatusMessage("%llds\nReloading backpointer table from disk...", (spillDone - startSpill + 500) / 1000);
@@ -486,6 +634,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 		delete[] backpointerSpillFileName;
 
 		WriteStatusMessage("%llds\n", (timeInMillis() - spillDone + 500) / 1000);
+        spillTime = timeInMillis() - startSpill;
 	}
 
     WriteStatusMessage("Building overflow table.\n");
@@ -515,25 +664,22 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
 		soft_exit(1);
 	}
 
-    _uint64 nBackpointersProcessed = 0;
+    //
+    // The hash tables' pieces of the overflow table are laid out in hash table order, so we know where each one starts.
+    //
+    _int64 *overflowTableOffsetForHashTable = new _int64[nHashTables + 1];
+    overflowTableOffsetForHashTable[0] = 0;
+    for (unsigned i = 0; i < nHashTables; i++) {
+        overflowTableOffsetForHashTable[i + 1] = overflowTableOffsetForHashTable[i] + overflowEntriesForHashTable[i];
+    }
+    _ASSERT(overflowTableOffsetForHashTable[nHashTables] == index->overflowTableSize);
+    delete[] overflowEntriesForHashTable;
+    overflowEntriesForHashTable = NULL;
+
     _int64 lastPrintTime = timeInMillis();
 
-    const unsigned maxHistogramEntry = 500000;
-    _uint64 countOfTooBigForHistogram = 0;
-    _uint64  sumOfTooBigForHistogram = 0;
-    _uint64 largestSeed = 0;
-    unsigned *histogram = NULL;
-    if (buildHistogram) {
-        histogram = new unsigned[maxHistogramEntry+1];
-        for (unsigned i = 0; i <= maxHistogramEntry; i++) {
-            histogram[i] = 0;
-        }
-    }
+    SeedHistogram *histogram = buildHistogram ? new SeedHistogram : NULL;
 
-	//
-	// Build the overflow table by walking each of the hash tables and looking for elements to fix up.
-	// Write the hash tables as we go so that we can free their memory on the fly.
-	//
 	snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexHash", directoryName, PATH_SEP);
     FILE *tablesFile = fopen(filenameBuffer, "wb");
     if (NULL == tablesFile) {
@@ -542,143 +688,95 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     }
 
     size_t totalBytesWritten = 0;
-    _uint64 overflowTableIndex = 0;
-	_uint64 duplicateSeedsProcessed = 0;
-
-	for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
-		if (NULL == hashTables[whichHashTable]) {
-			_ASSERT(smallMemory);
-			sprintf(halfBuiltHashTableSpillFileName, "%s%c%s.%d", directoryName, PATH_SEP, HALF_BUILT_HASH_TABLE_SPILL_FILE_NAME, whichHashTable);
-			GenericFile_stdio *file = GenericFile_stdio::open(halfBuiltHashTableSpillFileName);
-			if (NULL == file) {
-				WriteErrorMessage("Unable to open file '%s' to reload spilled hash table.\n", halfBuiltHashTableSpillFileName);
-				soft_exit(1);
-			}
-			hashTables[whichHashTable] = SNAPHashTable::loadFromGenericFile(file);
-			file->close();
-			DeleteSingleFile(halfBuiltHashTableSpillFileName);
-		}
 
-		for (_uint64 whichEntry = 0; whichEntry < hashTables[whichHashTable]->GetTableSize(); whichEntry++) {
-			unsigned *values32 = (unsigned *)hashTables[whichHashTable]->getEntryValues(whichEntry);
-            char *values64 = (char *)values32;  // char * because it's variable sized
-			for (int i = 0; i < (large ? NUM_DIRECTIONS : 1); i++) {
-                _int64 value;
-                if (locationSize > 4) {
-                    value = 0;
-                    memcpy((char *)&value, values64 + locationSize * i, locationSize);   // assumes little endian
-                } else {
-                    value = values32[i];
-                }
-				if (value >= countOfBases && value != GenomeLocationAsInt64(InvalidGenomeLocation) && value != GenomeLocationAsInt64(InvalidGenomeLocation) - 1) {
-					//
-					// This is an overflow pointer.  Fix it up.  Count the number of occurrences of this
-					// seed by walking the overflow chain.
-					//
-					duplicateSeedsProcessed++;
-
-					_uint64 nOccurrences = 0;
-					_int64 backpointerIndex = value - countOfBases;
-					while (backpointerIndex != -1) {
-						nOccurrences++;
-						OverflowBackpointer *backpointer = overflowAnchor->getBackpointer(backpointerIndex);
-						_ASSERT(overflowTableIndex + nOccurrences < index->overflowTableSize);
-                        if (locationSize > 4) {
-						    index->overflowTable64[overflowTableIndex + nOccurrences] = GenomeLocationAsInt64(backpointer->genomeLocation);
-                        } else {
-						    index->overflowTable32[overflowTableIndex + nOccurrences] = GenomeLocationAsInt32(backpointer->genomeLocation);
-                        }
-						backpointerIndex = backpointer->nextIndex;
-					}
+	//
+	// Fix up the hash tables and fill in the overflow table in parallel, and then write the hash tables out in order so
+	// that we can free their memory as we go.  With -sm the hash tables are on disk, so only bring back a few at a time.
+	//
+    unsigned hashTablesPerPass = smallMemory ? nThreads : nHashTables;
+    volatile int nextHashTable;
+    _int64 overflowBuildTime = 0;
+    _int64 hashTableSaveTime = 0;
 
-					_ASSERT(nOccurrences > 1);
+    CreateSingleWaiterObject(&doneObject);
+    BuildOverflowTableThreadContext *overflowContexts = new BuildOverflowTableThreadContext[nThreads];
 
-					//
-					// Fill the count in as the first thing in the overflow table
-					// and patch the value into the hash table.
-					//
-                    _ASSERT(overflowTableIndex < index->overflowTableSize);
-                    if (locationSize > 4) {
-					    index->overflowTable64[overflowTableIndex] = nOccurrences;
-                        _int64 newValue = overflowTableIndex + countOfBases;
-                        memcpy(values64 + locationSize * i, &newValue, locationSize);   // Assumes little endian
-                    } else {
-					    index->overflowTable32[overflowTableIndex] = (unsigned)nOccurrences;
-                        values32[i] = (unsigned)(overflowTableIndex + countOfBases);
-                    }
+	for (unsigned passStart = 0; passStart < nHashTables; passStart += hashTablesPerPass) {
+        unsigned passEnd = __min(nHashTables, passStart + hashTablesPerPass);
+        _int64 passStartTime = timeInMillis();
 
-					overflowTableIndex += 1 + nOccurrences;
-                    _ASSERT(overflowTableIndex <= index->overflowTableSize);
-					nBackpointersProcessed += nOccurrences;
-
-					//
-					// Sort the overflow table entries, because the paired-end aligner relies on this.  Sort them backwards, because that's
-					// what it expects.  For those who are desparately curious, this is because it was originally built this way by accident
-					// before there was any concept of doing binary search over a seed's hits.  When the binary search was built, it relied
-					// on this.  Then, when the index build was parallelized it was easier just to preserve the old order than to change the
-					// code in the aligner.  So now you know.
-					//
-                    if (locationSize > 4) { 
- 					    qsort(&index->overflowTable64[overflowTableIndex -nOccurrences], nOccurrences, sizeof(index->overflowTable64[0]), BackwardsInt64Compare);
-                   } else {
-					    qsort(&index->overflowTable32[overflowTableIndex -nOccurrences], nOccurrences, sizeof(index->overflowTable32[0]), BackwardsUnsignedCompare);
-                    }
+        nextHashTable = passStart;
+        runningThreadCount = nThreads;
+        for (unsigned i = 0; i < nThreads; i++) {
+            overflowContexts[i].doneObject = &doneObject;
+            overflowContexts[i].runningThreadCount = &runningThreadCount;
+            overflowContexts[i].index = index;
+            overflowContexts[i].overflowAnchor = overflowAnchor;
+            overflowContexts[i].countOfBases = countOfBases;
+            overflowContexts[i].locationSize = locationSize;
+            overflowContexts[i].large = large;
+            overflowContexts[i].nextHashTable = &nextHashTable;
+            overflowContexts[i].endHashTable = passEnd;
+            overflowContexts[i].overflowTableOffsetForHashTable = overflowTableOffsetForHashTable;
+            overflowContexts[i].halfBuiltHashTableSpillFileNameBase = halfBuiltHashTableSpillFileName;
+
+            StartNewThread(BuildOverflowTableWorkerThreadMain, &overflowContexts[i]);
+        }
+        WaitForSingleWaiterObject(&doneObject);
+        ResetSingleWaiterObject(&doneObject);
 
-					if (timeInMillis() - lastPrintTime > 60 * 1000) {
-						WriteStatusMessage("%lld/%lld duplicate seeds, %lld/%lld backpointers, %d/%d hash tables processed\n", 
-							duplicateSeedsProcessed, seedsWithMultipleOccurrences, nBackpointersProcessed, genomeLocationsInOverflowTable,
-							whichHashTable, nHashTables);
-						lastPrintTime = timeInMillis();
-					}
-
-					//
-					// If we're building a histogram, update it.
-					//
-					if (buildHistogram) {
-						if (nOccurrences > maxHistogramEntry) {
-							countOfTooBigForHistogram++;
-							sumOfTooBigForHistogram += nOccurrences;
-						} else {
-							histogram[nOccurrences]++;
-						}
-						largestSeed = __max(largestSeed, nOccurrences);
-					}
-
-				} // If this entry needs patching
-			} // forward and RC if large table
-		} // for each entry in the hash table
-
- 		//
-		// We're done with this hash table, free it to releive memory pressure.
-		//
-		size_t bytesWrittenThisHashTable;
-        if (!hashTables[whichHashTable]->saveToFile(tablesFile, &bytesWrittenThisHashTable)) {
-            WriteErrorMessage("GenomeIndex::saveToDirectory: Failed to save hash table %d\n", whichHashTable);
-            return false;
+        _int64 passBuildDone = timeInMillis();
+        overflowBuildTime += passBuildDone - passStartTime;
+
+        for (unsigned whichHashTable = passStart; whichHashTable < passEnd; whichHashTable++) {
+            //
+            // If we're building a histogram, update it from this hash table's piece of the overflow table, which is a count
+            // followed by that many locations for each seed.
+            //
+            if (buildHistogram) {
+                for (_int64 overflowTableIndex = overflowTableOffsetForHashTable[whichHashTable]; overflowTableIndex < overflowTableOffsetForHashTable[whichHashTable + 1]; ) {
+                    _uint64 nOccurrences = (locationSize > 4) ? (_uint64)index->overflowTable64[overflowTableIndex] : (_uint64)index->overflowTable32[overflowTableIndex];
+                    histogram->recordSeed(nOccurrences);
+                    overflowTableIndex += 1 + nOccurrences;
+                }
+            }
+
+ 		    //
+		    // We're done with this hash table, free it to releive memory pressure.
+		    //
+		    size_t bytesWrittenThisHashTable;
+            if (!hashTables[whichHashTable]->saveToFile(tablesFile, &bytesWrittenThisHashTable)) {
+                WriteErrorMessage("GenomeIndex::saveToDirectory: Failed to save hash table %d\n", whichHashTable);
+                return false;
+            }
+            totalBytesWritten += bytesWrittenThisHashTable;
+
+		    delete hashTables[whichHashTable];
+		    hashTables[whichHashTable] = NULL;
         }
-        totalBytesWritten += bytesWrittenThisHashTable;
 
-		delete hashTables[whichHashTable];
-		hashTables[whichHashTable] = NULL;
-	} // for each hash table
+        hashTableSaveTime += timeInMillis() - passBuildDone;
 
-    fclose(tablesFile);
+		if (timeInMillis() - lastPrintTime > 60 * 1000) {
+			WriteStatusMessage("%d/%d hash tables processed\n", passEnd, nHashTables);
+			lastPrintTime = timeInMillis();
+		}
+	} // for each pass
 
-    _ASSERT(overflowTableIndex == index->overflowTableSize);    // We used exactly what we expected to use.
+    fclose(tablesFile);
+    DestroySingleWaiterObject(&doneObject);
+    delete[] overflowContexts;
+    delete[] overflowTableOffsetForHashTable;
+    delete[] halfBuiltHashTableSpillFileName;
 
     delete overflowAnchor;
     overflowAnchor = NULL;
 
     if (buildHistogram) {
-        histogram[1] = (unsigned)(totalUsedHashTableElements - seedsWithMultipleOccurrences);
-        for (unsigned i = 0; i <= maxHistogramEntry; i++) {
-            if (histogram[i] != 0) {
-                fprintf(histogramFile,"%d\t%d\n", i, histogram[i]);
-            }
-        }
-        fprintf(histogramFile, "%d larger than %d with %d total genome locations, largest seed %d\n", countOfTooBigForHistogram, maxHistogramEntry, sumOfTooBigForHistogram, largestSeed);
+        histogram->histogram[1] = (unsigned)(totalUsedHashTableElements - seedsWithMultipleOccurrences);
+        histogram->write(histogramFile);
         fclose(histogramFile);
-        delete [] histogram;
+        delete histogram;
     }
 
     //
@@ -712,6 +810,31 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     fclose(fOverflowTable);
     fOverflowTable = NULL;
 
+    if (!WriteIndexHeaderFile(directoryName, cacheLineBuckets, index->nHashTables, index->overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize,
+            totalBytesWritten, large, locationSize)) {
+        return false;
+    }
+ 
+    delete index;
+    if (computeBias && biasTable != NULL) {
+        delete[] biasTable;
+    }
+ 
+    _int64 overflowTableSaveTime = timeInMillis() - start;
+    WriteStatusMessage("%llds\n", (overflowTableSaveTime + 500) / 1000);
+
+    WriteStatusMessage("Index build phase times: genome save %.1fs, bias table %.1fs, hash table allocation %.1fs, seed partitioning %.1fs, hash table inserts %.1fs, "
+        "spill %.1fs, overflow table build %.1fs, hash table save %.1fs, overflow table save %.1fs (%d threads)\n",
+        genomeSaveTime / 1000.0, biasTableTime / 1000.0, allocationTime / 1000.0, partitionTime / 1000.0, insertTime / 1000.0,
+        spillTime / 1000.0, overflowBuildTime / 1000.0, hashTableSaveTime / 1000.0, overflowTableSaveTime / 1000.0, nThreads);
+    
+    return true;
+}
+
+    bool
+GenomeIndex::WriteIndexHeaderFile(const char *directoryName, bool cacheLineBuckets, unsigned nHashTables, _int64 overflowTableSize, int seedLen,
+                        unsigned chromosomePaddingSize, unsigned hashTableKeySize, size_t hashTableBytesWritten, bool large, unsigned locationSize)
+{
     //
     // The save format is:
     //  file 'GenomeIndex' contains in order major version, minor version, nHashTables, overflowTableSize, seedLen, chromosomePaddingSize.
@@ -720,6 +843,8 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     //  table number.
     //  And the genome itself is already saved in the same directory in its own format.
     //
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
     snprintf(filenameBuffer, filenameBufferSize, "%s%cGenomeIndex", directoryName, PATH_SEP);
 
     FILE *indexFile = fopen(filenameBuffer,"w");
@@ -728,137 +853,670 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         return false;
     }
 
-    fprintf(indexFile,"%d %d %d %lld %d %d %d %lld %d %d", GenomeIndexFormatMajorVersion, GenomeIndexFormatMinorVersion, index->nHashTables, 
-        index->overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize, totalBytesWritten, large ? 0 : 1, locationSize); 
+    //
+    // Indices without cache line buckets are written with the old major version, since older versions of SNAP can still read them.
+    //
+    fprintf(indexFile,"%d %d %d %lld %d %d %d %lld %d %d", cacheLineBuckets ? GenomeIndexFormatMajorVersion : GenomeIndexFormatMajorVersionWithoutCacheLineBuckets,
+        GenomeIndexFormatMinorVersion, nHashTables, 
+        overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize, (_int64)hashTableBytesWritten, large ? 0 : 1, locationSize); 
 
     fclose(indexFile);
- 
-    delete index;
-    if (computeBias && biasTable != NULL) {
-        delete[] biasTable;
-    }
- 
-    WriteStatusMessage("%llds\n", (timeInMillis() + 500 - start) / 1000);
-    
+
     return true;
 }
 
+GenomeIndex::SeedHistogram::SeedHistogram() : countOfTooBigForHistogram(0), sumOfTooBigForHistogram(0), largestSeed(0)
+{
+    histogram = new unsigned[maxHistogramEntry+1];
+    for (unsigned i = 0; i <= maxHistogramEntry; i++) {
+        histogram[i] = 0;
+    }
+}
 
-
-SNAPHashTable** GenomeIndex::allocateHashTables(
-    unsigned*       o_nTables,
-    GenomeDistance  countOfBases,
-    double          slack,
-    int             seedLen,
-    unsigned        hashTableKeySize,
-	bool			large,
-    unsigned        locationSize,
-    double*         biasTable)
+GenomeIndex::SeedHistogram::~SeedHistogram()
 {
-    _ASSERT(NULL != biasTable);
+    delete [] histogram;
+}
 
-    BigAllocUseHugePages = false;   // Huge pages just slow down allocation and don't help much for hash table build, so don't use them.
+    void
+GenomeIndex::SeedHistogram::recordSeed(_uint64 nOccurrences)
+{
+	if (nOccurrences > maxHistogramEntry) {
+		countOfTooBigForHistogram++;
+		sumOfTooBigForHistogram += nOccurrences;
+	} else {
+		histogram[nOccurrences]++;
+	}
+	largestSeed = __max(largestSeed, nOccurrences);
+}
 
-    if (slack <= 0) {
-        WriteErrorMessage("allocateHashTables: must have positive slack for the hash table to work.  0.3 is probably OK, 0.1 is minimal, less will wreak havoc with perf.\n");
-        soft_exit(1);
+    void
+GenomeIndex::SeedHistogram::write(FILE *histogramFile)
+{
+    for (unsigned i = 0; i <= maxHistogramEntry; i++) {
+        if (histogram[i] != 0) {
+            fprintf(histogramFile,"%d\t%d\n", i, histogram[i]);
+        }
     }
+    fprintf(histogramFile, "%d larger than %d with %d total genome locations, largest seed %d\n", countOfTooBigForHistogram, maxHistogramEntry, sumOfTooBigForHistogram, largestSeed);
+}
 
-    if (seedLen <= 0) {
-        WriteErrorMessage("allocateHashTables: seedLen is too small (must be > 0, and practically should be >= 15 or so.\n");
-        soft_exit(1);
+//
+// A seed as written to the sorted runs for the out of core index build.  The runs are sorted by hash table, then key, then
+// genome location, which is the order in which BuildTablesOutOfCore needs them.
+//
+static const _uint64 SeedRunComplementFlag = (_uint64)1 << 63;
+
+struct SeedRunRecord {
+    unsigned        whichHashTable;
+    _uint64         lowBases;
+    _uint64         genomeLocationAndComplement;    // The high bit is set if the seed is its reverse complement
+
+    _int64 getGenomeLocation() const {return (_int64)(genomeLocationAndComplement & ~SeedRunComplementFlag);}
+    int getDirection() const {return (genomeLocationAndComplement & SeedRunComplementFlag) ? 1 : 0;}
+
+    bool operator<(const SeedRunRecord &peer) const {
+        if (whichHashTable != peer.whichHashTable) {
+            return whichHashTable < peer.whichHashTable;
+        }
+        if (lowBases != peer.lowBases) {
+            return lowBases < peer.lowBases;
+        }
+        return getGenomeLocation() < peer.getGenomeLocation();
     }
+};
 
-    if (hashTableKeySize < 4 || hashTableKeySize > 8) {
-        WriteErrorMessage("allocateHashTables: key size must be 4-8 inclusive\n");
-        soft_exit(1);
+//
+// All of the records for one key in one hash table.
+//
+struct SeedRunGroup {
+    _int64          firstGenomeLocation;
+    size_t          firstRecord;
+    size_t          nRecords;
+
+    bool operator<(const SeedRunGroup &peer) const {
+        return firstGenomeLocation < peer.firstGenomeLocation;
     }
+};
 
-    if ((unsigned)seedLen < hashTableKeySize * 4) {
-        WriteErrorMessage("allocateHashTables: key size too large for seedLen.\n");
+    static void
+WriteSeedRun(const char *fileName, const SeedRunRecord *records, size_t nRecords)
+{
+    FILE *runFile = fopen(fileName, "wb");
+    if (NULL == runFile) {
+        WriteErrorMessage("Unable to create seed run file '%s'\n", fileName);
         soft_exit(1);
     }
 
-    if ((unsigned)seedLen > hashTableKeySize * 4 + 9) {
-        WriteErrorMessage("allocateHashTables: key size too small for seeLen.\n");
-        soft_exit(1);
+    const size_t maxRecordsPerWrite = 1024 * 1024;
+    for (size_t recordsWritten = 0; recordsWritten < nRecords; ) {
+        size_t recordsToWrite = __min(maxRecordsPerWrite, nRecords - recordsWritten);
+        if (recordsToWrite != fwrite(records + recordsWritten, sizeof(SeedRunRecord), recordsToWrite, runFile)) {
+            WriteErrorMessage("Failure writing seed run file '%s'.  Maybe you're out of disk space.\n", fileName);
+            soft_exit(1);
+        }
+        recordsWritten += recordsToWrite;
     }
 
-    if (locationSize < 4 || locationSize > 8) {
-        WriteErrorMessage("Location size must be between 4 and 8 inclusive.\n");
-        soft_exit(1);
+    fclose(runFile);
+}
+
+//
+// Reads back one of the runs, a buffer at a time.
+//
+class SeedRunReader {
+public:
+    SeedRunReader() : runFile(NULL), buffer(NULL), bufferSize(0), nInBuffer(0), nextInBuffer(0) {}
+
+    ~SeedRunReader() {
+        if (NULL != runFile) {
+            fclose(runFile);
+        }
+        delete [] buffer;
     }
-    
-    //
-    // Make an array of HashTables, size depending on the seed size.  The way the index works is that we use
-    // the low bits of the seed as a hash key.  Any remaining bases are used as an index into the
-    // particular hash table in question.  The division between "low" and "high" depends on the hash table key size.
-    //
-    unsigned nHashTablesToBuild = 1 << ((seedLen - hashTableKeySize * 4) * 2);
 
-    if (nHashTablesToBuild > 256 * 1024) {
-        WriteErrorMessage("allocateHashTables: key size too small for seedLen.  Try specifying -keySize and giving it a larger value.\n");
-        soft_exit(1);
+    void open(const char *fileName, size_t i_bufferSize) {
+        runFile = fopen(fileName, "rb");
+        if (NULL == runFile) {
+            WriteErrorMessage("Unable to open seed run file '%s'\n", fileName);
+            soft_exit(1);
+        }
+        bufferSize = i_bufferSize;
+        buffer = new SeedRunRecord[bufferSize];
+        fill();
     }
+
     //
-    // Average size of the hash table.  We bias this later based on the actual content of the genome.
+    // The next record, or NULL if the run is done.
     //
-    size_t hashTableSize = (size_t) ((double)countOfBases * (slack + 1.0) / nHashTablesToBuild);
-    
-    SNAPHashTable **hashTables = new SNAPHashTable*[nHashTablesToBuild];
-    
-    for (unsigned i = 0; i < nHashTablesToBuild; i++) {
-        //
-        // Create the actual hash tables.  It turns out that the human genome is highly non-uniform in its
-        // sequences of bases, so we bias the hash table sizes based on their popularity (which is emperically
-        // measured), or use the estimates that we generated and passed in as "biasTable."
-        //
-        double bias = biasTable[i];
-        unsigned biasedSize = (unsigned) (hashTableSize * bias);
-        if (biasedSize < 100) {
-            biasedSize = 100;
+    const SeedRunRecord *peek() const {
+        return (nextInBuffer < nInBuffer) ? &buffer[nextInBuffer] : NULL;
+    }
+
+    void advance() {
+        _ASSERT(nextInBuffer < nInBuffer);
+        nextInBuffer++;
+        if (nextInBuffer == nInBuffer) {
+            fill();
         }
-        
-        hashTables[i] = new SNAPHashTable(biasedSize, hashTableKeySize, locationSize, large ? 2 : 1, GenomeLocationAsInt64(InvalidGenomeLocation));
- 
-        if (NULL == hashTables[i]) {
-            WriteErrorMessage("IndexBuilder: unable to allocate HashTable %d of %d\n", i+1, nHashTablesToBuild);
+    }
+
+private:
+    void fill() {
+        nInBuffer = fread(buffer, sizeof(SeedRunRecord), bufferSize, runFile);
+        if (nInBuffer < bufferSize && ferror(runFile)) {
+            WriteErrorMessage("Error reading seed run file\n");
             soft_exit(1);
         }
+        nextInBuffer = 0;
     }
 
-    *o_nTables = nHashTablesToBuild;
-    return hashTables;
-}
+    FILE            *runFile;
+    SeedRunRecord   *buffer;
+    size_t           bufferSize;
+    size_t           nInBuffer;
+    size_t           nextInBuffer;
+};
 
+//
+// For keeping a heap of the runs with the one with the smallest next record on top.
+//
+struct SeedRunReaderComparator {
+    SeedRunReader *readers;
 
+    SeedRunReaderComparator(SeedRunReader *i_readers) : readers(i_readers) {}
 
+    bool operator()(int first, int second) const {
+        return *readers[second].peek() < *readers[first].peek();
+    }
+};
 
-GenomeIndex::GenomeIndex() : nHashTables(0), hashTables(NULL), overflowTable32(NULL), overflowTable64(NULL), genome(NULL), tablesBlob(NULL), mappedOverflowTable(NULL), mappedTables(NULL)
-{
-}
+//
+// Buffers writes to the overflow table file.
+//
+class OverflowTableWriter {
+public:
+    OverflowTableWriter(FILE *i_file, unsigned i_elementSize) : file(i_file), elementSize(i_elementSize), bytesInBuffer(0) {
+        buffer = new char[bufferSize];
+    }
 
+    ~OverflowTableWriter() {
+        delete [] buffer;
+    }
 
-GenomeIndex::~GenomeIndex()
-{
-    if (NULL != hashTables) {
-        for (unsigned i = 0; i < nHashTables; i++) {
-            delete hashTables[i];
-            hashTables[i] = NULL;
+    void append(_int64 value) {
+        if (bytesInBuffer + elementSize > bufferSize) {
+            flush();
         }
+        memcpy(buffer + bytesInBuffer, &value, elementSize);    // Assumes little endian
+        bytesInBuffer += elementSize;
     }
 
-    delete [] hashTables;
-    hashTables = NULL;
+    void flush() {
+        if (bytesInBuffer != fwrite(buffer, 1, bytesInBuffer, file)) {
+            WriteErrorMessage("GenomeIndex::saveToDirectory: fwrite failed, %d\n",errno);
+            soft_exit(1);
+        }
+        bytesInBuffer = 0;
+    }
 
-	if (NULL != mappedTables) {
-		mappedTables->close();
-		mappedOverflowTable->close();
-	} else {
-		if (NULL != overflowTable32) {
-			BigDealloc(overflowTable32);
-			overflowTable32 = NULL;
-		}
+private:
+    static const size_t bufferSize = 32 * 1024 * 1024;
+    FILE        *file;
+    unsigned     elementSize;
+    char        *buffer;
+    size_t       bytesInBuffer;
+};
+
+    bool
+GenomeIndex::BuildTablesOutOfCore(const Genome *genome, int seedLen, double slack, const char *directoryName, unsigned hashTableKeySize,
+                        bool large, unsigned locationSize, bool cacheLineBuckets, double *biasTable, size_t memoryBudget, SeedHistogram *histogram,
+                        unsigned *o_nHashTables, _int64 *o_overflowTableSize, size_t *o_hashTableBytesWritten)
+/*++
+
+Routine Description:
+
+    Build the hash tables and the overflow table without having them all in memory at once.  First, go through the genome
+    and write out the seeds in runs that are each sorted by hash table, key and genome location.  Then merge the runs, which
+    gives the seeds for one hash table at a time.  For each hash table, insert its keys in the order they first occur in the
+    genome (which is the order the in-memory build inserts them, so they land in the same slots) and then walk the table
+    filling in the values and writing out the table's piece of the overflow table.
+
+Arguments:
+
+    genome                  - the genome to index.  This deletes it once the runs are written.
+    memoryBudget            - about how many bytes to use, not counting the genome
+    histogram               - the seed histogram to fill in, or NULL
+    o_nHashTables           - returns the number of hash tables
+    o_overflowTableSize     - returns the number of elements in the overflow table
+    o_hashTableBytesWritten - returns the size of the GenomeIndexHash file
+
+Return Value:
+
+    true on success, false otherwise.
+
+--*/
+{
+    GenomeDistance countOfBases = genome->getCountOfBases();
+    unsigned nHashTables = checkHashTableParameters(slack, seedLen, hashTableKeySize, locationSize);
+
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    //
+    // Write the sorted runs.
+    //
+    WriteStatusMessage("Writing sorted seed runs...");
+    _int64 start = timeInMillis();
+
+    size_t runBufferSize = __max((size_t)1024 * 1024, memoryBudget / sizeof(SeedRunRecord));
+    SeedRunRecord *runBuffer = (SeedRunRecord *)BigAlloc(runBufferSize * sizeof(SeedRunRecord));
+    size_t nInRunBuffer = 0;
+    int nRuns = 0;
+
+    _int64 *seedsForHashTable = new _int64[nHashTables];
+    for (unsigned i = 0; i < nHashTables; i++) {
+        seedsForHashTable[i] = 0;
+    }
+
+    IndexBuildStats stats;
+    GenomeDistance basesToIndex = countOfBases - seedLen - 1;
+    for (GenomeLocation genomeLocation = 0; genomeLocation < basesToIndex; genomeLocation++) {
+        const char *bases = genome->getSubstring(genomeLocation, seedLen);
+        if (NULL == bases) {
+            stats.noBaseAvailable++;
+            continue;
+        }
+
+        if (!Seed::DoesTextRepresentASeed(bases, seedLen)) {
+            stats.nonSeeds++;
+            continue;
+        }
+
+		Seed seed(bases, seedLen);
+
+	    bool usingComplement = large && seed.isBiggerThanItsReverseComplement();
+	    if (usingComplement) {
+		    seed = ~seed;
+	    }
+
+        SeedRunRecord *record = &runBuffer[nInRunBuffer];
+        record->whichHashTable = seed.getHighBases(hashTableKeySize);
+        record->lowBases = seed.getLowBases(hashTableKeySize);
+        record->genomeLocationAndComplement = GenomeLocationAsInt64(genomeLocation) | (usingComplement ? SeedRunComplementFlag : 0);
+        _ASSERT(record->whichHashTable < nHashTables);
+        seedsForHashTable[record->whichHashTable]++;
+        nInRunBuffer++;
+
+        if (nInRunBuffer == runBufferSize) {
+            std::sort(runBuffer, runBuffer + nInRunBuffer);
+            snprintf(filenameBuffer, filenameBufferSize, "%s%cSeedRun.%d", directoryName, PATH_SEP, nRuns);
+            WriteSeedRun(filenameBuffer, runBuffer, nInRunBuffer);
+            nRuns++;
+            nInRunBuffer = 0;
+        }
+    }
+
+    if (0 != nInRunBuffer) {
+        std::sort(runBuffer, runBuffer + nInRunBuffer);
+        snprintf(filenameBuffer, filenameBufferSize, "%s%cSeedRun.%d", directoryName, PATH_SEP, nRuns);
+        WriteSeedRun(filenameBuffer, runBuffer, nInRunBuffer);
+        nRuns++;
+    }
+
+    BigDealloc(runBuffer);
+    runBuffer = NULL;
+
+    delete genome;
+    genome = NULL;
+
+    WriteStatusMessage("%d runs, %llds\nBuilding hash tables and overflow table from the runs.\n", nRuns, (timeInMillis() + 500 - start) / 1000);
+    start = timeInMillis();
+
+    //
+    // Use a quarter of the budget for the run buffers, and the rest for the hash table that's being built.
+    //
+    SeedRunReader *readers = new SeedRunReader[__max(nRuns, 1)];
+    int *runHeap = new int[__max(nRuns, 1)];
+    int nRunsInHeap = 0;
+    size_t readerBufferSize = __max((size_t)4096, memoryBudget / 4 / __max(nRuns, 1) / sizeof(SeedRunRecord));
+    for (int i = 0; i < nRuns; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%cSeedRun.%d", directoryName, PATH_SEP, i);
+        readers[i].open(filenameBuffer, readerBufferSize);
+        if (NULL != readers[i].peek()) {
+            runHeap[nRunsInHeap++] = i;
+        }
+    }
+    SeedRunReaderComparator comparator(readers);
+    std::make_heap(runHeap, runHeap + nRunsInHeap, comparator);
+
+	snprintf(filenameBuffer, filenameBufferSize, "%s%cGenomeIndexHash", directoryName, PATH_SEP);
+    FILE *tablesFile = fopen(filenameBuffer, "wb");
+    if (NULL == tablesFile) {
+        WriteErrorMessage("Unable to open hash table file '%s'\n", filenameBuffer);
+        soft_exit(1);
+    }
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%cOverflowTable", directoryName, PATH_SEP);
+    FILE *overflowFile = fopen(filenameBuffer, "wb");
+    if (NULL == overflowFile) {
+        WriteErrorMessage("Unable to open overflow table file, '%s', %d\n", filenameBuffer, errno);
+        soft_exit(1);
+    }
+    OverflowTableWriter overflowWriter(overflowFile, (locationSize > 4) ? sizeof(_int64) : sizeof(unsigned));
+
+    size_t totalBytesWritten = 0;
+    size_t totalUsedHashTableElements = 0;
+    _int64 overflowTableIndex = 0;
+    _int64 lastPrintTime = timeInMillis();
+    int nDirections = large ? NUM_DIRECTIONS : 1;
+
+    for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
+        //
+        // Pull this table's seeds out of the merge and group them by key.
+        //
+        size_t nRecords = (size_t)seedsForHashTable[whichHashTable];
+        SeedRunRecord *records = (SeedRunRecord *)BigAlloc(__max(nRecords, (size_t)1) * sizeof(SeedRunRecord));
+        SeedRunGroup *groups = (SeedRunGroup *)BigAlloc(__max(nRecords, (size_t)1) * sizeof(SeedRunGroup));
+        size_t nGroups = 0;
+
+        for (size_t i = 0; i < nRecords; i++) {
+            _ASSERT(nRunsInHeap > 0);
+            std::pop_heap(runHeap, runHeap + nRunsInHeap, comparator);
+            SeedRunReader *reader = &readers[runHeap[nRunsInHeap - 1]];
+            records[i] = *reader->peek();
+            _ASSERT(records[i].whichHashTable == whichHashTable);
+            reader->advance();
+            if (NULL == reader->peek()) {
+                nRunsInHeap--;
+            } else {
+                std::push_heap(runHeap, runHeap + nRunsInHeap, comparator);
+            }
+
+            if (0 == i || records[i].lowBases != records[i - 1].lowBases) {
+                groups[nGroups].firstGenomeLocation = records[i].getGenomeLocation();
+                groups[nGroups].firstRecord = i;
+                groups[nGroups].nRecords = 0;
+                nGroups++;
+            }
+            groups[nGroups - 1].nRecords++;
+        }
+
+        SNAPHashTable *hashTable = allocateHashTable(whichHashTable, nHashTables, countOfBases, slack, hashTableKeySize, large, locationSize, cacheLineBuckets, biasTable);
+
+        size_t bytesForThisTable = hashTable->GetTableSize() * (hashTableKeySize + locationSize * nDirections) + nRecords * (sizeof(SeedRunRecord) + sizeof(SeedRunGroup));
+        if (bytesForThisTable > memoryBudget) {
+            WriteStatusMessage("Warning: hash table %d needs %lldMB to build, which is more than the memory budget.\n", whichHashTable, (_int64)(bytesForThisTable / (1024 * 1024)));
+        }
+
+        //
+        // Insert the keys in the order they first occur in the genome.  The value is the key's group for now.
+        //
+        std::sort(groups, groups + nGroups);
+        for (size_t whichGroup = 0; whichGroup < nGroups; whichGroup++) {
+            SNAPHashTable::ValueType newEntry[2] = {whichGroup, 0};
+            if (!hashTable->Insert(records[groups[whichGroup].firstRecord].lowBases, newEntry)) {
+                WriteErrorMessage("IndexBuilder: exceeded size of hash table %d.\n"
+                        "If you're indexing a non-human genome, make sure not to pass the -hg19 option.  Otheriwse, use -exact or increase slack with -h.\n",
+                        whichHashTable);
+                soft_exit(1);
+            }
+        }
+
+        //
+        // Now walk the table filling in the real values, and build the overflow table entries for seeds that occur more than once
+        // in the same order as the in-memory build: by slot, and sorted backwards within a seed.
+        //
+		for (_uint64 whichEntry = 0; whichEntry < hashTable->GetTableSize(); whichEntry++) {
+			char *values = (char *)hashTable->getEntryValues(whichEntry);
+            _int64 whichGroup = 0;
+            memcpy(&whichGroup, values, locationSize);  // Assumes little endian
+            if (whichGroup == GenomeLocationAsInt64(InvalidGenomeLocation)) {
+                continue;   // Unused entry
+            }
+
+            SeedRunGroup *group = &groups[whichGroup];
+            int nDirectionsUsed = 0;
+            for (int direction = 0; direction < nDirections; direction++) {
+                _int64 nOccurrences = 0;
+                _int64 value = GenomeLocationAsInt64(InvalidGenomeLocation) - 1;  // Unused, for large tables
+                for (size_t i = group->firstRecord; i < group->firstRecord + group->nRecords; i++) {
+                    if (records[i].getDirection() == direction) {
+                        nOccurrences++;
+                        value = records[i].getGenomeLocation();
+                    }
+                }
+
+                if (nOccurrences > 0) {
+                    nDirectionsUsed++;
+                }
+
+                if (nOccurrences > 1) {
+                    stats.seedsWithMultipleOccurrences++;
+                    stats.genomeLocationsInOverflowTable += nOccurrences;
+
+                    value = overflowTableIndex + countOfBases;
+                    overflowWriter.append(nOccurrences);
+                    for (size_t i = group->firstRecord + group->nRecords; i > group->firstRecord; i--) {
+                        if (records[i - 1].getDirection() == direction) {
+                            overflowWriter.append(records[i - 1].getGenomeLocation());
+                        }
+                    }
+                    overflowTableIndex += 1 + nOccurrences;
+
+                    if (NULL != histogram) {
+                        histogram->recordSeed(nOccurrences);
+                    }
+                }
+
+                memcpy(values + locationSize * direction, &value, locationSize);    // Assumes little endian
+            } // for each direction
+
+            if (NUM_DIRECTIONS == nDirectionsUsed) {
+                stats.bothComplementsUsed++;
+            }
+        } // for each entry in the hash table
+
+        if (locationSize != 8 && overflowTableIndex + countOfBases > ((_int64)1 << (8 * locationSize)) - 15) {
+            WriteErrorMessage("Ran out of overflow table namespace. This genome cannot be indexed with this seed and location size.  Increase at least one.\n");
+            soft_exit(1);
+        }
+
+        BigDealloc(records);
+        BigDealloc(groups);
+
+        totalUsedHashTableElements += hashTable->GetUsedElementCount();
+
+        size_t bytesWrittenThisHashTable;
+        if (!hashTable->saveToFile(tablesFile, &bytesWrittenThisHashTable)) {
+            WriteErrorMessage("GenomeIndex::saveToDirectory: Failed to save hash table %d\n", whichHashTable);
+            return false;
+        }
+        totalBytesWritten += bytesWrittenThisHashTable;
+        delete hashTable;
+
+		if (timeInMillis() - lastPrintTime > 60 * 1000) {
+			WriteStatusMessage("%d/%d hash tables processed\n", whichHashTable + 1, nHashTables);
+			lastPrintTime = timeInMillis();
+		}
+    } // for each hash table
+
+    _ASSERT(0 == nRunsInHeap);
+    overflowWriter.flush();
+    fclose(overflowFile);
+    fclose(tablesFile);
+
+    delete [] readers;
+    delete [] runHeap;
+    delete [] seedsForHashTable;
+    for (int i = 0; i < nRuns; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%cSeedRun.%d", directoryName, PATH_SEP, i);
+        DeleteSingleFile(filenameBuffer);
+    }
+
+    if (locationSize != 8 && overflowTableIndex + countOfBases >= GenomeLocationAsInt64(InvalidGenomeLocation) - 15) {
+		WriteErrorMessage("Not enough address space to index this genome with this seed size.  Try a larger seed or location size.\n");
+		soft_exit(1);
+    }
+
+    WriteStatusMessage("%lld(%lld%%) seeds occur more than once, total of %lld(%lld%%) genome locations are not unique, %lld(%lld%%) bad seeds, %lld both complements used %lld no string\n",
+        stats.seedsWithMultipleOccurrences,
+        (stats.seedsWithMultipleOccurrences * 100) / countOfBases,
+        stats.genomeLocationsInOverflowTable,
+        stats.genomeLocationsInOverflowTable * 100 / countOfBases,
+        stats.nonSeeds,
+        (stats.nonSeeds * 100) / countOfBases,
+        stats.bothComplementsUsed,
+        stats.noBaseAvailable);
+
+    WriteStatusMessage("Hash and overflow table build took %llds\n", (timeInMillis() + 500 - start) / 1000);
+
+    if (NULL != histogram) {
+        histogram->histogram[1] = (unsigned)(totalUsedHashTableElements - stats.seedsWithMultipleOccurrences);
+    }
+
+    _ASSERT(overflowTableIndex == stats.seedsWithMultipleOccurrences + stats.genomeLocationsInOverflowTable);
+    *o_nHashTables = nHashTables;
+    *o_overflowTableSize = overflowTableIndex;
+    *o_hashTableBytesWritten = totalBytesWritten;
+
+    return true;
+}
+
+SNAPHashTable** GenomeIndex::allocateHashTables(
+    unsigned*       o_nTables,
+    GenomeDistance  countOfBases,
+    double          slack,
+    int             seedLen,
+    unsigned        hashTableKeySize,
+	bool			large,
+    unsigned        locationSize,
+    bool            cacheLineBuckets,
+    double*         biasTable)
+{
+    _ASSERT(NULL != biasTable);
+
+    unsigned nHashTablesToBuild = checkHashTableParameters(slack, seedLen, hashTableKeySize, locationSize);
+
+    SNAPHashTable **hashTables = new SNAPHashTable*[nHashTablesToBuild];
+    
+    for (unsigned i = 0; i < nHashTablesToBuild; i++) {
+        hashTables[i] = allocateHashTable(i, nHashTablesToBuild, countOfBases, slack, hashTableKeySize, large, locationSize, cacheLineBuckets, biasTable);
+    }
+
+    *o_nTables = nHashTablesToBuild;
+    return hashTables;
+}
+
+    unsigned
+GenomeIndex::checkHashTableParameters(double slack, int seedLen, unsigned hashTableKeySize, unsigned locationSize)
+{
+    BigAllocUseHugePages = false;   // Huge pages just slow down allocation and don't help much for hash table build, so don't use them.
+
+    if (slack <= 0) {
+        WriteErrorMessage("allocateHashTables: must have positive slack for the hash table to work.  0.3 is probably OK, 0.1 is minimal, less will wreak havoc with perf.\n");
+        soft_exit(1);
+    }
+
+    if (seedLen <= 0) {
+        WriteErrorMessage("allocateHashTables: seedLen is too small (must be > 0, and practically should be >= 15 or so.\n");
+        soft_exit(1);
+    }
+
+    if (hashTableKeySize < 4 || hashTableKeySize > 8) {
+        WriteErrorMessage("allocateHashTables: key size must be 4-8 inclusive\n");
+        soft_exit(1);
+    }
+
+    if ((unsigned)seedLen < hashTableKeySize * 4) {
+        WriteErrorMessage("allocateHashTables: key size too large for seedLen.\n");
+        soft_exit(1);
+    }
+
+    if ((unsigned)seedLen > hashTableKeySize * 4 + 9) {
+        WriteErrorMessage("allocateHashTables: key size too small for seeLen.\n");
+        soft_exit(1);
+    }
+
+    if (locationSize < 4 || locationSize > 8) {
+        WriteErrorMessage("Location size must be between 4 and 8 inclusive.\n");
+        soft_exit(1);
+    }
+    
+    //
+    // Make an array of HashTables, size depending on the seed size.  The way the index works is that we use
+    // the low bits of the seed as a hash key.  Any remaining bases are used as an index into the
+    // particular hash table in question.  The division between "low" and "high" depends on the hash table key size.
+    //
+    unsigned nHashTablesToBuild = 1 << ((seedLen - hashTableKeySize * 4) * 2);
+
+    if (nHashTablesToBuild > 256 * 1024) {
+        WriteErrorMessage("allocateHashTables: key size too small for seedLen.  Try specifying -keySize and giving it a larger value.\n");
+        soft_exit(1);
+    }
+
+    return nHashTablesToBuild;
+}
+
+    SNAPHashTable *
+GenomeIndex::allocateHashTable(unsigned whichHashTable, unsigned nHashTables, GenomeDistance countOfBases, double slack,
+        unsigned hashTableKeySize, bool large, unsigned locationSize, bool cacheLineBuckets, double *biasTable)
+{
+    //
+    // Average size of the hash table.  We bias this later based on the actual content of the genome.
+    //
+    size_t hashTableSize = (size_t) ((double)countOfBases * (slack + 1.0) / nHashTables);
+    
+    //
+    // Create the actual hash table.  It turns out that the human genome is highly non-uniform in its
+    // sequences of bases, so we bias the hash table sizes based on their popularity (which is emperically
+    // measured), or use the estimates that we generated and passed in as "biasTable."
+    //
+    double bias = biasTable[whichHashTable];
+    unsigned biasedSize = (unsigned) (hashTableSize * bias);
+    if (biasedSize < 100) {
+        biasedSize = 100;
+    }
+        
+    SNAPHashTable *hashTable = new SNAPHashTable(biasedSize, hashTableKeySize, locationSize, large ? 2 : 1, GenomeLocationAsInt64(InvalidGenomeLocation), cacheLineBuckets);
+ 
+    if (NULL == hashTable) {
+        WriteErrorMessage("IndexBuilder: unable to allocate HashTable %d of %d\n", whichHashTable+1, nHashTables);
+        soft_exit(1);
+    }
+
+    return hashTable;
+}
+
+
+
+
+GenomeIndex::GenomeIndex() : nHashTables(0), genome(NULL), overflowTable32(NULL), overflowTable64(NULL), mappedOverflowTable(NULL), tablesBlob(NULL), mappedTables(NULL),
+    hitListSearchFile(NULL), mappedHitListSearch(NULL), hitListSearchMinHits(0x7fffffffffffffff), hitListSearchBuckets(NULL), hitListSearchBucketMask(0), hitListSearchLayouts(NULL), hashTables(NULL)
+{
+}
+
+
+GenomeIndex::~GenomeIndex()
+{
+    if (NULL != hashTables) {
+        for (unsigned i = 0; i < nHashTables; i++) {
+            delete hashTables[i];
+            hashTables[i] = NULL;
+        }
+    }
+
+    delete [] hashTables;
+    hashTables = NULL;
+
+	if (NULL != mappedTables) {
+		mappedTables->close();
+		mappedOverflowTable->close();
+	} else {
+		if (NULL != overflowTable32) {
+			BigDealloc(overflowTable32);
+			overflowTable32 = NULL;
+		}
 
 		if (NULL != overflowTable64) {
 			BigDealloc(overflowTable64);
@@ -871,6 +1529,15 @@ GenomeIndex::~GenomeIndex()
 		}
 	}
 
+    if (NULL != mappedHitListSearch) {
+        mappedHitListSearch->close();
+        delete mappedHitListSearch;
+        mappedHitListSearch = NULL;
+    } else if (NULL != hitListSearchFile) {
+        BigDealloc(hitListSearchFile);
+    }
+    hitListSearchFile = NULL;
+
 	delete genome;
 	genome = NULL;
 
@@ -1150,33 +1817,65 @@ GenomeIndex::BuildHashTablesWorkerThreadMain(void *param)
 {
     BuildHashTablesThreadContext *context = (BuildHashTablesThreadContext *)param;
 
-    context->index->BuildHashTablesWorkerThread(context);
+    if (PartitionSeedsPhase == context->phase) {
+        context->index->PartitionSeeds(context);
+    } else {
+        context->index->InsertSeeds(context);
+    }
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
 }
-    
+
     void
-GenomeIndex::BuildHashTablesWorkerThread(BuildHashTablesThreadContext *context)
+GenomeIndex::RunBuildHashTablesPhase(BuildHashTablesThreadContext *threadContexts, unsigned nThreads, BuildHashTablesPhase phase)
+{
+    *threadContexts[0].runningThreadCount = nThreads;
+    for (unsigned i = 0; i < nThreads; i++) {
+        threadContexts[i].phase = phase;
+        StartNewThread(BuildHashTablesWorkerThreadMain, &threadContexts[i]);
+    }
+
+    WaitForSingleWaiterObject(threadContexts[0].doneObject);
+    ResetSingleWaiterObject(threadContexts[0].doneObject);
+}
+    
+    void
+GenomeIndex::PartitionSeeds(BuildHashTablesThreadContext *context)
+/*++
+
+Routine Description:
+
+    Compute the seeds for this thread's slice of the window, and counting sort them by which hash table they go in.
+    The sort is stable, so each hash table's seeds stay in genome order.
+
+Arguments:
+
+    context     - the thread's context.  Its entries and firstEntryForHashTable are filled in.
+
+--*/
 {
-    GenomeDistance countOfBases = context->genome->getCountOfBases();
     const Genome *genome = context->genome;
     unsigned seedLen = context->seedLen;
+    unsigned hashTableKeySize = context->hashTableKeySize;
 	bool large = context->large;
- 
-    //
-    // Batch the insertions into the hash tables, because otherwise we spend all of
-    // our time acquiring and releasing locks.
-    //
- 
-    PerHashTableBatch *batches = new PerHashTableBatch[nHashTables];
-    IndexBuildStats stats;
+    IndexBuildEntry *unsortedEntries = context->unsortedEntries;
+    unsigned *hashTableForEntry = context->hashTableForEntry;
+    unsigned *firstEntryForHashTable = context->firstEntryForHashTable;
+
+    for (unsigned i = 0; i <= nHashTables; i++) {
+        firstEntryForHashTable[i] = 0;
+    }
 
+    unsigned nEntries = 0;
     for (GenomeLocation genomeLocation = context->genomeChunkStart; genomeLocation < context->genomeChunkEnd; genomeLocation++) {
         const char *bases = genome->getSubstring(genomeLocation, seedLen);
         //
         // Check it for NULL, because Genome won't return strings that cross contig boundaries.
         //
         if (NULL == bases) {
-            stats.noBaseAvailable++;
-            stats.unrecordedSkippedSeeds++;
+            context->stats.noBaseAvailable++;
             continue;
         }
 
@@ -1184,70 +1883,87 @@ GenomeIndex::BuildHashTablesWorkerThread(BuildHashTablesThreadContext *context)
         // We don't build seeds out of sections of the genome that contain 'N.'  If this is one, skip it.
         //
         if (!Seed::DoesTextRepresentASeed(bases, seedLen)) {
-            stats.nonSeeds++;
-            stats.unrecordedSkippedSeeds++;
+            context->stats.nonSeeds++;
             continue;
         }
 
 		Seed seed(bases, seedLen);
 
-        indexSeed(genomeLocation, seed, batches, context, &stats, large);
-    } // For each genome base in our area
-
-    //
-    // Now apply the updates from the batches that were left over
-    //
-
-    completeIndexing(batches, context, &stats, large);
+	    bool usingComplement = large && seed.isBiggerThanItsReverseComplement();
+	    if (usingComplement) {
+		    seed = ~seed;       // Couldn't resist using ~ for this.
+	    }
 
-    InterlockedAdd64AndReturnNewValue(context->noBaseAvailable, stats.noBaseAvailable);
-    InterlockedAdd64AndReturnNewValue(context->nonSeeds, stats.nonSeeds);
-    InterlockedAdd64AndReturnNewValue(context->bothComplementsUsed, stats.bothComplementsUsed);
-    InterlockedAdd64AndReturnNewValue(context->genomeLocationsInOverflowTable, stats.genomeLocationsInOverflowTable);
-    InterlockedAdd64AndReturnNewValue(context->seedsWithMultipleOccurrences, stats.seedsWithMultipleOccurrences);
+        unsigned whichHashTable = seed.getHighBases(hashTableKeySize);
+        _ASSERT(whichHashTable < nHashTables);
 
-    delete [] batches;
+        unsortedEntries[nEntries].lowBases = seed.getLowBases(hashTableKeySize);
+        unsortedEntries[nEntries].genomeLocationAndComplement = GenomeLocationAsInt64(genomeLocation) | (usingComplement ? IndexBuildEntry::usingComplementFlag : 0);
+        hashTableForEntry[nEntries] = whichHashTable;
+        firstEntryForHashTable[whichHashTable + 1]++;
+        nEntries++;
+    } // For each genome base in our area
 
-    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
-        SignalSingleWaiterObject(context->doneObject);
+    for (unsigned i = 0; i < nHashTables; i++) {
+        firstEntryForHashTable[i + 1] += firstEntryForHashTable[i];
+        context->nextEntryForHashTable[i] = firstEntryForHashTable[i];
     }
+    _ASSERT(firstEntryForHashTable[nHashTables] == nEntries);
 
+    for (unsigned i = 0; i < nEntries; i++) {
+        context->entries[context->nextEntryForHashTable[hashTableForEntry[i]]++] = unsortedEntries[i];
+    }
 }
-    
-const _int64 GenomeIndex::printPeriod = 100000000;
 
+    void
+GenomeIndex::InsertSeeds(BuildHashTablesThreadContext *context)
+/*++
 
+Routine Description:
 
-    void
-GenomeIndex::indexSeed(GenomeLocation genomeLocation, Seed seed, PerHashTableBatch *batches, BuildHashTablesThreadContext *context, IndexBuildStats *stats, bool large)
-{
-	bool usingComplement = large && seed.isBiggerThanItsReverseComplement();
-	if (usingComplement) {
-		seed = ~seed;       // Couldn't resist using ~ for this.
-	}
+    Take groups of hash tables until there are none left in this window, and insert all of the threads' seeds for them.
+    Nobody else touches the hash tables in a group while we have it, so there's no locking.  We go through the threads'
+    slices in order, so the seeds go in in genome order.
 
-    unsigned whichHashTable = seed.getHighBases(context->hashTableKeySize);
-    _ASSERT(whichHashTable < nHashTables);
- 
-	if (batches[whichHashTable].addSeed(genomeLocation, seed.getLowBases(context->hashTableKeySize), usingComplement)) {
-		AcquireExclusiveLock(&context->hashTableLocks[whichHashTable]);
-		for (unsigned i = 0; i < batches[whichHashTable].nUsed; i++) {
-			ApplyHashTableUpdate(context, whichHashTable, batches[whichHashTable].entries[i].genomeLocation, 
-				batches[whichHashTable].entries[i].lowBases, batches[whichHashTable].entries[i].usingComplement,
-				&stats->bothComplementsUsed, &stats->genomeLocationsInOverflowTable, &stats->seedsWithMultipleOccurrences, large);
-		}
-		ReleaseExclusiveLock(&context->hashTableLocks[whichHashTable]);
+Arguments:
 
-		_int64 newNBasesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, batches[whichHashTable].nUsed + stats->unrecordedSkippedSeeds);
+    context     - the thread's context
 
-		if ((unsigned)(newNBasesProcessed / printPeriod) > (unsigned)((newNBasesProcessed - batches[whichHashTable].nUsed - stats->unrecordedSkippedSeeds) / printPeriod)) {
-			WriteStatusMessage("Indexing %lld / %lld\n", (newNBasesProcessed / printPeriod) * printPeriod, context->genome->getCountOfBases());
-		}
-		stats->unrecordedSkippedSeeds = 0;
-		batches[whichHashTable].clear();
-	} // If we filled a batch
+--*/
+{
+    unsigned nThreads = context->nThreads;
+    unsigned hashTablesPerGroup = context->hashTablesPerGroup;
+    IndexBuildStats *stats = &context->stats;
+
+    for (;;) {
+        unsigned firstHashTable = (unsigned)(InterlockedIncrementAndReturnNewValue(context->nextHashTableGroup) - 1) * hashTablesPerGroup;
+        if (firstHashTable >= nHashTables) {
+            break;
+        }
+
+        unsigned endHashTable = __min(nHashTables, firstHashTable + hashTablesPerGroup);
+        for (unsigned whichHashTable = firstHashTable; whichHashTable < endHashTable; whichHashTable++) {
+            _int64 overflowEntriesBefore = stats->seedsWithMultipleOccurrences + stats->genomeLocationsInOverflowTable;
+
+            for (unsigned whichThread = 0; whichThread < nThreads; whichThread++) {
+                BuildHashTablesThreadContext *sourceContext = &context->allContexts[whichThread];
+                for (unsigned i = sourceContext->firstEntryForHashTable[whichHashTable]; i < sourceContext->firstEntryForHashTable[whichHashTable + 1]; i++) {
+                    IndexBuildEntry *entry = &sourceContext->entries[i];
+                    ApplyHashTableUpdate(context, whichHashTable, (_int64)(entry->genomeLocationAndComplement & ~IndexBuildEntry::usingComplementFlag), entry->lowBases,
+                        0 != (entry->genomeLocationAndComplement & IndexBuildEntry::usingComplementFlag),
+                        &stats->bothComplementsUsed, &stats->genomeLocationsInOverflowTable, &stats->seedsWithMultipleOccurrences, context->large);
+                }
+            }
+
+            context->overflowEntriesForHashTable[whichHashTable] += stats->seedsWithMultipleOccurrences + stats->genomeLocationsInOverflowTable - overflowEntriesBefore;
+        } // for each hash table in the group
+    } // for each group
 }
 
+const _int64 GenomeIndex::printPeriod = 100000000;
+const GenomeDistance GenomeIndex::hashTableBuildWindowSize = 16 * 1024 * 1024;
+
+
         void 
 GenomeIndex::ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64 whichHashTable, GenomeLocation genomeLocation, _uint64 lowBases, bool usingComplement,
                 _int64 *bothComplementsUsed, _int64 *genomeLocationsInOverflowTable, _int64 *seedsWithMultipleOccurrences, bool large)
@@ -1359,75 +2075,152 @@ GenomeIndex::AddOverflowBackpointer(
 	BuildHashTablesThreadContext*context,
 	GenomeLocation               genomeLocation)
 {
-    _int64 overflowBackpointerIndex = InterlockedAdd64AndReturnNewValue(context->nextOverflowBackpointer, 1) - 1;
+    if (context->nextBackpointerInBlock >= context->backpointerBlockEnd) {
+        context->backpointerBlockEnd = InterlockedAdd64AndReturnNewValue(context->nextOverflowBackpointer, BuildHashTablesThreadContext::backpointerBlockSize);
+        context->nextBackpointerInBlock = context->backpointerBlockEnd - BuildHashTablesThreadContext::backpointerBlockSize;
+
+	    if (NULL != context->lastBackpointerIndexUsedByThread) {
+		    AcquireExclusiveLock(context->backpointerSpillLock);
+		    context->lastBackpointerIndexUsedByThread[context->whichThread] = context->nextBackpointerInBlock;
+		    _int64 trimToIndex = context->lastBackpointerIndexUsedByThread[0];
+		    for (unsigned i = 1; i < context->nThreads; i++) {
+			    trimToIndex = __min(trimToIndex, context->lastBackpointerIndexUsedByThread[i]);
+		    }
+		    context->overflowAnchor->trimTo(trimToIndex, context->backpointerSpillFile);
+		    ReleaseExclusiveLock(context->backpointerSpillLock);
+	    }
+    }
+
+    _int64 overflowBackpointerIndex = context->nextBackpointerInBlock;
+    context->nextBackpointerInBlock++;
     OverflowBackpointer *newBackpointer = context->overflowAnchor->getBackpointer(overflowBackpointerIndex);
  
     newBackpointer->nextIndex = previousOverflowBackpointer;
     newBackpointer->genomeLocation = genomeLocation;
 
-	if (overflowBackpointerIndex % 100000 == 1 && NULL != context->lastBackpointerIndexUsedByThread) {
-		AcquireExclusiveLock(context->backpointerSpillLock);
-		context->lastBackpointerIndexUsedByThread[context->whichThread] = overflowBackpointerIndex - 1;
-		_int64 trimToIndex = context->lastBackpointerIndexUsedByThread[0];
-		for (unsigned i = 1; i < context->nThreads; i++) {
-			trimToIndex = __min(trimToIndex, context->lastBackpointerIndexUsedByThread[i]);
-		}
-		context->overflowAnchor->trimTo(trimToIndex, context->backpointerSpillFile);
-		ReleaseExclusiveLock(context->backpointerSpillLock);
-	}
-
     return overflowBackpointerIndex;
 }
 
-//
-// A comparison method for qsort that sorts unsigned ints backwards (SNAP expects them to be backwards due to 
-// a historical artifact).
-//
-int
-GenomeIndex::BackwardsUnsignedCompare(const void *first, const void *second)
+    void
+GenomeIndex::BuildOverflowTableWorkerThreadMain(void *param)
 {
-    if (*(const unsigned *) first > *(const unsigned *)second) {
-        return -1;
-    } else if (*(const unsigned *) first == *(const unsigned *)second) {
-        return 0;
-    } else {
-        return 1;
+    BuildOverflowTableThreadContext *context = (BuildOverflowTableThreadContext *)param;
+
+    for (;;) {
+        unsigned whichHashTable = (unsigned)(InterlockedIncrementAndReturnNewValue(context->nextHashTable) - 1);
+        if (whichHashTable >= context->endHashTable) {
+            break;
+        }
+
+        context->index->BuildOverflowTableForHashTable(context, whichHashTable);
     }
-}
 
-int
-GenomeIndex::BackwardsInt64Compare(const void *first, const void *second)
-{
-    if (*(const _int64 *) first > *(const _int64 *)second) {
-        return -1;
-    } else if (*(const _int64 *) first == *(const _int64 *)second) {
-        return 0;
-    } else {
-        return 1;
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
     }
 }
 
+    void
+GenomeIndex::BuildOverflowTableForHashTable(BuildOverflowTableThreadContext *context, unsigned whichHashTable)
+/*++
+
+Routine Description:
 
-    void 
-GenomeIndex::completeIndexing(PerHashTableBatch *batches, BuildHashTablesThreadContext *context, IndexBuildStats *stats, bool large)
+    Walk one hash table looking for entries that point at overflow backpointer chains.  For each one, copy the chain into
+    the hash table's piece of the overflow table, sort it and point the hash table entry at it.
+
+Arguments:
+
+    context         - the thread's context
+    whichHashTable  - the hash table to fix up.  If it was spilled for -sm, it's reloaded.
+
+--*/
 {
-    for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
-        _int64 basesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, batches[whichHashTable].nUsed + stats->unrecordedSkippedSeeds);
+    GenomeDistance countOfBases = context->countOfBases;
+    unsigned locationSize = context->locationSize;
 
-        if ((_uint64)basesProcessed / printPeriod > ((_uint64)basesProcessed - batches[whichHashTable].nUsed - stats->unrecordedSkippedSeeds)/printPeriod) {
-            WriteStatusMessage("Indexing %lld / %lld\n",(basesProcessed/printPeriod)*printPeriod, context->genome->getCountOfBases());
-        }
+	if (NULL == hashTables[whichHashTable]) {
+		_ASSERT(NULL != context->halfBuiltHashTableSpillFileNameBase);
+        char *spillFileName = new char[strlen(context->halfBuiltHashTableSpillFileNameBase) + 20];   // +20 is for the number and trailing null
+		sprintf(spillFileName, "%s.%d", context->halfBuiltHashTableSpillFileNameBase, whichHashTable);
+		GenericFile_stdio *file = GenericFile_stdio::open(spillFileName);
+		if (NULL == file) {
+			WriteErrorMessage("Unable to open file '%s' to reload spilled hash table.\n", spillFileName);
+			soft_exit(1);
+		}
+		hashTables[whichHashTable] = SNAPHashTable::loadFromGenericFile(file);
+		file->close();
+        delete file;
+		DeleteSingleFile(spillFileName);
+        delete[] spillFileName;
+	}
 
-        stats->unrecordedSkippedSeeds = 0; // All except the first time through the loop this will be 0.        
-        AcquireExclusiveLock(&context->hashTableLocks[whichHashTable]);
-		for (unsigned i = 0; i < batches[whichHashTable].nUsed; i++) {
-			ApplyHashTableUpdate(context, whichHashTable, batches[whichHashTable].entries[i].genomeLocation, 
-                batches[whichHashTable].entries[i].lowBases, batches[whichHashTable].entries[i].usingComplement,
-                &stats->bothComplementsUsed, &stats->genomeLocationsInOverflowTable, 
-                &stats->seedsWithMultipleOccurrences, large);
-        }
-        ReleaseExclusiveLock(&context->hashTableLocks[whichHashTable]);
-    }
+    _uint64 overflowTableIndex = context->overflowTableOffsetForHashTable[whichHashTable];
+
+	for (_uint64 whichEntry = 0; whichEntry < hashTables[whichHashTable]->GetTableSize(); whichEntry++) {
+		unsigned *values32 = (unsigned *)hashTables[whichHashTable]->getEntryValues(whichEntry);
+        char *values64 = (char *)values32;  // char * because it's variable sized
+		for (int i = 0; i < (context->large ? NUM_DIRECTIONS : 1); i++) {
+            _int64 value;
+            if (locationSize > 4) {
+                value = 0;
+                memcpy((char *)&value, values64 + locationSize * i, locationSize);   // assumes little endian
+            } else {
+                value = values32[i];
+            }
+			if (value >= countOfBases && value != GenomeLocationAsInt64(InvalidGenomeLocation) && value != GenomeLocationAsInt64(InvalidGenomeLocation) - 1) {
+				//
+				// This is an overflow pointer.  Fix it up.  Count the number of occurrences of this
+				// seed by walking the overflow chain.
+				//
+				_uint64 nOccurrences = 0;
+				_int64 backpointerIndex = value - countOfBases;
+				while (backpointerIndex != -1) {
+					nOccurrences++;
+					OverflowBackpointer *backpointer = context->overflowAnchor->getBackpointer(backpointerIndex);
+					_ASSERT((_int64)(overflowTableIndex + nOccurrences) < context->overflowTableOffsetForHashTable[whichHashTable + 1]);
+                    if (locationSize > 4) {
+					    overflowTable64[overflowTableIndex + nOccurrences] = GenomeLocationAsInt64(backpointer->genomeLocation);
+                    } else {
+					    overflowTable32[overflowTableIndex + nOccurrences] = GenomeLocationAsInt32(backpointer->genomeLocation);
+                    }
+					backpointerIndex = backpointer->nextIndex;
+				}
+
+				_ASSERT(nOccurrences > 1);
+
+				//
+				// Fill the count in as the first thing in the overflow table
+				// and patch the value into the hash table.
+				//
+                if (locationSize > 4) {
+				    overflowTable64[overflowTableIndex] = nOccurrences;
+                    _int64 newValue = overflowTableIndex + countOfBases;
+                    memcpy(values64 + locationSize * i, &newValue, locationSize);   // Assumes little endian
+                } else {
+				    overflowTable32[overflowTableIndex] = (unsigned)nOccurrences;
+                    values32[i] = (unsigned)(overflowTableIndex + countOfBases);
+                }
+
+				overflowTableIndex += 1 + nOccurrences;
+
+				//
+				// Sort the overflow table entries, because the paired-end aligner relies on this.  Sort them backwards, because that's
+				// what it expects.  For those who are desparately curious, this is because it was originally built this way by accident
+				// before there was any concept of doing binary search over a seed's hits.  When the binary search was built, it relied
+				// on this.  Then, when the index build was parallelized it was easier just to preserve the old order than to change the
+				// code in the aligner.  So now you know.
+				//
+                if (locationSize > 4) { 
+                    std::sort(&overflowTable64[overflowTableIndex - nOccurrences], &overflowTable64[overflowTableIndex], std::greater<_int64>());
+                } else {
+                    std::sort(&overflowTable32[overflowTableIndex - nOccurrences], &overflowTable32[overflowTableIndex], std::greater<unsigned>());
+                }
+			} // If this entry needs patching
+		} // forward and RC if large table
+	} // for each entry in the hash table
+
+    _ASSERT((_int64)overflowTableIndex == context->overflowTableOffsetForHashTable[whichHashTable + 1]);    // We used exactly what we expected to use.
 }
 
 GenomeIndex::OverflowBackpointerAnchor::OverflowBackpointerAnchor(_int64 maxOverflowEntries_) : maxOverflowEntries(maxOverflowEntries_)
@@ -1595,14 +2388,53 @@ GenomeIndex::printBiasTables()
 }
 
         GenomeIndex *
-GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
+GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch, bool packGenome, bool sharedMemory)
 {
     const unsigned filenameBufferSize = MAX_PATH+1;
     char filenameBuffer[filenameBufferSize];
-    
+    char segmentName[filenameBufferSize];
+
+    if (sharedMemory) {
+        getSharedMemorySegmentName(directoryName, NULL, segmentName, filenameBufferSize);
+        GenericFile_map *directorySegment = GenericFile_map::openSharedMemory(segmentName);
+        if (NULL == directorySegment) {
+            WriteStatusMessage("(index isn't in shared memory, loading it) ");
+            sharedMemory = false;
+        } else {
+            //
+            // Check that the copy is of the files that are there now, in case the index was rebuilt after it was loaded.
+            //
+            size_t stampBytes = 2 * nIndexFiles * sizeof(_int64);
+            _int64 *loadedStamps = new _int64[2 * nIndexFiles];
+            _int64 *fileStamps = new _int64[2 * nIndexFiles];
+            bool matches = directorySegment->getFileSize() == stampBytes && directorySegment->read(loadedStamps, stampBytes) == stampBytes &&
+                getIndexFileStamps(directoryName, fileStamps) && 0 == memcmp(loadedStamps, fileStamps, stampBytes);
+            delete [] loadedStamps;
+            delete [] fileStamps;
+            delete directorySegment;
+
+            if (!matches) {
+                WriteStatusMessage("(index in shared memory doesn't match the files in '%s', loading them instead) ", directoryName);
+                sharedMemory = false;
+            } else {
+                //
+                // Everything's already in memory, so map it all and don't bother touching it.
+                //
+                map = true;
+                prefetch = false;
+            }
+        }
+    }
+
     snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndex",directoryName,PATH_SEP);
 
-    GenericFile *indexFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+    GenericFile *indexFile;
+    if (sharedMemory) {
+        getSharedMemorySegmentName(directoryName, "GenomeIndex", segmentName, filenameBufferSize);
+        indexFile = GenericFile_map::openSharedMemory(segmentName);
+    } else {
+        indexFile = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+    }
 
     if (NULL == indexFile) {
         WriteErrorMessage("Unable to open file '%s' for read.\n",filenameBuffer);
@@ -1636,7 +2468,7 @@ GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
     indexFile->close();
     delete indexFile;
 
-    if (majorVersion != GenomeIndexFormatMajorVersion) {
+    if (majorVersion != GenomeIndexFormatMajorVersion && majorVersion != GenomeIndexFormatMajorVersionWithoutCacheLineBuckets) {
         WriteErrorMessage("This genome index appears to be from a different version of SNAP than this, and so we can't read it.  Index version %d, SNAP index format version %d\n",
             majorVersion, GenomeIndexFormatMajorVersion);
         soft_exit(1);
@@ -1678,7 +2510,12 @@ GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
 			delete overflowTableFile;
 		}
 
-		index->mappedOverflowTable = GenericFile_map::open(filenameBuffer);
+		if (sharedMemory) {
+			getSharedMemorySegmentName(directoryName, "OverflowTable", segmentName, filenameBufferSize);
+			index->mappedOverflowTable = GenericFile_map::openSharedMemory(segmentName);
+		} else {
+			index->mappedOverflowTable = GenericFile_map::open(filenameBuffer);
+		}
 		if (NULL == index->mappedOverflowTable) {
 			WriteErrorMessage("Unable to open file '%s'\n", filenameBuffer);
 			soft_exit(1);
@@ -1696,7 +2533,9 @@ GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
 			soft_exit(1);
 		}
 
-		index->mappedOverflowTable->prefetch();	// NB: This is different than the -pre prefetch.  This one maps the whole thing (and reads it sequentially in case you didn't use -pre)
+		if (!sharedMemory) {
+			index->mappedOverflowTable->prefetch();	// NB: This is different than the -pre prefetch.  This one maps the whole thing (and reads it sequentially in case you didn't use -pre)
+		}
 	} else {
 		char *tableAsCharStar;
 		if (locationSize > 4) {
@@ -1752,14 +2591,22 @@ GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
 			delete hashTableFile;
 		}
 
-		if (QueryFileSize(filenameBuffer) != hashTablesFileSize) {
-			WriteErrorMessage("File '%s' had unexpected size, %lld != %lld\n", filenameBuffer, QueryFileSize(filenameBuffer), hashTablesFileSize);
+		if (sharedMemory) {
+			getSharedMemorySegmentName(directoryName, "GenomeIndexHash", segmentName, filenameBufferSize);
+			index->mappedTables = GenericFile_map::openSharedMemory(segmentName);
+		} else {
+			index->mappedTables = GenericFile_map::open(filenameBuffer);
+		}
+
+		if (NULL == index->mappedTables || index->mappedTables->getFileSize() != hashTablesFileSize) {
+			WriteErrorMessage("File '%s' had unexpected size, %lld != %lld\n", filenameBuffer, NULL == index->mappedTables ? 0 : (_int64)index->mappedTables->getFileSize(), hashTablesFileSize);
 			delete index;
 			return NULL;
 		}
 
-		index->mappedTables = GenericFile_map::open(filenameBuffer);
-		index->mappedTables->prefetch();
+		if (!sharedMemory) {
+			index->mappedTables->prefetch();
+		}
 		blobFile = index->mappedTables;
 		index->tablesBlob = NULL;
 	} else {
@@ -1812,7 +2659,10 @@ GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
 	}
 
     snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
-    if (NULL == (index->genome = Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, map))) {
+    if (sharedMemory) {
+        getSharedMemorySegmentName(directoryName, "Genome", segmentName, filenameBufferSize);
+    }
+    if (NULL == (index->genome = Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, map, packGenome, sharedMemory ? segmentName : NULL))) {
         WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
         delete index;
         return NULL;
@@ -1828,31 +2678,367 @@ GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
         soft_exit(1);
     }
 
+    if (!index->loadHitListSearchFile(directoryName, map, sharedMemory)) {
+        delete index;
+        return NULL;
+    }
+
     return index;
 }
 
+const char *GenomeIndex::IndexFileNames[] = {"GenomeIndex", "OverflowTable", "GenomeIndexHash", "Genome", "HitListSearch"};
+const int GenomeIndex::nIndexFiles = sizeof(GenomeIndex::IndexFileNames) / sizeof(GenomeIndex::IndexFileNames[0]);
+const int GenomeIndex::nRequiredIndexFiles = 4;
+
     void
-GenomeIndex::lookupSeed32(
-    Seed              seed,
-    _int64           *nHits,
-    const unsigned  **hits,
-    _int64           *nRCHits,
-    const unsigned  **rcHits)
+GenomeIndex::getSharedMemorySegmentName(const char *directoryName, const char *fileName, char *segmentName, size_t segmentNameSize)
+/*++
+
+Routine Description:
+
+    Segment names have to be short and can't have slashes, so they're named by a hash of the full path of the index
+    directory, so that it doesn't matter how the directory is named on the command line.
+
+--*/
 {
-    _ASSERT(locationSize == 4);   // This is the caller's responsibility to check.
+    const size_t pathBufferSize = MAX_PATH + 1;
+    char fullPath[pathBufferSize];
+#ifdef _MSC_VER
+    if (NULL == _fullpath(fullPath, directoryName, pathBufferSize)) {
+#else   // _MSC_VER
+    if (NULL == realpath(directoryName, fullPath)) {
+#endif  // _MSC_VER
+        strncpy(fullPath, directoryName, pathBufferSize - 1);
+        fullPath[pathBufferSize - 1] = '\0';
+    }
 
-    if (largeHashTable) {
-        bool lookedUpComplement;
+    _uint64 hash = 14695981039346656037ull;   // FNV-1a
+    for (const char *p = fullPath; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+    }
+
+    if (NULL == fileName) {
+        snprintf(segmentName, segmentNameSize, "snap.%016llx", hash);
+    } else {
+        snprintf(segmentName, segmentNameSize, "snap.%016llx.%s", hash, fileName);
+    }
+}
+
+    bool
+GenomeIndex::getIndexFileStamps(const char *directoryName, _int64 *stamps)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    for (int i = 0; i < nIndexFiles; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IndexFileNames[i]);
+        stamps[2 * i + 1] = QueryFileModificationTime(filenameBuffer);
+        if (stamps[2 * i + 1] == -1) {
+            if (i < nRequiredIndexFiles) {
+                return false;
+            }
+            stamps[2 * i] = -1;
+            continue;
+        }
+        stamps[2 * i] = QueryFileSize(filenameBuffer);
+    }
+
+    return true;
+}
+
+    bool
+GenomeIndex::loadIntoSharedMemory(const char *directoryName)
+/*++
+
+Routine Description:
+
+    Copy each of the index files into its own shared memory segment, and then create the segment for the directory to
+    say that it's all there.
+
+Arguments:
+
+    directoryName   - the index directory
+
+Return Value:
+
+    true on success.  On failure, any segments that were created have been deleted.
+
+--*/
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    char segmentName[filenameBufferSize];
+
+    getSharedMemorySegmentName(directoryName, NULL, segmentName, filenameBufferSize);
+    GenericFile_map *directorySegment = GenericFile_map::openSharedMemory(segmentName);
+    if (NULL != directorySegment) {
+        delete directorySegment;
+        WriteErrorMessage("The index in '%s' is already in shared memory.  Unload it first if you want to reload it.\n", directoryName);
+        return false;
+    }
+
+    //
+    // Clear out anything left from a load that didn't finish.
+    //
+    for (int i = 0; i < nIndexFiles; i++) {
+        getSharedMemorySegmentName(directoryName, IndexFileNames[i], segmentName, filenameBufferSize);
+        DeleteSharedMemorySegment(segmentName);
+    }
+
+    //
+    // Note the files' sizes and times before copying them, so that if one changes while it's being copied, runs won't
+    // use the copy.
+    //
+    size_t stampBytes = 2 * nIndexFiles * sizeof(_int64);
+    _int64 *stamps = new _int64[2 * nIndexFiles];
+    if (!getIndexFileStamps(directoryName, stamps)) {
+        WriteErrorMessage("Unable to find all of the index files in '%s'\n", directoryName);
+        delete [] stamps;
+        return false;
+    }
+
+    for (int i = 0; i < nIndexFiles; i++) {
+        if (stamps[2 * i + 1] == -1) {
+            continue;   // An optional file that this index doesn't have
+        }
+
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IndexFileNames[i]);
+        getSharedMemorySegmentName(directoryName, IndexFileNames[i], segmentName, filenameBufferSize);
+
+        GenericFile *file = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+        if (NULL == file) {
+            WriteErrorMessage("Unable to open index file '%s'\n", filenameBuffer);
+            delete [] stamps;
+            unloadFromSharedMemory(directoryName);
+            return false;
+        }
+
+        size_t fileSize = QueryFileSize(filenameBuffer);
+        void *contents;
+        MemoryMappedFile *segment = CreateSharedMemorySegment(segmentName, fileSize, &contents);
+        if (NULL == segment) {
+            file->close();
+            delete file;
+            delete [] stamps;
+            unloadFromSharedMemory(directoryName);
+            return false;
+        }
+
+        size_t amountRead = file->read(contents, fileSize);
+        file->close();
+        delete file;
+        CloseMemoryMappedFile(segment);
+
+        if (amountRead != fileSize) {
+            WriteErrorMessage("Read incorrect amount for index file '%s', %lld != %lld\n", filenameBuffer, (_int64)amountRead, (_int64)fileSize);
+            delete [] stamps;
+            unloadFromSharedMemory(directoryName);
+            return false;
+        }
+    }
+
+    getSharedMemorySegmentName(directoryName, NULL, segmentName, filenameBufferSize);
+    void *contents;
+    MemoryMappedFile *segment = CreateSharedMemorySegment(segmentName, stampBytes, &contents);
+    if (NULL == segment) {
+        delete [] stamps;
+        unloadFromSharedMemory(directoryName);
+        return false;
+    }
+    memcpy(contents, stamps, stampBytes);
+    CloseMemoryMappedFile(segment);
+    delete [] stamps;
+
+    return true;
+}
+
+    bool
+GenomeIndex::unloadFromSharedMemory(const char *directoryName)
+{
+    const unsigned segmentNameSize = MAX_PATH+1;
+    char segmentName[segmentNameSize];
+
+    //
+    // The directory's segment goes first, so nobody new starts using a partly deleted index.  Processes that already
+    // have it mapped keep their mappings until they exit.
+    //
+    getSharedMemorySegmentName(directoryName, NULL, segmentName, segmentNameSize);
+    bool wasLoaded = DeleteSharedMemorySegment(segmentName);
+
+    for (int i = 0; i < nIndexFiles; i++) {
+        getSharedMemorySegmentName(directoryName, IndexFileNames[i], segmentName, segmentNameSize);
+        DeleteSharedMemorySegment(segmentName);
+    }
+
+    return wasLoaded;
+}
+
+static void sharedMemoryUsage()
+{
+    WriteErrorMessage(
+        "Usage: snap shm load <index-dir>\n"
+        "       snap shm unload <index-dir>\n"
+        "load copies the index into shared memory, where it stays after snap exits until it's unloaded (or the machine\n"
+        "reboots).  Runs of snap single and snap paired with the -shm option then use that copy, so they don't spend any\n"
+        "time loading the index.  It uses as much memory as loading the index normally does, and the memory isn't available\n"
+        "for anything else until it's unloaded.\n");
+    soft_exit_no_print(1);    // Don't use soft-exit, it's confusing people to get an error message after the usage
+}
+
+    void
+GenomeIndex::runSharedMemoryCommand(
+    int argc,
+    const char **argv)
+{
+    if (argc != 2) {
+        sharedMemoryUsage();
+    }
+
+    if (strcmp(argv[0], "load") == 0) {
+        WriteStatusMessage("Loading index in '%s' into shared memory...", argv[1]);
+        _int64 start = timeInMillis();
+        if (!loadIntoSharedMemory(argv[1])) {
+            soft_exit(1);
+        }
+        WriteStatusMessage("%llds\n", (timeInMillis() - start + 500) / 1000);
+    } else if (strcmp(argv[0], "unload") == 0) {
+        if (!unloadFromSharedMemory(argv[1])) {
+            WriteErrorMessage("The index in '%s' wasn't in shared memory.\n", argv[1]);
+            soft_exit(1);
+        }
+    } else {
+        sharedMemoryUsage();
+    }
+}
+
+    void
+GenomeIndex::findSeedEntries(Seed seed, bool *lookedUpComplement, const char **entries)
+/*++
+
+Routine Description:
 
-        lookedUpComplement = seed.isBiggerThanItsReverseComplement();
-        if (lookedUpComplement) {
+    Find the hash table entries for a seed.  For large hash tables, the seed and its reverse complement share an entry
+    that's keyed by whichever of them is smaller, so there's one entry and lookedUpComplement says whether it was
+    the complement's.  Otherwise, there's an entry for each direction.  Entries are NULL if the seed isn't there.
+
+--*/
+{
+    if (largeHashTable) {
+        *lookedUpComplement = seed.isBiggerThanItsReverseComplement();
+        if (*lookedUpComplement) {
             seed = ~seed;
         }
 
         _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-        _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-        _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() == 4);
-        const unsigned *entry = (const unsigned *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(lowBases);   // Cast OK because valueSize == 4
+        entries[0] = (const char *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(seed.getLowBases(hashTableKeySize));
+        entries[1] = NULL;
+    } else {
+        *lookedUpComplement = false;
+        for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+            _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
+            entries[dir] = (const char *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(seed.getLowBases(hashTableKeySize));
+            seed = ~seed;
+        }
+    }
+}
+
+    void
+GenomeIndex::findSeedEntriesBatch(unsigned nSeeds, const Seed *seeds, bool *lookedUpComplement, const char *(*entries)[NUM_DIRECTIONS])
+/*++
+
+Routine Description:
+
+    findSeedEntries for up to maxSeedsPerLookupBatch seeds at a time.  This works in three passes, so that each pass's
+    cache misses are all outstanding at once: hash all the seeds and prefetch their home hash table entries, then
+    resolve the entries (mostly cache hits by now, unless the key had to probe), and finally prefetch the overflow table
+    counts for any seeds that have more than one hit, since that's the next thing the caller is going to touch.
+
+--*/
+{
+    _ASSERT(nSeeds <= maxSeedsPerLookupBatch);
+
+    SNAPHashTable *tables[maxSeedsPerLookupBatch][NUM_DIRECTIONS];
+    _uint64 keys[maxSeedsPerLookupBatch][NUM_DIRECTIONS];
+    _uint64 homeIndices[maxSeedsPerLookupBatch][NUM_DIRECTIONS];
+    int nDirections = largeHashTable ? 1 : NUM_DIRECTIONS;
+
+    for (unsigned i = 0; i < nSeeds; i++) {
+        Seed seed = seeds[i];
+        if (largeHashTable) {
+            lookedUpComplement[i] = seed.isBiggerThanItsReverseComplement();
+            if (lookedUpComplement[i]) {
+                seed = ~seed;
+            }
+            entries[i][1] = NULL;
+        } else {
+            lookedUpComplement[i] = false;
+        }
+
+        for (int dir = 0; dir < nDirections; dir++) {
+            _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
+            tables[i][dir] = hashTables[seed.getHighBases(hashTableKeySize)];
+            keys[i][dir] = seed.getLowBases(hashTableKeySize);
+            homeIndices[i][dir] = tables[i][dir]->GetHomeIndexForKey(keys[i][dir]);
+            tables[i][dir]->PrefetchEntry(homeIndices[i][dir]);
+            seed = ~seed;
+        }
+    }
+
+    for (unsigned i = 0; i < nSeeds; i++) {
+        for (int dir = 0; dir < nDirections; dir++) {
+            entries[i][dir] = (const char *)tables[i][dir]->GetFirstValueForKeyFromHomeIndex(keys[i][dir], homeIndices[i][dir]);
+        }
+    }
+
+    for (unsigned i = 0; i < nSeeds; i++) {
+        for (int dir = 0; dir < nDirections; dir++) {
+            if (NULL == entries[i][dir]) {
+                continue;
+            }
+
+            //
+            // Large tables have both complements' values in the entry; otherwise it's just the first one.
+            //
+            for (int whichValue = 0; whichValue < (largeHashTable ? NUM_DIRECTIONS : 1); whichValue++) {
+                _uint64 lookedUpLocation = 0;
+                memcpy(&lookedUpLocation, entries[i][dir] + whichValue * locationSize, locationSize);  // Assumes little endian
+                prefetchOverflowTableEntry(lookedUpLocation);
+            }
+        }
+    }
+}
+
+    void
+GenomeIndex::prefetchOverflowTableEntry(_uint64 lookedUpLocation)
+{
+    if (lookedUpLocation < (_uint64)genome->getCountOfBases()) {
+        return; // A singleton, so it's in the hash table entry.
+    }
+
+    _uint64 overflowTableOffset = lookedUpLocation - genome->getCountOfBases();
+    if (overflowTableOffset >= overflowTableSize) {
+        return; // An unused complement.
+    }
+
+    if (locationSize == 4) {
+        _mm_prefetch((const char *)&overflowTable32[overflowTableOffset], _MM_HINT_T0);
+    } else {
+        _mm_prefetch((const char *)&overflowTable64[overflowTableOffset], _MM_HINT_T0);
+    }
+}
+
+    void
+GenomeIndex::fillInSeedLookup32(
+    Seed              seed,
+    bool              lookedUpComplement,
+    const char * const *entries,
+    _int64           *nHits,
+    const unsigned  **hits,
+    _int64           *nRCHits,
+    const unsigned  **rcHits)
+{
+    if (largeHashTable) {
+        const unsigned *entry = (const unsigned *)entries[0];   // Cast OK because valueSize == 4
         if (NULL == entry) {
             *nHits = 0;
             *nRCHits = 0;
@@ -1875,10 +3061,7 @@ GenomeIndex::lookupSeed32(
         }
     } else {
 	    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
-		    _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-		    _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-		    _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() == 4);
-		    unsigned *entry = (unsigned int *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(lowBases);   // Cast OK because valueSize == 4
+		    const unsigned *entry = (const unsigned *)entries[dir];   // Cast OK because valueSize == 4
 		    if (NULL == entry) {
 			    if (FORWARD == dir) {
 				    *nHits = 0;
@@ -1890,11 +3073,50 @@ GenomeIndex::lookupSeed32(
 		    } else {
 			    fillInLookedUpResults32(entry,  nRCHits, rcHits);
 		    }
-		    seed = ~seed;
         }	// For each direction    
     }
 }
 
+    void
+GenomeIndex::lookupSeed32(
+    Seed              seed,
+    _int64           *nHits,
+    const unsigned  **hits,
+    _int64           *nRCHits,
+    const unsigned  **rcHits)
+{
+    _ASSERT(locationSize == 4);   // This is the caller's responsibility to check.
+
+    bool lookedUpComplement;
+    const char *entries[NUM_DIRECTIONS];
+    findSeedEntries(seed, &lookedUpComplement, entries);
+    fillInSeedLookup32(seed, lookedUpComplement, entries, nHits, hits, nRCHits, rcHits);
+}
+
+    void
+GenomeIndex::lookupSeedBatch32(
+    unsigned          nSeeds,
+    const Seed       *seeds,
+    _int64           *nHits,
+    const unsigned  **hits,
+    _int64           *nRCHits,
+    const unsigned  **rcHits)
+{
+    _ASSERT(locationSize == 4);   // This is the caller's responsibility to check.
+
+    bool lookedUpComplement[maxSeedsPerLookupBatch];
+    const char *entries[maxSeedsPerLookupBatch][NUM_DIRECTIONS];
+
+    for (unsigned batchStart = 0; batchStart < nSeeds; batchStart += maxSeedsPerLookupBatch) {
+        unsigned nSeedsThisBatch = __min(maxSeedsPerLookupBatch, nSeeds - batchStart);
+        findSeedEntriesBatch(nSeedsThisBatch, seeds + batchStart, lookedUpComplement, entries);
+        for (unsigned i = 0; i < nSeedsThisBatch; i++) {
+            unsigned which = batchStart + i;
+            fillInSeedLookup32(seeds[which], lookedUpComplement[i], entries[i], &nHits[which], &hits[which], &nRCHits[which], &rcHits[which]);
+        }
+    }
+}
+
     void
 GenomeIndex::fillInLookedUpResults32(
     const unsigned  *subEntry,
@@ -1940,31 +3162,20 @@ GenomeIndex::fillInLookedUpResults32(
     }
 }
 
-    void 
-GenomeIndex::lookupSeed(
-    Seed                    seed, 
-    _int64 *                nHits, 
-    const GenomeLocation ** hits, 
-    _int64 *                nRCHits, 
-    const GenomeLocation ** rcHits, 
-    GenomeLocation *        singleHit, 
+    void
+GenomeIndex::fillInSeedLookup(
+    Seed                    seed,
+    bool                    lookedUpComplement,
+    const char * const *    entries,
+    _int64 *                nHits,
+    const GenomeLocation ** hits,
+    _int64 *                nRCHits,
+    const GenomeLocation ** rcHits,
+    GenomeLocation *        singleHit,
     GenomeLocation *        singleRCHit)
 {
-    _ASSERT(locationSize > 4 && locationSize <= 8);
-
     if (largeHashTable) {
-        bool lookedUpComplement;
-
-        lookedUpComplement = seed.isBiggerThanItsReverseComplement();
-        if (lookedUpComplement) {
-            seed = ~seed;
-        }
-
-        _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-        _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-        _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() > 4);
-
-        const char *entry = (char *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(lowBases);
+        const char *entry = entries[0];
         if (NULL == entry) {
             *nHits = 0;
             *nRCHits = 0;
@@ -1995,10 +3206,7 @@ GenomeIndex::lookupSeed(
         }
     } else {
 	    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
-		    _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-		    _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-		    _ASSERT(hashTables[seed.getHighBases(hashTableKeySize)]->GetValueSizeInBytes() > 4);
-		    const char *entry = (char *)hashTables[seed.getHighBases(hashTableKeySize)]->GetFirstValueForKey(lowBases);   
+		    const char *entry = entries[dir];
 
             if (NULL == entry) {
 			    if (FORWARD == dir) {
@@ -2016,11 +3224,54 @@ GenomeIndex::lookupSeed(
 			        fillInLookedUpResults(entryByValue,  nRCHits, rcHits, singleRCHit);
                 }
 		    }
-		    seed = ~seed;
         }	// For each direction    
     }
 }
 
+    void 
+GenomeIndex::lookupSeed(
+    Seed                    seed, 
+    _int64 *                nHits, 
+    const GenomeLocation ** hits, 
+    _int64 *                nRCHits, 
+    const GenomeLocation ** rcHits, 
+    GenomeLocation *        singleHit, 
+    GenomeLocation *        singleRCHit)
+{
+    _ASSERT(locationSize > 4 && locationSize <= 8);
+
+    bool lookedUpComplement;
+    const char *entries[NUM_DIRECTIONS];
+    findSeedEntries(seed, &lookedUpComplement, entries);
+    fillInSeedLookup(seed, lookedUpComplement, entries, nHits, hits, nRCHits, rcHits, singleHit, singleRCHit);
+}
+
+    void
+GenomeIndex::lookupSeedBatch(
+    unsigned                nSeeds,
+    const Seed *            seeds,
+    _int64 *                nHits,
+    const GenomeLocation ** hits,
+    _int64 *                nRCHits,
+    const GenomeLocation ** rcHits,
+    GenomeLocation *        singleHits,
+    GenomeLocation *        singleRCHits)
+{
+    _ASSERT(locationSize > 4 && locationSize <= 8);
+
+    bool lookedUpComplement[maxSeedsPerLookupBatch];
+    const char *entries[maxSeedsPerLookupBatch][NUM_DIRECTIONS];
+
+    for (unsigned batchStart = 0; batchStart < nSeeds; batchStart += maxSeedsPerLookupBatch) {
+        unsigned nSeedsThisBatch = __min(maxSeedsPerLookupBatch, nSeeds - batchStart);
+        findSeedEntriesBatch(nSeedsThisBatch, seeds + batchStart, lookedUpComplement, entries);
+        for (unsigned i = 0; i < nSeedsThisBatch; i++) {
+            unsigned which = batchStart + i;
+            fillInSeedLookup(seeds[which], lookedUpComplement[i], entries[i], &nHits[which], &hits[which], &nRCHits[which], &rcHits[which],
+                &singleHits[which], &singleRCHits[which]);
+        }
+    }
+}
 
     void 
 GenomeIndex::fillInLookedUpResults(GenomeLocation lookedUpLocation, _int64 *nHits, const GenomeLocation **hits, GenomeLocation *singleHitLocation)
@@ -2065,3 +3316,292 @@ GenomeIndex::fillInLookedUpResults(GenomeLocation lookedUpLocation, _int64 *nHit
         *hits = (const GenomeLocation *)&overflowTable64[overflowTableOffset + 1];
     }
 }
+
+//
+// The HitListSearch file is this header, then the layouts (each starting on a cache line), and then the hash buckets
+// that find them.
+//
+struct HitListSearchFileHeader {
+    _uint64     magic;
+    _int64      elementSize;        // 4 or 8, the same as the overflow table's
+    _int64      overflowTableSize;  // of the overflow table the file goes with
+    _int64      minHits;
+    _int64      nLayoutElements;
+    _int64      nBuckets;           // a power of two
+    _int64      bucketsOffset;      // in bytes from the start of the file
+    _int64      unused;
+};
+
+static const _uint64 HitListSearchFileMagic = 0x31534c4850414e53;   // "SNAPHLS1"
+
+//
+// Reads an overflow table file and writes the layouts for its long hit lists to output, returning the overflow table index
+// of each one's first hit and where its layout starts.
+//
+template<class GL> static bool
+WriteHitListSearchLayouts(GenericFile *overflowTable, FILE *output, _int64 minHits, _int64 *o_overflowTableSize, _int64 *o_nLayoutElements,
+                          std::vector<std::pair<_int64, _int64> > *o_layouts)
+{
+    const _int64 sampleInterval = HitListSearch<GL>::SampleInterval;
+    const size_t chunkElements = 4 * 1024 * 1024;
+    GL *chunk = (GL *)BigAlloc(chunkElements * sizeof(GL));
+    GL padding[HitListSearch<GL>::SampleInterval];
+    memset(padding, 0, sizeof(padding));
+    std::vector<GL> samples;
+    std::vector<GL> layout;
+
+    _int64 index = 0;               // in the overflow table
+    _int64 listStart = 0;
+    _int64 listLength = 0;
+    _int64 hitsLeftInList = 0;
+    _int64 nLayoutElements = 0;
+    bool worked = true;
+
+    size_t elementsRead;
+    while (worked && 0 != (elementsRead = overflowTable->read(chunk, chunkElements * sizeof(GL)) / sizeof(GL))) {
+        for (size_t i = 0; i < elementsRead; i++, index++) {
+            if (0 == hitsLeftInList) {
+                //
+                // The overflow table is a count of hits followed by the hits, for each seed.
+                //
+                listStart = index + 1;
+                listLength = hitsLeftInList = (_int64)chunk[i];
+                samples.clear();
+                continue;
+            }
+
+            hitsLeftInList--;
+            if (listLength < minHits) {
+                continue;
+            }
+
+            if ((index - listStart) % sampleInterval == 0) {
+                samples.push_back(chunk[i]);
+            }
+
+            if (0 == hitsLeftInList) {
+                layout.resize(HitListSearch<GL>::LayoutSize(samples.size()));
+                HitListSearch<GL>::Build(&samples[0], samples.size(), &layout[0]);
+
+                _int64 nPadding = (sampleInterval - nLayoutElements % sampleInterval) % sampleInterval;
+                if (fwrite(padding, sizeof(GL), nPadding, output) != (size_t)nPadding ||
+                    fwrite(&layout[0], sizeof(GL), layout.size(), output) != layout.size()) {
+                    WriteErrorMessage("Error writing hit list search layouts, %d\n", errno);
+                    worked = false;
+                    break;
+                }
+                o_layouts->push_back(std::make_pair(listStart, nLayoutElements + nPadding));
+                nLayoutElements += nPadding + layout.size();
+            }
+        }
+    }
+
+    BigDealloc(chunk);
+
+    if (worked && hitsLeftInList != 0) {
+        WriteErrorMessage("The overflow table ends in the middle of a hit list\n");
+        worked = false;
+    }
+
+    *o_overflowTableSize = index;
+    *o_nLayoutElements = nLayoutElements;
+    return worked;
+}
+
+    bool
+GenomeIndex::WriteHitListSearchFile(const char *directoryName, unsigned locationSize, _int64 minHits)
+{
+    WriteStatusMessage("Laying out hit lists with at least %lld hits for searching...", minHits);
+    _int64 start = timeInMillis();
+
+    const size_t filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%cOverflowTable", directoryName, PATH_SEP);
+    GenericFile *overflowTable = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+    if (NULL == overflowTable) {
+        WriteErrorMessage("Unable to open overflow table file, '%s', %d\n", filenameBuffer, errno);
+        return false;
+    }
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%cHitListSearch", directoryName, PATH_SEP);
+    FILE *output = fopen(filenameBuffer, "wb");
+    if (NULL == output) {
+        WriteErrorMessage("Unable to open file '%s' for write, %d\n", filenameBuffer, errno);
+        overflowTable->close();
+        delete overflowTable;
+        return false;
+    }
+
+    HitListSearchFileHeader header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, output);    // filled in at the end
+
+    header.magic = HitListSearchFileMagic;
+    header.elementSize = (locationSize > 4) ? sizeof(_int64) : sizeof(unsigned);
+    header.minHits = minHits;
+
+    std::vector<std::pair<_int64, _int64> > layouts;
+    bool worked;
+    if (locationSize > 4) {
+        worked = WriteHitListSearchLayouts<_int64>(overflowTable, output, minHits, &header.overflowTableSize, &header.nLayoutElements, &layouts);
+    } else {
+        worked = WriteHitListSearchLayouts<unsigned>(overflowTable, output, minHits, &header.overflowTableSize, &header.nLayoutElements, &layouts);
+    }
+    overflowTable->close();
+    delete overflowTable;
+
+    //
+    // An open addressed hash table, at most half full.
+    //
+    header.nBuckets = 2;
+    while (header.nBuckets < 2 * (_int64)layouts.size()) {
+        header.nBuckets *= 2;
+    }
+    std::vector<HitListSearchBucket> buckets(header.nBuckets);
+    for (_int64 i = 0; i < header.nBuckets; i++) {
+        buckets[i].firstHit = -1;
+        buckets[i].layout = 0;
+    }
+    for (size_t i = 0; i < layouts.size(); i++) {
+        _uint64 bucket = hitListSearchHash(layouts[i].first) & (header.nBuckets - 1);
+        while (buckets[bucket].firstHit != -1) {
+            bucket = (bucket + 1) & (header.nBuckets - 1);
+        }
+        buckets[bucket].firstHit = layouts[i].first;
+        buckets[bucket].layout = layouts[i].second;
+    }
+
+    _int64 layoutBytes = header.nLayoutElements * header.elementSize;
+    _int64 bucketPadding = (8 - layoutBytes % 8) % 8;
+    header.bucketsOffset = sizeof(header) + layoutBytes + bucketPadding;
+    _int64 zero = 0;
+
+    worked = worked &&
+        fwrite(&zero, 1, bucketPadding, output) == (size_t)bucketPadding &&
+        fwrite(&buckets[0], sizeof(HitListSearchBucket), buckets.size(), output) == buckets.size() &&
+        0 == fseek(output, 0, SEEK_SET) &&
+        fwrite(&header, sizeof(header), 1, output) == 1;
+
+    if (0 != fclose(output) || !worked) {
+        WriteErrorMessage("Error writing file '%s', %d\n", filenameBuffer, errno);
+        return false;
+    }
+
+    WriteStatusMessage("%lld lists, %lld MB, %llds\n", (_int64)layouts.size(), (header.bucketsOffset + header.nBuckets * (_int64)sizeof(HitListSearchBucket)) / (1024 * 1024),
+        (timeInMillis() + 500 - start) / 1000);
+    return true;
+}
+
+    bool
+GenomeIndex::loadHitListSearchFile(const char *directoryName, bool map, bool sharedMemory)
+/*++
+
+Routine Description:
+
+    Load the HitListSearch file, if there is one, the same way as the rest of the index: mapped from shared memory for
+    -shm, mapped from the file for -map, and otherwise read into memory.
+
+--*/
+{
+    const size_t filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    char segmentName[filenameBufferSize];
+    snprintf(filenameBuffer, filenameBufferSize, "%s%cHitListSearch", directoryName, PATH_SEP);
+
+    if (sharedMemory) {
+        //
+        // The shared memory copy matched the files on disk, so if there's no segment then there's no file either.
+        //
+        getSharedMemorySegmentName(directoryName, "HitListSearch", segmentName, filenameBufferSize);
+        mappedHitListSearch = GenericFile_map::openSharedMemory(segmentName);
+        if (NULL == mappedHitListSearch) {
+            return true;    // It's optional
+        }
+    } else if (map) {
+        if (-1 == QueryFileModificationTime(filenameBuffer)) {
+            return true;    // It's optional
+        }
+        mappedHitListSearch = GenericFile_map::open(filenameBuffer);
+        if (NULL == mappedHitListSearch) {
+            WriteErrorMessage("Unable to open file '%s'\n", filenameBuffer);
+            return false;
+        }
+    }
+
+    GenericFile *file = mappedHitListSearch;
+    if (NULL == file) {
+        file = GenericFile::open(filenameBuffer, GenericFile::ReadOnly);
+        if (NULL == file) {
+            return true;    // It's optional
+        }
+    }
+
+    HitListSearchFileHeader header;
+    if (file->read(&header, sizeof(header)) != sizeof(header) || header.magic != HitListSearchFileMagic || header.nBuckets <= 0 ||
+        (header.nBuckets & (header.nBuckets - 1)) != 0 || header.bucketsOffset < (_int64)sizeof(header)) {
+        WriteErrorMessage("File '%s' is corrupt\n", filenameBuffer);
+        closeHitListSearchFile(file);
+        return false;
+    }
+
+    if (header.elementSize != (_int64)((locationSize > 4) ? sizeof(_int64) : sizeof(unsigned)) || header.overflowTableSize != (_int64)overflowTableSize) {
+        WriteErrorMessage("Warning: '%s' is left over from a different index, ignoring it.  Rebuild the index to get rid of this warning.\n", filenameBuffer);
+        closeHitListSearchFile(file);
+        return true;
+    }
+
+    size_t fileSize = header.bucketsOffset + header.nBuckets * sizeof(HitListSearchBucket);
+    size_t amountRead;
+    if (NULL != mappedHitListSearch) {
+        hitListSearchFile = (char *)mappedHitListSearch->mapAndAdvance(fileSize - sizeof(header), &amountRead) - sizeof(header);
+        if (!sharedMemory) {
+            mappedHitListSearch->prefetch();
+        }
+    } else {
+        hitListSearchFile = (char *)BigAlloc(fileSize);
+        memcpy(hitListSearchFile, &header, sizeof(header));
+        amountRead = file->read(hitListSearchFile + sizeof(header), fileSize - sizeof(header));
+        file->close();
+        delete file;
+    }
+
+    if (amountRead != fileSize - sizeof(header)) {
+        WriteErrorMessage("Error reading '%s', %lld != %lld bytes read.\n", filenameBuffer, amountRead, fileSize - sizeof(header));
+        if (NULL != mappedHitListSearch) {
+            closeHitListSearchFile(mappedHitListSearch);
+        } else {
+            BigDealloc(hitListSearchFile);
+        }
+        hitListSearchFile = NULL;
+        return false;
+    }
+
+    hitListSearchLayouts = hitListSearchFile + sizeof(header);
+    hitListSearchBuckets = (HitListSearchBucket *)(hitListSearchFile + header.bucketsOffset);
+    hitListSearchBucketMask = header.nBuckets - 1;
+    hitListSearchMinHits = header.minHits;
+    return true;
+}
+
+    void
+GenomeIndex::closeHitListSearchFile(GenericFile *file)
+{
+    file->close();
+    delete file;
+    if (file == mappedHitListSearch) {
+        mappedHitListSearch = NULL;
+    }
+}
+
+    const unsigned *
+GenomeIndex::getHitListSearch32(const unsigned *hits, _int64 nHits) const
+{
+    return (const unsigned *)getHitListSearch(hits - overflowTable32, nHits, sizeof(unsigned));
+}
+
+    const GenomeLocation *
+GenomeIndex::getHitListSearch(const GenomeLocation *hits, _int64 nHits) const
+{
+    return (const GenomeLocation *)getHitListSearch((const _int64 *)hits - overflowTable64, nHits, sizeof(_int64));
+}
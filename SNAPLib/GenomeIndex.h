@@ -29,6 +29,7 @@ Revision History:
 #include "Genome.h"
 #include "ApproximateCounter.h"
 #include "GenericFile_map.h"
+#include "directions.h"
 
 class GenomeIndex {
 public:
@@ -50,8 +51,28 @@ public:
     void lookupSeed(Seed seed, _int64 *nHits, const GenomeLocation **hits, _int64 *nRCHits, const GenomeLocation **rcHits, GenomeLocation *singleHit, GenomeLocation *singleRCHit);
     void lookupSeed32(Seed seed, _int64 *nHits, const unsigned **hits, _int64 *nRCHits, const unsigned **rcHits);
 
+    //
+    // Batched versions of lookupSeed and lookupSeed32, for when the caller knows a set of seeds it's going to look up
+    // (all of the seeds of a read, or of a pair of reads).  Nearly every hash table lookup in a large index is a cache
+    // miss, and looking them up one at a time takes those misses one after the other.  These hash all of the seeds
+    // and prefetch their hash table entries, then resolve the entries and prefetch the overflow table counts for seeds
+    // with more than one hit, and only then fill in the results, so the misses overlap.  The results are exactly what
+    // calling lookupSeed on each seed in turn would give; each output array has nSeeds elements.
+    //
+    void lookupSeedBatch(unsigned nSeeds, const Seed *seeds, _int64 *nHits, const GenomeLocation **hits, _int64 *nRCHits, const GenomeLocation **rcHits,
+                         GenomeLocation *singleHits, GenomeLocation *singleRCHits);
+    void lookupSeedBatch32(unsigned nSeeds, const Seed *seeds, _int64 *nHits, const unsigned **hits, _int64 *nRCHits, const unsigned **rcHits);
+
     bool doesGenomeIndexHave64BitLocations() const {return locationSize > 4;}
 
+    //
+    // If the index was built with -searchHits, hit lists at least that long also have a layout that's quicker to
+    // search than the list itself (see HitListSearch.h).  These take a hit list that lookupSeed or lookupSeed32
+    // returned and give its layout, or NULL if it doesn't have one.
+    //
+    const unsigned *getHitListSearch32(const unsigned *hits, _int64 nHits) const;
+    const GenomeLocation *getHitListSearch(const GenomeLocation *hits, _int64 nHits) const;
+
     //
     // Looks up a seed and its reverse complement, restricting the search to a given range of locations,
     // and returns the number and list of hits for each.
@@ -75,12 +96,41 @@ public:
     //
     static void runIndexer(int argc, const char **argv);
 
-    static GenomeIndex *loadFromDirectory(char *directoryName, bool map, bool prefetch);
+    //
+    // Load an index.  With sharedMemory, it maps the copy of the index that 'snap shm load' put into shared memory, which
+    // takes no time at all.  If there isn't one, it says so and loads the index normally.
+    //
+    static GenomeIndex *loadFromDirectory(char *directoryName, bool map, bool prefetch, bool packGenome = false, bool sharedMemory = false);
+
+    //
+    // Run the 'snap shm' command, which copies an index into named shared memory segments that stay around after SNAP
+    // exits (or deletes the copy), so that later runs can map it rather than loading it.
+    //
+    static void runSharedMemoryCommand(int argc, const char **argv);
+
+    static bool loadIntoSharedMemory(const char *directoryName);
+    static bool unloadFromSharedMemory(const char *directoryName);
 
     static void printBiasTables();
 
 protected:
 
+    //
+    // The files that make up an index, in the order they're copied into shared memory, and the names of the segments
+    // that hold them.  The segment for an index's directory itself (fileName NULL) is created after all of the others
+    // and deleted before them, so if it exists the index is all there.  It holds the size and modification time of each
+    // file as it was copied, so that a run can tell if the index on disk has changed since.  The first
+    // nRequiredIndexFiles of them are in every index; the rest are optional, and are skipped if they aren't there.
+    //
+    static const char *IndexFileNames[];
+    static const int nIndexFiles;
+    static const int nRequiredIndexFiles;
+    static void getSharedMemorySegmentName(const char *directoryName, const char *fileName, char *segmentName, size_t segmentNameSize);
+
+    // fills in the size and modification time of each index file, 2 * nIndexFiles in all (both -1 for a missing optional
+    // file); false if a required one's missing
+    static bool getIndexFileStamps(const char *directoryName, _int64 *stamps);
+
     int seedLen;
     unsigned hashTableKeySize;
     unsigned nHashTables;
@@ -103,6 +153,47 @@ protected:
     void *tablesBlob;   // All of the hash tables in one giant blob
 	GenericFile_map *mappedTables;
 
+    //
+    // The HitListSearch file, which is optional.  Its layouts are found by a hash of the overflow table index
+    // of their list's first hit.
+    //
+    struct HitListSearchBucket {
+        _int64 firstHit;    // -1 if the bucket is empty
+        _int64 layout;      // element index in hitListSearchLayouts
+    };
+
+    char *hitListSearchFile;
+    GenericFile_map *mappedHitListSearch;
+    _int64 hitListSearchMinHits;
+    HitListSearchBucket *hitListSearchBuckets;
+    _uint64 hitListSearchBucketMask;
+    const void *hitListSearchLayouts;
+
+    static inline _uint64 hitListSearchHash(_int64 firstHit) {
+        return ((_uint64)firstHit * 0x9e3779b97f4a7c15ull) >> 24;
+    }
+
+    inline const void *getHitListSearch(_int64 firstHit, _int64 nHits, size_t elementSize) const {
+        if (nHits < hitListSearchMinHits || NULL == hitListSearchBuckets) {
+            return NULL;
+        }
+        for (_uint64 i = hitListSearchHash(firstHit) & hitListSearchBucketMask; hitListSearchBuckets[i].firstHit != -1; i = (i + 1) & hitListSearchBucketMask) {
+            if (hitListSearchBuckets[i].firstHit == firstHit) {
+                return (const char *)hitListSearchLayouts + hitListSearchBuckets[i].layout * elementSize;
+            }
+        }
+        return NULL;
+    }
+
+    //
+    // Writes the HitListSearch file for an index that's already in directoryName, with layouts for the hit lists
+    // with at least minHits hits.
+    //
+    static bool WriteHitListSearchFile(const char *directoryName, unsigned locationSize, _int64 minHits);
+
+    bool loadHitListSearchFile(const char *directoryName, bool map, bool sharedMemory);
+    void closeHitListSearchFile(GenericFile *file);  // and forget it if it's mappedHitListSearch
+
     //
     // We have to build the overflow table in two stages.  While we're walking the genome, we first
     // assign tentative overflow table locations, and build up a list of places where each repeat
@@ -148,20 +239,35 @@ protected:
     // the only way to get one is to build it into a directory and then load it from the directory.
     // NB: This deletes the Genome that's passed into it.
     //
+    // If memoryBudget is nonzero, the hash tables and overflow table are built out of core (see BuildTablesOutOfCore)
+    // using about that many bytes of memory in addition to the genome.  The index is the same either way.
+    //
     static bool BuildIndexToDirectory(const Genome *genome, int seedLen, double slack,
                                       bool computeBias, const char *directory,
                                       unsigned maxThreads, unsigned chromosomePaddingSize, bool forceExact, 
                                       unsigned hashTableKeySize, bool large, const char *histogramFileName,
-                                      unsigned locationSize, bool smallMemory);
+                                      unsigned locationSize, bool smallMemory, bool packGenome, bool cacheLineBuckets,
+                                      size_t memoryBudget);
 
  
     //
     // Allocate set of hash tables indexed by seeds with bias
     //
     static SNAPHashTable** allocateHashTables(unsigned* o_nTables, GenomeDistance countOfBases, double slack,
-        int seedLen, unsigned hashTableKeySize, bool large, unsigned locationSize, double* biasTable = NULL);
+        int seedLen, unsigned hashTableKeySize, bool large, unsigned locationSize, bool cacheLineBuckets, double* biasTable = NULL);
+
+    //
+    // The pieces of allocateHashTables: checking the parameters (which returns the number of hash tables) and allocating one table.
+    //
+    static unsigned checkHashTableParameters(double slack, int seedLen, unsigned hashTableKeySize, unsigned locationSize);
+    static SNAPHashTable *allocateHashTable(unsigned whichHashTable, unsigned nHashTables, GenomeDistance countOfBases, double slack,
+        unsigned hashTableKeySize, bool large, unsigned locationSize, bool cacheLineBuckets, double *biasTable);
     
-    static const unsigned GenomeIndexFormatMajorVersion = 5;
+    //
+    // Version 6 added hash tables with cache line buckets.  Indices that don't use them are still written as version 5.
+    //
+    static const unsigned GenomeIndexFormatMajorVersion = 6;
+    static const unsigned GenomeIndexFormatMajorVersionWithoutCacheLineBuckets = 5;
     static const unsigned GenomeIndexFormatMinorVersion = 0;
     
     static const unsigned largestBiasTable = 32;    // Can't be bigger than the biggest seed size, which is set in Seed.h.  Bigger than 32 means a new Seed structure.
@@ -192,97 +298,149 @@ protected:
 
     struct OverflowBackpointer;
 
+    struct IndexBuildStats {
+        IndexBuildStats() : noBaseAvailable(0), nonSeeds(0), bothComplementsUsed(0), genomeLocationsInOverflowTable(0),
+                            seedsWithMultipleOccurrences(0) {}
+        _int64 noBaseAvailable;
+        _int64 nonSeeds;
+        _int64 bothComplementsUsed;
+        _int64 genomeLocationsInOverflowTable;
+        _int64 seedsWithMultipleOccurrences;
+    };
+
+    //
+    // The hash tables are built a window of the genome at a time, in two phases per window.  In the partition phase, each
+    // thread takes a slice of the window and counting sorts its seeds by which hash table they go in.  In the insert phase,
+    // each thread takes groups of hash tables and inserts all of the window's seeds for them, going through the slices in
+    // order.  Since a hash table belongs to only one thread at a time there are no locks, and since the seeds for any one
+    // table go in in genome order the index comes out the same regardless of the number of threads.
+    //
+    struct IndexBuildEntry {
+        _uint64         lowBases;
+        _uint64         genomeLocationAndComplement;    // The high bit is set if the seed is its reverse complement
+
+        static const _uint64 usingComplementFlag = (_uint64)1 << 63;
+    };
+
+    enum BuildHashTablesPhase {PartitionSeedsPhase, InsertSeedsPhase};
+
     struct BuildHashTablesThreadContext {
 		unsigned						 nThreads;
 		unsigned						 whichThread;
         SingleWaiterObject              *doneObject;
         volatile int                    *runningThreadCount;
-        GenomeLocation                   genomeChunkStart;
+        BuildHashTablesPhase             phase;
+        GenomeLocation                   genomeChunkStart;      // This thread's slice of the current window
         GenomeLocation                   genomeChunkEnd;
         const Genome                    *genome;
-        volatile _int64                 *nBasesProcessed;
         unsigned                         seedLen;
-        volatile _int64                 *noBaseAvailable;
-        volatile _int64                 *nonSeeds;
-        volatile _int64                 *seedsWithMultipleOccurrences;
-        volatile _int64                 *bothComplementsUsed;
         GenomeIndex                     *index;
 		OverflowBackpointerAnchor		*overflowAnchor;
         volatile _int64                 *nextOverflowBackpointer;
-        volatile _int64                 *genomeLocationsInOverflowTable;
         unsigned                         hashTableKeySize;
 		bool							 large;
         unsigned                         locationSize;
+        IndexBuildStats                  stats;
+
+        //
+        // Output of the partition phase.  The entries for hash table i are entries[firstEntryForHashTable[i]] through
+        // entries[firstEntryForHashTable[i+1] - 1], in genome order.  unsortedEntries and hashTableForEntry are scratch space.
+        //
+        IndexBuildEntry                 *entries;
+        IndexBuildEntry                 *unsortedEntries;
+        unsigned                        *hashTableForEntry;
+        unsigned                        *firstEntryForHashTable;
+        unsigned                        *nextEntryForHashTable;
+
+        //
+        // For the insert phase.  Threads grab groups of hash tables with nextHashTableGroup, and record how much of the
+        // overflow table each hash table will need so that the overflow table can be built in parallel later.
+        //
+        BuildHashTablesThreadContext    *allContexts;
+        volatile int                    *nextHashTableGroup;
+        unsigned                         hashTablesPerGroup;
+        _int64                          *overflowEntriesForHashTable;
+
+        //
+        // Overflow backpointers are handed out to threads in blocks, so that they don't all fight over one counter.
+        //
+        _int64                           nextBackpointerInBlock;
+        _int64                           backpointerBlockEnd;
+        static const _int64              backpointerBlockSize = 64 * 1024;
 
 		//
 		// The "small memory" option causes SNAP to write out the backpointer table as it's
 		// built in order to save the memory it uses, because it's accessed sequentially as
 		// the table is built.  In order to be able to tell when it's safe to free some of the
-		// table, each thread occasionally records the largest backpointer index that it's done
-		// with.  It's safe to free table chunks that are less than the least of these.  The lock
-		// is used to keep more than one thread from trying to spill table at a time.
+		// table, each thread records the start of each backpointer block it takes, since it
+		// won't ever write anything lower than that again.  It's safe to free table chunks that
+		// are less than the least of these.  The lock is used to keep more than one thread from
+		// trying to spill table at a time.
 		//
 		_int64							*lastBackpointerIndexUsedByThread;
 		ExclusiveLock					*backpointerSpillLock;
 		FILE							*backpointerSpillFile;
-
-        ExclusiveLock                   *hashTableLocks;
-        ExclusiveLock                   *overflowTableLock;
     };
 
-    struct PerHashTableBatch {
-        PerHashTableBatch() : nUsed(0) {}
-
-        static const unsigned nSeedsPerBatch = 1000;
-
-        unsigned nUsed;
-
-        struct Entry {
-            bool usingComplement;
-            _uint64 lowBases;
-            GenomeLocation genomeLocation;
-        };
-
-        Entry entries[nSeedsPerBatch];
-
-        bool addSeed(GenomeLocation genomeLocation, _uint64 seedLowBases, bool seedUsingComplement) {
-            _ASSERT(nUsed < nSeedsPerBatch);
-            entries[nUsed].lowBases = seedLowBases;
-            entries[nUsed].usingComplement = seedUsingComplement;
-            entries[nUsed].genomeLocation = genomeLocation;
-            nUsed++;
-            return nUsed >= nSeedsPerBatch;
-        }
+    static const _int64 printPeriod;
+    static const GenomeDistance hashTableBuildWindowSize;
 
-        void clear()
-        {
-            nUsed = 0;
-        }
-    };
+    static void BuildHashTablesWorkerThreadMain(void *param);
+    static void RunBuildHashTablesPhase(BuildHashTablesThreadContext *threadContexts, unsigned nThreads, BuildHashTablesPhase phase);
+    void PartitionSeeds(BuildHashTablesThreadContext *context);
+    void InsertSeeds(BuildHashTablesThreadContext *context);
+    static void ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64 whichHashTable, GenomeLocation genomeLocation, _uint64 lowBases, bool usingComplement,
+                    _int64 *bothComplementsUsed, _int64 *genomeLocationsInOverflowTable, _int64 *seedsWithMultipleOccurrences, bool large);
 
-    struct IndexBuildStats {
-        IndexBuildStats() : noBaseAvailable(0), nonSeeds(0), bothComplementsUsed(0), genomeLocationsInOverflowTable(0),
-                            unrecordedSkippedSeeds(0), seedsWithMultipleOccurrences(0) {}
-        _int64 noBaseAvailable;
-        _int64 nonSeeds;
-        _int64 bothComplementsUsed;
-        _int64 genomeLocationsInOverflowTable;
-        _int64 seedsWithMultipleOccurrences;
-        _uint64 unrecordedSkippedSeeds;
+    //
+    // The overflow table build.  Each hash table's piece of the overflow table is known from the hash table build, so
+    // threads can fix up different hash tables and sort their overflow lists at the same time.
+    //
+    struct BuildOverflowTableThreadContext {
+        SingleWaiterObject              *doneObject;
+        volatile int                    *runningThreadCount;
+        GenomeIndex                     *index;
+		OverflowBackpointerAnchor		*overflowAnchor;
+        GenomeDistance                   countOfBases;
+        unsigned                         locationSize;
+		bool							 large;
+        volatile int                    *nextHashTable;
+        unsigned                         endHashTable;      // Exclusive end of the tables to be processed in this pass
+        const _int64                    *overflowTableOffsetForHashTable;
+        const char                      *halfBuiltHashTableSpillFileNameBase;     // NULL unless the hash tables were spilled
     };
 
-    static const _int64 printPeriod;
+    static void BuildOverflowTableWorkerThreadMain(void *param);
+    void BuildOverflowTableForHashTable(BuildOverflowTableThreadContext *context, unsigned whichHashTable);
 
-    virtual void indexSeed(GenomeLocation genomeLocation, Seed seed, PerHashTableBatch *batches, BuildHashTablesThreadContext *context, IndexBuildStats *stats, bool large);
-    virtual void completeIndexing(PerHashTableBatch *batches, BuildHashTablesThreadContext *context, IndexBuildStats *stats, bool large);
+    //
+    // The histogram of how many times seeds occur in the genome, for -H.
+    //
+    struct SeedHistogram {
+        SeedHistogram();
+        ~SeedHistogram();
+
+        void recordSeed(_uint64 nOccurrences);
+        void write(FILE *histogramFile);
+
+        static const unsigned maxHistogramEntry = 500000;
+        unsigned *histogram;
+        _uint64 countOfTooBigForHistogram;
+        _uint64 sumOfTooBigForHistogram;
+        _uint64 largestSeed;
+    };
 
-    static void BuildHashTablesWorkerThreadMain(void *param);
-    void BuildHashTablesWorkerThread(BuildHashTablesThreadContext *context);
-    static void ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64 whichHashTable, GenomeLocation genomeLocation, _uint64 lowBases, bool usingComplement,
-                    _int64 *bothComplementsUsed, _int64 *genomeLocationsInOverflowTable, _int64 *seedsWithMultipleOccurrences, bool large);
+    //
+    // The out of core build.  It writes the seeds out to disk in sorted runs, merges them and then builds the hash tables
+    // (and their pieces of the overflow table) one at a time in order.  It writes GenomeIndexHash and OverflowTable, and
+    // deletes the genome once it's done with it.
+    //
+    static bool BuildTablesOutOfCore(const Genome *genome, int seedLen, double slack, const char *directoryName, unsigned hashTableKeySize,
+                        bool large, unsigned locationSize, bool cacheLineBuckets, double *biasTable, size_t memoryBudget, SeedHistogram *histogram,
+                        unsigned *nHashTables, _int64 *overflowTableSize, size_t *hashTableBytesWritten);
 
-    static int BackwardsUnsignedCompare(const void *, const void *);
-    static int BackwardsInt64Compare(const void *, const void *);
+    static bool WriteIndexHeaderFile(const char *directoryName, bool cacheLineBuckets, unsigned nHashTables, _int64 overflowTableSize, int seedLen,
+                        unsigned chromosomePaddingSize, unsigned hashTableKeySize, size_t hashTableBytesWritten, bool large, unsigned locationSize);
 
     GenomeIndex();
 
@@ -296,4 +454,19 @@ protected:
 
     void fillInLookedUpResults32(const unsigned *subEntry, _int64 *nHits, const unsigned **hits);
     void fillInLookedUpResults(GenomeLocation lookedUpLocation, _int64 *nHits, const GenomeLocation **hits, GenomeLocation *singleHitLocation);
+
+    //
+    // The pieces of a seed lookup.  findSeedEntries gets the hash table entry (or entries, for non-large tables, where
+    // the seed and its reverse complement are stored separately) and fillInSeedLookup[32] turns them into hit lists.
+    // findSeedEntriesBatch does the former for a group of seeds, with prefetching.
+    //
+    static const unsigned maxSeedsPerLookupBatch = 32;
+
+    void findSeedEntries(Seed seed, bool *lookedUpComplement, const char **entries);
+    void findSeedEntriesBatch(unsigned nSeeds, const Seed *seeds, bool *lookedUpComplement, const char *(*entries)[NUM_DIRECTIONS]);
+    void prefetchOverflowTableEntry(_uint64 lookedUpLocation);
+    void fillInSeedLookup(Seed seed, bool lookedUpComplement, const char * const *entries, _int64 *nHits, const GenomeLocation **hits,
+                          _int64 *nRCHits, const GenomeLocation **rcHits, GenomeLocation *singleHit, GenomeLocation *singleRCHit);
+    void fillInSeedLookup32(Seed seed, bool lookedUpComplement, const char * const *entries, _int64 *nHits, const unsigned **hits,
+                          _int64 *nRCHits, const unsigned **rcHits);
 };
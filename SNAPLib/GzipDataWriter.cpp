@@ -23,7 +23,7 @@ Environment:
 #include "ParallelTask.h"
 #include "RangeSplitter.h"
 #include "Bam.h"
-#include "zlib.h"
+#include "Deflate.h"
 #include "exit.h"
 #include "Error.h"
 
@@ -37,8 +37,9 @@ class GzipCompressWorkerManager : public ParallelWorkerManager
 {
 public:
     GzipCompressWorkerManager(GzipWriterFilterSupplier* i_filterSupplier)
-        : filterSupplier(i_filterSupplier), buffer(NULL),
-        chunkSize(i_filterSupplier->chunkSize), bam(i_filterSupplier->bamFormat)
+        : chunkSize(i_filterSupplier->chunkSize),
+        inputChunkSize(i_filterSupplier->bamFormat ? min(i_filterSupplier->chunkSize, (size_t) BAM_BLOCK_INPUT) : i_filterSupplier->chunkSize),
+        bam(i_filterSupplier->bamFormat), level(i_filterSupplier->level), filterSupplier(i_filterSupplier), buffer(NULL)
     {}
 
     virtual ~GzipCompressWorkerManager();
@@ -54,8 +55,10 @@ public:
 private:
     VariableSizeVector<size_t> sizes;
     volatile int nChunks;
-    const size_t chunkSize;
+    const size_t chunkSize; // room for each compressed chunk
+    const size_t inputChunkSize; // uncompressed bytes in each chunk
     const bool bam;
+    const int level;
     FileEncoder* encoder;
     GzipWriterFilterSupplier* filterSupplier;
     char* input;
@@ -70,17 +73,16 @@ private:
 class GzipCompressWorker : public ParallelWorker
 {
 public:
-    GzipCompressWorker() : heap(NULL) {}
+    GzipCompressWorker() : compressor(NULL) {}
 
-    virtual ~GzipCompressWorker() { delete heap; }
+    virtual ~GzipCompressWorker() { delete compressor; }
 
     virtual void step();
 
-    static size_t compressChunk(z_stream& zstream, bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
+    static size_t compressChunk(GzipCompressor* compressor, bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
 
 private:
-    z_stream zstream;
-    ThreadHeap* heap;
+    GzipCompressor* compressor;
 };
 
 // used for case where each thread compresses by itself
@@ -131,12 +133,12 @@ GzipCompressWorkerManager::beginStep()
         return;
     }
     encoder->getEncodeBatch(&input, &inputSize, &inputUsed);
-    nChunks = (int) ((inputUsed + chunkSize - 1) / chunkSize);
+    nChunks = (int) ((inputUsed + inputChunkSize - 1) / inputChunkSize);
     sizes.clear();
     sizes.extend(nChunks);
 
     if (buffer == NULL) {
-        buffer = (char*) BigAlloc(inputSize);
+        buffer = (char*) BigAlloc(((inputSize + inputChunkSize - 1) / inputChunkSize) * chunkSize);
     }
 }
 
@@ -150,9 +152,9 @@ GzipCompressWorkerManager::finishStep()
     encoder->getOffsets(&logicalOffset, &physicalOffset);
     for (int i = 0; i < nChunks; i++) {
         translation.push_back(pair<_uint64,_uint64>(logicalOffset, physicalOffset + toUsed));
-        _ASSERT(i * chunkSize < inputUsed);
+        _ASSERT(i * inputChunkSize < inputUsed);
         _ASSERT(sizes[i] <= chunkSize);
-        size_t logicalChunk = min(chunkSize, inputUsed - i * chunkSize);
+        size_t logicalChunk = min(inputChunkSize, inputUsed - i * inputChunkSize);
         logicalOffset += logicalChunk;
         _ASSERT(((BgzfHeader*)(buffer + i * chunkSize))->validate(sizes[i], logicalChunk));
         memcpy(input + toUsed, buffer + i * chunkSize, sizes[i]);
@@ -168,21 +170,18 @@ GzipCompressWorkerManager::finishStep()
 GzipCompressWorker::step()
 {
     GzipCompressWorkerManager* supplier = (GzipCompressWorkerManager*) getManager();
-    if (heap == NULL) {
-        heap = new ThreadHeap(supplier->chunkSize * 8); // appears to use 4*chunkSize per run
-        zstream.zalloc = zalloc;
-        zstream.zfree = zfree;
-        zstream.opaque = heap;
+    if (compressor == NULL) {
+        compressor = GzipCompressor::create(supplier->level);
     }
     //fprintf(stderr, "zip task thread %d begin\n", GetCurrentThreadId());
     _int64 start = timeInMillis();
     int begin = (getThreadNum() * supplier->nChunks) / getNumThreads();
     int end = ((1 + getThreadNum()) * supplier->nChunks) / getNumThreads();
     for (int i = begin; i < end; i++) {
-        size_t bytes = min(supplier->chunkSize, supplier->inputUsed - i * supplier->chunkSize);
-        supplier->sizes[i] = compressChunk(zstream, supplier->bam,
+        size_t bytes = min(supplier->inputChunkSize, supplier->inputUsed - i * supplier->inputChunkSize);
+        supplier->sizes[i] = compressChunk(compressor, supplier->bam,
             supplier->buffer + i * supplier->chunkSize, supplier->chunkSize,
-            supplier->input + i * supplier->chunkSize, bytes);
+            supplier->input + i * supplier->inputChunkSize, bytes);
         _ASSERT(supplier->sizes[i] <= supplier->chunkSize); // can't grow!
     }
 }
@@ -190,7 +189,7 @@ GzipCompressWorker::step()
 
     size_t
 GzipCompressWorker::compressChunk(
-    z_stream& zstream,
+    GzipCompressor* compressor,
     bool bamFormat,
     char* toBuffer,
     size_t toSize,
@@ -201,92 +200,12 @@ GzipCompressWorker::compressChunk(
         WriteErrorMessage("exceeded BAM chunk size\n");
         soft_exit(1);
     }
-    if (zstream.opaque != NULL) {
-        ((ThreadHeap*)zstream.opaque)->reset();
-    }
-    // set up BAM header structure
-    gz_header header;
-    _uint8 bamExtraData[6];
-    if (bamFormat) {
-        header.text = false;
-        header.time = 0;
-        header.xflags = 0;
-        header.os = 0;
-        header.extra = bamExtraData;
-        header.extra_len = 6;
-        header.extra_max = 6;
-        header.name = NULL;
-        header.name_max = 0;
-        header.comment = NULL;
-        header.comm_max = 0;
-        header.hcrc = false;
-        header.done = true;
-        bamExtraData[0] = 'B';
-        bamExtraData[1] = 'C';
-        bamExtraData[2] = 2;
-        bamExtraData[3] = 0;
-        bamExtraData[4] = 3; // will be filled in later
-        bamExtraData[5] = 7; // will be filled in later
-    }
-
-    if (fromUsed > 0xffffffff || toSize > 0xffffffff) {
-        WriteErrorMessage("GZipDataWriter: fromUsed or toSize too big\n");
-        soft_exit(1);
-    }
-
-    // based on sample code at http://www.lemoda.net/c/zlib-open-write/index.html
-    const int windowBits = 15;
-    const int GZIP_ENCODING = 16;
-    zstream.next_in = (Bytef*) fromBuffer;
-    zstream.avail_in = (uInt)fromUsed;
-    zstream.next_out = (Bytef*) toBuffer;
-    zstream.avail_out = (uInt)toSize;
-    uInt oldAvail;
-    int status;
-
-    status = deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY);
-    if (status < 0) {
-        WriteErrorMessage("GzipWriterFilter: deflateInit2 failed with %d\n", status);
-        soft_exit(1);
-    }
-    if (bamFormat) {
-        status = deflateSetHeader(&zstream, &header);
-        if (status != Z_OK) {
-            WriteErrorMessage("GzipWriterFilter: defaultSetHeader failed with %d\n", status);
-            soft_exit(1);
-        }
-    }
-    oldAvail = zstream.avail_out;
-    status = deflate(&zstream, Z_FINISH);
-    if (status < 0 && status != Z_BUF_ERROR) {
-        WriteErrorMessage("GzipWriterFilter: deflate failed with %d\n", status);
+    size_t toUsed = compressor->compress(bamFormat, toBuffer, toSize, fromBuffer, fromUsed);
+    if (toUsed == 0) {
+        WriteErrorMessage("GzipWriterFilter: %s couldn't compress %lld bytes into %lld at level %d\n",
+            GzipCompressor::Library, (_int64) fromUsed, (_int64) toSize, compressor->getLevel());
         soft_exit(1);
     }
-
-    // make sure it all got written out in a single compressed block
-    if (zstream.avail_in != 0) {
-        WriteErrorMessage("GzipWriterFilter: default failed to read all input\n");
-        soft_exit(1);
-    }
-    if (zstream.avail_out == oldAvail) {
-        WriteErrorMessage("GzipWriterFilter: default failed to write output\n");
-        soft_exit(1);
-    }
-    status = deflateEnd(&zstream);
-    if (status < 0) {
-        WriteErrorMessage("GzipWriterFilter: deflateEnd failed with %d\n", status);
-        soft_exit(1);
-    }
-
-    size_t toUsed = toSize - zstream.avail_out;
-    if (bamFormat) {
-        // backpatch compressed block size into gzip header
-        if (toUsed >= BAM_BLOCK) {
-            WriteErrorMessage("exceeded BAM chunk size\n");
-            soft_exit(1);
-        }
-        * (_uint16*) (toBuffer + 16) = (_uint16) (toUsed - 1);
-    }
     return toUsed;
 }
 
@@ -341,9 +260,10 @@ DataWriterSupplier::gzip(
     size_t chunkSize,
     int numThreads,
     bool bindToProcessors,
-    bool multiThreaded)
+    bool multiThreaded,
+    int level)
 {
-    return new GzipWriterFilterSupplier(bamFormat, chunkSize, numThreads, bindToProcessors, multiThreaded);
+    return new GzipWriterFilterSupplier(bamFormat, chunkSize, numThreads, bindToProcessors, multiThreaded, level);
 }
 
     DataWriter::Filter*
@@ -360,18 +280,14 @@ GzipWriterFilterSupplier::onClosing(
         closing = true;
         DataWriter* writer = supplier->getWriter();
         // write empty block as BAM end of file marker
-        static _uint8 eof[] = {
-            0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
-            0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-        };
         char* buffer;
         size_t bytes;
-        if (! (writer->getBuffer(&buffer, &bytes) && bytes >= sizeof(eof))) {
+        if (! (writer->getBuffer(&buffer, &bytes) && bytes >= sizeof(BgzfHeader::EofMarker))) {
             WriteErrorMessage("no space to write eof marker\n");
             soft_exit(1);
         }
-        memcpy(buffer, eof, sizeof(eof));
-        writer->advance(sizeof(eof));
+        memcpy(buffer, BgzfHeader::EofMarker, sizeof(BgzfHeader::EofMarker));
+        writer->advance(sizeof(BgzfHeader::EofMarker));
 
         // add final translation for last empty block
         writer->nextBatch();
@@ -36,14 +36,15 @@ using std::pair;
 class GzipWriterFilterSupplier : public DataWriter::FilterSupplier
 {
 public:
-    GzipWriterFilterSupplier(bool i_bamFormat, size_t i_chunkSize, int i_numThreads, bool i_bindToProcessors, bool i_multiThreaded)
+    GzipWriterFilterSupplier(bool i_bamFormat, size_t i_chunkSize, int i_numThreads, bool i_bindToProcessors, bool i_multiThreaded, int i_level)
     :
         FilterSupplier(DataWriter::ResizeFilter),
+        multiThreaded(i_multiThreaded),
         bamFormat(i_bamFormat),
         chunkSize(i_chunkSize),
         numThreads(i_numThreads),
         bindToProcessors(i_bindToProcessors),
-        multiThreaded(i_multiThreaded),
+        level(i_level),
         closing(false)
     {
         InitializeExclusiveLock(&lock);
@@ -95,6 +96,7 @@ private:
     const size_t chunkSize;
     const int numThreads;
     const bool bindToProcessors;
+    const int level; // compression level, -1 for the default
     ExclusiveLock lock;
     VariableSizeVector< pair<_uint64,_uint64> > translation;
     bool closing;
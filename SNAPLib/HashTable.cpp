@@ -29,7 +29,8 @@ SNAPHashTable::SNAPHashTable(
     unsigned    i_keySizeInBytes,
     unsigned    i_valueSizeInBytes,
     unsigned    i_valueCount,
-    _uint64     i_invalidValueValue)
+    _uint64     i_invalidValueValue,
+    bool        i_cacheLineBuckets)
 /*++
 
 Routine Description:
@@ -38,6 +39,7 @@ Routine Description:
 
 Arguments:
     tableSize           - How many slots should the table have.
+    cacheLineBuckets    - Whether to group the slots into cache line sized buckets
 --*/
 {
     keySizeInBytes = i_keySizeInBytes;
@@ -47,6 +49,10 @@ Arguments:
     elementSize = keySizeInBytes + valueSizeInBytes * valueCount;
     tableSize = i_tableSize;
     usedElementCount = 0;
+    cacheLineBuckets = i_cacheLineBuckets;
+    entriesPerBucket = 0;
+    fingerprintBytesPerBucket = 0;
+    nBuckets = 0;
     Table = NULL;
 
     if (tableSize <= 0) {
@@ -54,9 +60,26 @@ Arguments:
         return;
     }
 
-	Table = BigAlloc(tableSize * elementSize);
+    if (cacheLineBuckets) {
+        if (!computeBucketLayout()) {
+            WriteErrorMessage("SNAPHashTable: entries of %d bytes are too big for cache line buckets\n", elementSize);
+            soft_exit(1);
+        }
+        nBuckets = (tableSize + entriesPerBucket - 1) / entriesPerBucket;
+        tableSize = nBuckets * entriesPerBucket;
+    }
+
+	Table = BigAlloc(getTableSizeInBytes());
     ownsMemoryForTable = true;
 
+    if (cacheLineBuckets) {
+        //
+        // Clears all of the fingerprints, and also the unused space at the end of the buckets so that the index
+        // files are deterministic.
+        //
+        memset(Table, 0, getTableSizeInBytes());
+    }
+
     //
     // Run through the table and set all of the first values to invalidValueValue, which means
     // unused.
@@ -64,7 +87,7 @@ Arguments:
 
     for (size_t i = 0; i < tableSize; i++) {
         void *entry = getEntry(i);
-		_ASSERT(entry >= Table && entry <= (char *)Table + tableSize * elementSize);
+		_ASSERT(entry >= Table && entry <= (char *)Table + getTableSizeInBytes());
         clearKey(entry);
         memcpy(getEntry(i), &invalidValueValue, valueSizeInBytes);
     }
@@ -75,12 +98,13 @@ SNAPHashTable *SNAPHashTable::loadFromBlob(GenericFile_Blob *loadFile)
 	SNAPHashTable *table = loadCommon(loadFile);
 
 	size_t bytesMapped;
-	table->Table = loadFile->mapAndAdvance(table->tableSize * table->elementSize, &bytesMapped);
-	if (bytesMapped != table->tableSize * table->elementSize) {
+	table->Table = loadFile->mapAndAdvance(table->getTableSizeInBytes(), &bytesMapped);
+	if (bytesMapped != table->getTableSizeInBytes()) {
 		WriteErrorMessage("SNAPHashTable: unable to map table\n");
 		soft_exit(1);
 	}
 	table->ownsMemoryForTable = false;
+	_ASSERT(table->BucketsAreCacheLineAligned());
 
 	return table;
 }
@@ -88,9 +112,10 @@ SNAPHashTable *SNAPHashTable::loadFromBlob(GenericFile_Blob *loadFile)
 SNAPHashTable *SNAPHashTable::loadFromGenericFile(GenericFile *loadFile)
 {
 	SNAPHashTable *table = loadCommon(loadFile);
-	table->Table = BigAlloc(table->tableSize * table->elementSize);
-	loadFile->read(table->Table, table->tableSize * table->elementSize);
+	table->Table = BigAlloc(table->getTableSizeInBytes());
+	loadFile->read(table->Table, table->getTableSizeInBytes());
 	table->ownsMemoryForTable = true;
+	_ASSERT(table->BucketsAreCacheLineAligned());
 
 	return table;
 }
@@ -105,10 +130,15 @@ SNAPHashTable *SNAPHashTable::loadCommon(GenericFile *loadFile)
         soft_exit(1);
     }
 
-    if (fileMagic != magic) {
+    if (fileMagic != magic && fileMagic != cacheLineBucketsMagic) {
         WriteErrorMessage("SNAPHashTable: magic number mismatch.  Perhaps you have a corruped index.  %d != %d\n", fileMagic, magic);
         soft_exit(1);
     }
+
+    table->cacheLineBuckets = (fileMagic == cacheLineBucketsMagic);
+    table->entriesPerBucket = 0;
+    table->fingerprintBytesPerBucket = 0;
+    table->nBuckets = 0;
  
     if (sizeof(table->tableSize) != loadFile->read(&table->tableSize, sizeof(table->tableSize))) {
         WriteErrorMessage("SNAPHashTable::SNAPHashTable fread table size failed\n");
@@ -169,7 +199,28 @@ SNAPHashTable *SNAPHashTable::loadCommon(GenericFile *loadFile)
 
     table->elementSize = table->keySizeInBytes + table->valueSizeInBytes * table->valueCount;
 
+    if (table->cacheLineBuckets) {
+        unsigned fileEntriesPerBucket;
+        if (sizeof(fileEntriesPerBucket) != loadFile->read(&fileEntriesPerBucket, sizeof(fileEntriesPerBucket))) {
+            WriteErrorMessage("SNAPHashTable::SNAPHashTable: unable to read entries per bucket\n");
+            soft_exit(1);
+        }
+
+        if (!table->computeBucketLayout() || fileEntriesPerBucket != table->entriesPerBucket || table->tableSize % table->entriesPerBucket != 0) {
+            WriteErrorMessage("SNAPHashTable::SNAPHashTable: bucket layout doesn't match, possible corruption or bad file format.\n");
+            soft_exit(1);
+        }
+
+        table->nBuckets = table->tableSize / table->entriesPerBucket;
 
+        //
+        // The header is padded out to a full bucket so that the buckets stay cache line aligned.
+        //
+        if (0 != loadFile->advance(BUCKET_SIZE - table->getHeaderSize())) {
+            WriteErrorMessage("SNAPHashTable::SNAPHashTable: unable to skip header padding\n");
+            soft_exit(1);
+        }
+    }
 
     return table;
 }
@@ -200,7 +251,7 @@ bool
 SNAPHashTable::saveToFile(FILE *saveFile, size_t *bytesWritten) 
 {
     *bytesWritten = 0;
-    if (1 != fwrite(&magic,sizeof(magic), 1, saveFile)) {
+    if (1 != fwrite(cacheLineBuckets ? &cacheLineBucketsMagic : &magic, sizeof(magic), 1, saveFile)) {
         WriteErrorMessage("SNAPHashTable::SNAPHashTable fwrite magic number failed\n");
         return false;
     }    
@@ -242,10 +293,32 @@ SNAPHashTable::saveToFile(FILE *saveFile, size_t *bytesWritten)
     }
     (*bytesWritten) += valueSizeInBytes;
 
+    if (cacheLineBuckets) {
+        if (1 != fwrite(&entriesPerBucket, sizeof(entriesPerBucket), 1, saveFile)) {
+            WriteErrorMessage("SNAPHashTable: fwrite entries per bucket failed\n");
+            return false;
+        }
+        (*bytesWritten) += sizeof(entriesPerBucket);
+
+        //
+        // Pad the header out to a full bucket.  The table data is then a whole number of buckets, so as long as
+        // every table in the file is bucketed (which is how GenomeIndex builds them), all of the buckets are cache
+        // line aligned when the file is mapped or read into an aligned buffer.
+        //
+        _ASSERT(*bytesWritten == getHeaderSize());
+        char padding[BUCKET_SIZE];
+        memset(padding, 0, sizeof(padding));
+        if (1 != fwrite(padding, BUCKET_SIZE - *bytesWritten, 1, saveFile)) {
+            WriteErrorMessage("SNAPHashTable: fwrite header padding failed\n");
+            return false;
+        }
+        *bytesWritten = BUCKET_SIZE;
+    }
+
     size_t maxWriteSize = 100 * 1024 * 1024;
     size_t writeOffset = 0;
-    while (writeOffset < tableSize * elementSize) {
-        size_t amountToWrite = __min(maxWriteSize,tableSize * elementSize - writeOffset);
+    while (writeOffset < getTableSizeInBytes()) {
+        size_t amountToWrite = __min(maxWriteSize,getTableSizeInBytes() - writeOffset);
         size_t thisWrite = fwrite((char*)Table + writeOffset, 1, amountToWrite, saveFile);
         if (thisWrite < amountToWrite) {
             WriteErrorMessage("SNAPHashTable::saveToFile: fwrite failed, %d\n"
@@ -267,6 +340,33 @@ SNAPHashTable::getEntryForKey(KeyType key) const
 {
     nCallsToGetEntryForKey++;
 
+    if (cacheLineBuckets) {
+        //
+        // Same as GetFirstValueForKeyFromHomeBucket, except that it returns the free entry where the key would go
+        // if it's not there.
+        //
+        _uint64 whichBucket = hash(key) % nBuckets;
+        BYTE fingerprint = getFingerprint(hash(key));
+        for (size_t nBucketsProbed = 0; nBucketsProbed < nBuckets; nBucketsProbed++) {
+            BYTE *bucket = getBucket(whichBucket);
+            for (unsigned i = 0; i < entriesPerBucket; i++) {
+                void *entry = bucket + fingerprintBytesPerBucket + i * elementSize;
+                if (0 == bucket[i] || (bucket[i] == fingerprint && isKeyEqual(entry, key))) {
+                    nProbesInGetEntryForKey++;
+                    return entry;
+                }
+            }
+
+            nProbesInGetEntryForKey++;
+            whichBucket++;
+            if (whichBucket == nBuckets) {
+                whichBucket = 0;
+            }
+        }
+
+        return NULL;
+    }
+
     _uint64 tableIndex = hash(key) % tableSize;
 
     bool wrapped = false;
@@ -305,6 +405,30 @@ SNAPHashTable::getEntryForKey(KeyType key) const
 
 
 
+    void
+SNAPHashTable::LookupBatch(const KeyType *keys, unsigned nKeys, ValueType **results) const
+{
+    //
+    // Work in groups so that the home indices fit on the stack, and so that we don't issue so many prefetches that
+    // the first ones are evicted before we get back to them.
+    //
+    const unsigned maxKeysPerGroup = 32;
+    _uint64 homeIndices[maxKeysPerGroup];
+
+    for (unsigned groupStart = 0; groupStart < nKeys; groupStart += maxKeysPerGroup) {
+        unsigned nKeysThisGroup = __min(maxKeysPerGroup, nKeys - groupStart);
+
+        for (unsigned i = 0; i < nKeysThisGroup; i++) {
+            homeIndices[i] = GetHomeIndexForKey(keys[groupStart + i]);
+            PrefetchEntry(homeIndices[i]);
+        }
+
+        for (unsigned i = 0; i < nKeysThisGroup; i++) {
+            results[groupStart + i] = GetFirstValueForKeyFromHomeIndex(keys[groupStart + i], homeIndices[i]);
+        }
+    }
+}
+
     SNAPHashTable::ValueType * 
 SNAPHashTable::SlowLookup(KeyType key)
 {
@@ -326,8 +450,11 @@ SNAPHashTable::Insert(KeyType key, ValueType *data)
         return false;
     }
 
-	if (!isKeyEqual(entry, key)) {
+	if (!isKeyEqual(entry, key) || (cacheLineBuckets && doesEntryHaveInvalidValue(entry))) {
 		setKey(entry, key);
+        if (cacheLineBuckets) {
+            setFingerprint(entry, key);
+        }
 		usedElementCount++;
 	}
 
@@ -340,4 +467,37 @@ SNAPHashTable::Insert(KeyType key, ValueType *data)
 
 
 
+    void
+SNAPHashTable::setFingerprint(void *entry, KeyType key)
+{
+    _ASSERT(cacheLineBuckets);
+    size_t offsetInTable = (char *)entry - (char *)Table;
+    BYTE *bucket = getBucket(offsetInTable / BUCKET_SIZE);
+    unsigned whichEntryInBucket = (unsigned)((offsetInTable % BUCKET_SIZE - fingerprintBytesPerBucket) / elementSize);
+    _ASSERT(whichEntryInBucket < entriesPerBucket && (char *)bucket + fingerprintBytesPerBucket + whichEntryInBucket * elementSize == entry);
+
+    bucket[whichEntryInBucket] = getFingerprint(hash(key));
+}
+
+    bool
+SNAPHashTable::computeBucketLayout()
+/*++
+
+Routine Description:
+
+    Figure out how many entries fit in a bucket along with their fingerprints.  The fingerprints are padded to a
+    multiple of four bytes.
+
+--*/
+{
+    entriesPerBucket = 0;
+    while (((entriesPerBucket + 1 + 3) & ~3) + (entriesPerBucket + 1) * elementSize <= BUCKET_SIZE) {
+        entriesPerBucket++;
+    }
+    fingerprintBytesPerBucket = (entriesPerBucket + 3) & ~3;
+
+    return entriesPerBucket > 0;
+}
+
 const unsigned SNAPHashTable::magic = 0xb111b010;
+const unsigned SNAPHashTable::cacheLineBucketsMagic = 0xb111b011;
@@ -31,12 +31,18 @@ class SNAPHashTable {
         typedef _uint64 ValueType;  // Values can be smaller than this, but they're expanded in the interface
         typedef _uint64 KeyType;    // Likewise for keys.
 
+        //
+        // If i_cacheLineBuckets is set, the table is laid out as an array of cache-line sized buckets, each holding
+        // several entries, rather than as a flat array of entries.  See the comment on the private section below.
+        // i_tableSize is rounded up to fill the last bucket.
+        //
         SNAPHashTable(
             _int64		i_tableSize,
             unsigned    i_keySizeInBytes,
             unsigned    i_valueSizeInBytes,
             unsigned    i_valueCount,
-            _uint64		i_invalidValueValue);
+            _uint64		i_invalidValueValue,
+            bool        i_cacheLineBuckets = false);
 
         //
         // Load from file.
@@ -62,6 +68,8 @@ class SNAPHashTable {
         unsigned GetKeySizeInBytes() const {return keySizeInBytes;}
         unsigned GetValueSizeInBytes() const {return valueSizeInBytes;}
         unsigned GetValueCount() const {return valueCount;}
+        bool UsesCacheLineBuckets() const {return cacheLineBuckets;}
+        bool BucketsAreCacheLineAligned() const {return !cacheLineBuckets || 0 == (size_t)Table % BUCKET_SIZE;}
 
 		void *getEntryValues(_uint64 whichEntry) 
 		{
@@ -84,9 +92,39 @@ class SNAPHashTable {
             return key;
         }
 
-        inline ValueType *GetFirstValueForKey(KeyType key) const {
+        //
+        // GetFirstValueForKey split into its pieces, so that callers looking up many keys (possibly in different tables)
+        // can hash everything and get the prefetches going before they touch any of the entries.  See LookupBatch.
+        //
+        // For bucketed tables the home index is a bucket number rather than an entry number.
+        //
+        inline _uint64 GetHomeIndexForKey(KeyType key) const {
             _ASSERT(keySizeInBytes == 8 || (key & ~((((_uint64)1) << (keySizeInBytes * 8)) - 1)) == 0);    // High bits of the key aren't set.
-            _uint64 tableIndex = hash(key) % tableSize;
+            if (cacheLineBuckets) {
+                return hash(key) % nBuckets;
+            }
+            return hash(key) % tableSize;
+        }
+
+        inline void PrefetchEntry(_uint64 tableIndex) const {
+            if (cacheLineBuckets) {
+                _mm_prefetch((const char *)getBucket(tableIndex), _MM_HINT_T0);
+                return;
+            }
+
+            //
+            // Entries aren't aligned, so get the line with the end of the entry, too.  It's usually the same one.
+            //
+            const char *entry = (const char *)getEntry(tableIndex);
+            _mm_prefetch(entry, _MM_HINT_T0);
+            _mm_prefetch(entry + elementSize - 1, _MM_HINT_T0);
+        }
+
+        inline ValueType *GetFirstValueForKeyFromHomeIndex(KeyType key, _uint64 tableIndex) const {
+            if (cacheLineBuckets) {
+                return GetFirstValueForKeyFromHomeBucket(key, tableIndex);
+            }
+
             void *entry = getEntry(tableIndex);
             if (isKeyEqual(entry, key) && !doesEntryHaveInvalidValue(entry)) {
                 return (ValueType *)entry;
@@ -117,6 +155,48 @@ class SNAPHashTable {
             }
         }
 
+        inline ValueType *GetFirstValueForKeyFromHomeBucket(KeyType key, _uint64 whichBucket) const {
+            //
+            // Check the fingerprints in the home bucket, which are all in the same cache line as the entries themselves.
+            // Entries are filled in order and never deleted, so an empty slot means that the key isn't in the table.  We
+            // only move on to the next bucket if the home one is full.
+            //
+            BYTE fingerprint = getFingerprint(hash(key));
+            for (size_t nBucketsProbed = 0; nBucketsProbed < nBuckets; nBucketsProbed++) {
+                const BYTE *bucket = getBucket(whichBucket);
+                for (unsigned i = 0; i < entriesPerBucket; i++) {
+                    if (bucket[i] == fingerprint) {
+                        const char *entry = (const char *)bucket + fingerprintBytesPerBucket + i * elementSize;
+                        if (isKeyEqual(entry, key)) {
+                            return (ValueType *)entry;
+                        }
+                    } else if (bucket[i] == 0) {
+                        return NULL;
+                    }
+                }
+
+                extern _int64 nProbesInGetEntryForKey;
+                nProbesInGetEntryForKey++;
+
+                whichBucket++;
+                if (whichBucket == nBuckets) {
+                    whichBucket = 0;
+                }
+            }
+
+            return NULL;
+        }
+
+        inline ValueType *GetFirstValueForKey(KeyType key) const {
+            return GetFirstValueForKeyFromHomeIndex(key, GetHomeIndexForKey(key));
+        }
+
+        //
+        // Look up a set of keys at once.  This hashes all of them and prefetches their home entries before
+        // resolving any of the probes, so the cache misses (and there's usually one per key in a big table) happen
+        // in parallel rather than one after the other.  results[i] is what GetFirstValueForKey(keys[i]) would return.
+        //
+        void LookupBatch(const KeyType *keys, unsigned nKeys, ValueType **results) const;
 
         inline bool Lookup(KeyType key, unsigned nValuesToFill, ValueType *values) const {
             _ASSERT(nValuesToFill <= valueCount);
@@ -164,11 +244,50 @@ private:
 
         // Free Entries have the first valueSizeInByes bytes of value == invalidValueValue.  The following methods
         // understand the format and try to make it less opaque to use them.
-        
+        //
+        // Tables built with cacheLineBuckets group the entries into BUCKET_SIZE byte buckets, which are aligned to
+        // cache lines in memory and in the index file.  A bucket starts with a one byte fingerprint for each of its
+        // entriesPerBucket entries (rounded up to a multiple of four bytes, so that four byte values stay aligned),
+        // followed by the entries themselves in the same format as above, followed by any unused bytes.  The
+        // fingerprint is a few bits of the key's hash, and is 0 for free entries.  Entries are numbered
+        // consecutively through the buckets, so getEntry() works the same either way.
+        //
+        static const unsigned BUCKET_SIZE = 64;
+
         inline void *getEntry(_uint64 whichEntry) const {
+            if (cacheLineBuckets) {
+                return (char *)getBucket(whichEntry / entriesPerBucket) + fingerprintBytesPerBucket + (whichEntry % entriesPerBucket) * elementSize;
+            }
             return ((char *)Table + elementSize * whichEntry);
         }
 
+        inline BYTE *getBucket(_uint64 whichBucket) const {
+            return (BYTE *)Table + BUCKET_SIZE * whichBucket;
+        }
+
+        static inline BYTE getFingerprint(_uint64 hashValue) {
+            //
+            // Use the high bits, which don't have much to do with which bucket the key hashes to.  Zero means
+            // free, so map it to something else.
+            //
+            BYTE fingerprint = (BYTE)(hashValue >> 56);
+            return (0 == fingerprint) ? 1 : fingerprint;
+        }
+
+        void setFingerprint(void *entry, KeyType key);
+
+        inline size_t getHeaderSize() const {
+            return sizeof(magic) + sizeof(tableSize) + sizeof(usedElementCount) + sizeof(keySizeInBytes) + sizeof(valueSizeInBytes) + sizeof(valueCount) +
+                valueSizeInBytes + (cacheLineBuckets ? sizeof(entriesPerBucket) : 0);
+        }
+
+        inline size_t getTableSizeInBytes() const {
+            if (cacheLineBuckets) {
+                return nBuckets * BUCKET_SIZE;
+            }
+            return tableSize * elementSize;
+        }
+
         inline bool doesEntryHaveInvalidValue(void *entry) const
         {
             return !memcmp(entry, &invalidValueValue, valueSizeInBytes);
@@ -206,6 +325,10 @@ private:
         unsigned valueSizeInBytes;
         unsigned valueCount;
         ValueType invalidValueValue;
+        bool cacheLineBuckets;
+        unsigned entriesPerBucket;
+        unsigned fingerprintBytesPerBucket;
+        size_t nBuckets;
  
         //
         // Returns either the entry for this key, or else the entry where the key would be
@@ -213,7 +336,13 @@ private:
         //
         void* getEntryForKey(__in KeyType key) const;
 
+        //
+        // Figures out the bucket geometry from elementSize.  Returns false if an entry won't fit in a bucket.
+        //
+        bool computeBucketLayout();
+
         friend class SeedCountIterator;
 
         static const unsigned magic;
+        static const unsigned cacheLineBucketsMagic;
 };
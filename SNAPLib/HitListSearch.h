@@ -0,0 +1,113 @@
+/*++
+
+Module Name:
+
+    HitListSearch.h
+
+Abstract:
+
+    A cache friendly layout for searching the long hit lists in the overflow table.
+
+    Hit lists are sorted from the largest location to the smallest.  The layout samples the first hit in each
+    cache line's worth of the list and stores the samples in Eytzinger (breadth first) order, padded out to a
+    complete binary tree with the root at index 1.  Searching it walks down the tree without branching, and since
+    a node's descendants a few levels down are next to each other they can be prefetched well before they're
+    needed.  At the bottom, the sample says which cache line of the hit list holds the answer, and we count our
+    way through that.  A plain binary search of a long list misses the cache on nearly every probe.
+
+    The layouts are built at index build time (snap index -searchHits) and kept in their own file in the index
+    directory; see GenomeIndex::WriteHitListSearchFile.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+template<class GL> class HitListSearch {
+public:
+    // how many hits there are in the list for each sample
+    static const _int64 SampleInterval = 64 / sizeof(GL);
+
+    static _int64 SampleCount(_int64 nHits)
+    {
+        return (nHits + SampleInterval - 1) / SampleInterval;
+    }
+
+    //
+    // The number of elements in the layout for nSamples samples: a complete tree of size - 1 nodes, plus the unused
+    // element 0.
+    //
+    static _int64 LayoutSize(_int64 nSamples)
+    {
+        _int64 size = 1;
+        while (size <= nSamples) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    //
+    // Fills in layout, which has LayoutSize(nSamples) elements, from samples[i] = hits[i * SampleInterval].  The
+    // padding is 0, which is never above a location we look for, so it acts like the end of the list.
+    //
+    static void Build(const GL* samples, _int64 nSamples, GL* layout)
+    {
+        _int64 nextSample = 0;
+        layout[0] = 0;
+        fill(samples, nSamples, layout, LayoutSize(nSamples), 1, &nextSample);
+        _ASSERT(nextSample == LayoutSize(nSamples) - 1);
+    }
+
+    //
+    // Returns the index of the first (that is, largest) hit that's <= location, or nHits if there isn't one.
+    //
+    static _int64 FirstAtOrBelow(const GL* hits, _int64 nHits, const GL* layout, GL location)
+    {
+        const _int64 size = LayoutSize(SampleCount(nHits));
+
+        _int64 node = 1;
+        while (node < size) {
+            //
+            // The nodes SampleInterval times further along are this one's descendants a cache line's worth of levels
+            // down, and they fill exactly that cache line.  Prefetching never faults, so it's fine to run off the end.
+            //
+            _mm_prefetch((const char*)(layout + node * SampleInterval), _MM_HINT_T0);
+            node = 2 * node + (layout[node] > location);
+        }
+
+        //
+        // Which leaf we landed on is the number of samples above location.  The answer is after the last of them,
+        // and at or before the next sample.
+        //
+        _int64 samplesAbove = node - size;
+        if (samplesAbove == 0) {
+            return 0;
+        }
+
+        _int64 first = (samplesAbove - 1) * SampleInterval + 1;
+        _int64 last = __min(samplesAbove * SampleInterval, nHits);
+        _int64 result = first;
+        for (_int64 i = first; i < last; i++) {
+            result += (hits[i] > location);
+        }
+        return result;
+    }
+
+private:
+
+    static void fill(const GL* samples, _int64 nSamples, GL* layout, _int64 size, _int64 node, _int64* nextSample)
+    {
+        if (node >= size) {
+            return;
+        }
+        fill(samples, nSamples, layout, size, 2 * node, nextSample);
+        layout[node] = *nextSample < nSamples ? samples[*nextSample] : (GL)0;
+        (*nextSample)++;
+        fill(samples, nSamples, layout, size, 2 * node + 1, nextSample);
+    }
+};
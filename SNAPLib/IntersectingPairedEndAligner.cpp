@@ -26,6 +26,7 @@ Revision History:
 #include "mapq.h"
 #include "exit.h"
 #include "Error.h"
+#include "HitListSearch.h"
 
 #ifdef  _DEBUG
 extern bool _DumpAlignments;    // From BaseAligner.cpp
@@ -47,7 +48,7 @@ IntersectingPairedEndAligner::IntersectingPairedEndAligner(
         bool          noUkkonen_,
         bool          noOrderedEvaluation_,
 		bool          noTruncation_) :
-    index(index_), maxReadSize(maxReadSize_), maxHits(maxHits_), maxK(maxK_), numSeedsFromCommandLine(__min(MAX_MAX_SEEDS,numSeedsFromCommandLine_)), minSpacing(minSpacing_), maxSpacing(maxSpacing_),
+    index(index_), seedLookupCache(NULL), maxReadSize(maxReadSize_), maxHits(maxHits_), maxK(maxK_), numSeedsFromCommandLine(__min(MAX_MAX_SEEDS,numSeedsFromCommandLine_)), minSpacing(minSpacing_), maxSpacing(maxSpacing_),
 	landauVishkin(NULL), reverseLandauVishkin(NULL), maxBigHits(maxBigHits_), seedCoverage(seedCoverage_),
     extraSearchDepth(extraSearchDepth_), nLocationsScored(0), noUkkonen(noUkkonen_), noOrderedEvaluation(noOrderedEvaluation_), noTruncation(noTruncation_)
 {
@@ -109,6 +110,17 @@ IntersectingPairedEndAligner::allocateDynamicMemory(BigAllocator *allocator, uns
 {
     seedUsed = (BYTE *) allocator->allocate(100 + (maxReadSize + 7) / 8);
 
+    batchSeeds = (Seed *)allocator->allocate(sizeof(Seed) * maxSeedsToUse);
+    batchSeedOffsets = (unsigned *)allocator->allocate(sizeof(unsigned) * maxSeedsToUse);
+    batchBeginsDisjointHitSet = (bool *)allocator->allocate(sizeof(bool) * maxSeedsToUse);
+    for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        batchNHits[dir] = (_int64 *)allocator->allocate(sizeof(_int64) * maxSeedsToUse);
+        batchHits[dir] = (const GenomeLocation **)allocator->allocate(sizeof(const GenomeLocation *) * maxSeedsToUse);
+        batchHits32[dir] = (const unsigned **)allocator->allocate(sizeof(const unsigned *) * maxSeedsToUse);
+        batchSingletonHits[dir] = (GenomeLocation *)allocator->allocate(sizeof(GenomeLocation) * maxSeedsToUse);
+    }
+    genomeDecodeBuffer = (char *)allocator->allocate(maxReadSize + 2 * MAX_K);    // MAX_K before the read for the reverse LV, and MAX_K after for deletions
+
     for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
         rcReadData[whichRead] = (char *)allocator->allocate(maxReadSize);
         rcReadQuality[whichRead] = (char *)allocator->allocate(maxReadSize);
@@ -264,18 +276,21 @@ IntersectingPairedEndAligner::align(
 
     //
     // Phase 1: do the hash table lookups for each of the seeds for each of the reads and add them to the hit sets.
+    // Which seeds we use doesn't depend on what the lookups find, so pick all of a read's seeds first and then
+    // look them up as a batch, which lets the index overlap the cache misses from the hash table probes.
     //
     for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
         int nextSeedToTest = 0;
         unsigned wrapCount = 0;
         int nPossibleSeeds = (int)readLen[whichRead] - seedLen + 1;
         memset(seedUsed, 0, (__max(readLen[0], readLen[1]) + 7) / 8);
-        bool beginsDisjointHitSet[NUM_DIRECTIONS] = {true, true};
+        bool beginsDisjointHitSet = true;
+        unsigned nSeedsInBatch = 0;
 
         while (countOfHashTableLookups[whichRead] < nPossibleSeeds && countOfHashTableLookups[whichRead] < maxSeeds) {
             if (nextSeedToTest >= nPossibleSeeds) {
                 wrapCount++;
-				beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
+				beginsDisjointHitSet = true;
                 if (wrapCount >= seedLen) {
                     //
                     // There aren't enough valid seeds in this read to reach our target.
@@ -310,53 +325,82 @@ IntersectingPairedEndAligner::align(
                 continue;
             }
 
-            Seed seed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen);
+            _ASSERT(nSeedsInBatch < (unsigned)maxSeeds);
+            batchSeeds[nSeedsInBatch] = Seed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen);
+            batchSeedOffsets[nSeedsInBatch] = nextSeedToTest;
+            batchBeginsDisjointHitSet[nSeedsInBatch] = beginsDisjointHitSet;
+            beginsDisjointHitSet = false;
+            nSeedsInBatch++;
+
+            countOfHashTableLookups[whichRead]++;
+
             //
-            // Find all instances of this seed in the genome.
+            // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
             //
-            _int64 nHits[NUM_DIRECTIONS];
-            const GenomeLocation *hits[NUM_DIRECTIONS];
-            const unsigned *hits32[NUM_DIRECTIONS];
+            if ((maxSeeds - countOfHashTableLookups[whichRead] + 1) * (int)seedLen + nextSeedToTest < nPossibleSeeds) {
+                _ASSERT((nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1) >= (int)seedLen);
+                nextSeedToTest += (nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1);
+                _ASSERT(nextSeedToTest < nPossibleSeeds);   // We haven't run off the end of the read.
+            } else {
+                nextSeedToTest += seedLen;
+            }
+        } // while we need to pick seeds for this read
 
+        //
+        // Find all instances of these seeds in the genome.
+        //
+        if (NULL != seedLookupCache) {
             if (doesGenomeIndexHave64BitLocations) {
-                index->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], 
-                            hashTableHitSets[whichRead][FORWARD]->getNextSingletonLocation(), hashTableHitSets[whichRead][RC]->getNextSingletonLocation());
+                seedLookupCache->lookupSeedBatch(nSeedsInBatch, batchSeeds, batchNHits[FORWARD], batchHits[FORWARD], batchNHits[RC], batchHits[RC],
+                    batchSingletonHits[FORWARD], batchSingletonHits[RC]);
             } else {
-                index->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
+                seedLookupCache->lookupSeedBatch32(nSeedsInBatch, batchSeeds, batchNHits[FORWARD], batchHits32[FORWARD], batchNHits[RC], batchHits32[RC]);
+            }
+        } else if (doesGenomeIndexHave64BitLocations) {
+            index->lookupSeedBatch(nSeedsInBatch, batchSeeds, batchNHits[FORWARD], batchHits[FORWARD], batchNHits[RC], batchHits[RC],
+                batchSingletonHits[FORWARD], batchSingletonHits[RC]);
+        } else {
+            index->lookupSeedBatch32(nSeedsInBatch, batchSeeds, batchNHits[FORWARD], batchHits32[FORWARD], batchNHits[RC], batchHits32[RC]);
+        }
+
+        bool beginsDisjointHitSetForDirection[NUM_DIRECTIONS] = {true, true};
+        for (unsigned whichSeed = 0; whichSeed < nSeedsInBatch; whichSeed++) {
+            if (batchBeginsDisjointHitSet[whichSeed]) {
+                beginsDisjointHitSetForDirection[FORWARD] = beginsDisjointHitSetForDirection[RC] = true;
             }
 
-            countOfHashTableLookups[whichRead]++;
             for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
                 int offset;
                 if (dir == FORWARD) {
-                    offset = nextSeedToTest;
+                    offset = batchSeedOffsets[whichSeed];
                 } else {
-                    offset = readLen[whichRead] - seedLen - nextSeedToTest;
+                    offset = readLen[whichRead] - seedLen - batchSeedOffsets[whichSeed];
                 }
-                if (nHits[dir] < maxBigHits) {
-                    totalHashTableHits[whichRead][dir] += nHits[dir];
+                _int64 nHits = batchNHits[dir][whichSeed];
+                if (nHits < maxBigHits) {
+                    totalHashTableHits[whichRead][dir] += nHits;
                     if (doesGenomeIndexHave64BitLocations) {
-                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits[dir], beginsDisjointHitSet[dir]);
+                        const GenomeLocation *hits = batchHits[dir][whichSeed];
+                        if (hits == &batchSingletonHits[FORWARD][whichSeed] || hits == &batchSingletonHits[RC][whichSeed]) {
+                            //
+                            // The lookup extended a singleton into the batch's storage.  The hit set needs it in its own
+                            // (which also guarantees that hits[-1] is valid memory), so move it there.
+                            //
+                            GenomeLocation *singletonLocation = hashTableHitSets[whichRead][dir]->getNextSingletonLocation();
+                            *singletonLocation = *hits;
+                            hits = singletonLocation;
+                        }
+                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits, hits, index->getHitListSearch(hits, nHits), beginsDisjointHitSetForDirection[dir]);
                     } else {
-                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits32[dir], beginsDisjointHitSet[dir]);
+                        const unsigned *hits = batchHits32[dir][whichSeed];
+                        hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits, hits, index->getHitListSearch32(hits, nHits), beginsDisjointHitSetForDirection[dir]);
                     }
-                    beginsDisjointHitSet[dir]= false;
+                    beginsDisjointHitSetForDirection[dir]= false;
                 } else {
                     popularSeedsSkipped[whichRead]++;
                 }
             }
-
-            //
-            // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
-            //
-            if ((maxSeeds - countOfHashTableLookups[whichRead] + 1) * (int)seedLen + nextSeedToTest < nPossibleSeeds) {
-                _ASSERT((nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1) >= (int)seedLen);
-                nextSeedToTest += (nPossibleSeeds - nextSeedToTest - 1) / (maxSeeds - countOfHashTableLookups[whichRead] + 1);
-                _ASSERT(nextSeedToTest < nPossibleSeeds);   // We haven't run off the end of the read.
-            } else {
-                nextSeedToTest += seedLen;
-            }
-        } // while we need to lookup seeds for this read
+        }
     } // for each read
 
     readWithMoreHits = totalHashTableHits[0][FORWARD] + totalHashTableHits[0][RC] > totalHashTableHits[1][FORWARD] + totalHashTableHits[1][RC] ? 0 : 1;
@@ -881,7 +925,7 @@ IntersectingPairedEndAligner::scoreLocation(
     Read *readToScore = reads[whichRead][direction];
     unsigned readDataLength = readToScore->getDataLength();
     GenomeDistance genomeDataLength = readDataLength + MAX_K; // Leave extra space in case the read has deletions
-    const char *data = genome->getSubstring(genomeLocation, genomeDataLength);
+    const char *data = genome->getSubstring(genomeLocation, genomeDataLength, genomeDecodeBuffer, MAX_K);
 
 #if		0 // This only happens when genomeLocation is in the padding, which can lead to no good.  Just say no.
     if (NULL == data) {
@@ -999,7 +1043,8 @@ IntersectingPairedEndAligner::HashTableHitSet::init()
 
 #define RL(lookups, glType, lookupListHead)                                                                                                                 \
     void                                                                                                                                                    \
-IntersectingPairedEndAligner::HashTableHitSet::recordLookup(unsigned seedOffset, _int64 nHits, const glType *hits, bool beginsDisjointHitSet)               \
+IntersectingPairedEndAligner::HashTableHitSet::recordLookup(unsigned seedOffset, _int64 nHits, const glType *hits, const glType *search,                    \
+    bool beginsDisjointHitSet)                                                                                                                              \
 {                                                                                                                                                           \
     _ASSERT(nLookupsUsed < maxSeeds);                                                                                                                       \
     if (beginsDisjointHitSet) {                                                                                                                             \
@@ -1014,6 +1059,7 @@ IntersectingPairedEndAligner::HashTableHitSet::recordLookup(unsigned seedOffset,
         _ASSERT(currentDisjointHitSet != -1);    /* Essentially that beginsDisjointHitSet is set for the first recordLookup call */                         \
         lookups[nLookupsUsed].currentHitForIntersection = 0;                                                                                                \
         lookups[nLookupsUsed].hits = hits;                                                                                                                  \
+        lookups[nLookupsUsed].search = search;                                                                                                              \
         lookups[nLookupsUsed].nHits = nHits;                                                                                                                \
         lookups[nLookupsUsed].seedOffset = seedOffset;                                                                                                      \
         lookups[nLookupsUsed].whichDisjointHitSet = currentDisjointHitSet;                                                                                  \
@@ -1022,6 +1068,7 @@ IntersectingPairedEndAligner::HashTableHitSet::recordLookup(unsigned seedOffset,
                                                                                                                                                             \
         while (lookups[nLookupsUsed].nHits > 0 && lookups[nLookupsUsed].hits[lookups[nLookupsUsed].nHits - 1] < lookups[nLookupsUsed].seedOffset) {         \
             lookups[nLookupsUsed].nHits--;                                                                                                                  \
+            lookups[nLookupsUsed].search = NULL;    /* It's laid out for the whole list */                                                                  \
         }                                                                                                                                                   \
                                                                                                                                                             \
         /* Add this lookup into the non-empty lookup list. */                                                                                               \
@@ -1110,6 +1157,42 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(Genom
             limit[1] = (_int64)lookups32[i].nHits - 1;
             maxGenomeLocationToFindThisSeed = maxGenomeLocationToFind + lookups32[i].seedOffset;
         }
+
+        //
+        // Long hit lists may have a search layout in the index, which gets the same answer as the binary search below
+        // without a cache miss on every probe.  Like the binary search, it only finds a hit at or after the current one.
+        //
+        if (doesGenomeIndexHave64BitLocations ? NULL != lookups64[i].search : NULL != lookups32[i].search) {
+            _int64 found;
+            GenomeLocation foundHit;
+            unsigned seedOffset;
+            _int64 *currentHitForIntersection;
+            if (doesGenomeIndexHave64BitLocations) {
+                found = HitListSearch<GenomeLocation>::FirstAtOrBelow(lookups64[i].hits, lookups64[i].nHits, lookups64[i].search, maxGenomeLocationToFindThisSeed);
+                foundHit = found < lookups64[i].nHits ? lookups64[i].hits[found] : 0;
+                seedOffset = lookups64[i].seedOffset;
+                currentHitForIntersection = &lookups64[i].currentHitForIntersection;
+            } else {
+                unsigned location = (unsigned)__min(GenomeLocationAsInt64(maxGenomeLocationToFindThisSeed), (_int64)0xffffffff);
+                found = HitListSearch<unsigned>::FirstAtOrBelow(lookups32[i].hits, lookups32[i].nHits, lookups32[i].search, location);
+                foundHit = found < lookups32[i].nHits ? lookups32[i].hits[found] : 0;
+                seedOffset = lookups32[i].seedOffset;
+                currentHitForIntersection = &lookups32[i].currentHitForIntersection;
+            }
+
+            if (found >= limit[0] && found <= limit[1]) {
+                if (foundHit - seedOffset > bestLocationFound) {
+                    anyFound = true;
+                    mostRecentLocationReturned = *actualGenomeLocationFound = bestLocationFound = foundHit - seedOffset;
+                    *seedOffsetFound = seedOffset;
+                }
+                *currentHitForIntersection = found;
+            } else {
+                // We're done with this lookup.
+                *currentHitForIntersection = limit[1] + 1;
+            }
+            continue;
+        }
  
         while (limit[0] <= limit[1]) {
             _int64 probe = (limit[0] + limit[1]) / 2;
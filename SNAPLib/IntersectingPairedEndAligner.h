@@ -75,6 +75,11 @@ public:
         landauVishkin = landauVishkin_;
         reverseLandauVishkin = reverseLandauVishkin_;
     }
+
+    void setSeedLookupCache(SeedLookupCache *seedLookupCache_)
+    {
+        seedLookupCache = seedLookupCache_;
+    }
     
     virtual ~IntersectingPairedEndAligner();
     
@@ -116,6 +121,7 @@ private:
                                unsigned maxEditDistanceToConsider, unsigned maxExtraSearchDepth, unsigned maxCandidatePoolSize);
 
     GenomeIndex *   index;
+    SeedLookupCache *seedLookupCache;   // NULL to look seeds up in the index directly
     const Genome *  genome;
     GenomeDistance  genomeSize;
     unsigned        maxReadSize;
@@ -145,6 +151,7 @@ private:
         unsigned        seedOffset;
         _int64          nHits;
         const GL  *     hits;
+        const GL  *     search;     // The index's search layout for hits (see HitListSearch.h), or NULL
         unsigned        whichDisjointHitSet;
 
         //
@@ -207,8 +214,10 @@ private:
 		// seed for it not to hit, and since the reads are disjoint there can't be a case
 		// where the same difference caused two seeds to miss).
         //
-        void recordLookup(unsigned seedOffset, _int64 nHits, const unsigned *hits, bool beginsDisjointHitSet);
-        void recordLookup(unsigned seedOffset, _int64 nHits, const GenomeLocation *hits, bool beginsDisjointHitSet);
+        // search is the index's search layout for the hits, if it has one.
+        //
+        void recordLookup(unsigned seedOffset, _int64 nHits, const unsigned *hits, const unsigned *search, bool beginsDisjointHitSet);
+        void recordLookup(unsigned seedOffset, _int64 nHits, const GenomeLocation *hits, const GenomeLocation *search, bool beginsDisjointHitSet);
 
         //
         // This efficiently works through the set looking for the next hit at or below this address.
@@ -306,6 +315,8 @@ private:
 
     char *reversedRead[NUM_READS_PER_PAIR][NUM_DIRECTIONS]; // The reversed data for each read for forward and RC.  This is used in the backwards LV
 
+    char *genomeDecodeBuffer;                               // Where we unpack the reference when the genome is packed
+
     LandauVishkin<> *landauVishkin;
     LandauVishkin<-1> *reverseLandauVishkin;
 
@@ -322,6 +333,18 @@ private:
         seedUsed[indexInRead / 8] |= (1 << (indexInRead % 8));
     }
 
+    //
+    // Phase 1 picks all of a read's seeds before looking any of them up, so that the hash table lookups can be
+    // batched and their cache misses overlapped.  These hold the picked seeds and the lookup results.
+    //
+    Seed *                  batchSeeds;
+    unsigned *              batchSeedOffsets;
+    bool *                  batchBeginsDisjointHitSet;
+    _int64 *                batchNHits[NUM_DIRECTIONS];
+    const GenomeLocation ** batchHits[NUM_DIRECTIONS];
+    const unsigned **       batchHits32[NUM_DIRECTIONS];
+    GenomeLocation *        batchSingletonHits[NUM_DIRECTIONS];
+
     //
     // "Local probability" means the probability that each end is correct given that the pair itself is correct.
     // Consider the example where there's exactly one decent match for one read, but the other one has several
@@ -7,6 +7,7 @@
 #include "Bam.h"
 #include "exit.h"
 #include "Error.h"
+#include "Util.h"
 
 using std::make_pair;
 using std::min;
@@ -49,11 +50,16 @@ bool writeCigar(char** o_buf, int* o_buflen, int count, char code, CigarFormat f
             *(*o_buf - 1) = '\0';
             return false;
         }
-        int written = snprintf(*o_buf, *o_buflen, "%d%c", count, code);
+        char op[util::FormatIntMaxChars + 1];
+        int written = util::FormatUInt(count, op);
+        op[written++] = code;
         if (written > *o_buflen - 1) {
-            *o_buf = '\0';
+            memcpy(*o_buf, op, *o_buflen - 1);
+            (*o_buf)[*o_buflen - 1] = '\0';
             return false;
         } else {
+            memcpy(*o_buf, op, written);
+            (*o_buf)[written] = '\0';
             *o_buf += written;
             *o_buflen -= written;
             return true;
@@ -764,3 +770,4 @@ initializeLVProbabilitiesToPhredPlus33()
 double *lv_phredToProbability = NULL;
 double *lv_indelProbabilities = NULL;
 double *lv_perfectMatchProbability = NULL;
+bool lv_useVectorCompares = ProcessorSupports(ProcessorFeatureSSE2);
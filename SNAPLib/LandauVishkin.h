@@ -5,6 +5,15 @@
 #include "exit.h"
 #include "Genome.h"
 
+//
+// The vector compare path uses SSE2, which every x64 processor has.  It's still chosen at run time (see
+// lv_useVectorCompares) so that it's easy to turn off and compare against the 8-byte-at-a-time version.
+//
+#if (defined(_M_X64) || defined(__SSE2__)) && !defined(__APPLE__)
+#define LV_VECTOR_COMPARES
+#include <emmintrin.h>
+#endif
+
 const int MAX_K = 63;
 
 //
@@ -14,6 +23,7 @@ const int MAX_K = 63;
 extern double *lv_indelProbabilities;  // Maps indels by length to probability of occurance.
 extern double *lv_phredToProbability;  // Maps ASCII phred character to probability of error, including 
 extern double *lv_perfectMatchProbability; // Probability that a read of this length has no mutations
+extern bool lv_useVectorCompares;           // Default for new LandauVishkin objects, set from the processor features at startup
 
 struct LVResult {
     short k;
@@ -60,6 +70,11 @@ public:
 
     memsetint(L[0], -2, (MAX_K+1)*(2*MAX_K+1));
 
+    setUseVectorCompares(lv_useVectorCompares);
+    useBitVectorFilter = true;
+
+    memset(bitVectorSlotForChar, 0, sizeof(bitVectorSlotForChar));
+
     //
     // Initialize dTable, which is used to avoid a branch misprediction in our inner loop.
     // The d values are 0, -1, 1, -2, 2, etc.
@@ -76,6 +91,28 @@ public:
         }
     }
 */
+    //
+    // Choose between extending matches 16 bytes at a time with SSE2 compares or 8 bytes at a time with 64 bit xors.
+    // Both produce identical results; this is here for benchmarking and testing.  Asking for vector compares
+    // when they're not compiled in just leaves them off.
+    //
+    void setUseVectorCompares(bool useVector) {
+#ifdef LV_VECTOR_COMPARES
+        useVectorCompares = useVector;
+#else
+        useVectorCompares = false;
+#endif
+    }
+
+    bool getUseVectorCompares() const {return useVectorCompares;}
+
+    //
+    // Turn on or off the bit-parallel check that gives up early on texts that are more than k away from the pattern
+    // (see bitVectorWithinK).  It only ever skips work whose answer would have been -1, so it doesn't change results.
+    //
+    void setUseBitVectorFilter(bool useFilter) {useBitVectorFilter = useFilter;}
+    bool getUseBitVectorFilter() const {return useBitVectorFilter;}
+
     static size_t getBigAllocatorReservation() {return sizeof(LandauVishkin<TEXT_DIRECTION>);} // maybe we should worry about allocating the cache with a BigAllocator, but not for now.
 
     ~LandauVishkin()
@@ -108,6 +145,233 @@ public:
                 int k,
                 double *matchProbability,
                 int *o_netIndel = NULL)   // the net of insertions and deletions in the alignment.  Negative for insertions, positive for deleteions (and 0 if there are non in net).  Filled in only if matchProbability is non-NULL
+{
+    if (useVectorCompares) {
+        return computeEditDistanceInternal<true>(text, textLen, pattern, qualityString, patternLen, k, matchProbability, o_netIndel);
+    } else {
+        return computeEditDistanceInternal<false>(text, textLen, pattern, qualityString, patternLen, k, matchProbability, o_netIndel);
+    }
+}
+
+    // Version that does not requre match probability and quality string
+    inline int computeEditDistance(
+            const char* text,
+            int textLen,
+            const char* pattern,
+            int patternLen,
+            int k)
+    {
+        return computeEditDistance(text, textLen, pattern, NULL, patternLen, k, NULL);
+    }
+
+    void *operator new(size_t size) {return BigAlloc(size);}
+    void operator delete(void *ptr) {BigDealloc(ptr);}
+
+    void *operator new(size_t size, BigAllocator *allocator) {_ASSERT(size == sizeof(LandauVishkin<TEXT_DIRECTION>)); return allocator->allocate(size);}
+    void operator delete(void *ptr, BigAllocator *allocator) {/*Do nothing.  The memory is freed when the allocator is deleted.*/}
+ 
+private:
+
+#ifdef LV_VECTOR_COMPARES
+    // Reverse the order of the bytes in an SSE register, using only SSE2 (pshufb would need SSSE3).
+    static inline __m128i reverseBytes(__m128i v) {
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+#endif // LV_VECTOR_COMPARES
+
+    //
+    // Move p and t forward over matching 16 byte chunks that lie entirely before pend.  If it finds a mismatch,
+    // it leaves p and t pointing at it and returns true.  Otherwise it returns false with p and t at the first byte
+    // it didn't look at, and the caller finishes up with the 8 byte loop.  Because it never looks past pend, it
+    // doesn't read any farther than the 8 byte loop would have, and it finds the same first mismatch.
+    //
+    static inline bool skipMatchingVectors(const char *&p, const char *&t, const char *pend)
+{
+#ifdef LV_VECTOR_COMPARES
+    while (p + 16 <= pend) {
+        __m128i patternBytes = _mm_loadu_si128((const __m128i *)p);
+        __m128i textBytes;
+        if (TEXT_DIRECTION == 1) {
+            textBytes = _mm_loadu_si128((const __m128i *)t);
+        } else {
+            textBytes = reverseBytes(_mm_loadu_si128((const __m128i *)(t - 15)));
+        }
+
+        _uint64 mismatches = (~_mm_movemask_epi8(_mm_cmpeq_epi8(patternBytes, textBytes))) & 0xffff;
+        if (mismatches) {
+            unsigned long zeroes;
+            CountTrailingZeroes(mismatches, zeroes);
+            p += zeroes;
+            t += zeroes * TEXT_DIRECTION;
+            return true;
+        }
+        p += 16;
+        t += 16 * TEXT_DIRECTION;
+    }
+#endif // LV_VECTOR_COMPARES
+    return false;
+}
+
+    //
+    // Limits on when bitVectorWithinK applies.  The band of 2k+1 diagonals has to fit in a 64 bit word, and the
+    // per-character match bitmaps are sized for patterns up to BitVectorMaxPatternLen, with a word of slop on each
+    // end so that the 64 bit window can hang off either end of the pattern.
+    //
+    static const int BitVectorMaxK = 31;
+    static const int BitVectorMaxPatternLen = 256;
+    static const int BitVectorWords = (BitVectorMaxPatternLen + 3 * 64) / 64;
+    static const int BitVectorMaxSlots = 16;        // Distinct characters in the pattern, plus one for "matches nothing"
+    static const int BitVectorFilterRow = 6;        // Which row of L to run the filter before.  Most real alignments are done by then.
+
+    //
+    // Extract the 64 bits of the match bitmap starting at pattern row firstRow (which may be as small as -63).
+    //
+    inline _uint64 bitVectorWindow(const _uint64 *peq, int firstRow)
+{
+    int bit = firstRow + 64;
+    int word = bit >> 6;
+    int shift = bit & 63;
+    return (peq[word] >> shift) | ((peq[word + 1] << 1) << (63 - shift));
+}
+
+    //
+    // Banded bit-parallel edit distance (after Myers and Hyyro), used to decide quickly whether the pattern can possibly
+    // be within k of a prefix of the text.  Returns false only if it's sure it can't be, in which case computeEditDistance
+    // would have returned -1.  Returns true if it can be, or if the filter doesn't apply.
+    //
+    // Rows are pattern positions (row i is after pattern[i-1]) and columns are text positions.  Column j keeps the vertical
+    // deltas for the 2k+1 rows j-k..j+k, one per bit, in Pv (+1) and Mv (-1).  Any alignment with cost <= k stays in that
+    // band.  Each column the band moves down a row; the cells that fall outside of it are assigned a value one greater than
+    // their in-band neighbor, which is at least k+1 and so can't make an in-band cell look closer than it really is.
+    // Rows above the pattern behave as though D[i][j] = j - i, which keeps D[0][j] = j: the alignment has to start at the
+    // beginning of the text, but can end anywhere.
+    //
+    bool bitVectorWithinK(const char *text, int textLen, const char *pattern, int patternLen, int k)
+{
+    if (k > BitVectorMaxK || patternLen <= k || patternLen > BitVectorMaxPatternLen || textLen < patternLen + k) {
+        //
+        // The last test is so that computeEditDistance's end-of-text handling never comes into play.
+        //
+        return true;
+    }
+
+    //
+    // Build the per-character match bitmaps.  Slot 0 is characters that don't appear in the pattern.
+    //
+    int nSlots = 1;
+    bool tooManyCharacters = false;
+    memset(bitVectorPeq[0], 0, sizeof(bitVectorPeq[0]));
+    for (int i = 0; i < patternLen; i++) {
+        _uint8 c = (_uint8)pattern[i];
+        if (0 == bitVectorSlotForChar[c]) {
+            if (nSlots == BitVectorMaxSlots) {
+                tooManyCharacters = true;
+                break;
+            }
+            bitVectorSlotForChar[c] = (_uint8)nSlots;
+            memset(bitVectorPeq[nSlots], 0, sizeof(bitVectorPeq[nSlots]));
+            nSlots++;
+        }
+        int bit = i + 1 + 64;   // Row i + 1
+        bitVectorPeq[bitVectorSlotForChar[c]][bit >> 6] |= ((_uint64)1) << (bit & 63);
+    }
+
+    bool withinK = true;
+    if (!tooManyCharacters) {
+        const _uint64 bandMask = (((_uint64)1) << (2 * k + 1)) - 1;
+        const _uint64 bottomBit = ((_uint64)1) << (2 * k);
+
+        //
+        // Column 0: D[i][0] = |i|, so the rows at or above 0 step down by one and the ones below step up.
+        //
+        _uint64 Pv = bandMask & ~((((_uint64)1) << (k + 1)) - 1);
+        _uint64 Mv = (((_uint64)1) << (k + 1)) - 1;
+        int diagonalScore = 0;          // D[j][j], which is bit k
+        int topScore = k;               // D[j-k][j], the top of the band
+        int bottomScore = k;            // D[j+k][j], the bottom
+        int rowMScore = 0;              // D[patternLen][j], once row patternLen is in the band
+        int lastColumn = patternLen + k;
+
+        withinK = false;
+        for (int j = 1; j <= lastColumn; j++) {
+            //
+            // Move the band down a row.  The new bottom row is one more than the row above it.
+            //
+            Pv = (Pv >> 1) | bottomBit;
+            Mv = (Mv >> 1) & ~bottomBit;
+
+            _uint64 Eq = bitVectorWindow(bitVectorPeq[bitVectorSlotForChar[(_uint8)text[(j - 1) * TEXT_DIRECTION]]], j - k);
+            _uint64 Xv = Eq | Mv;
+            _uint64 Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq;
+            _uint64 Ph = Mv | ~(Xh | Pv);
+            _uint64 Mh = Pv & Xh;
+
+            int rowMBit = patternLen - j + k;
+            if (rowMBit < 2 * k) {
+                //
+                // Row patternLen was already in the band, so just follow it across.
+                //
+                rowMScore += (int)((Ph >> rowMBit) & 1) - (int)((Mh >> rowMBit) & 1);
+            }
+
+            //
+            // The row above the band goes up by one, as does everything above the pattern.
+            //
+            Ph = (Ph << 1) | 1;
+            Mh = Mh << 1;
+            Pv = Mh | ~(Xv | Ph);
+            Mv = Ph & Xv;
+
+            diagonalScore += (int)((Ph >> k) & 1) - (int)((Mh >> k) & 1) + (int)((Pv >> k) & 1) - (int)((Mv >> k) & 1);
+            topScore += 1 + (int)(Pv & 1) - (int)(Mv & 1);
+            bottomScore += (int)((Ph >> (2 * k)) & 1) - (int)((Mh >> (2 * k)) & 1) + (int)((Pv >> (2 * k)) & 1) - (int)((Mv >> (2 * k)) & 1);
+
+            if (rowMBit == 2 * k) {
+                //
+                // Row patternLen just came into the band at the bottom.  Sum down from the diagonal.
+                //
+                rowMScore = diagonalScore;
+                for (int bit = k + 1; bit <= 2 * k; bit++) {
+                    rowMScore += (int)((Pv >> bit) & 1) - (int)((Mv >> bit) & 1);
+                }
+            }
+
+            if (rowMBit <= 2 * k && rowMScore <= k) {
+                withinK = true;
+                break;
+            }
+
+            //
+            // Adjacent cells in a column differ by at most one, so a cell b rows below the top is at least topScore - b
+            // and at least diagonalScore - (k - b), which makes the whole top half of the band at least
+            // (topScore + diagonalScore - k) / 2.  Likewise for the bottom half.  Once both are more than k, so is every
+            // cell in the band, and any alignment that gets to the end of the pattern from here has to go through one.
+            //
+            if (topScore + diagonalScore > 3 * k && bottomScore + diagonalScore > 3 * k) {
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < patternLen; i++) {
+        bitVectorSlotForChar[(_uint8)pattern[i]] = 0;
+    }
+
+    return withinK;
+}
+
+    template<bool VECTOR_COMPARES> int computeEditDistanceInternal(
+                const char* text,
+                int textLen,
+                const char* pattern,
+                const char *qualityString,
+                int patternLen,
+                int k,
+                double *matchProbability,
+                int *o_netIndel)
 {
     int localNetIndel;
 	int d;
@@ -146,6 +410,10 @@ public:
     const char* t = text;
     int end = __min(patternLen, textLen);
     const char* pend = pattern + end;
+    if (VECTOR_COMPARES && skipMatchingVectors(p, t, pend)) {
+        L[0][MAX_K] = (int)(p - pattern);
+        goto done1;
+    }
     while (p < pend) {
         _uint64 x;
         if (TEXT_DIRECTION == 1) {
@@ -188,6 +456,13 @@ done1:
 	int e;
 
     for (e = 1; e <= k; e++) {
+        if (e == BitVectorFilterRow && useBitVectorFilter && !bitVectorWithinK(text, textLen, pattern, patternLen, k)) {
+            //
+            // It's not going to get there.  Skip the rest of the rows.
+            //
+            return -1;
+        }
+
         // Search d's in the order 0, 1, -1, 2, -2, etc to find an alignment with as few indels as possible.
         // dTable is just precomputed d = (d > 0 ? -d : -d+1) to save the branch misprediction from (d > 0)
         int i =0;
@@ -233,6 +508,14 @@ done1:
                         break;
                     }
                     t += 8 * TEXT_DIRECTION;
+
+                    //
+                    // Most extensions end in the first 8 bytes, so only switch to vector compares for the longer ones.
+                    //
+                    if (VECTOR_COMPARES && skipMatchingVectors(p, t, pend)) {
+                        best = (int)(p - pattern);
+                        break;
+                    }
                 }
             }
 
@@ -348,25 +631,6 @@ got_answer:
 	return e;
 }
 
-
-    // Version that does not requre match probability and quality string
-    inline int computeEditDistance(
-            const char* text,
-            int textLen,
-            const char* pattern,
-            int patternLen,
-            int k)
-    {
-        return computeEditDistance(text, textLen, pattern, NULL, patternLen, k, NULL);
-    }
-
-    void *operator new(size_t size) {return BigAlloc(size);}
-    void operator delete(void *ptr) {BigDealloc(ptr);}
-
-    void *operator new(size_t size, BigAllocator *allocator) {_ASSERT(size == sizeof(LandauVishkin<TEXT_DIRECTION>)); return allocator->allocate(size);}
-    void operator delete(void *ptr, BigAllocator *allocator) {/*Do nothing.  The memory is freed when the allocator is deleted.*/}
- 
-private:
     // TODO: For long reads, we should include a version that only has L be 2 x (2*MAX_K+1) cells
     int L[MAX_K+1][2 * MAX_K + 1];
 
@@ -383,6 +647,13 @@ private:
     char backtraceAction[MAX_K+1];
     int  backtraceMatched[MAX_K+1];
     int  backtraceD[MAX_K+1];
+
+    bool useVectorCompares;
+    bool useBitVectorFilter;
+
+    // Match bitmaps for bitVectorWithinK, and which of them goes with each character (0 for ones not in the pattern).
+    _uint64 bitVectorPeq[BitVectorMaxSlots][BitVectorWords];
+    _uint8 bitVectorSlotForChar[256];
 };
 
 void setLVProbabilities(double *i_indelProbabilities, double *i_phredToProbability, double mutationProbability);
@@ -0,0 +1,148 @@
+/*++
+
+Module Name:
+
+    MD5.cpp
+
+Abstract:
+
+    The MD5 message digest, straight from RFC 1321.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "MD5.h"
+
+const size_t MD5::DigestBytes;
+
+// per-round shift amounts, and the sines that RFC 1321 calls T[1..64]
+static const int Shifts[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static const _uint32 Sines[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+MD5::MD5()
+    : totalBytes(0)
+{
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+}
+
+    void
+MD5::update(
+    const void* data,
+    size_t bytes)
+{
+    const _uint8* p = (const _uint8*) data;
+    size_t buffered = (size_t) (totalBytes % 64);
+    totalBytes += bytes;
+    if (buffered > 0) {
+        size_t n = __min(bytes, 64 - buffered);
+        memcpy(buffer + buffered, p, n);
+        p += n;
+        bytes -= n;
+        if (buffered + n < 64) {
+            return;
+        }
+        transform(buffer);
+    }
+    for (; bytes >= 64; p += 64, bytes -= 64) {
+        transform(p);
+    }
+    if (bytes > 0) {
+        memcpy(buffer, p, bytes);
+    }
+}
+
+    void
+MD5::final(
+    _uint8* o_digest)
+{
+    // pad with a 1 bit, then 0s up to 8 bytes short of a block, then the length in bits
+    _uint64 bits = totalBytes * 8;
+    _uint8 padding[72];
+    size_t buffered = (size_t) (totalBytes % 64);
+    size_t padBytes = (buffered < 56 ? 56 : 120) - buffered;
+    memset(padding, 0, padBytes);
+    padding[0] = 0x80;
+    for (int i = 0; i < 8; i++) {
+        padding[padBytes + i] = (_uint8) (bits >> (8 * i));
+    }
+    update(padding, padBytes + 8);
+    for (int i = 0; i < 16; i++) {
+        o_digest[i] = (_uint8) (state[i / 4] >> (8 * (i % 4)));
+    }
+}
+
+    void
+MD5::toHex(
+    const _uint8* digest,
+    char* o_hex)
+{
+    for (size_t i = 0; i < DigestBytes; i++) {
+        o_hex[2 * i] = "0123456789abcdef"[digest[i] >> 4];
+        o_hex[2 * i + 1] = "0123456789abcdef"[digest[i] & 0xf];
+    }
+    o_hex[2 * DigestBytes] = '\0';
+}
+
+    void
+MD5::transform(
+    const _uint8* block)
+{
+    _uint32 words[16];
+    for (int i = 0; i < 16; i++) {
+        words[i] = block[4 * i] | (block[4 * i + 1] << 8) | (block[4 * i + 2] << 16) | ((_uint32) block[4 * i + 3] << 24);
+    }
+    _uint32 a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) {
+        _uint32 f;
+        int w;
+        switch (i / 16) {
+        case 0:
+            f = (b & c) | (~b & d);
+            w = i;
+            break;
+        case 1:
+            f = (d & b) | (~d & c);
+            w = (5 * i + 1) % 16;
+            break;
+        case 2:
+            f = b ^ c ^ d;
+            w = (3 * i + 5) % 16;
+            break;
+        default:
+            f = c ^ (b | ~d);
+            w = (7 * i) % 16;
+            break;
+        }
+        _uint32 sum = a + f + Sines[i] + words[w];
+        a = d;
+        d = c;
+        c = b;
+        b += (sum << Shifts[i]) | (sum >> (32 - Shifts[i]));
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
@@ -0,0 +1,47 @@
+/*++
+
+Module Name:
+
+    MD5.h
+
+Abstract:
+
+    The MD5 message digest (RFC 1321).  It's not for security; it's here because that's the checksum SAM and CRAM
+    use to name a reference sequence (the M5 tag of an @SQ line).
+
+Environment:
+
+    User mode service.
+
+    Each object is used by one thread at a time.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class MD5
+{
+public:
+
+    static const size_t DigestBytes = 16;
+
+    MD5();
+
+    void update(const void* data, size_t bytes);
+
+    // finishes the digest; the object can't be updated afterwards
+    void final(_uint8* o_digest);
+
+    // as 32 lower case hex digits and a null, the way the M5 tag has it
+    static void toHex(const _uint8* digest, char* o_hex);
+
+private:
+
+    void transform(const _uint8* block);
+
+    _uint32     state[4];
+    _uint64     totalBytes;
+    _uint8      buffer[64];
+};
@@ -113,6 +113,16 @@ MultiInputReadSupplier::releaseBatch(
     return readSuppliers[index]->releaseBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
 }
 
+    _int64
+MultiInputReadSupplier::getRangesStolen()
+{
+    _int64 rangesStolen = 0;
+    for (int i = 0; i < nReadSuppliers; i++) {
+        rangesStolen += readSuppliers[i]->getRangesStolen();
+    }
+    return rangesStolen;
+}
+
 MultiInputPairedReadSupplier::MultiInputPairedReadSupplier(int i_nReadSuppliers, PairedReadSupplier **i_pairedReadSuppliers)
 {
     pairedReadSuppliers = i_pairedReadSuppliers;    // We get to own the array
@@ -211,6 +221,16 @@ MultiInputPairedReadSupplier::releaseBatch(
     return pairedReadSuppliers[index]->releaseBatch(DataBatch(batch.batchID, batch.fileID / nReadSuppliers));
 }
 
+    _int64
+MultiInputPairedReadSupplier::getRangesStolen()
+{
+    _int64 rangesStolen = 0;
+    for (int i = 0; i < nReadSuppliers; i++) {
+        rangesStolen += pairedReadSuppliers[i]->getRangesStolen();
+    }
+    return rangesStolen;
+}
+
 
 MultiInputReadSupplierGenerator::MultiInputReadSupplierGenerator(int i_nReadSuppliers, ReadSupplierGenerator **i_readSupplierGenerators)
 {
@@ -35,6 +35,8 @@ public:
     virtual void holdBatch(DataBatch batch);
     virtual bool releaseBatch(DataBatch batch);
 
+    virtual _int64 getRangesStolen();
+
 private:
 
     // info for a currently active supplier
@@ -63,6 +65,8 @@ public:
 
     virtual bool releaseBatch(DataBatch batch);
 
+    virtual _int64 getRangesStolen();
+
 private:
     
     // info for a currently active supplier
@@ -44,6 +44,7 @@ Revision History:
 #include "FASTQ.h"
 #include "PairedAligner.h"
 #include "MultiInputReadSupplier.h"
+#include "SeedLookupCache.h"
 #include "Util.h"
 #include "IntersectingPairedEndAligner.h"
 #include "exit.h"
@@ -404,6 +405,10 @@ void PairedAlignerContext::runIterationThread()
 
     memoryPoolSize += maxPairedSecondaryHits * sizeof(PairedAlignmentResult) + maxSingleSecondaryHits * sizeof(SingleAlignmentResult);
 
+    if (0 != options->seedLookupCacheMB) {
+        memoryPoolSize += SeedLookupCache::getBigAllocatorReservation(options->seedLookupCacheMB);
+    }
+
     BigAllocator *allocator = new BigAllocator(memoryPoolSize);
     
     IntersectingPairedEndAligner *intersectingAligner = new (allocator) IntersectingPairedEndAligner(index, maxReadSize, maxHits, maxDist, numSeedsFromCommandLine, 
@@ -447,6 +452,15 @@ void PairedAlignerContext::runIterationThread()
 							 minReadLength,
 							 allocator);
     } 
+
+    SeedLookupCache *seedLookupCache = NULL;
+    if (0 != options->seedLookupCacheMB) {
+        seedLookupCache = new (allocator) SeedLookupCache(index, options->seedLookupCacheMB, options->seedLookupCacheMinHits, allocator);
+        intersectingAligner->setSeedLookupCache(seedLookupCache);
+        aligner->setSeedLookupCache(seedLookupCache);
+    }
+    aligner->setExactMatchFastPath(options->exactMatchFastPath);
+
       allocator->checkCanaries();
       
     PairedAlignmentResult *secondaryResults = (PairedAlignmentResult *)allocator->allocate(maxPairedSecondaryHits * sizeof(*secondaryResults));
@@ -547,10 +561,15 @@ void PairedAlignerContext::runIterationThread()
     }
 
     stats->lvCalls = aligner->getLocationsScored();
+    if (NULL != seedLookupCache) {
+        stats->seedLookupCacheLookups += seedLookupCache->getLookups();
+        stats->seedLookupCacheHits += seedLookupCache->getCacheHits();
+    }
 
     allocator->checkCanaries();
 
     aligner->~ChimericPairedEndAligner();
+    stats->rangesStolen += supplier->getRangesStolen();
     delete supplier;
 
     intersectingAligner->~IntersectingPairedEndAligner();
@@ -154,11 +154,18 @@ ParallelTask<TContext>::run()
     DestroyEventObject(&memoryAllocationCompleteBarrier);
 #endif  // _MSC_VER
 
-    for (int i = 0; i < common->totalThreads; i++) {
-        contexts[i].finishThread(common);
-    }
-
     common->time = timeInMillis() - start;
+
+    //
+    // Finishing the last thread may let the owner of a forked task delete it and the common context, so don't touch
+    // either of them afterwards.
+    //
+    TContext* threadContexts = contexts;
+    TContext* commonContext = common;
+    int totalThreads = common->totalThreads;
+    for (int i = 0; i < totalThreads; i++) {
+        threadContexts[i].finishThread(commonContext);
+    }
 }
 
     template <class TContext>
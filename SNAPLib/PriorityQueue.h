@@ -115,3 +115,111 @@ private:
 
     EntryVector queue; // sorted list
 };
+
+//
+// A tournament tree of losers for merging k sorted sources.  Each internal node holds the source that lost the match
+// there, and replacing the overall winner's key only replays the matches on its path to the root, so it takes log k
+// comparisons with no swapping of entries.  Ties go to the lower numbered source, so merging is stable.
+//
+template <typename K>
+class LoserTree
+{
+public:
+    LoserTree(int i_nSources) : nSources(i_nSources)
+    {
+        _ASSERT(nSources > 0);
+        keys = new K[nSources];
+        exhausted = new bool[nSources];
+        tree = new int[nSources];
+        for (int i = 0; i < nSources; i++) {
+            exhausted[i] = true;
+        }
+    }
+
+    ~LoserTree()
+    {
+        delete[] keys;
+        delete[] exhausted;
+        delete[] tree;
+    }
+
+    // set the first key of each source that isn't empty, then call build()
+    void set(int source, K key)
+    {
+        keys[source] = key;
+        exhausted[source] = false;
+    }
+
+    void build()
+    {
+        //
+        // The sources are the leaves, nodes nSources..2*nSources-1 of an implicit binary tree whose node i has
+        // children 2i and 2i+1.  Play the matches bottom up.
+        //
+        int* winners = new int[2 * nSources];
+        for (int i = 0; i < nSources; i++) {
+            winners[nSources + i] = i;
+        }
+        for (int node = nSources - 1; node >= 1; node--) {
+            int a = winners[2 * node];
+            int b = winners[2 * node + 1];
+            if (beats(a, b)) {
+                winners[node] = a;
+                tree[node] = b;
+            } else {
+                winners[node] = b;
+                tree[node] = a;
+            }
+        }
+        tree[0] = nSources == 1 ? 0 : winners[1];
+        delete[] winners;
+    }
+
+    bool empty() const
+    { return exhausted[tree[0]]; }
+
+    // the source with the smallest key
+    int winner() const
+    { return tree[0]; }
+
+    K winnerKey() const
+    { return keys[tree[0]]; }
+
+    // the winner has moved on to its next key
+    void replaceWinner(K key)
+    {
+        keys[tree[0]] = key;
+        replay();
+    }
+
+    // the winner has no more keys
+    void removeWinner()
+    {
+        exhausted[tree[0]] = true;
+        replay();
+    }
+
+private:
+    bool beats(int a, int b) const
+    {
+        return !exhausted[a] && (exhausted[b] || keys[a] < keys[b] || (keys[a] == keys[b] && a < b));
+    }
+
+    void replay()
+    {
+        int candidate = tree[0];
+        for (int node = (nSources + candidate) / 2; node >= 1; node /= 2) {
+            if (beats(tree[node], candidate)) {
+                int loser = candidate;
+                candidate = tree[node];
+                tree[node] = loser;
+            }
+        }
+        tree[0] = candidate;
+    }
+
+    const int nSources;
+    K* keys;
+    bool* exhausted;
+    int* tree;  // tree[0] is the overall winner
+};
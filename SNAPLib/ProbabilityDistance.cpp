@@ -11,7 +11,7 @@
 
 
 namespace {
-    inline double max3(double d1, double d2, double d3) {
+    inline float max3(float d1, float d2, float d3) {
         if (d1 > d2) {
             return (d1 > d3) ? d1 : d3;
         } else {
@@ -23,9 +23,9 @@ namespace {
 
 ProbabilityDistance::ProbabilityDistance(double snpProb, double gapOpenProb, double gapExtensionProb)
 {
-    snpLogProb = log(snpProb);
-    gapOpenLogProb = log(gapOpenProb);
-    gapExtensionLogProb = log(gapExtensionProb);
+    snpLogProb = (float)log(snpProb);
+    gapOpenLogProb = (float)log(gapOpenProb);
+    gapExtensionLogProb = (float)log(gapExtensionProb);
 
     // Fill in the matchLogProb and mismatchLogProb tables for base quality values; assumes Phred+33 encoding
     for (int q = 0; q < 256; q++) {
@@ -39,8 +39,8 @@ ProbabilityDistance::ProbabilityDistance(double snpProb, double gapOpenProb, dou
             // be that we misread it and it *was* a SNP, but that's pretty unlikely)
             double matchProb = (1.0 - errorProb) * (1.0 - snpProb);
             double mismatchProb = 1.0 - matchProb;
-            matchLogProb[q] = log(matchProb);
-            mismatchLogProb[q] = log(mismatchProb);
+            matchLogProb[q] = (float)log(matchProb);
+            mismatchLogProb[q] = (float)log(mismatchProb);
             if (q >= 33 && q <= 'J') {
                 TRACE("q=%c: match %.04f, mismatch %.04f\n", q, matchProb, mismatchProb);
             }
@@ -63,73 +63,93 @@ int ProbabilityDistance::compute(
     _ASSERT(maxShift < MAX_SHIFT);
     _ASSERT(maxStartShift <= maxShift);
 
-    // Fill in the readPos = 0 row to allow us to start only at -maxStartShift..+maxStartShift
-    for (int s = -maxShift-1; s <= maxShift+1; s++) {
-        d[0][MAX_SHIFT+s][READ_GAP] = NO_PROB;
-        d[0][MAX_SHIFT+s][REF_GAP] = NO_PROB;
-        if (s < -maxStartShift || s > maxStartShift) {
-            d[0][MAX_SHIFT+s][NO_GAP] = NO_PROB;
-        } else {
-            d[0][MAX_SHIFT+s][NO_GAP] = log(1.0);
+    // The band of shifts we compute is [first, last] in the row, with the sentinels just outside it
+    const int first = MAX_SHIFT + 1 - maxShift;
+    const int last = MAX_SHIFT + 1 + maxShift;
+
+    // Fill in the readPos = 0 row to allow us to start only at -maxStartShift..+maxStartShift.  Everything
+    // else, including the sentinels and the slop past them, starts out impossible.
+    for (int r = 0; r < 2; r++) {
+        for (int g = 0; g < N_GAP_STATUSES; g++) {
+            for (int c = 0; c < ROW_WIDTH; c++) {
+                row[r][g][c] = NO_PROB;
+            }
         }
     }
+    for (int c = 0; c < ROW_WIDTH; c++) {
+        baseLogProb[c] = 0.0f;
+    }
+    for (int s = -maxStartShift; s <= maxStartShift; s++) {
+        row[0][NO_GAP][MAX_SHIFT + 1 + s] = 0.0f;  // log(1.0)
+    }
+
+    const __m128 gapOpen = _mm_set1_ps(gapOpenLogProb);
+    const __m128 gapExtension = _mm_set1_ps(gapExtensionLogProb);
 
     // Now go through each readPos from 1 to readLen and compute how to best get there
     for (int r = 1; r <= readLen; r++) {
-        // Add sentinels at the end of the array
-        d[r][MAX_SHIFT-maxShift-1][READ_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][READ_GAP] = NO_PROB;
-        d[r][MAX_SHIFT-maxShift-1][REF_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][REF_GAP] = NO_PROB;
-        d[r][MAX_SHIFT-maxShift-1][NO_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][NO_GAP] = NO_PROB;
-
-        // Fill in the rest of the values using dynamic program recurrence
-        for (int s = -maxShift; s <= maxShift; s++) {
+        float (*prev)[ROW_WIDTH] = row[(r - 1) % 2];
+        float (*cur)[ROW_WIDTH] = row[r % 2];
+
+        const float match = matchLogProb[(unsigned char)quality[r-1]];
+        const float mismatch = mismatchLogProb[(unsigned char)quality[r-1]];
+        const char readBase = read[r-1];
+        const char *ref = reference + r - 1 - (MAX_SHIFT + 1);   // so ref[c] is the reference base for row position c
+        for (int c = first; c <= last; c++) {
+            baseLogProb[c] = (readBase == ref[c]) ? match : mismatch;
+        }
+
+        // The NO_GAP and READ_GAP cases only depend on the previous readPos, so do four shifts at a time.  The
+        // last group can run past the band, but that's just slop that gets overwritten by the sentinel or ignored.
+        for (int c = first; c <= last; c += 4) {
             // The NO_GAP case; we get here either from a previous NO_GAP or by closing a gap from the
             // previous readPos, and in either case, we need to match the current base
-            double thisBaseProb = (read[r-1] == reference[r-1+s]) ? matchLogProb[quality[r-1]] : mismatchLogProb[quality[r-1]];
-            d[r][MAX_SHIFT+s][NO_GAP] = max3(d[r-1][MAX_SHIFT+s][NO_GAP] + thisBaseProb,
-                                             d[r-1][MAX_SHIFT+s][REF_GAP] + thisBaseProb,
-                                             d[r-1][MAX_SHIFT+s][READ_GAP] + thisBaseProb);
+            __m128 thisBaseProb = _mm_loadu_ps(&baseLogProb[c]);
+            __m128 noGap = _mm_max_ps(_mm_max_ps(_mm_loadu_ps(&prev[NO_GAP][c]), _mm_loadu_ps(&prev[REF_GAP][c])),
+                                      _mm_loadu_ps(&prev[READ_GAP][c]));
+            _mm_storeu_ps(&cur[NO_GAP][c], _mm_add_ps(noGap, thisBaseProb));
 
             // The READ_GAP case; we can either open a new gap from the previous NO_GAP or REF_GAP cases, or
             // extend a gap computed in the previous READ_GAP case
-            d[r][MAX_SHIFT+s][READ_GAP] = max3(d[r-1][MAX_SHIFT+s+1][NO_GAP] + gapOpenLogProb,
-                                               d[r-1][MAX_SHIFT+s+1][REF_GAP] + gapOpenLogProb,
-                                               d[r-1][MAX_SHIFT+s+1][READ_GAP] + gapExtensionLogProb);
-
-            // The REF_GAP case; we can either open a new gap from NO_GAP/READ_GAP, or extend one
-            d[r][MAX_SHIFT+s][REF_GAP] = max3(d[r][MAX_SHIFT+s-1][NO_GAP] + gapOpenLogProb,
-                                              d[r][MAX_SHIFT+s-1][REF_GAP] + gapExtensionLogProb,
-                                              d[r][MAX_SHIFT+s-1][READ_GAP] + gapOpenLogProb);
+            __m128 open = _mm_add_ps(_mm_max_ps(_mm_loadu_ps(&prev[NO_GAP][c+1]), _mm_loadu_ps(&prev[REF_GAP][c+1])), gapOpen);
+            __m128 extend = _mm_add_ps(_mm_loadu_ps(&prev[READ_GAP][c+1]), gapExtension);
+            _mm_storeu_ps(&cur[READ_GAP][c], _mm_max_ps(open, extend));
+        }
+
+        // Put back the sentinel at the end of the band
+        cur[NO_GAP][last + 1] = NO_PROB;
+        cur[READ_GAP][last + 1] = NO_PROB;
+
+        // The REF_GAP case; we can either open a new gap from NO_GAP/READ_GAP, or extend one.  This depends on the
+        // previous shift at the same readPos, so it's a scan along the row.
+        for (int c = first; c <= last; c++) {
+            cur[REF_GAP][c] = max3(cur[NO_GAP][c-1] + gapOpenLogProb,
+                                   cur[REF_GAP][c-1] + gapExtensionLogProb,
+                                   cur[READ_GAP][c-1] + gapOpenLogProb);
         }
-    }
 
 #ifdef TRACE_PROBABILITY_DISTANCE
-    printf("Here is the final matrix:\n");
-    for (int r = 0; r <= readLen; r++) {
         printf("%d: ", r);
-        for (int g = 0; g < 3; g++) {
-            for (int s = -maxShift; s <= maxShift; s++) {
-                printf("%7.2g ", d[r][MAX_SHIFT+s][g]);
+        for (int g = 0; g < N_GAP_STATUSES; g++) {
+            for (int c = first; c <= last; c++) {
+                printf("%7.2g ", cur[g][c]);
             }
-            if (g < 2) {
+            if (g < N_GAP_STATUSES - 1) {
                 printf("| ");
             }
         }
         printf("\n");
-    }
 #endif
+    }
 
     // Return the best probability, and a somewhat arbitrary score for it (TODO: need to actually compute # of edits)
-    double best = NO_PROB;
-    for (int s = -maxShift; s <= maxShift; s++) {
-        for (int g = 0; g < 3; g++) {
-            best = __max(best, d[readLen][MAX_SHIFT+s][g]);
+    float best = NO_PROB;
+    for (int c = first; c <= last; c++) {
+        for (int g = 0; g < N_GAP_STATUSES; g++) {
+            best = __max(best, row[readLen % 2][g][c]);
         }
     }
-    *matchProbability = exp(best);
-    TRACE("Best match probability: %g (log: %.2g)\n", exp(best), best);
+    *matchProbability = exp((double)best);
+    TRACE("Best match probability: %g (log: %.2g)\n", exp((double)best), best);
     return 5;
 }
@@ -27,30 +27,27 @@ public:
             double *matchProbability);
 
 private:
-    double snpLogProb;
-    double gapOpenLogProb;
-    double gapExtensionLogProb;
+    float snpLogProb;
+    float gapOpenLogProb;
+    float gapExtensionLogProb;
 
-    double matchLogProb[256];      // [baseQuality]
-    double mismatchLogProb[256];   // [baseQuality]
+    float matchLogProb[256];      // [baseQuality]
+    float mismatchLogProb[256];   // [baseQuality]
 
-#define NO_PROB  -1000000.0;  // A really negative log probability -- basically zero.  VC compiler won't allow static const double in a class.
+#define NO_PROB  -1000000.0f;  // A really negative log probability -- basically zero.  VC compiler won't allow static const float in a class.
 
-    enum GapStatus { NO_GAP, READ_GAP, REF_GAP };
+    enum GapStatus { NO_GAP, READ_GAP, REF_GAP, N_GAP_STATUSES };
 
-    // d[readPos][shift][gapStatus] is the best possible log probability for aligning the
-    // substring read[0..readPos] to reference[?..readPos + shift]. The "?" in reference is
-    // because we allow starting an alignment from reference[-maxStartShift..maxStartShift]
-    // instead of just reference[0], to deal with indels toward the start of the read.
-    double d[MAX_READ][2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus]
+    // The dynamic program only ever looks back one read position, so rather than keeping the whole
+    // d[readPos][shift][gapStatus] matrix we keep two rows of it and alternate between them.
+    // row[readPos % 2][gapStatus][MAX_SHIFT + 1 + shift] is the best possible log probability for aligning
+    // the substring read[0..readPos] to reference[?..readPos + shift]. The "?" in reference is because we
+    // allow starting an alignment from reference[-maxStartShift..maxStartShift] instead of just reference[0],
+    // to deal with indels toward the start of the read.  There's a sentinel on each side of the band, and
+    // room past the end for the last group of four that we compute with vector instructions to run over.
+    // We work in single precision so that a vector holds four shifts.
+    static const int ROW_WIDTH = (2 * MAX_SHIFT + 3 + 4 + 3) & ~3;
+    float row[2][N_GAP_STATUSES][ROW_WIDTH];   // [readPos % 2][gapStatus][shift]
 
-    // A state in the D array, used for backtracking pointers
-    struct State {
-        int readPos;
-        int shift;
-        int gapStatus;
-    };
-
-    // Previous state in our dynamic program, for backtracking to print CIGAR strings
-    State prev[MAX_READ][2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus]
+    float baseLogProb[ROW_WIDTH];   // [shift], log probability of the current read base against the reference
 };
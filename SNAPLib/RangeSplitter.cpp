@@ -33,71 +33,152 @@ using std::max;
 using std::min;
 
 
-RangeSplitter::RangeSplitter(_int64 rangeEnd_, int numThreads_, unsigned divisionSize_, _int64 rangeBegin_, unsigned minMillis_, unsigned minRangeSize_)
+RangeSplitter::RangeSplitter(_int64 rangeEnd_, int numThreads_, _int64 rangeBegin_, unsigned minRangeSize_)
 {
-    numThreads = numThreads_;
+    numThreads = __max(numThreads_, 1);
     rangeEnd = rangeEnd_;
     rangeBegin = rangeBegin_;
-    position = rangeBegin_;
-    startTime = 0;                       // We'll initialize it when getNextRange() is first called
-    divisionSize = divisionSize_;
-    minMillis = minMillis_;
-    minRangeSize = minRangeSize_;
+    nWorkersRegistered = 0;
+
+    //
+    // If there's just one thread, we give it the whole range as a single chunk, since there's nobody to share with.
+    // Otherwise, cut it into enough chunks that what's left for the last thread to finish is small, but no smaller
+    // than minRangeSize so that the readers don't spend all their time restarting.  Whatever doesn't divide evenly goes
+    // into the last chunk rather than into a runt chunk of its own, so the last chunk is between one and two chunkSizes.
+    //
+    _int64 rangeSize = __max(rangeEnd - rangeBegin, (_int64)0);
+    if (numThreads == 1) {
+        chunkSize = __max(rangeSize, (_int64)1);
+    } else {
+        chunkSize = __max(rangeSize / ((_int64)numThreads * ChunksPerThread), (_int64)__max(minRangeSize_, 1u));
+    }
+    nChunks = 0 == rangeSize ? 0 : __max(rangeSize / chunkSize, (_int64)1);
+
+    queues = new WorkerQueue[numThreads];
+    for (int i = 0; i < numThreads; i++) {
+        InitializeExclusiveLock(&queues[i].lock);
+        queues[i].nextChunk = nChunks * i / numThreads;
+        queues[i].endChunk = nChunks * (i + 1) / numThreads;
+    }
+}
+
+RangeSplitter::~RangeSplitter()
+{
+    for (int i = 0; i < numThreads; i++) {
+        DestroyExclusiveLock(&queues[i].lock);
+    }
+    delete [] queues;
 }
 
+    int
+RangeSplitter::registerWorker()
+{
+    //
+    // If more workers show up than we have queues, they share.  That's fine for correctness, since everything's
+    // done under the queue locks; it just means they'll be stealing from one another.
+    //
+    return (InterlockedIncrementAndReturnNewValue(&nWorkersRegistered) - 1) % numThreads;
+}
 
-bool RangeSplitter::getNextRange(_int64 *rangeStart, _int64 *rangeLength)
+    bool
+RangeSplitter::getNextRange(int worker, _int64 *rangeStart, _int64 *rangeLength, bool *stolen)
 {
-    // If there are multiple threads, start each of them off with (rangeEnd / divionSize / numThreads),
-    // and then keep giving everyone 1 / (divisionSize * numThreads) of the remaining data or the amount
-    // of units processed per thread in minMillis ms, whichever is bigger.
-    // If there's just one thread, we give it the whole range at the beginning.
-
-    if (startTime == 0) {
-        // There's a possible "race" here if multiple threads start at the same time, but that's
-        // actually OK; we just want a rough idea of when we started the processing.
-        startTime = timeInMillis();
+    _ASSERT(worker >= 0 && worker < numThreads);
+    WorkerQueue *queue = &queues[worker];
+
+    AcquireExclusiveLock(&queue->lock);
+    if (queue->nextChunk < queue->endChunk) {
+        _int64 chunk = queue->nextChunk;
+        queue->nextChunk++;
+        ReleaseExclusiveLock(&queue->lock);
+
+        *rangeStart = chunkStart(chunk);
+        *rangeLength = chunkStart(chunk + 1) - *rangeStart;
+        if (NULL != stolen) {
+            *stolen = false;
+        }
+        _ASSERT(*rangeLength > 0);
+        return true;
     }
+    ReleaseExclusiveLock(&queue->lock);
 
-    _int64 amountLeft = rangeEnd - position;
-    if (amountLeft <= 0) {
+    if (!stealRange(worker, rangeStart, rangeLength)) {
         return false;
     }
 
-    _int64 amountToTake;
-    if (numThreads == 1) {
-		amountToTake = rangeEnd;
-    } else if (amountLeft >= (rangeEnd - rangeBegin) / divisionSize) {
-        amountToTake = (rangeEnd - rangeBegin) / divisionSize / numThreads;
-	    if (amountToTake == 0) {
-			amountToTake = amountLeft;
-	    } else {
-			amountToTake = min(amountLeft, max(amountToTake, (_int64) minRangeSize));
-		}
-    } else {
-        // Figure out units processed in minMillis ms per thread (keeping in mind we ran numThreads in total).
-        _int64 unitsInMinms = (position - rangeBegin) * minMillis / max((_int64) (timeInMillis() - startTime) * numThreads, (_int64) 1);
-        amountToTake = max(amountLeft / divisionSize / numThreads, unitsInMinms);
-        amountToTake = max(amountToTake, (_int64) minRangeSize);  // Avoid getting really tiny amounts at the end.
+    if (NULL != stolen) {
+        *stolen = true;
     }
+    _ASSERT(*rangeStart >= rangeBegin && *rangeLength > 0 && *rangeStart + *rangeLength <= rangeEnd);
+    return true;
+}
 
-    _ASSERT(amountToTake > 0);
-	_int64 oldPosition = position; // for debugging
-    _int64 startOffset = InterlockedAdd64AndReturnNewValue(&position, amountToTake) - amountToTake;
-	_ASSERT(position >= rangeBegin);
-    if (startOffset >= rangeEnd) {
-        // No work left to allocate.
-        return false;
-    }
+    bool
+RangeSplitter::stealRange(int worker, _int64 *rangeStart, _int64 *rangeLength)
+/*++
 
-    // Don't run past EOF if there was a race above (threads looking at amountLeft at the same time).
-    amountToTake = min(amountToTake, rangeEnd - startOffset);
-    _ASSERT(amountToTake > 0);
+Routine Description:
 
-    *rangeStart = startOffset;
-    *rangeLength = amountToTake;
-	_ASSERT(startOffset >= rangeBegin && startOffset + amountToTake <= rangeEnd);
-    return true;
+    Take work from another worker's queue when our own is empty.  We take the back half of the fullest queue, because
+    the owner is working from the front and that's the part it'll get to last.  The first of the stolen chunks is
+    returned to run now and the rest go into our own queue, so we don't have to come back and steal again right away.
+
+Arguments:
+
+    worker      - the worker doing the stealing
+    rangeStart  - returns the start of the range to run
+    rangeLength - returns the length of the range to run
+
+Return Value:
+
+    true if there was anything to steal, false if all of the queues are empty, meaning that the whole range is done.
+
+--*/
+{
+    for (;;) {
+        //
+        // Look for the fullest queue without taking any locks.  It might change before we lock it, in which case we'll
+        // just look again.  Queues only ever get emptier, so this terminates.
+        //
+        int victim = -1;
+        _int64 mostChunks = 0;
+        for (int i = 0; i < numThreads; i++) {
+            _int64 chunksInQueue = queues[i].endChunk - queues[i].nextChunk;
+            if (chunksInQueue > mostChunks) {
+                mostChunks = chunksInQueue;
+                victim = i;
+            }
+        }
+
+        if (-1 == victim) {
+            return false;
+        }
+
+        _int64 firstStolenChunk, endStolenChunk;
+        AcquireExclusiveLock(&queues[victim].lock);
+        _int64 chunksInQueue = queues[victim].endChunk - queues[victim].nextChunk;
+        if (chunksInQueue <= 0) {
+            ReleaseExclusiveLock(&queues[victim].lock);
+            continue;
+        }
+        endStolenChunk = queues[victim].endChunk;
+        firstStolenChunk = endStolenChunk - (chunksInQueue + 1) / 2;
+        queues[victim].endChunk = firstStolenChunk;
+        ReleaseExclusiveLock(&queues[victim].lock);
+
+        WorkerQueue *queue = &queues[worker];
+        AcquireExclusiveLock(&queue->lock);
+        if (queue->nextChunk >= queue->endChunk) {
+            queue->nextChunk = firstStolenChunk + 1;
+            queue->endChunk = endStolenChunk;
+            endStolenChunk = firstStolenChunk + 1;
+        } // else we're sharing this queue with another worker that's put something in it; just run the whole stolen piece.
+        ReleaseExclusiveLock(&queue->lock);
+
+        *rangeStart = chunkStart(firstStolenChunk);
+        *rangeLength = chunkStart(endStolenChunk) - *rangeStart;
+        return true;
+    }
 }
 
 RangeSplittingReadSupplierGenerator::RangeSplittingReadSupplierGenerator(
@@ -130,14 +211,16 @@ RangeSplittingReadSupplierGenerator::RangeSplittingReadSupplierGenerator(
 		headerSize = 0;
 	}
 
-	splitter = new RangeSplitter(QueryFileSize(fileName), numThreads, 5, headerSize, 200, 10 * MAX_READ_LENGTH);
+	splitter = new RangeSplitter(QueryFileSize(fileName), numThreads, headerSize, 10 * MAX_READ_LENGTH);
 }
 
 ReadSupplier *
 RangeSplittingReadSupplierGenerator::generateNewReadSupplier()
 {
     _int64 rangeStart, rangeLength;
-    if (!splitter->getNextRange(&rangeStart, &rangeLength)) {
+    int worker = splitter->registerWorker();
+    bool stolen;
+    if (!splitter->getNextRange(worker, &rangeStart, &rangeLength, &stolen)) {
         return NULL;
     }
 
@@ -148,32 +231,125 @@ RangeSplittingReadSupplierGenerator::generateNewReadSupplier()
     } else {
         underlyingReader = FASTQReader::create(DataSupplier::Default, fileName, 2, rangeStart, rangeLength, context);
     }
-    return new RangeSplittingReadSupplier(splitter,underlyingReader);
+    return new RangeSplittingReadSupplier(splitter, worker, stolen, underlyingReader);
 }
 
 RangeSplittingReadSupplier::~RangeSplittingReadSupplier()
 {
+    releaseHeldBatches(true);
+    delete [] windowReads;
+    delete [] heldBatches;
 }
 
+    bool
+RangeSplittingReadSupplier::moveToNextRange()
+{
+    _int64 rangeStart, rangeLength;
+    bool stolen;
+    if (!splitter->getNextRange(worker, &rangeStart, &rangeLength, &stolen)) {
+        return false;
+    }
+    if (stolen) {
+        rangesStolen++;
+    }
+    underlyingReader->reinit(rangeStart,rangeLength);
+    return true;
+}
 
     Read * 
 RangeSplittingReadSupplier::getNextRead()
 {
+    releaseHeldBatches(false);
     if (underlyingReader->getNextRead(&read)) {
         return &read;
     }
 
-    _int64 rangeStart, rangeLength;
-    if (!splitter->getNextRange(&rangeStart, &rangeLength)) {
+    releaseHeldBatches(true);
+    if (!moveToNextRange()) {
         return NULL;
     }
-    underlyingReader->reinit(rangeStart,rangeLength);
     if (!underlyingReader->getNextRead(&read)) {
         return NULL;
     }
     return &read;
 }
 
+    unsigned
+RangeSplittingReadSupplier::getNextReads(Read **reads, unsigned maxReads)
+{
+    releaseHeldBatches(false);
+
+    if (maxReads > windowSize) {
+        DataBatch *newHeldBatches = new DataBatch[maxReads + 1];
+        for (unsigned i = 0; i < nHeldBatches; i++) {
+            newHeldBatches[i] = heldBatches[i];
+        }
+        delete [] heldBatches;
+        heldBatches = newHeldBatches;
+        delete [] windowReads;
+        windowReads = new Read[maxReads];
+        windowSize = maxReads;
+    }
+
+    unsigned nReads = 0;
+    while (nReads < maxReads && underlyingReader->getNextRead(&windowReads[nReads])) {
+        holdBatchForRead(&windowReads[nReads]);
+        reads[nReads] = &windowReads[nReads];
+        nReads++;
+    }
+
+    if (nReads > 0) {
+        //
+        // If we ran off the end of the range, the next call moves on to the next one.  That remaps the input, so
+        // it has to wait until the caller's done with these.
+        //
+        return nReads;
+    }
+
+    releaseHeldBatches(true);
+    if (!moveToNextRange() || !underlyingReader->getNextRead(&windowReads[0])) {
+        return 0;
+    }
+    holdBatchForRead(&windowReads[0]);
+    reads[0] = &windowReads[0];
+    return 1;
+}
+
+    void
+RangeSplittingReadSupplier::holdBatchForRead(Read *windowRead)
+{
+    DataBatch batch = windowRead->getBatch();
+    if (0 == nHeldBatches || heldBatches[nHeldBatches - 1] != batch) {
+        underlyingReader->holdBatch(batch);
+        heldBatches[nHeldBatches++] = batch;
+    }
+}
+
+    void
+RangeSplittingReadSupplier::releaseHeldBatches(bool all)
+/*++
+
+Routine Description:
+
+    Let go of the batches behind the reads that getNextReads handed out.  Unless we're releasing all of them
+    (because we're about to reinit the reader or go away), keep the hold on the one the last read came from:
+    the reader is still working in it, and releasing its last hold would hand its buffer back for reuse.
+    That hold carries over to the next window.
+
+--*/
+{
+    unsigned nToRelease = (all || 0 == nHeldBatches) ? nHeldBatches : nHeldBatches - 1;
+    for (unsigned i = 0; i < nToRelease; i++) {
+        underlyingReader->releaseBatch(heldBatches[i]);
+    }
+    if (nToRelease < nHeldBatches) {
+        heldBatches[0] = heldBatches[nHeldBatches - 1];
+        nHeldBatches = 1;
+    } else {
+        nHeldBatches = 0;
+    }
+}
+
 RangeSplittingPairedReadSupplier::~RangeSplittingPairedReadSupplier()
 {
 }
@@ -194,9 +370,13 @@ RangeSplittingPairedReadSupplier::getNextReadPair(Read **read1, Read **read2)
     //
 
     _int64 rangeStart, rangeLength;
-    if (!splitter->getNextRange(&rangeStart, &rangeLength)) {
+    bool stolen;
+    if (!splitter->getNextRange(worker, &rangeStart, &rangeLength, &stolen)) {
         return false;
     }
+    if (stolen) {
+        rangesStolen++;
+    }
  
     underlyingReader->reinit(rangeStart,rangeLength);
     return underlyingReader->getNextReadPair(&internalRead1, &internalRead2);
@@ -232,7 +412,9 @@ RangeSplittingPairedReadSupplierGenerator::~RangeSplittingPairedReadSupplierGene
 RangeSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
 {
     _int64 rangeStart, rangeLength;
-    if (!splitter->getNextRange(&rangeStart, &rangeLength)) {
+    int worker = splitter->registerWorker();
+    bool stolen;
+    if (!splitter->getNextRange(worker, &rangeStart, &rangeLength, &stolen)) {
         return NULL;
     }
 
@@ -255,6 +437,6 @@ RangeSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
         soft_exit(1);
     }
  
-    return new RangeSplittingPairedReadSupplier(splitter,underlyingReader);
+    return new RangeSplittingPairedReadSupplier(splitter, worker, stolen, underlyingReader);
 }
 
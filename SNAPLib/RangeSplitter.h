@@ -35,33 +35,60 @@ Revision History:
 // Utility class for letting multiple threads split chunks of a range to process.
 // This is used by the parallel versions of the aligners.
 //
+// The range is cut into chunks up front, and each worker starts out with a contiguous run of them in its own queue.
+// A worker takes chunks from the front of its own queue, and when that's empty it steals the back half of the fullest
+// queue belonging to someone else.  So a worker reads mostly sequentially through its part of the file, but no thread is
+// left holding a big piece of work at the end while the others sit idle.
+//
 class RangeSplitter
 {
 public:
-    RangeSplitter(_int64 rangeEnd_, int numThreads_, unsigned divisonSize_ = 5, _int64 rangeBegin_ = 0, unsigned minMillis_ = 200, unsigned minRangeSize_ = 32768);
+    RangeSplitter(_int64 rangeEnd_, int numThreads_, _int64 rangeBegin_ = 0, unsigned minRangeSize_ = 32768);
+    ~RangeSplitter();
+
+    // Get the worker number to use for calls to getNextRange.  Each thread taking from the range should call this once.
+    int registerWorker();
 
-    // Get the next range for a thread to process, or return false if the whole range is done.
-    bool getNextRange(_int64 *rangeStart, _int64 *rangeLength);
+    // Get the next range for a worker to process, or return false if the whole range is done.  *stolen (if supplied)
+    // says whether the range came from some other worker's queue.
+    bool getNextRange(int worker, _int64 *rangeStart, _int64 *rangeLength, bool *stolen = NULL);
 
 private:
+    static const int ChunksPerThread = 64;
+
+    bool stealRange(int worker, _int64 *rangeStart, _int64 *rangeLength);
+
+    // Where a chunk starts.  The last chunk runs all the way to rangeEnd, so the start of the chunk past it is rangeEnd.
+    _int64 chunkStart(_int64 chunk) const {return chunk >= nChunks ? rangeEnd : rangeBegin + chunk * chunkSize;}
+
+    struct WorkerQueue {
+        ExclusiveLock       lock;
+        volatile _int64     nextChunk;      // The owner takes from here
+        volatile _int64     endChunk;       // One past the last chunk in the queue; thieves take from here back
+        char                padding[64];    // Keep the queues on different cache lines
+    };
+
     int numThreads;
     _int64 rangeBegin;
     _int64 rangeEnd;
-    unsigned divisionSize;
-    unsigned minMillis;
-    unsigned minRangeSize;
-    volatile _int64 position;
-    volatile _int64 startTime;
+    _int64 chunkSize;
+    _int64 nChunks;
+    WorkerQueue *queues;
+    volatile int nWorkersRegistered;
 };
 
 class RangeSplittingReadSupplier : public ReadSupplier {
 public:
-    RangeSplittingReadSupplier(RangeSplitter *i_splitter, ReadReader *i_underlyingReader) : 
-      splitter(i_splitter), underlyingReader(i_underlyingReader), read() {}
+    RangeSplittingReadSupplier(RangeSplitter *i_splitter, int i_worker, bool i_firstRangeStolen, ReadReader *i_underlyingReader) : 
+      splitter(i_splitter), underlyingReader(i_underlyingReader), read(), worker(i_worker), rangesStolen(i_firstRangeStolen ? 1 : 0),
+      windowReads(NULL), windowSize(0), heldBatches(NULL), nHeldBatches(0) {}
 
     virtual ~RangeSplittingReadSupplier();
 
     Read *getNextRead();
+    virtual unsigned getNextReads(Read **reads, unsigned maxReads);
+
+    virtual _int64 getRangesStolen() {return rangesStolen;}
  
     virtual void holdBatch(DataBatch batch)
     { underlyingReader->holdBatch(batch); }
@@ -70,9 +97,24 @@ public:
     { return underlyingReader->releaseBatch(batch); }
 
 private:
+    bool moveToNextRange();
+    void holdBatchForRead(Read *windowRead);
+    void releaseHeldBatches(bool all);
+
     RangeSplitter *splitter;
     ReadReader *underlyingReader;
     Read read;
+    int worker;
+    _int64 rangesStolen;
+
+    //
+    // For getNextReads.  The reads point into the reader's buffers, so we hold the batches they came from until
+    // the caller asks for more.
+    //
+    Read *windowReads;
+    unsigned windowSize;
+    DataBatch *heldBatches;     // windowSize + 1 of them, one for each read plus one carried over from the last call
+    unsigned nHeldBatches;
 };
 
 class RangeSplittingReadSupplierGenerator: public ReadSupplierGenerator {
@@ -94,13 +136,16 @@ private:
 
 class RangeSplittingPairedReadSupplier : public PairedReadSupplier {
 public:
-    RangeSplittingPairedReadSupplier(RangeSplitter *i_splitter, PairedReadReader *i_underlyingReader) : splitter(i_splitter), underlyingReader(i_underlyingReader) {}
+    RangeSplittingPairedReadSupplier(RangeSplitter *i_splitter, int i_worker, bool i_firstRangeStolen, PairedReadReader *i_underlyingReader) :
+        underlyingReader(i_underlyingReader), splitter(i_splitter), worker(i_worker), rangesStolen(i_firstRangeStolen ? 1 : 0) {}
     virtual ~RangeSplittingPairedReadSupplier();
 
     virtual bool getNextReadPair(Read **read1, Read **read2);
+
+    virtual _int64 getRangesStolen() {return rangesStolen;}
        
     virtual void holdBatch(DataBatch batch)
-    { underlyingReader->releaseBatch(batch); }
+    { underlyingReader->holdBatch(batch); }
 
     virtual bool releaseBatch(DataBatch batch)
     { return underlyingReader->releaseBatch(batch); }
@@ -110,6 +155,8 @@ public:
     RangeSplitter *splitter;
     Read internalRead1;
     Read internalRead2;
+    int worker;
+    _int64 rangesStolen;
  };
 
 class RangeSplittingPairedReadSupplierGenerator: public PairedReadSupplierGenerator {
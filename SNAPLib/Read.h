@@ -152,8 +152,19 @@ public:
     virtual Read *getNextRead() = 0;    // This read is valid until you call getNextRead, then it's done.  Don't worry about deallocating it.
     virtual ~ReadSupplier() {}
 
+    //
+    // Get up to maxReads reads at once, all of which stay valid until the next call to getNextRead or getNextReads.
+    // Suppliers that can only keep one read valid at a time hand out one.  Returns the number of reads, 0 at the end.
+    //
+    virtual unsigned getNextReads(Read **reads, unsigned maxReads) {
+        reads[0] = getNextRead();
+        return NULL == reads[0] ? 0 : 1;
+    }
+
     virtual void holdBatch(DataBatch batch) = 0;
     virtual bool releaseBatch(DataBatch batch) = 0;
+
+    virtual _int64 getRangesStolen() {return 0;}   // For suppliers that share their input with work stealing, how many times this one stole
 };
 
 class PairedReadSupplier {
@@ -164,6 +175,8 @@ public:
 
     virtual void holdBatch(DataBatch batch) = 0;
     virtual bool releaseBatch(DataBatch batch) = 0;
+
+    virtual _int64 getRangesStolen() {return 0;}
 };
 
 class ReadSupplierGenerator {
@@ -303,31 +316,13 @@ public:
             }
 
             //
-            // Now set up the data, unclippedData, quality and unclippedQuality pointers.
+            // Now set up the data, unclippedData, quality and unclippedQuality pointers.  Each is checked on its own:
+            // an upcased read has its data in the other read's local buffer but its quality still external.
             //
-            if (NULL == other.localBuffer || other.data < other.localBuffer || other.data >= other.localBuffer + other.localBufferAllocationOffset - dataLength) {
-                //
-                // Not in the other read's local buffer, so it must be external.  Copy it.
-                //
-                data = other.data;
-                _ASSERT(NULL == other.localBuffer || other.quality < other.localBuffer || other.quality >= other.localBuffer + other.localBufferAllocationOffset);
-                quality = other.quality;
-                _ASSERT(NULL == other.localBuffer || other.unclippedData < other.localBuffer || other.unclippedData >= other.localBuffer + other.localBufferAllocationOffset);
-                unclippedData = other.unclippedData;
-                _ASSERT(NULL == other.localBuffer || other.unclippedQuality < other.localBuffer || other.unclippedQuality >= other.localBuffer + other.localBufferAllocationOffset);
-                unclippedQuality = other.unclippedQuality;
-            } else {
-                //
-                // It is in the other read's local buffer.  Copy the local buffer offsets from the other read into this one.
-                //
-                data = localBuffer + (other.data - other.localBuffer);
-                _ASSERT(other.quality >= other.localBuffer && other.quality <= other.localBuffer + other.localBufferAllocationOffset - dataLength);
-                quality = localBuffer + (other.quality - other.localBuffer);
-                _ASSERT(other.unclippedData >= other.localBuffer && other.unclippedData <= other.localBuffer + other.localBufferAllocationOffset - unclippedLength);
-                unclippedData = localBuffer + (other.unclippedData - other.localBuffer);
-                _ASSERT(other.unclippedQuality >= other.localBuffer && other.unclippedQuality <= other.localBuffer + other.localBufferAllocationOffset - unclippedLength);
-                unclippedQuality = localBuffer + (other.unclippedQuality - other.localBuffer);
-            }
+            data = translateFromOtherLocalBuffer(other, other.data);
+            quality = translateFromOtherLocalBuffer(other, other.quality);
+            unclippedData = translateFromOtherLocalBuffer(other, other.unclippedData);
+            unclippedQuality = translateFromOtherLocalBuffer(other, other.unclippedQuality);
 
             clippingState = other.clippingState;
 	    junctionTruncated = other.junctionTruncated;
@@ -412,18 +407,11 @@ public:
             // '.' to N.
             //
             if (! allUpper) {
-                unsigned anyLowerCase = 0;
-                for (unsigned i = 0; i < dataLength; i++) {
-                    anyLowerCase |= IS_LOWER_CASE_OR_DOT[data[i]];
-                }
-
-                if (anyLowerCase) {
+                if (anyLowerCaseOrDot(data, dataLength)) {
                     assureLocalBufferLargeEnough();
                     upcaseForwardRead = localBuffer;
                     localBufferAllocationOffset += unclippedLength;
-                    for (unsigned i = 0; i < dataLength; i++) {
-                        upcaseForwardRead[i] = TO_UPPER_CASE_DOT_TO_N[data[i]];
-                    }
+                    toUpperCaseDotToN(data, upcaseForwardRead, dataLength);
 
                     unclippedData = data = upcaseForwardRead;
                 }
@@ -665,6 +653,8 @@ public:
 
 private:
 
+        friend class ReadWithOwnMemory;
+
         const char *id;
         const char *data;
         const char *unclippedData;
@@ -708,6 +698,18 @@ private:
         const char *externalQuality;            // The quality that was passed in at init() time, memory doens't belong to this.
         Direction currentReadDirection;
 
+        //
+        // If p points into the allocated part of the other read's local buffer, return the same offset in ours
+        // (which copyFromOtherRead has already filled in).  Otherwise it's external memory and is returned as-is.
+        //
+        inline const char *translateFromOtherLocalBuffer(const Read& other, const char *p) const
+        {
+            if (other.localBufferAllocationOffset != 0 && p >= other.localBuffer && p < other.localBuffer + other.localBufferAllocationOffset) {
+                return localBuffer + (p - other.localBuffer);
+            }
+            return p;
+        }
+
         inline void assureLocalBufferLargeEnough()
         {
 #if 0   // Always true with static allocation
@@ -723,6 +725,55 @@ private:
 #endif // 0
         }
 
+        //
+        // The same as looking up each base in IS_LOWER_CASE_OR_DOT and TO_UPPER_CASE_DOT_TO_N, but 16 at a time.  Adding
+        // 0x80 - 'a' moves 'a'..'z' to the bottom 26 values of a signed byte, so one signed compare finds all of them.
+        //
+        static inline bool anyLowerCaseOrDot(const char *bases, unsigned length)
+        {
+            unsigned i = 0;
+#if USE_SSE2
+            const __m128i lowerCaseBias = _mm_set1_epi8((char)(0x80 - 'a'));
+            const __m128i lowerCaseLimit = _mm_set1_epi8((char)(0x80 + 26));
+            const __m128i dots = _mm_set1_epi8('.');
+            for (; i + 16 <= length; i += 16) {
+                __m128i chunk = _mm_loadu_si128((const __m128i *)(bases + i));
+                __m128i lowerCase = _mm_cmplt_epi8(_mm_add_epi8(chunk, lowerCaseBias), lowerCaseLimit);
+                if (0 != _mm_movemask_epi8(_mm_or_si128(lowerCase, _mm_cmpeq_epi8(chunk, dots)))) {
+                    return true;
+                }
+            }
+#endif  // USE_SSE2
+            for (; i < length; i++) {
+                if (IS_LOWER_CASE_OR_DOT[bases[i]]) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static inline void toUpperCaseDotToN(const char *bases, char *upperCaseBases, unsigned length)
+        {
+            unsigned i = 0;
+#if USE_SSE2
+            const __m128i lowerCaseBias = _mm_set1_epi8((char)(0x80 - 'a'));
+            const __m128i lowerCaseLimit = _mm_set1_epi8((char)(0x80 + 26));
+            const __m128i caseBit = _mm_set1_epi8(0x20);
+            const __m128i dots = _mm_set1_epi8('.');
+            const __m128i ns = _mm_set1_epi8('N');
+            for (; i + 16 <= length; i += 16) {
+                __m128i chunk = _mm_loadu_si128((const __m128i *)(bases + i));
+                __m128i lowerCase = _mm_cmplt_epi8(_mm_add_epi8(chunk, lowerCaseBias), lowerCaseLimit);
+                __m128i isDot = _mm_cmpeq_epi8(chunk, dots);
+                __m128i upperCase = _mm_sub_epi8(chunk, _mm_and_si128(lowerCase, caseBit));
+                _mm_storeu_si128((__m128i *)(upperCaseBases + i), _mm_or_si128(_mm_andnot_si128(isDot, upperCase), _mm_and_si128(isDot, ns)));
+            }
+#endif  // USE_SSE2
+            for (; i < length; i++) {
+                upperCaseBases[i] = TO_UPPER_CASE_DOT_TO_N[bases[i]];
+            }
+        }
+
         // batch for managing lifetime during input
         DataBatch batch;
 
@@ -786,7 +837,7 @@ private:
 //
 class ReadWithOwnMemory : public Read {
 public:
-    ReadWithOwnMemory() : Read(), extraBuffer(NULL), dataBuffer(NULL), idBuffer(NULL), qualityBuffer(NULL), auxBuffer(NULL) {}
+    ReadWithOwnMemory() : Read(), extraBuffer(NULL), dataBuffer(NULL), idBuffer(NULL), qualityBuffer(NULL), auxBuffer(NULL), rnextBuffer(NULL) {}
 
     ReadWithOwnMemory(const Read &baseRead) {
         set(baseRead);
@@ -796,14 +847,17 @@ public:
     void dispose() {
         if (extraBuffer != NULL) {
             delete [] extraBuffer;
+            extraBuffer = NULL;
         }
     }
 
-private:
-
+    //
+    // Become a copy of baseRead, clipping, upcasing, original alignment and all, but with every string it points
+    // to copied.  Call dispose() first if this has been set before.
+    //
     void set(const Read &baseRead)
     {
-        // allocate space in ownBuffer if possible; id/aux might need extraBuffer
+        // allocate space in ownBuffer if possible; id/aux/rnext might need extraBuffer
         dataBuffer = ownBuffer;
         int ownBufferUsed = baseRead.getUnclippedLength() + 1;
         qualityBuffer = ownBuffer + ownBufferUsed;
@@ -811,6 +865,7 @@ private:
         unsigned auxLen;
         bool auxSam;
         char* aux = baseRead.getAuxiliaryData(&auxLen, &auxSam);
+        unsigned rnextLen = baseRead.originalRNEXT != NULL ? baseRead.originalRNEXTLength : 0;
         if (baseRead.getIdLength() + 1 < sizeof(ownBuffer) - ownBufferUsed) {
             idBuffer = ownBuffer + ownBufferUsed;
             ownBufferUsed += baseRead.getIdLength() + 1;
@@ -823,8 +878,14 @@ private:
         } else {
             auxBuffer = NULL;
         }
-        if (idBuffer == NULL || (auxLen > 0 && auxBuffer == NULL)) {
-            extraBuffer = new char[(idBuffer == NULL ? baseRead.getIdLength() + 1 : 0) + auxLen];
+        if (rnextLen > 0 && rnextLen < sizeof(ownBuffer) - ownBufferUsed) {
+            rnextBuffer = ownBuffer + ownBufferUsed;
+            ownBufferUsed += rnextLen;
+        } else {
+            rnextBuffer = NULL;
+        }
+        if (idBuffer == NULL || (auxLen > 0 && auxBuffer == NULL) || (rnextLen > 0 && rnextBuffer == NULL)) {
+            extraBuffer = new char[(idBuffer == NULL ? baseRead.getIdLength() + 1 : 0) + (auxBuffer == NULL ? auxLen : 0) + (rnextBuffer == NULL ? rnextLen : 0)];
             int extraBufferUsed = 0;
             if (idBuffer == NULL) {
                 idBuffer = extraBuffer;
@@ -832,6 +893,10 @@ private:
             }
             if (auxLen > 0 && auxBuffer == NULL) {
                 auxBuffer = extraBuffer + extraBufferUsed;
+                extraBufferUsed += auxLen;
+            }
+            if (rnextLen > 0 && rnextBuffer == NULL) {
+                rnextBuffer = extraBuffer + extraBufferUsed;
             }
         } else {
             extraBuffer = NULL;
@@ -841,24 +906,50 @@ private:
         memcpy(idBuffer,baseRead.getId(),baseRead.getIdLength());
         idBuffer[baseRead.getIdLength()] = '\0';    // Even though it doesn't need to be null terminated, it seems like a good idea.
 
-        memcpy(dataBuffer,baseRead.getUnclippedData(),baseRead.getUnclippedLength());
+        memcpy(dataBuffer,baseRead.externalData,baseRead.getUnclippedLength());
         dataBuffer[baseRead.getUnclippedLength()] = '\0';
 
-        memcpy(qualityBuffer,baseRead.getUnclippedQuality(),baseRead.getUnclippedLength());
+        memcpy(qualityBuffer,baseRead.externalQuality,baseRead.getUnclippedLength());
         qualityBuffer[baseRead.getUnclippedLength()] = '\0';
-    
-        init(idBuffer,baseRead.getIdLength(),dataBuffer,qualityBuffer,baseRead.getUnclippedLength());
-		clip(baseRead.getClippingState());
 
-        setReadGroup(baseRead.getReadGroup());
-        
         if (aux != NULL && auxLen > 0) {
             memcpy(auxBuffer, aux, auxLen);
+        }
+
+        if (rnextLen > 0) {
+            memcpy(rnextBuffer, baseRead.originalRNEXT, rnextLen);
+        }
+
+        //
+        // Take all of the other read's state, and then point whatever is still outside of our local buffer at our own copies.
+        //
+        copyFromOtherRead(baseRead);
+
+        id = idBuffer;
+        data = ownCopy(data, externalData, dataBuffer);
+        unclippedData = ownCopy(unclippedData, externalData, dataBuffer);
+        quality = ownCopy(quality, externalQuality, qualityBuffer);
+        unclippedQuality = ownCopy(unclippedQuality, externalQuality, qualityBuffer);
+        externalData = dataBuffer;
+        externalQuality = qualityBuffer;
+        originalRNEXT = rnextLen > 0 ? rnextBuffer : NULL;
+
+        if (aux != NULL && auxLen > 0) {
             setAuxiliaryData(auxBuffer, auxLen);
         } else {
             setAuxiliaryData(NULL, 0);
         }
     }
+
+private:
+
+    inline const char *ownCopy(const char *p, const char *external, char *copy) const
+    {
+        if (p >= localBuffer && p < localBuffer + localBufferAllocationOffset) {
+            return p;
+        }
+        return copy + (p - external);
+    }
         
     char ownBuffer[MAX_READ_LENGTH * 2 + 1000]; // internal buffer for copied data
     char* extraBuffer; // extra buffer if internal buffer not big enough
@@ -868,6 +959,7 @@ private:
     char *dataBuffer;
     char *qualityBuffer;
     char *auxBuffer;
+    char *rnextBuffer;
 };
 
 extern const unsigned DEFAULT_MIN_READ_LENGTH;
@@ -648,6 +648,25 @@ ReadSupplierFromQueue::getNextRead()
     return &currentElement->reads[nextReadIndex++]; // Note the post increment.
 }
 
+    unsigned
+ReadSupplierFromQueue::getNextReads(Read **reads, unsigned maxReads)
+{
+    //
+    // An element's reads stay valid until we're done with the whole element, so hand out as many of the rest of
+    // them as the caller wants.
+    //
+    reads[0] = getNextRead();
+    if (NULL == reads[0]) {
+        return 0;
+    }
+
+    unsigned nReads = 1;
+    while (nReads < maxReads && nextReadIndex < currentElement->totalReads) {
+        reads[nReads++] = &currentElement->reads[nextReadIndex++];
+    }
+    return nReads;
+}
+
 PairedReadSupplierFromQueue::PairedReadSupplierFromQueue(ReadSupplierQueue *i_queue, bool i_twoFiles) :
     queue(i_queue), twoFiles(i_twoFiles), done(false), 
     currentElement(NULL), currentSecondElement(NULL), nextReadIndex(0) {}
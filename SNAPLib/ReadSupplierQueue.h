@@ -183,6 +183,7 @@ public:
     ~ReadSupplierFromQueue() {}
 
     Read *getNextRead();
+    virtual unsigned getNextReads(Read **reads, unsigned maxReads);
     
     virtual void holdBatch(DataBatch batch)
     { queue->holdBatch(batch); }
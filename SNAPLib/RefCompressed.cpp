@@ -0,0 +1,1245 @@
+/*++
+
+Module Name:
+
+    RefCompressed.cpp
+
+Abstract:
+
+    Reference-compressed alignment output: the codec, the writer filter, the file format and the reader.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "BigAlloc.h"
+#include "Compat.h"
+#include "RefCompressed.h"
+#include "DataReader.h"
+#include "DataWriter.h"
+#include "FileFormat.h"
+#include "Bam.h"
+#include "Deflate.h"
+#include "MD5.h"
+#include "exit.h"
+#include "Error.h"
+
+using std::min;
+using std::max;
+
+const _uint32 RefCompressedContainer::Magic;
+const size_t RefCompressedCodec::ContainerBytes;
+
+//
+// A column being built up, or decompressed for decoding.  It's kept from one container to the next,
+// so it only grows a few times.
+//
+class RefCompressedCodec::Column
+{
+public:
+    Column() : data(NULL), used(0), capacity(0) {}
+
+    ~Column()
+    { delete [] data; }
+
+    void clear()
+    { used = 0; }
+
+    char* append(size_t bytes)
+    {
+        if (used + bytes > capacity) {
+            grow(used + bytes);
+        }
+        char* result = data + used;
+        used += bytes;
+        return result;
+    }
+
+    void put(const void* bytes, size_t count)
+    { memcpy(append(count), bytes, count); }
+
+    void putByte(_uint8 value)
+    { *append(1) = (char) value; }
+
+    void putVarint(_uint64 value)
+    {
+        while (value >= 0x80) {
+            putByte((_uint8) (value | 0x80));
+            value >>= 7;
+        }
+        putByte((_uint8) value);
+    }
+
+    char*   data;
+    size_t  used;
+
+private:
+    void grow(size_t needed)
+    {
+        capacity = max(needed, max(2 * capacity, (size_t) 4096));
+        char* larger = new char[capacity];
+        if (used > 0) {
+            memcpy(larger, data, used);
+        }
+        delete [] data;
+        data = larger;
+    }
+
+    size_t  capacity;
+};
+
+//
+// Reads back a column, noting if it runs off the end.
+//
+class ColumnReader
+{
+public:
+    ColumnReader() : ok(true), next(NULL), end(NULL) {}
+
+    void init(const char* data, size_t bytes)
+    { next = data; end = data + bytes; }
+
+    const char* get(size_t bytes)
+    {
+        if ((size_t) (end - next) < bytes) {
+            ok = false;
+            return NULL;
+        }
+        const char* result = next;
+        next += bytes;
+        return result;
+    }
+
+    _uint64 getVarint()
+    {
+        _uint64 value = 0;
+        for (int shift = 0; shift < 64 && next < end; shift += 7) {
+            _uint8 b = (_uint8) *next++;
+            value |= (_uint64) (b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return value;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+
+    bool atEnd()
+    { return next == end; }
+
+    bool ok;
+
+private:
+    const char* next;
+    const char* end;
+};
+
+static inline _uint64 Zigzag(_int64 value)
+{ return ((_uint64) value << 1) ^ (_uint64) (value >> 63); }
+
+static inline _int64 Unzigzag(_uint64 value)
+{ return (_int64) (value >> 1) ^ -(_int64) (value & 1); }
+
+static inline _uint8 GetBase(const _uint8* nibbles, _int64 i)
+{ return (i & 1) ? (nibbles[i >> 1] & 0xf) : (nibbles[i >> 1] >> 4); }
+
+static inline void SetBase(_uint8* nibbles, _int64 i, _uint8 code)
+{ nibbles[i >> 1] |= (i & 1) ? code : (code << 4); }
+
+// read and reference lengths of a cigar string; false if it has an unknown op
+    static bool
+CigarLengths(
+    const _uint32* cigar,
+    int ops,
+    _int64* o_query,
+    _int64* o_ref)
+{
+    *o_query = *o_ref = 0;
+    bool ok = true;
+    for (int i = 0; i < ops; i++) {
+        int count = BAMAlignment::GetCigarOpCount(cigar[i]);
+        switch (BAMAlignment::GetCigarOpCode(cigar[i])) {
+        case 0: case 7: case 8: // M = X
+            *o_query += count;
+            *o_ref += count;
+            break;
+        case 1: case 4: // I S
+            *o_query += count;
+            break;
+        case 2: case 3: // D N
+            *o_ref += count;
+            break;
+        case 5: case 6: // H P
+            break;
+        default:
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// the bin SNAP would write, so usually the stored difference is 0
+    static _uint16
+PredictBin(
+    _int32 pos,
+    const _uint32* cigar,
+    int ops)
+{
+    if (pos < 0) {
+        return (_uint16) BAMAlignment::reg2bin(-1, 0);
+    }
+    _int64 query, ref;
+    CigarLengths(cigar, ops, &query, &ref);
+    _int64 end = min((_int64) pos + max(ref, (_int64) 1), (_int64) INT32_MAX);
+    return (_uint16) BAMAlignment::reg2bin(pos, (int) end);
+}
+
+// bytes in the BAM header at the start of the data, or all of it if it's cut off
+    static size_t
+BamHeaderBytes(
+    const char* data,
+    size_t bytes)
+{
+    _int64 l_text = ((const BAMHeader*) data)->l_text;
+    _int64 offset = BAMHeader::size(0) + l_text;
+    if (l_text < 0 || offset > (_int64) bytes) {
+        return bytes;
+    }
+    _int32 n_ref = *(const _int32*) (data + offset - sizeof(_int32));
+    for (_int32 i = 0; i < n_ref; i++) {
+        if (offset + (_int64) sizeof(_int32) > (_int64) bytes) {
+            return bytes;
+        }
+        _int32 l_name = *(const _int32*) (data + offset);
+        offset += BAMHeaderRefSeq::size(max(l_name, 0));
+        if (l_name < 0 || offset > (_int64) bytes) {
+            return bytes;
+        }
+    }
+    return (size_t) offset;
+}
+
+// size of a whole BAM record at the start of the data, or 0 if it isn't one
+    static size_t
+RecordBytes(
+    const char* data,
+    size_t bytes)
+{
+    if (bytes < sizeof(BAMAlignment)) {
+        return 0;
+    }
+    const BAMAlignment* bam = (const BAMAlignment*) data;
+    _int64 size = (_int64) bam->block_size + sizeof(bam->block_size);
+    if (bam->l_seq < 0 || size > (_int64) bytes ||
+        (_int64) sizeof(BAMAlignment) + bam->l_read_name + bam->n_cigar_op * (_int64) sizeof(_uint32) + ((_int64) bam->l_seq + 1) / 2 + bam->l_seq > size)
+    {
+        return 0;
+    }
+    return (size_t) size;
+}
+
+RefCompressedCodec::RefCompressedCodec(
+    const Genome* i_genome,
+    int i_level)
+    : genome(i_genome), referenceHash(ReferenceHash(i_genome)), level(i_level), compressor(NULL), decompressor(NULL)
+{
+    columns = new Column[RefCompressedContainer::NumColumns];
+    decodeBuffer = new Column();
+}
+
+RefCompressedCodec::RefCompressedCodec(
+    const Genome* i_genome,
+    _uint64 i_referenceHash,
+    int i_level)
+    : genome(i_genome), referenceHash(i_referenceHash), level(i_level), compressor(NULL), decompressor(NULL)
+{
+    columns = new Column[RefCompressedContainer::NumColumns];
+    decodeBuffer = new Column();
+}
+
+RefCompressedCodec::~RefCompressedCodec()
+{
+    delete compressor;
+    delete decompressor;
+    delete [] columns;
+    delete decodeBuffer;
+}
+
+    _uint64
+RefCompressedCodec::ReferenceHash(
+    const Genome* genome)
+{
+    // FNV-1a of each contig's name, a null, its length and its MD5
+    _uint64 hash = 14695981039346656037ULL;
+    int n = genome->getNumContigs();
+    const Genome::Contig* contigs = genome->getContigs();
+    for (int i = 0; i < n; i++) {
+        _int64 length = contigs[i].length;
+        _uint8 digest[MD5::DigestBytes];
+        ContigMD5(genome, i, digest);
+        for (unsigned j = 0; j <= contigs[i].nameLength + sizeof(length) + MD5::DigestBytes; j++) {
+            _uint8 b = j < contigs[i].nameLength ? (_uint8) contigs[i].name[j]
+                : j == contigs[i].nameLength ? 0
+                : j <= contigs[i].nameLength + sizeof(length) ? (_uint8) (length >> (8 * (j - contigs[i].nameLength - 1)))
+                : digest[j - contigs[i].nameLength - sizeof(length) - 1];
+            hash = (hash ^ b) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+    void
+RefCompressedCodec::ContigMD5(
+    const Genome* genome,
+    int contig,
+    _uint8* o_digest)
+{
+    const Genome::Contig* c = &genome->getContigs()[contig];
+    // the contig's length includes the padding after it
+    GenomeDistance length = max(c->length - (GenomeDistance) genome->getChromosomePadding(), (GenomeDistance) 0);
+    const GenomeDistance pieceBytes = 1024 * 1024;
+    char* piece = new char[pieceBytes];
+    char* decodeBuffer = genome->isPacked() ? new char[pieceBytes] : NULL;
+    MD5 md5;
+    for (GenomeDistance done = 0; done < length; done += pieceBytes) {
+        GenomeDistance bytes = min(pieceBytes, length - done);
+        const char* bases = genome->getSubstring(c->beginningLocation + done, bytes, decodeBuffer, 0);
+        _ASSERT(bases != NULL);
+        for (GenomeDistance i = 0; i < bytes; i++) {
+            piece[i] = (char) toupper((_uint8) bases[i]);
+        }
+        md5.update(piece, (size_t) bytes);
+    }
+    md5.final(o_digest);
+    delete [] piece;
+    delete [] decodeBuffer;
+}
+
+    size_t
+RefCompressedCodec::encode(
+    const char* input,
+    size_t inputBytes,
+    char* output,
+    size_t outputSize)
+{
+    size_t in = 0, out = 0;
+    if (inputBytes >= BAMHeader::size(0) && ((const BAMHeader*) input)->magic == BAMHeader::BAM_MAGIC) {
+        size_t headerBytes = BamHeaderBytes(input, inputBytes);
+        while (in < headerBytes) {
+            size_t piece = min(ContainerBytes, headerBytes - in);
+            size_t used = encodeRaw(input + in, piece, output + out, outputSize - out);
+            if (used == 0) {
+                return 0;
+            }
+            in += piece;
+            out += used;
+        }
+    }
+    while (in < inputBytes) {
+        size_t bytes = 0;
+        _uint32 records = 0;
+        while (in + bytes < inputBytes) {
+            size_t recordBytes = RecordBytes(input + in + bytes, inputBytes - in - bytes);
+            if (recordBytes == 0 || (records > 0 && bytes + recordBytes > ContainerBytes)) {
+                break;
+            }
+            bytes += recordBytes;
+            records++;
+        }
+        size_t used;
+        if (records > 0) {
+            used = encodeRecords(input + in, bytes, records, output + out, outputSize - out);
+        } else {
+            // not a record, so don't try to make sense of any of the rest
+            bytes = min(ContainerBytes, inputBytes - in);
+            used = encodeRaw(input + in, bytes, output + out, outputSize - out);
+        }
+        if (used == 0) {
+            return 0;
+        }
+        in += bytes;
+        out += used;
+    }
+    return out;
+}
+
+    size_t
+RefCompressedCodec::encodeEnd(
+    char* output,
+    size_t outputSize)
+{
+    if (outputSize < sizeof(RefCompressedContainer)) {
+        return 0;
+    }
+    memset(output, 0, sizeof(RefCompressedContainer));
+    ((RefCompressedContainer*) output)->magic = RefCompressedContainer::Magic;
+    return sizeof(RefCompressedContainer);
+}
+
+    size_t
+RefCompressedCodec::encodeRaw(
+    const char* input,
+    size_t bytes,
+    char* output,
+    size_t outputSize)
+{
+    for (int i = 0; i < RefCompressedContainer::NumColumns; i++) {
+        columns[i].clear();
+    }
+    columns[RefCompressedContainer::RawColumn].put(input, bytes);
+    return writeContainer(0, bytes, output, outputSize);
+}
+
+    size_t
+RefCompressedCodec::encodeRecords(
+    const char* input,
+    size_t bytes,
+    _uint32 records,
+    char* output,
+    size_t outputSize)
+{
+    for (int i = 0; i < RefCompressedContainer::NumColumns; i++) {
+        columns[i].clear();
+    }
+    const char* record = input;
+    prevRefID = -1;
+    prevPos = 0;
+    for (_uint32 i = 0; i < records; i++) {
+        encodeRecord(record);
+        record += ((BAMAlignment*) record)->size();
+    }
+    _ASSERT(record == input + bytes);
+    return writeContainer(records, bytes, output, outputSize);
+}
+
+    void
+RefCompressedCodec::encodeRecord(
+    const char* record)
+{
+    BAMAlignment* bam = (BAMAlignment*) record;
+    Column* fields = &columns[RefCompressedContainer::FieldsColumn];
+    if (bam->refID != prevRefID) {
+        prevPos = 0;
+    }
+    _uint32* cigar = bam->cigar();
+    fields->putVarint(Zigzag((_int64) bam->refID - prevRefID));
+    fields->putVarint(Zigzag((_int64) bam->pos - prevPos));
+    fields->putVarint(bam->l_read_name);
+    fields->putVarint(bam->MAPQ);
+    fields->putVarint(Zigzag((_int16) (bam->bin - PredictBin(bam->pos, cigar, bam->n_cigar_op))));
+    fields->putVarint(bam->n_cigar_op);
+    fields->putVarint(bam->FLAG);
+    fields->putVarint(bam->l_seq);
+    fields->putVarint(Zigzag((_int64) bam->next_refID - bam->refID));
+    fields->putVarint(Zigzag((_int64) bam->next_pos - bam->pos));
+    fields->putVarint(Zigzag(bam->tlen));
+    fields->putVarint(bam->auxLen());
+    prevRefID = bam->refID;
+    prevPos = bam->pos;
+
+    columns[RefCompressedContainer::NamesColumn].put(bam->read_name(), bam->l_read_name);
+    columns[RefCompressedContainer::CigarsColumn].put(cigar, bam->n_cigar_op * sizeof(_uint32));
+
+    Column* differences = &columns[RefCompressedContainer::DifferencesColumn];
+    Column* bases = &columns[RefCompressedContainer::BasesColumn];
+    const _uint8* seq = bam->seq();
+    const char* ref = getReference(bam->refID, bam->pos, cigar, bam->n_cigar_op, bam->l_seq);
+    if (ref == NULL) {
+        differences->putVarint(0);
+        bases->put(seq, (bam->l_seq + 1) / 2);
+    } else {
+        // each mismatch is 1 + the number of matching bases since the last one, with 0 at the end
+        differences->putVarint(1);
+        _int64 q = 0, compared = 0, lastMismatch = 0;
+        for (int i = 0; i < bam->n_cigar_op; i++) {
+            int count = BAMAlignment::GetCigarOpCount(cigar[i]);
+            switch (BAMAlignment::GetCigarOpCode(cigar[i])) {
+            case 0: case 7: case 8: // M = X
+                for (int j = 0; j < count; j++, q++, compared++, ref++) {
+                    _uint8 code = GetBase(seq, q);
+                    if (code != BAMAlignment::SeqToCode[(_uint8) *ref]) {
+                        differences->putVarint(compared - lastMismatch + 1);
+                        bases->putByte(code);
+                        lastMismatch = compared + 1;
+                    }
+                }
+                break;
+            case 1: case 4: // I S
+                for (int j = 0; j < count; j++, q++) {
+                    bases->putByte(GetBase(seq, q));
+                }
+                break;
+            case 2: case 3: // D N
+                ref += count;
+                break;
+            }
+        }
+        differences->putVarint(0);
+        if (bam->l_seq & 1) {
+            bases->putByte(seq[bam->l_seq / 2] & 0xf); // padding
+        }
+    }
+
+    columns[RefCompressedContainer::QualitiesColumn].put(bam->qual(), bam->l_seq);
+    columns[RefCompressedContainer::AuxColumn].put(bam->firstAux(), bam->auxLen());
+}
+
+    const char*
+RefCompressedCodec::getReference(
+    _int32 refID,
+    _int32 pos,
+    const _uint32* cigar,
+    int ops,
+    _int32 l_seq)
+{
+    _int64 query, ref;
+    if (refID < 0 || refID >= genome->getNumContigs() || pos < 0 || l_seq <= 0 ||
+        ! CigarLengths(cigar, ops, &query, &ref) || query != l_seq || ref <= 0)
+    {
+        return NULL;
+    }
+    const Genome::Contig* contig = &genome->getContigs()[refID];
+    if (pos + ref > contig->length) {
+        return NULL;
+    }
+    decodeBuffer->clear();
+    return genome->getSubstring(contig->beginningLocation + pos, ref, decodeBuffer->append(ref), 0);
+}
+
+    size_t
+RefCompressedCodec::writeContainer(
+    _uint32 records,
+    size_t decodedBytes,
+    char* output,
+    size_t outputSize)
+{
+    if (outputSize < sizeof(RefCompressedContainer)) {
+        return 0;
+    }
+    if (compressor == NULL) {
+        compressor = GzipCompressor::create(level);
+    }
+    RefCompressedContainer* container = (RefCompressedContainer*) output;
+    container->magic = RefCompressedContainer::Magic;
+    container->records = records;
+    container->referenceHash = referenceHash;
+    container->decodedBytes = (_uint32) decodedBytes;
+    size_t used = sizeof(RefCompressedContainer);
+    for (int i = 0; i < RefCompressedContainer::NumColumns; i++) {
+        size_t raw = columns[i].used;
+        size_t room = outputSize - used;
+        // only keep the compressed column if it's smaller
+        size_t stored = raw > 1 ? compressor->compress(false, output + used, min(room, raw - 1), columns[i].data, raw) : 0;
+        if (stored == 0) {
+            if (raw > room) {
+                return 0;
+            }
+            if (raw > 0) {
+                memcpy(output + used, columns[i].data, raw);
+            }
+            stored = raw;
+        }
+        container->columnRawBytes[i] = (_uint32) raw;
+        container->columnBytes[i] = (_uint32) stored;
+        used += stored;
+    }
+    return used;
+}
+
+    size_t
+RefCompressedCodec::validate(
+    const char* data,
+    size_t bytes)
+{
+    if (bytes < sizeof(RefCompressedContainer)) {
+        return 0;
+    }
+    const RefCompressedContainer* container = (const RefCompressedContainer*) data;
+    if (container->magic != RefCompressedContainer::Magic) {
+        return 0;
+    }
+    for (int i = 0; i < RefCompressedContainer::NumColumns; i++) {
+        if (container->columnBytes[i] > container->columnRawBytes[i]) {
+            return 0;
+        }
+    }
+    return container->size();
+}
+
+    bool
+RefCompressedCodec::decode(
+    const RefCompressedContainer* container,
+    char* output,
+    size_t outputSize)
+{
+    if (container->isEnd()) {
+        return true;
+    }
+    if (container->referenceHash != referenceHash || container->decodedBytes > outputSize) {
+        return false;
+    }
+    if (decompressor == NULL) {
+        decompressor = GzipDecompressor::create();
+    }
+    const char* data[RefCompressedContainer::NumColumns];
+    const char* p = (const char*) (container + 1);
+    for (int i = 0; i < RefCompressedContainer::NumColumns; i++) {
+        _uint32 stored = container->columnBytes[i], raw = container->columnRawBytes[i];
+        if (stored == raw) {
+            data[i] = p;
+        } else {
+            columns[i].clear();
+            char* decompressed = columns[i].append(raw);
+            if (! decompressor->decompress(p, stored, decompressed, raw)) {
+                return false;
+            }
+            data[i] = decompressed;
+        }
+        p += stored;
+    }
+    if (container->records == 0) {
+        if (container->columnRawBytes[RefCompressedContainer::RawColumn] != container->decodedBytes) {
+            return false;
+        }
+        memcpy(output, data[RefCompressedContainer::RawColumn], container->decodedBytes);
+        return true;
+    }
+    return decodeRecords(container, data, output, container->decodedBytes);
+}
+
+    bool
+RefCompressedCodec::decodeRecords(
+    const RefCompressedContainer* container,
+    const char** data,
+    char* output,
+    size_t outputSize)
+{
+    ColumnReader columnReaders[RefCompressedContainer::NumColumns];
+    for (int i = 0; i < RefCompressedContainer::NumColumns; i++) {
+        columnReaders[i].init(data[i], container->columnRawBytes[i]);
+    }
+    ColumnReader* fields = &columnReaders[RefCompressedContainer::FieldsColumn];
+    ColumnReader* differences = &columnReaders[RefCompressedContainer::DifferencesColumn];
+    ColumnReader* bases = &columnReaders[RefCompressedContainer::BasesColumn];
+    size_t out = 0;
+    _int64 lastRefID = -1, lastPos = 0;
+    for (_uint32 r = 0; r < container->records; r++) {
+        _int64 refID = lastRefID + Unzigzag(fields->getVarint());
+        if (refID != lastRefID) {
+            lastPos = 0;
+        }
+        _int64 pos = lastPos + Unzigzag(fields->getVarint());
+        _uint64 l_read_name = fields->getVarint();
+        _uint64 mapq = fields->getVarint();
+        _int64 binDelta = Unzigzag(fields->getVarint());
+        _uint64 n_cigar_op = fields->getVarint();
+        _uint64 flag = fields->getVarint();
+        _uint64 l_seq = fields->getVarint();
+        _int64 next_refID = refID + Unzigzag(fields->getVarint());
+        _int64 next_pos = pos + Unzigzag(fields->getVarint());
+        _int64 tlen = Unzigzag(fields->getVarint());
+        _uint64 auxBytes = fields->getVarint();
+        if (! fields->ok || refID != (_int32) refID || pos != (_int32) pos || next_refID != (_int32) next_refID ||
+            next_pos != (_int32) next_pos || tlen != (_int32) tlen || l_read_name > 0xff || mapq > 0xff ||
+            n_cigar_op > 0xffff || flag > 0xffff || l_seq > INT32_MAX || auxBytes > INT32_MAX)
+        {
+            return false;
+        }
+        _uint64 size = sizeof(BAMAlignment) + l_read_name + n_cigar_op * sizeof(_uint32) + (l_seq + 1) / 2 + l_seq + auxBytes;
+        if (size > outputSize - out || size - sizeof(_int32) > INT32_MAX) {
+            return false;
+        }
+        BAMAlignment* bam = (BAMAlignment*) (output + out);
+        bam->block_size = (_int32) (size - sizeof(bam->block_size));
+        bam->refID = (_int32) refID;
+        bam->pos = (_int32) pos;
+        bam->l_read_name = (_uint8) l_read_name;
+        bam->MAPQ = (_uint8) mapq;
+        bam->n_cigar_op = (_uint16) n_cigar_op;
+        bam->FLAG = (_uint16) flag;
+        bam->l_seq = (_int32) l_seq;
+        bam->next_refID = (_int32) next_refID;
+        bam->next_pos = (_int32) next_pos;
+        bam->tlen = (_int32) tlen;
+        const char* name = columnReaders[RefCompressedContainer::NamesColumn].get(l_read_name);
+        const char* cigarBytes = columnReaders[RefCompressedContainer::CigarsColumn].get(n_cigar_op * sizeof(_uint32));
+        if (name == NULL || cigarBytes == NULL) {
+            return false;
+        }
+        memcpy(bam->read_name(), name, l_read_name);
+        _uint32* cigar = bam->cigar();
+        memcpy(cigar, cigarBytes, n_cigar_op * sizeof(_uint32));
+        bam->bin = (_uint16) (PredictBin(bam->pos, cigar, bam->n_cigar_op) + binDelta);
+
+        _uint8* seq = bam->seq();
+        _uint64 mode = differences->getVarint();
+        if (mode == 0) {
+            const char* packed = bases->get((l_seq + 1) / 2);
+            if (packed == NULL) {
+                return false;
+            }
+            memcpy(seq, packed, (l_seq + 1) / 2);
+        } else {
+            const char* ref = getReference(bam->refID, bam->pos, cigar, bam->n_cigar_op, bam->l_seq);
+            if (mode != 1 || ref == NULL) {
+                return false;
+            }
+            memset(seq, 0, (l_seq + 1) / 2);
+            _uint64 gap = differences->getVarint();
+            _int64 q = 0, compared = 0, nextMismatch = gap == 0 ? -1 : gap - 1;
+            for (int i = 0; i < bam->n_cigar_op; i++) {
+                int count = BAMAlignment::GetCigarOpCount(cigar[i]);
+                switch (BAMAlignment::GetCigarOpCode(cigar[i])) {
+                case 0: case 7: case 8: // M = X
+                    for (int j = 0; j < count; j++, q++, compared++, ref++) {
+                        _uint8 code;
+                        if (compared == nextMismatch) {
+                            const char* b = bases->get(1);
+                            gap = differences->getVarint();
+                            if (b == NULL) {
+                                return false;
+                            }
+                            code = (_uint8) *b;
+                            nextMismatch = gap == 0 ? -1 : compared + gap;
+                        } else {
+                            code = BAMAlignment::SeqToCode[(_uint8) *ref];
+                        }
+                        SetBase(seq, q, code & 0xf);
+                    }
+                    break;
+                case 1: case 4: // I S
+                    for (int j = 0; j < count; j++, q++) {
+                        const char* b = bases->get(1);
+                        if (b == NULL) {
+                            return false;
+                        }
+                        SetBase(seq, q, (_uint8) *b & 0xf);
+                    }
+                    break;
+                case 2: case 3: // D N
+                    ref += count;
+                    break;
+                }
+            }
+            if (nextMismatch != -1) {
+                return false;
+            }
+            if (l_seq & 1) {
+                const char* b = bases->get(1);
+                if (b == NULL) {
+                    return false;
+                }
+                seq[l_seq / 2] |= (_uint8) *b & 0xf;
+            }
+        }
+
+        const char* qual = columnReaders[RefCompressedContainer::QualitiesColumn].get(l_seq);
+        const char* aux = columnReaders[RefCompressedContainer::AuxColumn].get(auxBytes);
+        if (qual == NULL || aux == NULL) {
+            return false;
+        }
+        memcpy(bam->qual(), qual, l_seq);
+        memcpy(bam->firstAux(), aux, auxBytes);
+        lastRefID = refID;
+        lastPos = pos;
+        out += size;
+    }
+    for (int i = 0; i < RefCompressedContainer::NumColumns; i++) {
+        if (! (columnReaders[i].ok && columnReaders[i].atEnd())) {
+            return false;
+        }
+    }
+    return out == outputSize;
+}
+
+//
+// Writing
+//
+
+class RefCompressedFilterSupplier : public DataWriter::FilterSupplier
+{
+public:
+    RefCompressedFilterSupplier(const Genome* i_genome, int i_level)
+        : FilterSupplier(DataWriter::ResizeFilter), genome(i_genome), referenceHash(RefCompressedCodec::ReferenceHash(i_genome)), level(i_level)
+    {}
+
+    virtual DataWriter::Filter* getFilter();
+
+    virtual void onClosing(DataWriterSupplier* supplier);
+
+    virtual void onClosed(DataWriterSupplier* supplier) {}
+
+private:
+    friend class RefCompressedFilter;
+
+    const Genome* genome;
+    const _uint64 referenceHash; // once for all the writers' codecs
+    const int level;
+};
+
+// encodes each batch in place as it's written, on the writer's own thread
+class RefCompressedFilter : public DataWriter::Filter
+{
+public:
+    RefCompressedFilter(RefCompressedFilterSupplier* i_supplier)
+        : DataWriter::Filter(DataWriter::ResizeFilter), supplier(i_supplier), codec(NULL), buffer(NULL), bufferSize(0)
+    {}
+
+    virtual ~RefCompressedFilter()
+    {
+        delete codec;
+        if (buffer != NULL) {
+            BigDealloc(buffer);
+        }
+    }
+
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, GenomeDistance bytes, GenomeLocation location)
+    {}
+
+    virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
+
+private:
+    RefCompressedFilterSupplier* supplier;
+    RefCompressedCodec* codec;
+    char* buffer;
+    size_t bufferSize;
+};
+
+    size_t
+RefCompressedFilter::onNextBatch(
+    DataWriter* writer,
+    size_t offset,
+    size_t bytes)
+{
+    char* batch;
+    size_t batchSize, batchUsed;
+    writer->getBatch(-1, &batch, &batchSize, &batchUsed);
+    if (batchUsed == 0) {
+        return 0;
+    }
+    if (codec == NULL) {
+        codec = new RefCompressedCodec(supplier->genome, supplier->referenceHash, supplier->level);
+    }
+    if (buffer == NULL || bufferSize < batchSize) {
+        if (buffer != NULL) {
+            BigDealloc(buffer);
+        }
+        bufferSize = batchSize;
+        buffer = (char*) BigAlloc(bufferSize);
+    }
+    size_t used = codec->encode(batch, batchUsed, buffer, batchSize);
+    if (used == 0) {
+        WriteErrorMessage("RefCompressedFilter: couldn't encode %lld bytes into %lld\n", (_int64) batchUsed, (_int64) batchSize);
+        soft_exit(1);
+    }
+    memcpy(batch, buffer, used);
+    return used;
+}
+
+    DataWriter::Filter*
+RefCompressedFilterSupplier::getFilter()
+{
+    return new RefCompressedFilter(this);
+}
+
+    void
+RefCompressedFilterSupplier::onClosing(
+    DataWriterSupplier* supplier)
+{
+    // the writer gets no filter now, so write the end container directly
+    DataWriter* writer = supplier->getWriter();
+    char* buffer;
+    size_t bytes, used;
+    if (! (writer->getBuffer(&buffer, &bytes) && (used = RefCompressedCodec::encodeEnd(buffer, bytes)) > 0)) {
+        WriteErrorMessage("no space to write end of reference-compressed file\n");
+        soft_exit(1);
+    }
+    writer->advance(used);
+    writer->close();
+    delete writer;
+}
+
+    DataWriter::FilterSupplier*
+DataWriterSupplier::refCompressed(
+    const Genome* genome,
+    int level)
+{
+    return new RefCompressedFilterSupplier(genome, level);
+}
+
+//
+// The records are BAM records, so everything but the output filter is BAM's
+//
+
+class RefCompressedFormat : public FileFormat
+{
+public:
+    RefCompressedFormat(bool i_useM) : useM(i_useM) {}
+
+    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, GenomeDistance* o_readBytes, int* o_refID, int* o_pos) const
+    { FileFormat::BAM[useM]->getSortInfo(genome, buffer, bytes, o_location, o_readBytes, o_refID, o_pos); }
+
+    virtual void setupReaderContext(AlignerOptions* options, ReaderContext* readerContext) const
+    { FileFormat::setupReaderContext(options, readerContext, true); }
+
+    virtual ReadWriterSupplier* getWriterSupplier(AlignerOptions* options, const Genome* genome) const;
+
+    virtual bool writeHeader(
+        const ReaderContext& context, char *header, size_t headerBufferSize, size_t *headerActualSize,
+        bool sorted, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const
+    {
+        return FileFormat::BAM[useM]->writeHeader(context, header, headerBufferSize, headerActualSize,
+            sorted, argc, argv, version, rgLine, omitSQLines);
+    }
+
+    virtual bool writeRead(
+        const ReaderContext& context, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace,
+        size_t * spaceUsed, size_t qnameLen, Read * read, AlignmentResult result,
+        int mapQuality, GenomeLocation genomeLocation, Direction direction, bool secondaryAlignment, int* o_addFrontClipping,
+        bool hasMate, bool firstInPair, Read * mate,
+        int mateMapQuality, AlignmentResult mateResult, GenomeLocation mateLocation, Direction mateDirection) const
+    {
+        return FileFormat::BAM[useM]->writeRead(context, lv, buffer, bufferSpace, spaceUsed, qnameLen, read, result,
+            mapQuality, genomeLocation, direction, secondaryAlignment, o_addFrontClipping,
+            hasMate, firstInPair, mate, mateMapQuality, mateResult, mateLocation, mateDirection);
+    }
+
+private:
+    const bool useM;
+};
+
+const FileFormat* FileFormat::RefCompressed[] = { new RefCompressedFormat(false), new RefCompressedFormat(true) };
+
+    ReadWriterSupplier*
+RefCompressedFormat::getWriterSupplier(
+    AlignerOptions* options,
+    const Genome* genome) const
+{
+    if (genome == NULL) {
+        WriteErrorMessage("Reference-compressed output needs a genome\n");
+        soft_exit(1);
+    }
+    DataWriter::FilterSupplier* filters = DataWriterSupplier::refCompressed(genome, options->compressionLevel);
+    DataWriterSupplier* dataSupplier;
+    if (options->sortOutput) {
+        // no index, since BAM's virtual file offsets don't mean anything here
+        size_t len = strlen(options->outputFile.fileName);
+        char* tempFileName = (char*) malloc(5 + len);
+        strcpy(tempFileName, options->outputFile.fileName);
+        strcpy(tempFileName + len, ".tmp");
+        dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
+            options->sortMemory * (1ULL << 30),
+            options->sortInMemory * (1LL << 30),
+            options->numThreads, ! options->noDuplicateMarking, options->outputFile.fileName, filters);
+    } else {
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, filters);
+    }
+    return ReadWriterSupplier::create(this, dataSupplier, genome);
+}
+
+//
+// Reading
+//
+// Like DecompressDataReader, each batch of the file is decoded into the inner batch's extra data, after room
+// for the overflow carried over from the previous batch.  Decoding is done synchronously in nextBatch.
+//
+
+class RefCompressedDataReader : public DataReader
+{
+public:
+    RefCompressedDataReader(DataReader* i_inner, const Genome* genome, _uint64 referenceHash, _int64 i_totalExtra, _int64 i_extraBytes, _int64 i_overflowBytes);
+
+    virtual ~RefCompressedDataReader();
+
+    virtual bool init(const char* fileName)
+    { return inner->init(fileName); }
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL);
+
+    virtual void advance(_int64 bytes)
+    { offset = min(offset + max(bytes, (_int64) 0), current.valid); }
+
+    virtual void nextBatch();
+
+    virtual bool isEOF()
+    { return eof; }
+
+    virtual DataBatch getBatch()
+    { return current.batch; }
+
+    virtual void holdBatch(DataBatch batch)
+    { inner->holdBatch(batch); }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return inner->releaseBatch(batch); }
+
+    virtual _int64 getFileOffset()
+    { return inner->getFileOffset(); }
+
+    virtual void getExtra(char** o_extra, _int64* o_length)
+    {
+        *o_extra = current.decoded + extraBytes;
+        *o_length = totalExtra - extraBytes;
+    }
+
+    virtual const char* getFilename()
+    { return inner->getFilename(); }
+
+private:
+
+    struct Batch
+    {
+        DataBatch   batch;
+        char*       decoded;
+        _int64      start;
+        _int64      valid;
+        bool        last; // in our own buffer after the end of the inner data
+    };
+
+    // decodes the next inner batch, and holds it; false at the end of the data
+    bool decodeBatch(Batch* o_batch);
+
+    DataReader* inner;
+    RefCompressedCodec codec;
+    const _int64 totalExtra;
+    const _int64 extraBytes;
+    const _int64 overflowBytes;
+    Batch current;
+    _int64 offset;
+    bool eof;
+    bool sawEnd;
+    char* lastBuffer;
+};
+
+RefCompressedDataReader::RefCompressedDataReader(
+    DataReader* i_inner,
+    const Genome* genome,
+    _uint64 referenceHash,
+    _int64 i_totalExtra,
+    _int64 i_extraBytes,
+    _int64 i_overflowBytes)
+    : inner(i_inner), codec(genome, referenceHash, -1), totalExtra(i_totalExtra), extraBytes(i_extraBytes), overflowBytes(i_overflowBytes),
+    offset(0), eof(false), sawEnd(false), lastBuffer(NULL)
+{
+    current.decoded = NULL;
+    current.start = current.valid = 0;
+    current.last = false;
+}
+
+RefCompressedDataReader::~RefCompressedDataReader()
+{
+    if (lastBuffer != NULL) {
+        BigDealloc(lastBuffer);
+    }
+    delete inner;
+}
+
+    char*
+RefCompressedDataReader::readHeader(
+    _int64* io_headerSize)
+{
+    // enough for the containers holding the header, allowing for some not compressing at all
+    _int64 compressedBytes = *io_headerSize + RefCompressedCodec::ContainerBytes +
+        sizeof(RefCompressedContainer) * (2 + *io_headerSize / RefCompressedCodec::ContainerBytes);
+    char* compressed = inner->readHeader(&compressedBytes);
+    char* header;
+    _int64 total;
+    inner->getExtra(&header, &total);
+    _int64 headerSize = 0;
+    while (headerSize < *io_headerSize) {
+        size_t bytes = RefCompressedCodec::validate(compressed, compressedBytes);
+        if (bytes == 0 || (_int64) bytes > compressedBytes) {
+            break;
+        }
+        const RefCompressedContainer* container = (const RefCompressedContainer*) compressed;
+        if (container->isEnd() || headerSize + container->decodedBytes > total) {
+            break;
+        }
+        if (! codec.decode(container, header + headerSize, container->decodedBytes)) {
+            WriteErrorMessage("%s is corrupt, or wasn't written against this genome\n", inner->getFilename());
+            soft_exit(1);
+        }
+        compressed += bytes;
+        compressedBytes -= bytes;
+        headerSize += container->decodedBytes;
+    }
+    *io_headerSize = headerSize;
+    return header;
+}
+
+    void
+RefCompressedDataReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    if (startingOffset != 0 || current.decoded != NULL) {
+        WriteErrorMessage("Reference-compressed files can only be read once from the beginning\n");
+        soft_exit(1);
+    }
+    inner->reinit(startingOffset, amountOfFileToProcess);
+    nextBatch();
+}
+
+    bool
+RefCompressedDataReader::getData(
+    char** o_buffer,
+    _int64* o_validBytes,
+    _int64* o_startBytes)
+{
+    if (eof || offset >= current.start) {
+        return false;
+    }
+    *o_buffer = current.decoded + offset;
+    *o_validBytes = current.valid - offset;
+    if (o_startBytes != NULL) {
+        *o_startBytes = current.start - offset;
+    }
+    return true;
+}
+
+    void
+RefCompressedDataReader::nextBatch()
+{
+    if (eof) {
+        return;
+    }
+    if (current.last) {
+        eof = true;
+        return;
+    }
+    Batch old = current;
+    if (! decodeBatch(&current)) {
+        // what's left of the last batch is all there is
+        if (lastBuffer == NULL) {
+            lastBuffer = (char*) BigAlloc(totalExtra);
+        }
+        current.decoded = lastBuffer;
+        current.start = current.valid = overflowBytes;
+        current.batch = DataBatch(old.batch.batchID + 1, old.batch.fileID);
+        current.last = true;
+    }
+    _int64 copy = old.valid - max(offset, old.start);
+    if (copy > 0) {
+        memcpy(current.decoded + overflowBytes - copy, old.decoded + old.valid - copy, copy);
+    }
+    offset = overflowBytes - copy;
+    if (old.decoded != NULL) {
+        releaseBatch(old.batch); // held while it was current
+    }
+    if (offset == current.valid) {
+        eof = true;
+        if (! sawEnd) {
+            WriteErrorMessage("%s is truncated\n", inner->getFilename());
+            soft_exit(1);
+        }
+    }
+}
+
+    bool
+RefCompressedDataReader::decodeBatch(
+    Batch* o_batch)
+{
+    char* compressed;
+    _int64 compressedValid, compressedStart;
+    if (! inner->getData(&compressed, &compressedValid, &compressedStart)) {
+        if (! inner->isEOF()) {
+            WriteErrorMessage("error reading file at offset %lld\n", inner->getFileOffset());
+            soft_exit(1);
+        }
+        return false;
+    }
+    _int64 start = timeInNanos();
+    _int64 extraSize;
+    inner->getExtra(&o_batch->decoded, &extraSize);
+    _ASSERT(extraSize >= extraBytes);
+    _int64 input = 0, output = overflowBytes;
+    while (input < compressedStart) {
+        size_t bytes = RefCompressedCodec::validate(compressed + input, compressedValid - input);
+        if (bytes == 0 || input + (_int64) bytes > compressedValid) {
+            WriteErrorMessage("error reading reference-compressed file %s near offset %lld\n", inner->getFilename(), inner->getFileOffset());
+            soft_exit(1);
+        }
+        const RefCompressedContainer* container = (const RefCompressedContainer*) (compressed + input);
+        if (container->isEnd()) {
+            sawEnd = true;
+        } else {
+            if (output + container->decodedBytes > extraBytes) {
+                WriteErrorMessage("insufficient decompression buffer space - increase expansion factor, currently -xf %.1f\n", DataSupplier::ExpansionFactor);
+                soft_exit(1);
+            }
+            if (! codec.decode(container, o_batch->decoded + output, container->decodedBytes)) {
+                WriteErrorMessage("%s is corrupt, or wasn't written against this genome\n", inner->getFilename());
+                soft_exit(1);
+            }
+            output += container->decodedBytes;
+        }
+        input += bytes;
+    }
+    inner->advance(input);
+    o_batch->batch = inner->getBatch();
+    inner->holdBatch(o_batch->batch);
+    inner->nextBatch();
+    o_batch->valid = output;
+    o_batch->start = output - overflowBytes;
+    o_batch->last = false;
+    InterlockedAdd64AndReturnNewValue(&DecompressTime, timeInNanos() - start);
+    InterlockedAdd64AndReturnNewValue(&DecompressedBytes, output - overflowBytes);
+    return true;
+}
+
+class RefCompressedDataSupplier : public DataSupplier
+{
+public:
+    RefCompressedDataSupplier(DataSupplier* i_inner, const Genome* i_genome)
+        : DataSupplier(), inner(i_inner), genome(i_genome), referenceHash(i_genome != NULL ? RefCompressedCodec::ReferenceHash(i_genome) : 0)
+    {}
+
+    virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor);
+
+private:
+    // decoded bytes per encoded byte to make room for, as for gzip; -xf scales it
+    static const double MaxFactor;
+
+    DataSupplier* inner;
+    const Genome* genome;
+    const _uint64 referenceHash; // once for all the readers' codecs
+};
+
+const double RefCompressedDataSupplier::MaxFactor = 10.0;
+
+    DataReader*
+RefCompressedDataSupplier::getDataReader(
+    int bufferCount,
+    _int64 overflowBytes,
+    double extraFactor)
+{
+    if (genome == NULL) {
+        WriteErrorMessage("Reading reference-compressed files needs a genome\n");
+        soft_exit(1);
+    }
+    double expand = MaxFactor * DataSupplier::ExpansionFactor;
+    double totalFactor = expand * (1.0 + extraFactor);
+    // inner overflow for a whole container, so they can span batches; add 2 buffers for the one being decoded
+    _int64 containerBytes = max((_int64) RefCompressedCodec::ContainerBytes, (_int64) BAMReader::MAX_RECORD_LENGTH) + sizeof(RefCompressedContainer);
+    DataReader* data = inner->getDataReader(bufferCount + 2, containerBytes, totalFactor);
+    char* p;
+    _int64 totalExtra;
+    data->getExtra(&p, &totalExtra);
+    _int64 mine = (_int64) (totalExtra * expand / totalFactor);
+    return new RefCompressedDataReader(data, genome, referenceHash, totalExtra, mine, overflowBytes);
+}
+
+    DataSupplier*
+DataSupplier::RefCompressed(
+    DataSupplier* inner,
+    const Genome* genome)
+{
+    return new RefCompressedDataSupplier(inner, genome);
+}
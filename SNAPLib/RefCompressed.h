@@ -0,0 +1,141 @@
+/*++
+
+Module Name:
+
+    RefCompressed.h
+
+Abstract:
+
+    Reference-compressed alignment output (.rca files).
+
+    The records are BAM records, but instead of BGZF blocks they are stored in containers that split them into
+    columns (fixed fields, names, CIGARs, sequence differences, bases, qualities and aux data), each deflated on
+    its own.  The sequence of an aligned read is stored as its differences from the reference it's aligned to, so
+    the reader needs the same genome as the writer; each container records a hash of the contig names, lengths and
+    MD5s of their bases (as in the M5 tag that SAM and CRAM use) to check that it has it.
+
+    Anything that doesn't parse as whole records (such as the BAM header) goes into a raw container, so decoding
+    always gives back exactly the bytes that were encoded.  The file ends with an empty container.
+
+    This is SNAP's own format, loosely modelled on CRAM, not CRAM itself.
+
+Environment:
+
+    User mode service.
+
+    Each codec is used by one thread at a time.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+
+class GzipCompressor;
+class GzipDecompressor;
+
+#pragma pack(push, 1)
+
+struct RefCompressedContainer
+{
+    static const _uint32 Magic = 0x01414352; // 'RCA\1'
+
+    enum Column
+    {
+        RawColumn,          // bytes that aren't records
+        FieldsColumn,       // varints for the fixed fields, mostly as deltas
+        NamesColumn,
+        CigarsColumn,
+        DifferencesColumn,  // per record, 0 if the bases are stored whole, else 1, then 1 + the bases matched before each mismatch, then 0
+        BasesColumn,        // one base code per byte for mismatches, insertions & soft clips, or packed bases for whole reads
+        QualitiesColumn,
+        AuxColumn,
+        NumColumns
+    };
+
+    _uint32     magic;
+    _uint32     records;        // 0 for a raw container
+    _uint64     referenceHash;
+    _uint32     decodedBytes;
+    _uint32     columnBytes[NumColumns];    // as stored
+    _uint32     columnRawBytes[NumColumns]; // before compression; the column is stored as is if these are the same
+
+    size_t size() const
+    {
+        size_t result = sizeof(RefCompressedContainer);
+        for (int i = 0; i < NumColumns; i++) {
+            result += columnBytes[i];
+        }
+        return result;
+    }
+
+    bool isEnd() const
+    { return records == 0 && decodedBytes == 0; }
+};
+
+#pragma pack(pop)
+
+class RefCompressedCodec
+{
+public:
+
+    // level is the compression level for the columns (see GzipCompressor); the decoder doesn't need one
+    RefCompressedCodec(const Genome* i_genome, int level = -1);
+
+    // with the genome's ReferenceHash already computed, since that reads the whole genome
+    RefCompressedCodec(const Genome* i_genome, _uint64 i_referenceHash, int level);
+
+    ~RefCompressedCodec();
+
+    // most record bytes to put in one container; a bigger record gets a container to itself
+    static const size_t ContainerBytes = 1024 * 1024;
+
+    // encodes BAM data (header and/or whole records) into containers, returns the bytes used or 0 if there isn't room
+    size_t encode(const char* input, size_t inputBytes, char* output, size_t outputSize);
+
+    // writes the empty container that ends a file, returns the bytes used or 0 if there isn't room
+    static size_t encodeEnd(char* output, size_t outputSize);
+
+    // decodes one whole container into exactly its decodedBytes; returns false if it's corrupt,
+    // or if it wasn't written against this genome
+    bool decode(const RefCompressedContainer* container, char* output, size_t outputSize);
+
+    // checks that a container header makes sense and returns its total size, or 0 if it doesn't
+    static size_t validate(const char* data, size_t bytes);
+
+    // identifies the reference by its contig names, lengths and bases
+    static _uint64 ReferenceHash(const Genome* genome);
+
+    // MD5 of a contig's bases in upper case, as in the M5 tag of its @SQ line
+    static void ContigMD5(const Genome* genome, int contig, _uint8* o_digest);
+
+private:
+
+    class Column;
+
+    size_t encodeRaw(const char* input, size_t bytes, char* output, size_t outputSize);
+
+    size_t encodeRecords(const char* input, size_t bytes, _uint32 records, char* output, size_t outputSize);
+
+    void encodeRecord(const char* record);
+
+    size_t writeContainer(_uint32 records, size_t decodedBytes, char* output, size_t outputSize);
+
+    bool decodeRecords(const RefCompressedContainer* container, const char** columns, char* output, size_t outputSize);
+
+    // finds the reference bases a record's cigar covers, or NULL if it can't use them
+    const char* getReference(_int32 refID, _int32 pos, const _uint32* cigar, int ops, _int32 l_seq);
+
+    const Genome* genome;
+    const _uint64 referenceHash;
+    const int level;
+    GzipCompressor* compressor;
+    GzipDecompressor* decompressor;
+    Column* columns;    // [NumColumns]
+    Column* decodeBuffer; // for packed genomes
+
+    // the previous record's, while encoding
+    _int32 prevRefID;
+    _int32 prevPos;
+};
@@ -633,7 +633,6 @@ SAMReader::createReadSupplierGenerator(
         queue->startReaders();
         return queue;
     } else {
-        RangeSplitter *splitter = new RangeSplitter(QueryFileSize(fileName), numThreads, 100);
         return new RangeSplittingReadSupplierGenerator(fileName, true, numThreads, context);
     }
 }
@@ -828,7 +827,7 @@ SAMFormat::getWriterSupplier(
         strcpy(tempFileName, options->outputFile.fileName);
         strcpy(tempFileName + len, ".tmp");
         dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName, options->sortMemory * (1ULL << 30),
-            options->numThreads, options->outputFile.fileName, NULL);
+            options->sortInMemory * (1LL << 30), options->numThreads, false, options->outputFile.fileName, NULL);
     } else {
         dataSupplier = DataWriterSupplier::create(options->outputFile.fileName);
     }
@@ -1012,17 +1011,24 @@ SAMFormat::createSAMLine(
         return false;
     }
 
+    // If quality is NULL the caller writes them itself, and only needs data for reverse complemented reads.
     if (direction == RC) {
       for (unsigned i = 0; i < fullLength; i++) {
         data[fullLength - 1 - i] = COMPLEMENT[read->getUnclippedData()[i]];
-        quality[fullLength - 1 - i] = read->getUnclippedQuality()[i];
+      }
+      if (quality != NULL) {
+        for (unsigned i = 0; i < fullLength; i++) {
+          quality[fullLength - 1 - i] = read->getUnclippedQuality()[i];
+        }
       }
       clippedData = &data[fullLength - clippedLength - read->getFrontClippedLength()];
       basesClippedBefore = fullLength - clippedLength - read->getFrontClippedLength();
       basesClippedAfter = read->getFrontClippedLength();
     } else {
-      memcpy(data, read->getUnclippedData(), read->getUnclippedLength());
-      memcpy(quality, read->getUnclippedQuality(), read->getUnclippedLength());
+      if (quality != NULL) {
+        memcpy(data, read->getUnclippedData(), read->getUnclippedLength());
+        memcpy(quality, read->getUnclippedQuality(), read->getUnclippedLength());
+      }
       clippedData = read->getData();
       basesClippedBefore = read->getFrontClippedLength();
       basesClippedAfter = fullLength - clippedLength - basesClippedBefore;
@@ -1110,6 +1116,65 @@ SAMFormat::createSAMLine(
     return true;
 }
 
+//
+// Appends the fields of a SAM line straight into an output buffer, and remembers if any of them didn't fit.
+//
+class SAMLineBuilder
+{
+public:
+    SAMLineBuilder(char* i_buffer, size_t i_size) : buffer(i_buffer), next(i_buffer), end(i_buffer + i_size), overflowed(false) {}
+
+    inline void put(const char* bytes, size_t count)
+    {
+        char* to = reserve(count);
+        if (to != NULL) {
+            memcpy(to, bytes, count);
+        }
+    }
+
+    inline void putTab()
+    {
+        if (next < end) {
+            *next++ = '\t';
+        } else {
+            overflowed = true;
+        }
+    }
+
+    inline void putInt(_int64 value)
+    {
+        if (end - next >= util::FormatIntMaxChars) {
+            next += util::FormatInt(value, next);
+        } else {
+            char digits[util::FormatIntMaxChars];
+            put(digits, util::FormatInt(value, digits));
+        }
+    }
+
+    // returns where to write count bytes, or NULL if they don't fit
+    inline char* reserve(size_t count)
+    {
+        if (count > (size_t)(end - next)) {
+            overflowed = true;
+            next = end;
+            return NULL;
+        }
+        char* result = next;
+        next += count;
+        return result;
+    }
+
+    bool fits() const { return ! overflowed; }
+
+    size_t used() const { return next - buffer; }
+
+private:
+    char* const buffer;
+    char* next;
+    char* const end;
+    bool overflowed;
+};
+
     bool
 SAMFormat::writeRead(
     const ReaderContext& context,
@@ -1151,8 +1216,7 @@ SAMFormat::writeRead(
     GenomeDistance matePositionInContig = 0;
     _int64 templateLength = 0;
 
-    char data[MAX_READ];
-    char quality[MAX_READ];
+    char data[MAX_READ];    // only for reverse complemented reads; forward ones are written straight from the read
 
     const char* clippedData;
     unsigned fullLength;
@@ -1164,7 +1228,7 @@ SAMFormat::writeRead(
 
     *o_addFrontClipping = 0;
 
-	if (!createSAMLine(context.genome, lv, data, quality, MAX_READ, contigName, contigIndex,
+	if (!createSAMLine(context.genome, lv, data, NULL, MAX_READ, contigName, contigIndex,
 			   flags, positionInContig, mapQuality, matecontigName, mateContigIndex, matePositionInContig, templateLength,
 			   fullLength, clippedData, clippedLength, basesClippedBefore, basesClippedAfter,
 			   qnameLen, read, result, genomeLocation, direction, secondaryAlignment, useM,
@@ -1207,10 +1271,6 @@ SAMFormat::writeRead(
         qnameLen = (unsigned)(firstSpace - read->getId());
     }
 
-    const int nmStringSize = 30;// Big enough that it won't buffer overflow regardless of the value of editDistance
-    char nmString[nmStringSize];  
-    snprintf(nmString, nmStringSize, "\tNM:i:%d",editDistance);
-
     unsigned auxLen;
     bool auxSAM;
     char* aux = read->getAuxiliaryData(&auxLen, &auxSAM);
@@ -1247,34 +1307,68 @@ SAMFormat::writeRead(
             readGroupString = read->getReadGroup();
         }
     }
-    int charsInString = snprintf(buffer, bufferSpace, "%.*s\t%d\t%s\t%u\t%d\t%s\t%s\t%u\t%lld\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s%.*s\n",
-        qnameLen, read->getId(),
-        flags,
-        contigName,
-        positionInContig,
-        mapQuality,
-        cigar,
-        matecontigName,
-        matePositionInContig,
-        templateLength,
-        fullLength, data,
-        fullLength, quality,
-        aux != NULL ? "\t" : "", auxLen, aux != NULL ? aux : "",
-        readGroupSeparator, readGroupString,
-        nmString, rglineAuxLen, rglineAux);
-
-    if (charsInString > bufferSpace) {
+
+    //
+    // Format the line straight into the output buffer.  The contig names come from the genome's table along with
+    // their lengths; the only ones that aren't there are "*" and "=".
+    //
+    const Genome::Contig *contigs = context.genome->getContigs();
+    SAMLineBuilder line(buffer, bufferSpace);
+    line.put(read->getId(), qnameLen);
+    line.putTab();
+    line.putInt(flags);
+    line.putTab();
+    line.put(contigName, contigIndex >= 0 && contigName == contigs[contigIndex].name ? contigs[contigIndex].nameLength : strlen(contigName));
+    line.putTab();
+    line.putInt(positionInContig);
+    line.putTab();
+    line.putInt(mapQuality);
+    line.putTab();
+    line.put(cigar, strlen(cigar));
+    line.putTab();
+    line.put(matecontigName, mateContigIndex >= 0 && matecontigName == contigs[mateContigIndex].name ? contigs[mateContigIndex].nameLength : strlen(matecontigName));
+    line.putTab();
+    line.putInt(matePositionInContig);
+    line.putTab();
+    line.putInt(templateLength);
+    line.putTab();
+    if (flags & SAM_REVERSE_COMPLEMENT) {
+        line.put(data, fullLength);
+        line.putTab();
+        char* qual = line.reserve(fullLength);
+        if (qual != NULL) {
+            const char* from = read->getUnclippedQuality();
+            for (unsigned i = 0; i < fullLength; i++) {
+                qual[fullLength - 1 - i] = from[i];
+            }
+        }
+    } else {
+        line.put(read->getUnclippedData(), fullLength);
+        line.putTab();
+        line.put(read->getUnclippedQuality(), fullLength);
+    }
+    if (aux != NULL) {
+        line.putTab();
+        line.put(aux, auxLen);
+    }
+    if (*readGroupSeparator != '\0') {
+        line.put(readGroupSeparator, strlen(readGroupSeparator));
+        line.put(readGroupString, strlen(readGroupString));
+    }
+    line.put("\tPG:Z:SNAP\tNM:i:", 16);
+    line.putInt(editDistance);
+    line.put(rglineAux, rglineAuxLen);
+    line.put("\n", 1);
+
+    if (! line.fits()) {
         //
         // Out of buffer space.
         //
         return false;
-    } else if (charsInString == bufferSpace) {
-      buffer[bufferSpace-1] = '\n'; // overwrite trailing null with newline
     }
 
-
     if (NULL != spaceUsed) {
-        *spaceUsed = charsInString;
+        *spaceUsed = line.used();
     }
     return true;
 }
@@ -1328,7 +1422,11 @@ SAMFormat::computeCigar(
         *o_extraBasesClippedAfter = 0;
     }
 
-    const char *reference = genome->getSubstring(genomeLocation, dataLength);
+    char referenceBuffer[MAX_READ_LENGTH + MAX_K];  // Only used if the genome is packed
+    const char *reference = NULL;
+    if (dataLength <= MAX_READ_LENGTH) {
+        reference = genome->getSubstring(genomeLocation, dataLength, referenceBuffer, 0, MAX_K);   // MAX_K after for indels, see below
+    }
     if (NULL == reference) {
         //
         // Fell off the end of the contig.
@@ -1446,23 +1544,37 @@ SAMFormat::computeCigarString(
         return "*";
     } else {
         // Add some CIGAR instructions for soft-clipping if we've ignored some bases in the read.
-        char clipBefore[16] = {'\0'};
-        char clipAfter[16] = {'\0'};
-        char hardClipBefore[16] = {'\0'};
-        char hardClipAfter[16] = {'\0'};
+        char clipBefore[2 * (util::FormatIntMaxChars + 1)];
+        char clipAfter[2 * (util::FormatIntMaxChars + 1)];
+        int clipBeforeLen = 0, clipAfterLen = 0;
         if (frontHardClipping > 0) {
-            snprintf(hardClipBefore, sizeof(hardClipBefore), "%uH", frontHardClipping);
+            clipBeforeLen += util::FormatUInt(frontHardClipping, clipBefore + clipBeforeLen);
+            clipBefore[clipBeforeLen++] = 'H';
         }
         if (basesClippedBefore + extraBasesClippedBefore > 0) {
-            snprintf(clipBefore, sizeof(clipBefore), "%lluS", basesClippedBefore + extraBasesClippedBefore);
+            clipBeforeLen += util::FormatUInt(basesClippedBefore + extraBasesClippedBefore, clipBefore + clipBeforeLen);
+            clipBefore[clipBeforeLen++] = 'S';
         }
         if (basesClippedAfter + extraBasesClippedAfter > 0) {
-            snprintf(clipAfter, sizeof(clipAfter), "%lluS", basesClippedAfter + extraBasesClippedAfter);
+            clipAfterLen += util::FormatUInt(basesClippedAfter + extraBasesClippedAfter, clipAfter + clipAfterLen);
+            clipAfter[clipAfterLen++] = 'S';
         }
         if (backHardClipping > 0) {
-            snprintf(hardClipAfter, sizeof(hardClipAfter), "%uH", backHardClipping);
+            clipAfterLen += util::FormatUInt(backHardClipping, clipAfter + clipAfterLen);
+            clipAfter[clipAfterLen++] = 'H';
+        }
+        size_t cigarLen = strlen(cigarBuf);
+        if (clipBeforeLen + cigarLen + clipAfterLen >= (size_t)cigarBufWithClippingLen) {
+            WriteErrorMessage( "WARNING: cigarBufWithClipping is too small\n");
+            return "*";
         }
-        snprintf(cigarBufWithClipping, cigarBufWithClippingLen, "%s%s%s%s%s", hardClipBefore, clipBefore, cigarBuf, clipAfter, hardClipAfter);
+        char *p = cigarBufWithClipping;
+        memcpy(p, clipBefore, clipBeforeLen);
+        p += clipBeforeLen;
+        memcpy(p, cigarBuf, cigarLen);
+        p += cigarLen;
+        memcpy(p, clipAfter, clipAfterLen);
+        p[clipAfterLen] = '\0';
 
 		validateCigarString(genome, cigarBufWithClipping, cigarBufWithClippingLen, 
 			data - basesClippedBefore, dataLength + (basesClippedBefore + basesClippedAfter), genomeLocation + extraBasesClippedBefore, direction, useM);
@@ -1478,7 +1590,8 @@ SAMFormat::validateCigarString(
 {
 	const char *nextChunkOfCigar = cigarBuf;
 	GenomeDistance offsetInData = 0;
-	const char *reference = genome->getSubstring(genomeLocation, dataLength);
+	char referenceBuffer[MAX_READ_LENGTH + MAX_K];
+	const char *reference = dataLength <= MAX_READ_LENGTH ? genome->getSubstring(genomeLocation, dataLength, referenceBuffer, 0, MAX_K) : NULL;
 	if (NULL == reference) {
 		WriteErrorMessage("validateCigarString: couldn't look up genome data for location %lld\n", genomeLocation);
 		soft_exit(1);
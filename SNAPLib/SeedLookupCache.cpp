@@ -0,0 +1,268 @@
+/*++
+
+Module Name:
+
+    SeedLookupCache.cpp
+
+Abstract:
+
+    A per-thread cache of the results of looking up popular seeds in the genome index.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "SeedLookupCache.h"
+#include "exit.h"
+#include "Error.h"
+
+SeedLookupCache::SeedLookupCache(GenomeIndex *i_index, unsigned megabytes, unsigned i_minHits, BigAllocator *allocator) :
+    index(i_index), locations64(i_index->doesGenomeIndexHave64BitLocations()), minHits(__max(1u, i_minHits)), nLookups(0), nCacheHits(0)
+{
+    _ASSERT(sizeof(Entry) == BytesPerEntry);
+
+    //
+    // Round down to a power of two entries, so we can index with a mask.
+    //
+    _uint64 nEntries = 1;
+    while (nEntries * 2 * BytesPerEntry <= (_uint64)megabytes * 1024 * 1024) {
+        nEntries *= 2;
+    }
+    entryMask = nEntries - 1;
+
+    //
+    // Line the entries up with cache lines, so each lookup touches just one.
+    //
+    char *memory = (char *)allocator->allocate(nEntries * BytesPerEntry + BytesPerEntry);
+    entries = (Entry *)(((size_t)memory + BytesPerEntry - 1) & ~((size_t)BytesPerEntry - 1));
+    memset(entries, 0, nEntries * BytesPerEntry);
+}
+
+    size_t
+SeedLookupCache::getBigAllocatorReservation(unsigned megabytes)
+{
+    return sizeof(SeedLookupCache) + (size_t)megabytes * 1024 * 1024 + BytesPerEntry;
+}
+
+    bool
+SeedLookupCache::find(
+    Entry           *entry,
+    Seed             seed,
+    _int64          *nHits,
+    const void     **hits,
+    _int64          *nRCHits,
+    const void     **rcHits,
+    GenomeLocation  *singleHit,
+    GenomeLocation  *singleRCHit)
+{
+    nLookups++;
+    if (entry->bases != seed.getBases() || 0 == entry->nHits[FORWARD] + entry->nHits[RC]) {
+        return false;
+    }
+    nCacheHits++;
+
+    *nHits = entry->nHits[FORWARD];
+    *nRCHits = entry->nHits[RC];
+    *hits = entry->hits[FORWARD];
+    *rcHits = entry->hits[RC];
+
+    if (locations64) {
+        if (1 == *nHits) {
+            *singleHit = entry->singletonHits[FORWARD];
+            *hits = singleHit;
+        }
+        if (1 == *nRCHits) {
+            *singleRCHit = entry->singletonHits[RC];
+            *rcHits = singleRCHit;
+        }
+    }
+    return true;
+}
+
+    void
+SeedLookupCache::remember(
+    Entry       *entry,
+    Seed         seed,
+    _int64       nHits,
+    const void  *hits,
+    _int64       nRCHits,
+    const void  *rcHits)
+{
+    if (nHits + nRCHits < minHits) {
+        return;
+    }
+
+    entry->bases = seed.getBases();
+    entry->nHits[FORWARD] = nHits;
+    entry->nHits[RC] = nRCHits;
+    entry->hits[FORWARD] = hits;
+    entry->hits[RC] = rcHits;
+    if (locations64) {
+        //
+        // Singletons live in the caller's storage, which won't be there next time.
+        //
+        if (1 == nHits) {
+            entry->singletonHits[FORWARD] = *(const GenomeLocation *)hits;
+        }
+        if (1 == nRCHits) {
+            entry->singletonHits[RC] = *(const GenomeLocation *)rcHits;
+        }
+    }
+}
+
+    void
+SeedLookupCache::lookupSeed(
+    Seed                    seed,
+    _int64 *                nHits,
+    const GenomeLocation ** hits,
+    _int64 *                nRCHits,
+    const GenomeLocation ** rcHits,
+    GenomeLocation *        singleHit,
+    GenomeLocation *        singleRCHit)
+{
+    Entry *entry = entryFor(seed);
+    if (find(entry, seed, nHits, (const void **)hits, nRCHits, (const void **)rcHits, singleHit, singleRCHit)) {
+        return;
+    }
+
+    index->lookupSeed(seed, nHits, hits, nRCHits, rcHits, singleHit, singleRCHit);
+    remember(entry, seed, *nHits, *hits, *nRCHits, *rcHits);
+}
+
+    void
+SeedLookupCache::lookupSeed32(
+    Seed              seed,
+    _int64           *nHits,
+    const unsigned  **hits,
+    _int64           *nRCHits,
+    const unsigned  **rcHits)
+{
+    Entry *entry = entryFor(seed);
+    if (find(entry, seed, nHits, (const void **)hits, nRCHits, (const void **)rcHits, NULL, NULL)) {
+        return;
+    }
+
+    index->lookupSeed32(seed, nHits, hits, nRCHits, rcHits);
+    remember(entry, seed, *nHits, *hits, *nRCHits, *rcHits);
+}
+
+    void
+SeedLookupCache::lookupSeedBatch(
+    unsigned                nSeeds,
+    const Seed *            seeds,
+    _int64 *                nHits,
+    const GenomeLocation ** hits,
+    _int64 *                nRCHits,
+    const GenomeLocation ** rcHits,
+    GenomeLocation *        singleHits,
+    GenomeLocation *        singleRCHits)
+{
+    Entry *entry[maxSeedsPerBatch];
+    unsigned missed[maxSeedsPerBatch];
+    Seed missedSeeds[maxSeedsPerBatch];
+    _int64 missedNHits[maxSeedsPerBatch], missedNRCHits[maxSeedsPerBatch];
+    const GenomeLocation *missedHits[maxSeedsPerBatch], *missedRCHits[maxSeedsPerBatch];
+    GenomeLocation missedSingleHits[maxSeedsPerBatch], missedSingleRCHits[maxSeedsPerBatch];
+
+    for (unsigned batchStart = 0; batchStart < nSeeds; batchStart += maxSeedsPerBatch) {
+        unsigned nSeedsThisBatch = __min(maxSeedsPerBatch, nSeeds - batchStart);
+        for (unsigned i = 0; i < nSeedsThisBatch; i++) {
+            entry[i] = entryFor(seeds[batchStart + i]);
+            _mm_prefetch((const char *)entry[i], _MM_HINT_T0);
+        }
+
+        unsigned nMissed = 0;
+        for (unsigned i = 0; i < nSeedsThisBatch; i++) {
+            unsigned which = batchStart + i;
+            if (!find(entry[i], seeds[which], &nHits[which], (const void **)&hits[which], &nRCHits[which], (const void **)&rcHits[which],
+                      &singleHits[which], &singleRCHits[which])) {
+                missed[nMissed] = i;
+                missedSeeds[nMissed] = seeds[which];
+                nMissed++;
+            }
+        }
+
+        if (0 == nMissed) {
+            continue;
+        }
+
+        index->lookupSeedBatch(nMissed, missedSeeds, missedNHits, missedHits, missedNRCHits, missedRCHits, missedSingleHits, missedSingleRCHits);
+
+        for (unsigned j = 0; j < nMissed; j++) {
+            unsigned which = batchStart + missed[j];
+            nHits[which] = missedNHits[j];
+            nRCHits[which] = missedNRCHits[j];
+            hits[which] = missedHits[j];
+            rcHits[which] = missedRCHits[j];
+
+            //
+            // Singletons came back in our storage; move them to the caller's.  A seed that's its own reverse
+            // complement has both directions pointing at the forward one.
+            //
+            singleHits[which] = missedSingleHits[j];
+            singleRCHits[which] = missedSingleRCHits[j];
+            if (hits[which] == &missedSingleHits[j]) {
+                hits[which] = &singleHits[which];
+            }
+            if (rcHits[which] == &missedSingleHits[j]) {
+                rcHits[which] = &singleHits[which];
+            } else if (rcHits[which] == &missedSingleRCHits[j]) {
+                rcHits[which] = &singleRCHits[which];
+            }
+
+            remember(entry[missed[j]], seeds[which], nHits[which], hits[which], nRCHits[which], rcHits[which]);
+        }
+    }
+}
+
+    void
+SeedLookupCache::lookupSeedBatch32(
+    unsigned          nSeeds,
+    const Seed       *seeds,
+    _int64           *nHits,
+    const unsigned  **hits,
+    _int64           *nRCHits,
+    const unsigned  **rcHits)
+{
+    Entry *entry[maxSeedsPerBatch];
+    unsigned missed[maxSeedsPerBatch];
+    Seed missedSeeds[maxSeedsPerBatch];
+    _int64 missedNHits[maxSeedsPerBatch], missedNRCHits[maxSeedsPerBatch];
+    const unsigned *missedHits[maxSeedsPerBatch], *missedRCHits[maxSeedsPerBatch];
+
+    for (unsigned batchStart = 0; batchStart < nSeeds; batchStart += maxSeedsPerBatch) {
+        unsigned nSeedsThisBatch = __min(maxSeedsPerBatch, nSeeds - batchStart);
+        for (unsigned i = 0; i < nSeedsThisBatch; i++) {
+            entry[i] = entryFor(seeds[batchStart + i]);
+            _mm_prefetch((const char *)entry[i], _MM_HINT_T0);
+        }
+
+        unsigned nMissed = 0;
+        for (unsigned i = 0; i < nSeedsThisBatch; i++) {
+            unsigned which = batchStart + i;
+            if (!find(entry[i], seeds[which], &nHits[which], (const void **)&hits[which], &nRCHits[which], (const void **)&rcHits[which], NULL, NULL)) {
+                missed[nMissed] = i;
+                missedSeeds[nMissed] = seeds[which];
+                nMissed++;
+            }
+        }
+
+        if (0 == nMissed) {
+            continue;
+        }
+
+        index->lookupSeedBatch32(nMissed, missedSeeds, missedNHits, missedHits, missedNRCHits, missedRCHits);
+
+        for (unsigned j = 0; j < nMissed; j++) {
+            unsigned which = batchStart + missed[j];
+            nHits[which] = missedNHits[j];
+            nRCHits[which] = missedNRCHits[j];
+            hits[which] = missedHits[j];
+            rcHits[which] = missedRCHits[j];
+            remember(entry[missed[j]], seeds[which], nHits[which], hits[which], nRCHits[which], rcHits[which]);
+        }
+    }
+}
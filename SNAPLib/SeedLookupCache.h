@@ -0,0 +1,96 @@
+/*++
+
+Module Name:
+
+    SeedLookupCache.h
+
+Abstract:
+
+    A per-thread cache of the results of looking up popular seeds in the genome index.
+
+    Seeds from repeats (ALUs, centromeric satellites and the like) turn up in read after read, and each time we look
+    one up we walk the hash table and then the overflow table to find its hit list, which in a big index are cache
+    misses.  The results don't change, so we keep the most recent ones for seeds with at least a given number of hits
+    in a direct mapped table of cache line sized entries.  Seeds with fewer hits just go to the index, since they're
+    unlikely to be seen again soon and would only push out the ones that are.
+
+    The cache fronts GenomeIndex's lookupSeed calls and gives exactly the same answers, so using it doesn't change any
+    alignments.  It belongs to one aligner thread, so it doesn't need any locking.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "BigAlloc.h"
+#include "Seed.h"
+#include "GenomeIndex.h"
+
+class SeedLookupCache {
+public:
+    //
+    // megabytes is the size of the table, and minHits is the fewest hits (counting both directions) that a seed needs
+    // to be kept.
+    //
+    SeedLookupCache(GenomeIndex *i_index, unsigned megabytes, unsigned i_minHits, BigAllocator *allocator);
+
+    static size_t getBigAllocatorReservation(unsigned megabytes);
+
+    //
+    // These work just like the GenomeIndex methods of the same names.
+    //
+    void lookupSeed(Seed seed, _int64 *nHits, const GenomeLocation **hits, _int64 *nRCHits, const GenomeLocation **rcHits, GenomeLocation *singleHit, GenomeLocation *singleRCHit);
+    void lookupSeed32(Seed seed, _int64 *nHits, const unsigned **hits, _int64 *nRCHits, const unsigned **rcHits);
+
+    void lookupSeedBatch(unsigned nSeeds, const Seed *seeds, _int64 *nHits, const GenomeLocation **hits, _int64 *nRCHits, const GenomeLocation **rcHits,
+                         GenomeLocation *singleHits, GenomeLocation *singleRCHits);
+    void lookupSeedBatch32(unsigned nSeeds, const Seed *seeds, _int64 *nHits, const unsigned **hits, _int64 *nRCHits, const unsigned **rcHits);
+
+    _int64 getLookups() const {return nLookups;}
+    _int64 getCacheHits() const {return nCacheHits;}
+
+    void *operator new(size_t size, BigAllocator *allocator) {_ASSERT(size == sizeof(SeedLookupCache)); return allocator->allocate(size);}
+    void operator delete(void *ptr, BigAllocator *allocator) {/* do nothing.  Memory gets cleaned up when the allocator is deleted.*/}
+
+private:
+
+    //
+    // One cache line.  An entry is empty if it has no hits.  Since the index only keeps singletons for 64 bit
+    // locations in the hash table entry (see GenomeIndex::lookupSeed), we keep their values rather than pointers
+    // to them; the hit lists and 32 bit singletons stay where they are in the index.
+    //
+    struct Entry {
+        _uint64          bases;
+        _int64           nHits[NUM_DIRECTIONS];
+        const void      *hits[NUM_DIRECTIONS];
+        GenomeLocation   singletonHits[NUM_DIRECTIONS];
+        _uint64          unused;
+    };
+
+    static const unsigned BytesPerEntry = 64;
+    static const unsigned maxSeedsPerBatch = 32;
+
+    inline Entry *entryFor(Seed seed) const {
+        return &entries[util::hash64(seed.getBases()) & entryMask];
+    }
+
+    //
+    // Returns whether we had it, and if so fills in the caller's answers.
+    //
+    bool find(Entry *entry, Seed seed, _int64 *nHits, const void **hits, _int64 *nRCHits, const void **rcHits, GenomeLocation *singleHit, GenomeLocation *singleRCHit);
+
+    void remember(Entry *entry, Seed seed, _int64 nHits, const void *hits, _int64 nRCHits, const void *rcHits);
+
+    GenomeIndex    *index;
+    bool            locations64;
+    unsigned        minHits;
+    Entry          *entries;
+    _uint64         entryMask;
+
+    _int64          nLookups;
+    _int64          nCacheHits;
+};
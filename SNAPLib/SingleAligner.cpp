@@ -36,6 +36,7 @@ Revision History:
 #include "Util.h"
 #include "SingleAligner.h"
 #include "MultiInputReadSupplier.h"
+#include "SeedLookupCache.h"
 
 using namespace std;
 using util::stringEndsWith;
@@ -102,8 +103,11 @@ SingleAlignerContext::runIterationThread()
         secondaryAlignmentBufferCount = BaseAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength());
     }
     size_t secondaryAlignmentBufferSize = sizeof(*secondaryAlignments) * secondaryAlignmentBufferCount;
+    size_t seedLookupCacheSize = 0 == options->seedLookupCacheMB ? 0 : SeedLookupCache::getBigAllocatorReservation(options->seedLookupCacheMB);
+    size_t firstSeedLookupsSize = sizeof(BaseAligner::FirstSeedLookups) * options->readsInFlight;
  
-    BigAllocator *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage) + secondaryAlignmentBufferSize);
+    BigAllocator *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage) + secondaryAlignmentBufferSize +
+        seedLookupCacheSize + firstSeedLookupsSize);
    
     BaseAligner *aligner = new (allocator) BaseAligner(
             index,
@@ -126,10 +130,20 @@ SingleAlignerContext::runIterationThread()
         secondaryAlignments = (SingleAlignmentResult *)allocator->allocate(secondaryAlignmentBufferSize);
     }
 
+    BaseAligner::FirstSeedLookups *firstSeedLookups = (BaseAligner::FirstSeedLookups *)allocator->allocate(firstSeedLookupsSize);
+
     allocator->checkCanaries();
 
     aligner->setExplorePopularSeeds(options->explorePopularSeeds);
     aligner->setStopOnFirstHit(options->stopOnFirstHit);
+    aligner->setAdaptiveSeeding(options->adaptiveSeeding);
+    aligner->setExactMatchFastPath(options->exactMatchFastPath);
+
+    SeedLookupCache *seedLookupCache = NULL;
+    if (0 != options->seedLookupCacheMB) {
+        seedLookupCache = new (allocator) SeedLookupCache(index, options->seedLookupCacheMB, options->seedLookupCacheMinHits, allocator);
+        aligner->setSeedLookupCache(seedLookupCache);
+    }
 
 #ifdef  _MSC_VER
     if (options->useTimingBarrier) {
@@ -142,70 +156,102 @@ SingleAlignerContext::runIterationThread()
 #endif  // _MSC_VER
 
     // Align the reads.
-    Read *read;
+    Read *reads[MAX_READS_IN_FLIGHT];
+    Read *usefulReads[MAX_READS_IN_FLIGHT];
+    unsigned nReads;
     _uint64 lastReportTime = timeInMillis();
     _uint64 readsWhenLastReported = 0;
 
-    while (NULL != (read = supplier->getNextRead())) {
-        stats->totalReads++;
-
-        if (AlignerOptions::useHadoopErrorMessages && stats->totalReads % 10000 == 0 && timeInMillis() - lastReportTime > 10000) {
-            fprintf(stderr,"reporter:counter:SNAP,readsAligned,%lu\n",stats->totalReads - readsWhenLastReported);
-            readsWhenLastReported = stats->totalReads;
-            lastReportTime = timeInMillis();
+    while (0 != (nReads = supplier->getNextReads(reads, options->readsInFlight))) {
+        //
+        // Look up the first seeds of all of the reads we're going to align before aligning any of them, so that
+        // the index and genome cache misses for the later reads overlap with the earlier ones'.
+        //
+        unsigned nUsefulReads = 0;
+        for (unsigned whichRead = 0; whichRead < nReads; whichRead++) {
+            if (reads[whichRead]->getDataLength() >= minReadLength && reads[whichRead]->countOfNs() <= maxDist) {
+                usefulReads[nUsefulReads++] = reads[whichRead];
+            }
         }
+        aligner->lookupFirstSeeds(nUsefulReads, usefulReads, firstSeedLookups);
+
+        unsigned whichUsefulRead = 0;
+        for (unsigned whichRead = 0; whichRead < nReads; whichRead++) {
+            Read *read = reads[whichRead];
+            stats->totalReads++;
 
-        // Skip the read if it has too many Ns or trailing 2 quality scores.
-        if (read->getDataLength() < minReadLength || read->countOfNs() > maxDist) {
-            if (readWriter != NULL && options->passFilter(read, NotFound, true)) {
-                readWriter->writeRead(readerContext, read, NotFound, 0, InvalidGenomeLocation, FORWARD, false);
+            if (AlignerOptions::useHadoopErrorMessages && stats->totalReads % 10000 == 0 && timeInMillis() - lastReportTime > 10000) {
+                fprintf(stderr,"reporter:counter:SNAP,readsAligned,%lu\n",stats->totalReads - readsWhenLastReported);
+                readsWhenLastReported = stats->totalReads;
+                lastReportTime = timeInMillis();
+            }
+
+            // Skip the read if it has too many Ns or trailing 2 quality scores.
+            if (whichUsefulRead == nUsefulReads || usefulReads[whichUsefulRead] != read) {
+                if (readWriter != NULL && options->passFilter(read, NotFound, true)) {
+                    readWriter->writeRead(readerContext, read, NotFound, 0, InvalidGenomeLocation, FORWARD, false);
+                }
+                continue;
+            } else {
+                stats->usefulReads++;
             }
-            continue;
-        } else {
-            stats->usefulReads++;
-        }
 
 #if     TIME_HISTOGRAM
-        _int64 startTime = timeInNanos();
+            _int64 startTime = timeInNanos();
 #endif // TIME_HISTOGRAM
 
-        SingleAlignmentResult result;
-        int nSecondaryResults = 0;
+            SingleAlignmentResult result;
+            int nSecondaryResults = 0;
 
 #ifdef LONG_READS
-        int oldMaxK = aligner->getMaxK();
-        if (options->maxDistFraction > 0.0) {
-            aligner->setMaxK(min(MAX_K, (int)(read->getDataLength() * options->maxDistFraction)));
-        }
+            int oldMaxK = aligner->getMaxK();
+            if (options->maxDistFraction > 0.0) {
+                aligner->setMaxK(min(MAX_K, (int)(read->getDataLength() * options->maxDistFraction)));
+            }
 #endif
 
-		aligner->AlignRead(read, &result, maxSecondaryAlignmentAdditionalEditDistance, secondaryAlignmentBufferCount, &nSecondaryResults, secondaryAlignments);
+		    aligner->AlignRead(read, &result, maxSecondaryAlignmentAdditionalEditDistance, secondaryAlignmentBufferCount, &nSecondaryResults, secondaryAlignments,
+                &firstSeedLookups[whichUsefulRead]);
+            whichUsefulRead++;
 #ifdef LONG_READS
-        aligner->setMaxK(oldMaxK);
+            aligner->setMaxK(oldMaxK);
 #endif
 
 #if     TIME_HISTOGRAM
-        _int64 runTime = timeInNanos() - startTime;
-        int timeBucket = min(30, cheezyLogBase2(runTime));
-        stats->countByTimeBucket[timeBucket]++;
-        stats->nanosByTimeBucket[timeBucket] += runTime;
+            _int64 runTime = timeInNanos() - startTime;
+            int timeBucket = min(30, cheezyLogBase2(runTime));
+            stats->countByTimeBucket[timeBucket]++;
+            stats->nanosByTimeBucket[timeBucket] += runTime;
 #endif // TIME_HISTOGRAM
 
-        allocator->checkCanaries();
+            allocator->checkCanaries();
 
 
-		writeRead(read, result, false);
+		    writeRead(read, result, false);
 
-		for (int i = 0; i < __min(nSecondaryResults, maxSecondaryAlignments); i++) {
-            writeRead(read, secondaryAlignments[i], true);
-        }
+		    for (int i = 0; i < __min(nSecondaryResults, maxSecondaryAlignments); i++) {
+                writeRead(read, secondaryAlignments[i], true);
+            }
         
-        updateStats(stats, read, result.status, result.score, result.mapq);
+            updateStats(stats, read, result.status, result.score, result.mapq);
+        }
+    }
+
+    stats->exactMatchFastPathReads += aligner->getNReadsTakingExactMatchFastPath();
+    stats->adaptiveSeedingEarlyStops += aligner->getNReadsStoppingSeedingEarly();
+    stats->adaptiveSeedingEscalations += aligner->getNReadsWithEscalatedSeeds();
+    for (unsigned i = 0; i <= AlignerStats::maxSeedsPerReadBucket; i++) {
+        stats->seedsPerReadHistogram[i] += aligner->getSeedsPerReadHistogram()[i];
+    }
+    if (NULL != seedLookupCache) {
+        stats->seedLookupCacheLookups += seedLookupCache->getLookups();
+        stats->seedLookupCacheHits += seedLookupCache->getCacheHits();
     }
 
     aligner->~BaseAligner(); // This calls the destructor without calling operator delete, allocator owns the memory.
  
     if (supplier != NULL) {
+        stats->rangesStolen += supplier->getRangesStolen();
         delete supplier;
     }
 
@@ -25,6 +25,7 @@ Environment:
 #include "VariableSizeVector.h"
 #include "FileFormat.h"
 #include "PriorityQueue.h"
+#include "ParallelTask.h"
 #include "exit.h"
 #include "Bam.h"
 #include "Error.h"
@@ -52,12 +53,68 @@ struct SortEntry
 
 typedef VariableSizeVector<SortEntry,150,true> SortVector;
 
+//
+// Sorts entries by location, keeping entries at the same location in order, just like std::stable_sort with
+// SortEntry::comparator would.  It's a least-significant-digit radix sort 16 bits at a time, which skips digits
+// that are the same for every entry, so it usually takes two passes.
+//
+    static void
+RadixSortByLocation(
+    SortEntry* entries,
+    SortEntry* scratch,
+    _int64 count)
+{
+    const int DigitBits = 16;
+    const int nBuckets = 1 << DigitBits;
+    if (count < 2) {
+        return;
+    }
+    // flipping the sign bit makes signed order unsigned
+    const _uint64 signBit = (_uint64) 1 << 63;
+    _uint64 first = (_uint64) GenomeLocationAsInt64(entries[0].location) ^ signBit;
+    _uint64 differ = 0;
+    for (_int64 i = 1; i < count; i++) {
+        differ |= ((_uint64) GenomeLocationAsInt64(entries[i].location) ^ signBit) ^ first;
+    }
+    _int64* buckets = new _int64[nBuckets];
+    SortEntry* from = entries;
+    SortEntry* to = scratch;
+    for (int shift = 0; shift < 64; shift += DigitBits) {
+        if (((differ >> shift) & (nBuckets - 1)) == 0) {
+            continue;
+        }
+        memset(buckets, 0, nBuckets * sizeof(_int64));
+        for (_int64 i = 0; i < count; i++) {
+            buckets[(((_uint64) GenomeLocationAsInt64(from[i].location) ^ signBit) >> shift) & (nBuckets - 1)]++;
+        }
+        _int64 offset = 0;
+        for (int b = 0; b < nBuckets; b++) {
+            _int64 n = buckets[b];
+            buckets[b] = offset;
+            offset += n;
+        }
+        for (_int64 i = 0; i < count; i++) {
+            to[buckets[(((_uint64) GenomeLocationAsInt64(from[i].location) ^ signBit) >> shift) & (nBuckets - 1)]++] = from[i];
+        }
+        SortEntry* t = from;
+        from = to;
+        to = t;
+    }
+    if (from != entries) {
+        memcpy(entries, from, count * sizeof(SortEntry));
+    }
+    delete[] buckets;
+}
+
+// number of reads between samples of the locations in each sorted block, for partitioning the merge
+static const int MergeSampleInterval = 256;
+
 struct SortBlock
 {
 #ifdef VALIDATE_SORT
-    SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL), minLocation(0), maxLocation(0) {}
+    SortBlock() : start(0), bytes(0), firstSample(0), nSamples(0), memory(NULL), minLocation(0), maxLocation(0) {}
 #else
-    SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL) {}
+    SortBlock() : start(0), bytes(0), firstSample(0), nSamples(0), memory(NULL) {}
 #endif
 	SortBlock(const SortBlock& other) { *this = other; }
     void operator=(const SortBlock& other);
@@ -67,11 +124,12 @@ struct SortBlock
 #ifdef VALIDATE_SORT
 	unsigned	minLocation, maxLocation;
 #endif
-    // for mergesort phase
-    DataReader* reader;
-    GenomeLocation    location; // genome location of current read
-    char*       data; // read data in read buffer
-    GenomeDistance    length; // length in bytes
+    // every MergeSampleInterval'th read in the block, in SortedDataFilterSupplier::samples
+    // with offset relative to the start of the block, and length the bytes up to the next sample
+    size_t      firstSample;
+    size_t      nSamples;
+    // for mergesort phase, the block's data if it was held in memory rather than spilled to the temp file
+    char*       memory;
 };
 
     void
@@ -80,9 +138,9 @@ SortBlock::operator=(
 {
     start = other.start;
     bytes = other.bytes;
-    location = other.location;
-    length = other.length;
-    reader = other.reader;
+    firstSample = other.firstSample;
+    nSamples = other.nSamples;
+    memory = other.memory;
 #ifdef VALIDATE_SORT
 	minLocation = other.minLocation;
 	maxLocation = other.maxLocation;
@@ -90,8 +148,193 @@ SortBlock::operator=(
 }
 
 typedef VariableSizeVector<SortBlock> SortBlockVector;
+
+//
+// The file that SortedDataFilter's sorted blocks are written to.  Writes are kept in memory as long as they fit in
+// the budget, and only the rest go to the temp file, which isn't even created if nothing spills.  The merge then
+// reads blocks from memory where it can.
+//
+class SortTempFile : public AsyncFile
+{
+public:
+    SortTempFile(const char* i_fileName, size_t i_budget);
+
+    ~SortTempFile();
+
+    virtual bool close();
+
+    virtual AsyncFile::Writer* getWriter()
+    { return new Writer(this); }
+
+    // only written through this, the merge reads the temp file with a DataReader
+    virtual AsyncFile::Reader* getReader()
+    { return NULL; }
+
+    // where a range that was written is in memory, or NULL if it went to the temp file
+    char* getMemory(size_t offset, size_t bytes);
+
+    bool anySpilled()
+    { return inner != NULL; }
+
+    bool anyInMemory()
+    { return extents.size() > 0; }
+
+    void freeMemory();
+
+private:
+
+    class Writer : public AsyncFile::Writer
+    {
+    public:
+        Writer(SortTempFile* i_file) : file(i_file), inner(NULL) {}
+
+        virtual bool close();
+
+        virtual bool beginWrite(void* buffer, size_t length, size_t offset, size_t *bytesWritten);
+
+        virtual bool waitForCompletion();
+
+    private:
+        SortTempFile*       file;
+        AsyncFile::Writer*  inner; // writes that spill
+    };
+
+    // reserves memory for a write, or opens the temp file if it doesn't fit
+    char* allocate(size_t offset, size_t bytes);
+
+    struct Extent
+    {
+        size_t  offset;
+        size_t  bytes;
+        char*   memory;
+    };
+
+    const char*                 fileName;
+    const size_t                budget;
+    size_t                      used;
+    ExclusiveLock               lock;
+    VariableSizeVector<Extent>  extents;
+    AsyncFile*                  inner; // temp file, once something spills
+};
+
+SortTempFile::SortTempFile(
+    const char* i_fileName,
+    size_t i_budget)
+    : fileName(i_fileName), budget(i_budget), used(0), extents(), inner(NULL)
+{
+    InitializeExclusiveLock(&lock);
+}
+
+SortTempFile::~SortTempFile()
+{
+    freeMemory();
+    delete inner;
+    DestroyExclusiveLock(&lock);
+}
+
+    bool
+SortTempFile::close()
+{
+    return inner == NULL || inner->close();
+}
+
+    char*
+SortTempFile::getMemory(
+    size_t offset,
+    size_t bytes)
+{
+    for (_int64 i = 0; i < extents.size(); i++) {
+        if (extents[i].offset <= offset && offset + bytes <= extents[i].offset + extents[i].bytes) {
+            return extents[i].memory + (offset - extents[i].offset);
+        }
+    }
+    return NULL;
+}
+
+    void
+SortTempFile::freeMemory()
+{
+    for (_int64 i = 0; i < extents.size(); i++) {
+        BigDealloc(extents[i].memory);
+    }
+    extents.clear();
+    used = 0;
+}
+
+    char*
+SortTempFile::allocate(
+    size_t offset,
+    size_t bytes)
+{
+    AcquireExclusiveLock(&lock);
+    char* result = NULL;
+    if (used + bytes <= budget) {
+        Extent extent;
+        extent.offset = offset;
+        extent.bytes = bytes;
+        extent.memory = result = (char*) BigAlloc(bytes);
+        extents.push_back(extent);
+        used += bytes;
+    } else if (inner == NULL) {
+        inner = AsyncFile::open(fileName, true);
+        if (inner == NULL) {
+            WriteErrorMessage("failed to open %s for write\n", fileName);
+            soft_exit(1);
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+    return result;
+}
+
+    bool
+SortTempFile::Writer::close()
+{
+    bool ok = true;
+    if (inner != NULL) {
+        ok = inner->close();
+        delete inner;
+        inner = NULL;
+    }
+    return ok;
+}
+
+    bool
+SortTempFile::Writer::beginWrite(
+    void* buffer,
+    size_t length,
+    size_t offset,
+    size_t *bytesWritten)
+{
+    if (length == 0) {
+        if (bytesWritten != NULL) {
+            *bytesWritten = 0;
+        }
+        return true;
+    }
+    char* memory = file->allocate(offset, length);
+    if (memory != NULL) {
+        memcpy(memory, buffer, length);
+        if (bytesWritten != NULL) {
+            *bytesWritten = length;
+        }
+        return true;
+    }
+    if (inner == NULL) {
+        inner = file->inner->getWriter();
+    }
+    return inner->beginWrite(buffer, length, offset, bytesWritten);
+}
+
+    bool
+SortTempFile::Writer::waitForCompletion()
+{
+    return inner == NULL || inner->waitForCompletion();
+}
+
     
 class SortedDataFilterSupplier;
+struct MergePartition;
+struct MergeCursor;
 
 class SortedDataFilter : public DataWriter::Filter
 {
@@ -109,6 +352,7 @@ public:
 private:
     SortedDataFilterSupplier*   parent;
     SortVector                  locations;
+    SortVector                  scratch; // for sorting locations
 };
 
 class SortedDataFilterSupplier : public DataWriter::FilterSupplier
@@ -121,25 +365,38 @@ public:
         const char* i_tempFileName,
         const char* i_sortedFileName,
         DataWriter::FilterSupplier* i_sortedFilterSupplier,
+        size_t i_inMemoryBudget,
+        int i_numThreads,
+        bool i_markDuplicates,
         FileEncoder* i_encoder = NULL)
         :
-        format(i_fileFormat),
-        genome(i_genome),
         FilterSupplier(DataWriter::CopyFilter),
-        encoder(i_encoder),
+        genome(i_genome),
+        format(i_fileFormat),
         tempFileName(i_tempFileName),
         sortedFileName(i_sortedFileName),
         sortedFilterSupplier(i_sortedFilterSupplier),
-        blocks()
+        encoder(i_encoder),
+        numThreads(i_numThreads),
+        markDuplicates(i_markDuplicates),
+        longPairs(NULL),
+        blocks(),
+        samples()
     {
         InitializeExclusiveLock(&lock);
+        tempFile = new SortTempFile(tempFileName, i_inMemoryBudget);
     }
 
     virtual ~SortedDataFilterSupplier()
     {
         DestroyExclusiveLock(&lock);
+        delete tempFile;
     }
 
+    // where the sorted blocks get written
+    AsyncFile* getTempFile()
+    { return tempFile; }
+
     virtual DataWriter::Filter* getFilter();
 
     virtual void onClosing(DataWriterSupplier* supplier) {}
@@ -149,25 +406,43 @@ public:
     { headerSize = bytes; }
 
 #ifndef VALIDATE_SORT
-	void addBlock(size_t start, size_t bytes);
+	void addBlock(size_t start, size_t bytes, SortVector& blockSamples);
 #else
-    void addBlock(size_t start, size_t bytes, unsigned minLocation, unsigned maxLocation);
+    void addBlock(size_t start, size_t bytes, SortVector& blockSamples, unsigned minLocation, unsigned maxLocation);
 #endif
 
 private:
     bool mergeSort();
 
+    int choosePartitions(int nWorkers, MergePartition** o_partitions);
+
+    // merge one partition into its own buffer, or straight into the writer if there is one
+    _int64 mergePartition(MergePartition* partition, MergeCursor* cursors, DataWriter* writer);
+
+    void outputRecord(MergePartition* partition, DataWriter* writer, char* data, GenomeDistance length, bool deferred);
+
+    bool nextRecord(MergeCursor* cursor, char** o_data, GenomeLocation* o_location, GenomeDistance* o_length);
+
+    void writeRecord(DataWriter* writer, char* data, GenomeDistance length);
+
     const Genome*                   genome;
     const FileFormat*               format;
     const char*                     tempFileName;
+    SortTempFile*                   tempFile;
     const char*                     sortedFileName;
     DataWriter::FilterSupplier*     sortedFilterSupplier;
     FileEncoder*                    encoder;
+    int                             numThreads;
+    bool                            markDuplicates;
+    BAMDuplicateMarker::LongPairs*  longPairs;
     size_t                          headerSize;
     ExclusiveLock                   lock; // for adding blocks
     SortBlockVector                 blocks;
+    SortVector                      samples;
 
 	friend class SortedDataFilter;
+	friend class MergeWorker;
+	friend class MergeDuplicateMarker;
 };
 
     void
@@ -196,7 +471,8 @@ SortedDataFilter::onNextBatch(
     size_t bytes)
 {
     // sort buffered reads by location for later merge sort
-    std::stable_sort(locations.begin(), locations.end(), SortEntry::comparator);
+    scratch.reserve(locations.size());
+    RadixSortByLocation(locations.begin(), scratch.begin(), locations.size());
     
     // copy from previous buffer into current in sorted order
     char* fromBuffer;
@@ -211,7 +487,14 @@ SortedDataFilter::onNextBatch(
     }
     size_t target = 0;
 	unsigned previous = 0;
+    // handle header specially
+    size_t header = offset > 0 ? 0 : locations[0].length;
+    SortVector blockSamples;
     for (VariableSizeVector<SortEntry>::iterator i = locations.begin(); i != locations.end(); i++) {
+        _int64 read = (i - locations.begin()) - (header > 0);
+        if (read >= 0 && read % MergeSampleInterval == 0) {
+            blockSamples.push_back(SortEntry(target - header, 0, i->location));
+        }
 #ifdef VALIDATE_SORT
 		if (locations.size() > 1) { // skip header block
 			unsigned loc, len;
@@ -225,9 +508,6 @@ SortedDataFilter::onNextBatch(
     }
     
     // remember block extent for later merge sort
-    SortBlock block;
-    // handle header specially
-    size_t header = offset > 0 ? 0 : locations[0].length;
     if (header > 0) {
         parent->setHeaderSize(header);
     }
@@ -235,9 +515,9 @@ SortedDataFilter::onNextBatch(
 #ifdef VALIDATE_SORT
 	unsigned minLocation = locations.size() > first ? locations[first].location : 0;
 	unsigned maxLocation = locations.size() > first ? locations[locations.size()-1].location : UINT32_MAX;
-    parent->addBlock(offset + header, bytes - header, minLocation, maxLocation);
+    parent->addBlock(offset + header, bytes - header, blockSamples, minLocation, maxLocation);
 #else
-    parent->addBlock(offset + header, bytes - header);
+    parent->addBlock(offset + header, bytes - header, blockSamples);
 #endif
     locations.clear();
 
@@ -254,7 +534,7 @@ SortedDataFilterSupplier::getFilter()
 SortedDataFilterSupplier::onClosed(
     DataWriterSupplier* supplier)
 {
-    if (blocks.size() == 1 && sortedFilterSupplier == NULL) {
+    if (blocks.size() == 1 && sortedFilterSupplier == NULL && ! tempFile->anyInMemory()) {
         // just rename/move temp file to real file, we're done
         DeleteSingleFile(sortedFileName); // if it exists
         if (! MoveSingleFile(tempFileName, sortedFileName)) {
@@ -277,7 +557,8 @@ SortedDataFilterSupplier::onClosed(
     void
 SortedDataFilterSupplier::addBlock(
     size_t start,
-    size_t bytes
+    size_t bytes,
+    SortVector& blockSamples
 #ifdef VALIDATE_SORT
 	, unsigned minLocation
 	, unsigned maxLocation
@@ -298,11 +579,490 @@ SortedDataFilterSupplier::addBlock(
 		block.minLocation = minLocation;
 		block.maxLocation = maxLocation;
 #endif
+        block.firstSample = samples.size();
+        block.nSamples = blockSamples.size();
+        for (_int64 i = 0; i < blockSamples.size(); i++) {
+            SortEntry sample = blockSamples[i];
+            sample.length = (i + 1 < blockSamples.size() ? blockSamples[i + 1].offset : bytes) - sample.offset;
+            samples.push_back(sample);
+        }
         blocks.push_back(block);
         ReleaseExclusiveLock(&lock);
     }
 }
 
+//
+// The merge is split up by genome location into partitions of about the same size, chosen using the samples taken
+// from each block.  Worker threads each merge whole partitions into memory, and the main thread copies them to the
+// writer in order, so the result is the same as merging all the blocks at once.  Ties between blocks go to the
+// earlier block, so the order doesn't depend on how the partitions fall either.  Reads at the same location come
+// out in block order and then in the order they were written within each block, which is what a stable sort of
+// the unsorted output gives.  (The heap merge that this replaced broke ties in whatever order its heap held the
+// blocks, which depends on everything merged before and so can't be reproduced one partition at a time.)
+//
+// A partition that's too big to buffer (say, lots of reads at one location) is merged by the main thread straight
+// into the writer when its turn comes, as is the whole thing when there's only one thread.
+//
+// Duplicates are marked on the way, by whichever thread merges each partition.  Each one merges an extra window
+// of reads either side of its partition for the marker to look at, so the flags are the same however the merge
+// is split up.  The second reads of pairs whose ends are further apart than that are marked by the main thread as
+// it writes them, since by then everything before them has been through a marker.
+//
+static const size_t MinMergePartitionBytes = 1024 * 1024;
+static const size_t MaxMergePartitionBytes = 16 * 1024 * 1024;
+static const size_t MaxBufferedPartitionBytes = 64 * 1024 * 1024;
+
+struct MergePartition
+{
+    MergePartition() : blockStart(NULL), blockEnd(NULL), bytes(0), direct(false), output(NULL), outputBytes(0), lengths(), deferred(), merged(false) {}
+
+    ~MergePartition()
+    {
+        delete[] blockStart;
+        delete[] blockEnd;
+    }
+
+    GenomeLocation      begin, end;     // reads in [begin,end)
+    GenomeLocation      scanBegin, scanEnd; // reads merged, including the ones the duplicate marker just looks at
+    bool                first, last;    // no lower or upper bound on locations
+    size_t*             blockStart;     // range of bytes in each block that holds the reads to merge
+    size_t*             blockEnd;
+    size_t              bytes;          // at least as big as the merged output
+    bool                direct;         // merged by the main thread into the writer
+    char*               output;         // merged reads
+    size_t              outputBytes;
+    VariableSizeVector<GenomeDistance> lengths; // of each read in output
+    VariableSizeVector<_int64> deferred; // indices of reads in output left for the main thread to mark
+    volatile bool       merged;
+};
+
+// where a merge is up to in one block
+struct MergeCursor
+{
+    MergeCursor() : reader(NULL), next(NULL), end(NULL) {}
+
+    ~MergeCursor()
+    { delete reader; }
+
+    void advance(GenomeDistance bytes)
+    {
+        if (reader != NULL) {
+            reader->advance(bytes);
+        } else {
+            next += bytes;
+        }
+    }
+
+    DataReader* reader; // for blocks in the temp file
+    char*       next;   // for blocks in memory
+    char*       end;
+};
+
+// sends marked reads wherever the partition's merge is going
+class MergeDuplicateMarker : public BAMDuplicateMarker
+{
+public:
+    MergeDuplicateMarker(SortedDataFilterSupplier* i_supplier, MergePartition* i_partition, DataWriter* i_writer)
+        : BAMDuplicateMarker(i_supplier->genome, i_supplier->longPairs, i_writer == NULL),
+        supplier(i_supplier), partition(i_partition), writer(i_writer)
+    {}
+
+protected:
+    virtual void emit(char* data, GenomeDistance length, bool deferred)
+    { supplier->outputRecord(partition, writer, data, length, deferred); }
+
+private:
+    SortedDataFilterSupplier*   supplier;
+    MergePartition*             partition;
+    DataWriter*                 writer;
+};
+
+class MergeWorker : public ParallelWorker
+{
+public:
+    MergeWorker() {}
+
+    virtual void step();
+};
+
+class MergeWorkerManager : public ParallelWorkerManager
+{
+public:
+    MergeWorkerManager(SortedDataFilterSupplier* i_supplier, MergePartition* i_partitions, int i_nPartitions, int i_window)
+        : supplier(i_supplier), partitions(i_partitions), nPartitions(i_nPartitions), window(i_window), nextPartition(0), nConsumed(0)
+    {
+        InitializeExclusiveLock(&lock);
+        CreateEventObject(&mergedEvent);
+        CreateEventObject(&consumedEvent);
+        CreateSingleWaiterObject(&finished);
+    }
+
+    virtual ~MergeWorkerManager()
+    {
+        DestroyExclusiveLock(&lock);
+        DestroyEventObject(&mergedEvent);
+        DestroyEventObject(&consumedEvent);
+        DestroySingleWaiterObject(&finished);
+    }
+
+    virtual ParallelWorker* createWorker()
+    { return new MergeWorker(); }
+
+    // next partition for a worker to merge, once there's room for it; -1 when they're all taken
+    int claim();
+
+    void onMerged(int partition);
+
+    // main thread, in partition order
+    void waitUntilMerged(int partition);
+
+    void onConsumed();
+
+    static void finishedCallback(void* p)
+    { SignalSingleWaiterObject(&((MergeWorkerManager*) p)->finished); }
+
+    SortedDataFilterSupplier*   supplier;
+    MergePartition*             partitions;
+    const int                   nPartitions;
+    const int                   window; // max partitions merged ahead of the writer
+    int                         nextPartition;
+    int                         nConsumed;
+    ExclusiveLock               lock;
+    EventObject                 mergedEvent;
+    EventObject                 consumedEvent;
+    SingleWaiterObject          finished;
+};
+
+    int
+MergeWorkerManager::claim()
+{
+    while (true) {
+        AcquireExclusiveLock(&lock);
+        while (nextPartition < nPartitions && partitions[nextPartition].direct) {
+            nextPartition++;
+        }
+        if (nextPartition >= nPartitions) {
+            ReleaseExclusiveLock(&lock);
+            return -1;
+        }
+        if (nextPartition < nConsumed + window) {
+            int result = nextPartition++;
+            ReleaseExclusiveLock(&lock);
+            return result;
+        }
+        PreventEventWaitersFromProceeding(&consumedEvent);
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&consumedEvent);
+    }
+}
+
+    void
+MergeWorkerManager::onMerged(
+    int partition)
+{
+    AcquireExclusiveLock(&lock);
+    partitions[partition].merged = true;
+    AllowEventWaitersToProceed(&mergedEvent);
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+MergeWorkerManager::waitUntilMerged(
+    int partition)
+{
+    while (true) {
+        AcquireExclusiveLock(&lock);
+        if (partitions[partition].merged) {
+            ReleaseExclusiveLock(&lock);
+            return;
+        }
+        PreventEventWaitersFromProceeding(&mergedEvent);
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&mergedEvent);
+    }
+}
+
+    void
+MergeWorkerManager::onConsumed()
+{
+    AcquireExclusiveLock(&lock);
+    nConsumed++;
+    AllowEventWaitersToProceed(&consumedEvent);
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+MergeWorker::step()
+{
+    MergeWorkerManager* manager = (MergeWorkerManager*) getManager();
+    SortedDataFilterSupplier* supplier = manager->supplier;
+    MergeCursor* cursors = new MergeCursor[supplier->blocks.size()];
+    for (int p = manager->claim(); p != -1; p = manager->claim()) {
+        supplier->mergePartition(&manager->partitions[p], cursors, NULL);
+        manager->onMerged(p);
+    }
+    delete[] cursors;
+}
+
+// index of the first of a block's samples at or after a location
+    static _int64
+FirstSampleAtOrAfter(
+    SortEntry* samples,
+    _int64 nSamples,
+    GenomeLocation location)
+{
+    _int64 lo = 0, hi = nSamples;
+    while (lo < hi) {
+        _int64 mid = (lo + hi) / 2;
+        if (samples[mid].location < location) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//
+// The range of bytes in a block that holds its reads in [begin,end).  Reads before the last sample ahead of begin are
+// all ahead of it, and reads from the first sample at or past end on are all past it.
+//
+    static void
+BlockRange(
+    SortBlock* block,
+    SortEntry* blockSamples,
+    bool first,
+    GenomeLocation begin,
+    bool last,
+    GenomeLocation end,
+    size_t* o_start,
+    size_t* o_end)
+{
+    size_t start = 0, stop = block->bytes;
+    if (! first) {
+        _int64 i = FirstSampleAtOrAfter(blockSamples, block->nSamples, begin);
+        start = i > 0 ? blockSamples[i - 1].offset : 0;
+    }
+    if (! last) {
+        _int64 i = FirstSampleAtOrAfter(blockSamples, block->nSamples, end);
+        stop = i < (_int64) block->nSamples ? blockSamples[i].offset : block->bytes;
+    }
+    *o_start = start;
+    *o_end = __max(start, stop);
+}
+
+    int
+SortedDataFilterSupplier::choosePartitions(
+    int nWorkers,
+    MergePartition** o_partitions)
+{
+    //
+    // Walk all the samples in location order, adding up the bytes they stand for, and split whenever there's
+    // enough.  Splitters have to go up strictly, so all the reads at one location end up in one partition.
+    //
+    VariableSizeVector<GenomeLocation> splitters;
+    if (nWorkers > 1 && samples.size() > 0) {
+        size_t total = 0;
+        for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
+            total += b->bytes;
+        }
+        size_t target = max(MinMergePartitionBytes, min(MaxMergePartitionBytes, total / (4 * nWorkers)));
+        SortVector sorted;
+        for (_int64 i = 0; i < samples.size(); i++) {
+            sorted.push_back(samples[i]);
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), SortEntry::comparator);
+        GenomeLocation previous = sorted[0].location;
+        size_t bytes = 0;
+        for (_int64 i = 0; i < sorted.size(); i++) {
+            if (bytes >= target && sorted[i].location > previous) {
+                splitters.push_back(sorted[i].location);
+                previous = sorted[i].location;
+                bytes = 0;
+            }
+            bytes += sorted[i].length;
+        }
+    }
+
+    int nPartitions = (int) splitters.size() + 1;
+    MergePartition* partitions = new MergePartition[nPartitions];
+    for (int p = 0; p < nPartitions; p++) {
+        MergePartition* partition = &partitions[p];
+        partition->first = p == 0;
+        partition->last = p == nPartitions - 1;
+        partition->begin = partition->first ? 0 : splitters[p - 1];
+        partition->end = partition->last ? InvalidGenomeLocation : splitters[p];
+        partition->scanBegin = partition->begin;
+        partition->scanEnd = partition->end;
+        if (markDuplicates) {
+            // unmapped reads are never context
+            const GenomeDistance window = BAMDuplicateMarker::Window;
+            partition->scanBegin = partition->begin > window ? partition->begin - window : 0;
+            partition->scanEnd = partition->end < UINT32_MAX - window ? partition->end + window : UINT32_MAX;
+        }
+        partition->blockStart = new size_t[blocks.size()];
+        partition->blockEnd = new size_t[blocks.size()];
+        for (_int64 b = 0; b < blocks.size(); b++) {
+            SortBlock* block = &blocks[b];
+            SortEntry* blockSamples = &samples[block->firstSample];
+            size_t start, end;
+            BlockRange(block, blockSamples, partition->first, partition->begin, partition->last, partition->end, &start, &end);
+            partition->bytes += end - start;
+            BlockRange(block, blockSamples, partition->first, partition->scanBegin, partition->last, partition->scanEnd,
+                &partition->blockStart[b], &partition->blockEnd[b]);
+        }
+        partition->direct = nWorkers <= 1 || partition->bytes > MaxBufferedPartitionBytes;
+        partition->merged = partition->direct;
+    }
+    *o_partitions = partitions;
+    return nPartitions;
+}
+
+    bool
+SortedDataFilterSupplier::nextRecord(
+    MergeCursor* cursor,
+    char** o_data,
+    GenomeLocation* o_location,
+    GenomeDistance* o_length)
+{
+    _int64 bytes;
+    if (cursor->reader == NULL) {
+        if (cursor->next >= cursor->end) {
+            return false;
+        }
+        *o_data = cursor->next;
+        bytes = cursor->end - cursor->next;
+    } else if (! cursor->reader->getData(o_data, &bytes)) {
+        cursor->reader->nextBatch();
+        if (! cursor->reader->getData(o_data, &bytes)) {
+            _ASSERT(cursor->reader->isEOF());
+            return false;
+        }
+    }
+    format->getSortInfo(genome, *o_data, bytes, o_location, o_length);
+    _ASSERT(*o_length <= bytes);
+    return true;
+}
+
+    void
+SortedDataFilterSupplier::writeRecord(
+    DataWriter* writer,
+    char* data,
+    GenomeDistance length)
+{
+    char* buffer;
+    size_t bytes;
+    if ((! writer->getBuffer(&buffer, &bytes)) || bytes < (size_t) length) {
+        writer->nextBatch();
+        if ((! writer->getBuffer(&buffer, &bytes)) || bytes < (size_t) length) {
+            WriteErrorMessage( "mergeSort: buffer size too small\n");
+            soft_exit(1);
+        }
+    }
+    memcpy(buffer, data, length);
+#ifdef VALIDATE_BAM
+    if (format == FileFormat::BAM[0] || format == FileFormat::BAM[1]) {
+        ((BAMAlignment*)data)->validate();
+    }
+#endif
+    writer->advance(length);
+}
+
+    _int64
+SortedDataFilterSupplier::mergePartition(
+    MergePartition* partition,
+    MergeCursor* cursors,
+    DataWriter* writer)
+{
+    int nBlocks = (int) blocks.size();
+    LoserTree<GenomeLocation> tree(nBlocks);
+    char** data = new char*[nBlocks];
+    GenomeDistance* lengths = new GenomeDistance[nBlocks];
+    for (int b = 0; b < nBlocks; b++) {
+        if (partition->blockStart[b] == partition->blockEnd[b]) {
+            continue;
+        }
+        MergeCursor* cursor = &cursors[b];
+        if (blocks[b].memory != NULL) {
+            cursor->next = blocks[b].memory + partition->blockStart[b];
+            cursor->end = blocks[b].memory + partition->blockEnd[b];
+        } else {
+            if (cursor->reader == NULL) {
+                cursor->reader = DataSupplier::Default->getDataReader(1, MAX_READ_LENGTH * 8, 0.0); // todo: standardize max length
+                cursor->reader->init(tempFileName);
+            }
+            cursor->reader->reinit(blocks[b].start + partition->blockStart[b], partition->blockEnd[b] - partition->blockStart[b]);
+        }
+        // skip reads that belong to earlier partitions
+        GenomeLocation location;
+        while (nextRecord(cursor, &data[b], &location, &lengths[b])) {
+            if (partition->first || location >= partition->scanBegin) {
+                if (partition->last || location < partition->scanEnd) {
+                    tree.set(b, location);
+                }
+                break;
+            }
+            cursor->advance(lengths[b]);
+        }
+    }
+    tree.build();
+
+    if (writer == NULL && partition->bytes > 0) {
+        partition->output = (char*) BigAlloc(partition->bytes);
+    }
+    MergeDuplicateMarker* marker = markDuplicates ? new MergeDuplicateMarker(this, partition, writer) : NULL;
+    _int64 total = 0;
+    while (! tree.empty()) {
+        int b = tree.winner();
+        if (marker != NULL) {
+            GenomeLocation location = tree.winnerKey();
+            bool context = ! ((partition->first || location >= partition->begin) && (partition->last || location < partition->end));
+            marker->add(data[b], lengths[b], location, context);
+            total += ! context;
+        } else {
+            outputRecord(partition, writer, data[b], lengths[b], false);
+            total++;
+        }
+        cursors[b].advance(lengths[b]);
+        GenomeLocation location;
+        if (nextRecord(&cursors[b], &data[b], &location, &lengths[b]) && (partition->last || location < partition->scanEnd)) {
+            _ASSERT(location >= tree.winnerKey());
+            tree.replaceWinner(location);
+        } else {
+            tree.removeWinner();
+        }
+    }
+    if (marker != NULL) {
+        marker->flush();
+        delete marker;
+    }
+    delete[] data;
+    delete[] lengths;
+    return total;
+}
+
+    void
+SortedDataFilterSupplier::outputRecord(
+    MergePartition* partition,
+    DataWriter* writer,
+    char* data,
+    GenomeDistance length,
+    bool deferred)
+{
+    if (writer != NULL) {
+        _ASSERT(! deferred);
+        writeRecord(writer, data, length);
+    } else {
+        _ASSERT(partition->outputBytes + length <= partition->bytes);
+        if (deferred) {
+            partition->deferred.push_back(partition->lengths.size());
+        }
+        memcpy(partition->output + partition->outputBytes, data, length);
+        partition->outputBytes += length;
+        partition->lengths.push_back(length);
+    }
+}
+
     bool
 SortedDataFilterSupplier::mergeSort()
 {
@@ -314,6 +1074,8 @@ SortedDataFilterSupplier::mergeSort()
     _int64 startReleaseWaitTime = DataReader::ReleaseWaitTime;
     _int64 startWriteWaitTime = DataWriter::WaitTime;
     _int64 startWriteFilterTime = DataWriter::FilterTime;
+    _int64 startDuplicatesMarked = BAMDuplicateMarker::DuplicatesMarked;
+    _int64 startDuplicateTime = BAMDuplicateMarker::Time;
 #endif
 
     // set up buffered output
@@ -325,12 +1087,6 @@ SortedDataFilterSupplier::mergeSort()
         return false;
     }
     DataSupplier* readerSupplier = DataSupplier::Default; // autorelease
-    // setup - open all files, read first block, begin read for second
-    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
-        i->reader = readerSupplier->getDataReader(1, MAX_READ_LENGTH * 8, 0.0); // todo: standardize max length
-        i->reader->init(tempFileName);
-        i->reader->reinit(i->start, i->bytes);
-    }
 
     // write out header
     if (headerSize > 0xffffffff) {
@@ -338,16 +1094,25 @@ SortedDataFilterSupplier::mergeSort()
         soft_exit(1);
     }
     if (headerSize > 0) {
-        blocks[0].reader->reinit(0, headerSize);
+        char* headerMemory = tempFile->getMemory(0, headerSize);
+        DataReader* headerReader = NULL;
+        if (headerMemory == NULL) {
+            headerReader = readerSupplier->getDataReader(1, MAX_READ_LENGTH * 8, 0.0);
+            headerReader->init(tempFileName);
+            headerReader->reinit(0, headerSize);
+        }
 		writer->inHeader(true);
         char* rbuffer;
         _int64 rbytes;
         char* wbuffer;
         size_t wbytes;
 		for (size_t left = headerSize; left > 0; ) {
-			if ((! blocks[0].reader->getData(&rbuffer, &rbytes)) || rbytes == 0) {
-				blocks[0].reader->nextBatch();
-				if (! blocks[0].reader->getData(&rbuffer, &rbytes)) {
+            if (headerMemory != NULL) {
+                rbuffer = headerMemory + (headerSize - left);
+                rbytes = left;
+            } else if ((! headerReader->getData(&rbuffer, &rbytes)) || rbytes == 0) {
+				headerReader->nextBatch();
+				if (! headerReader->getData(&rbuffer, &rbytes)) {
 					WriteErrorMessage( "read header failed\n");
 					soft_exit(1);
 				}
@@ -362,93 +1127,88 @@ SortedDataFilterSupplier::mergeSort()
 			size_t xfer = min(left, min((size_t) rbytes, wbytes));
 			_ASSERT(xfer > 0 && xfer <= UINT32_MAX);
 			memcpy(wbuffer, rbuffer, xfer);
-			blocks[0].reader->advance(xfer);
+            if (headerReader != NULL) {
+                headerReader->advance(xfer);
+            }
 			writer->advance((unsigned) xfer);
 			left -= xfer;
 		}
-        blocks[0].reader->reinit(blocks[0].start, blocks[0].bytes);
+        delete headerReader;
 		writer->nextBatch();
 		writer->inHeader(false);
     }
 
-    // merge temp blocks into output
-    _int64 total = 0;
-    // get initial merge sort data
-    typedef PriorityQueue<GenomeLocation, _int64> BlockQueue;
-    BlockQueue queue;
+    // split the merge up and start workers on the partitions they can buffer
     for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
-        _int64 bytes;
-        b->reader->getData(&b->data, &bytes);
-        format->getSortInfo(genome, b->data, bytes, &b->location, &b->length);
-        queue.add((_uint32) (b - blocks.begin()), b->location); 
-    }
-    GenomeLocation current = 0; // current location for validation
-	int lastRefID = -1, lastPos = 0;
-    while (queue.size() > 0) {
-#if VALIDATE_SORT
-		unsigned check;
-		queue.peek(&check);
-		_ASSERT(check >= current);
-#endif
-        GenomeLocation secondLocation;
-        _int64 smallestIndex = queue.pop();
-        _int64 secondIndex = queue.size() > 0 ? queue.peek(&secondLocation) : -1;
-        GenomeLocation limit = secondIndex != -1 ? secondLocation : InvalidGenomeLocation;
-        SortBlock* b = &blocks[smallestIndex];
-        char* writeBuffer;
-        size_t writeBytes;
-        writer->getBuffer(&writeBuffer, &writeBytes);
-        while (b->location <= limit) {
-#if VALIDATE_SORT
-			_ASSERT(b->location >= b->minLocation && b->location <= b->maxLocation);
-#endif
-            if (writeBytes < (size_t)b->length) {
-                writer->nextBatch();
-                writer->getBuffer(&writeBuffer, &writeBytes);
-                if (writeBytes < (size_t)b->length) {
-                    WriteErrorMessage( "mergeSort: buffer size too small\n");
-                    return false;
+        b->memory = tempFile->getMemory(b->start, b->bytes);
+    }
+    int nWorkers = __max(1, numThreads);
+    if (markDuplicates) {
+        longPairs = new BAMDuplicateMarker::LongPairs();
+    }
+    MergePartition* partitions;
+    int nPartitions = choosePartitions(nWorkers, &partitions);
+    int nBuffered = 0;
+    for (int p = 0; p < nPartitions; p++) {
+        nBuffered += ! partitions[p].direct;
+    }
+    MergeWorkerManager* manager = NULL;
+    ParallelCoworker* coworker = NULL;
+    if (nBuffered > 0) {
+        manager = new MergeWorkerManager(this, partitions, nPartitions, 2 * nWorkers);
+        coworker = new ParallelCoworker(min(nWorkers, nBuffered), false, manager, MergeWorkerManager::finishedCallback, manager);
+        coworker->start();
+        coworker->step();
+    }
+
+    // write partitions out in order
+    _int64 total = 0;
+    _int64 longPairDuplicates = 0, longPairTime = 0;
+    MergeCursor* cursors = new MergeCursor[blocks.size()];
+    for (int p = 0; p < nPartitions; p++) {
+        MergePartition* partition = &partitions[p];
+        if (partition->direct) {
+            total += mergePartition(partition, cursors, writer);
+        } else {
+            manager->waitUntilMerged(p);
+            char* data = partition->output;
+            _int64 nextDeferred = 0;
+            for (_int64 i = 0; i < partition->lengths.size(); i++) {
+                if (nextDeferred < partition->deferred.size() && partition->deferred[nextDeferred] == i) {
+                    _int64 startMark = timeInNanos();
+                    longPairDuplicates += longPairs->mark((BAMAlignment*) data, genome);
+                    longPairTime += timeInNanos() - startMark;
+                    nextDeferred++;
                 }
+                writeRecord(writer, data, partition->lengths[i]);
+                data += partition->lengths[i];
             }
-            memcpy(writeBuffer, b->data, b->length);
-#ifdef VALIDATE_BAM
-            if (format == FileFormat::BAM[0] || format == FileFormat::BAM[1]) {
-                ((BAMAlignment*)b->data)->validate();
+            total += partition->lengths.size();
+            if (partition->output != NULL) {
+                BigDealloc(partition->output);
+                partition->output = NULL;
             }
-#endif
-#if VALIDATE_SORT
-			int refID, pos;
-			format->getSortInfo(genome, b->data, b->length, NULL, NULL, &refID, &pos);
-			_ASSERT(refID == -1 || refID > lastRefID || (refID == lastRefID && pos >= lastPos));
-			if (refID != -1) {
-				lastRefID = refID;
-				lastPos = pos;
-			}
-#endif
-			total++;
-            writer->advance(b->length);
-            writeBytes -= b->length;
-            writeBuffer += b->length;
-            b->reader->advance(b->length);
-            _ASSERT(b->location >= current);
-            current = b->location;
-            _int64 readBytes;
-            if (! b->reader->getData(&b->data, &readBytes)) {
-                b->reader->nextBatch();
-                if (! b->reader->getData(&b->data, &readBytes)) {
-                    _ASSERT(b->reader->isEOF());
-                    delete b->reader;
-                    b->reader = NULL;
-                    break;
-                }
-            }
-            GenomeLocation previous = b->location;
-            format->getSortInfo(genome, b->data, readBytes, &b->location, &b->length);
-            _ASSERT(b->length <= readBytes && b->location >= previous);
         }
-        if (b->reader != NULL) {
-            queue.add(smallestIndex, b->location);
+        if (manager != NULL) {
+            manager->onConsumed();
+        }
+    }
+    delete[] cursors;
+    if (coworker != NULL) {
+        if (! WaitForSingleWaiterObject(&manager->finished)) {
+            WriteErrorMessage("Waiting for merge threads to finish failed\n");
+            soft_exit(1);
         }
+        coworker->stop();
+        delete coworker;
+        delete manager;
+    }
+    delete[] partitions;
+    if (longPairs != NULL) {
+        InterlockedAdd64AndReturnNewValue(&BAMDuplicateMarker::DuplicatesMarked, longPairDuplicates);
+        InterlockedAdd64AndReturnNewValue(&BAMDuplicateMarker::Time, longPairTime);
+        delete longPairs;
+        longPairs = NULL;
     }
     
     // close everything
@@ -456,19 +1216,24 @@ SortedDataFilterSupplier::mergeSort()
     delete writer;
     writerSupplier->close();
     delete writerSupplier;
-    if (! DeleteSingleFile(tempFileName)) {
+    tempFile->freeMemory();
+    if (tempFile->anySpilled() && ! DeleteSingleFile(tempFileName)) {
         WriteErrorMessage( "warning: failure deleting temp file %s\n", tempFileName);
     }
 
 #if USE_DEVTEAM_OPTIONS
-    WriteStatusMessage("sorted %lld reads in %u blocks, %lld s\n"
+    WriteStatusMessage("sorted %lld reads in %u blocks, %d partitions, %lld s\n"
         "read wait align %.3f s + merge %.3f s, read release align %.3f s + merge %.3f s\n"
         "write wait %.3f s align + %.3f s merge, write filter %.3f s align + %.3f s merge\n",
-        total, blocks.size(), (timeInMillis() - start)/1000,
+        total, blocks.size(), nPartitions, (timeInMillis() - start)/1000,
         startReadWaitTime * 1e-9, (DataReader::ReadWaitTime - startReadWaitTime) * 1e-9,
         startReleaseWaitTime * 1e-9, (DataReader::ReleaseWaitTime - startReleaseWaitTime) * 1e-9,
         startWriteWaitTime * 1e-9, (DataWriter::WaitTime - startWriteWaitTime) * 1e-9,
         startWriteFilterTime * 1e-9, (DataWriter::FilterTime - startWriteFilterTime) * 1e-9);
+    if (markDuplicates) {
+        WriteStatusMessage("marked %lld duplicates, %.3f s over all threads\n",
+            BAMDuplicateMarker::DuplicatesMarked - startDuplicatesMarked, (BAMDuplicateMarker::Time - startDuplicateTime) * 1e-9);
+    }
 #endif
     return true;
 }
@@ -479,7 +1244,9 @@ DataWriterSupplier::sorted(
     const Genome* genome,
     const char* tempFileName,
     size_t tempBufferMemory,
+    _int64 inMemoryBudget,
     int numThreads,
+    bool markDuplicates,
     const char* sortedFileName,
     DataWriter::FilterSupplier* sortedFilterSuppler,
     FileEncoder* encoder)
@@ -488,7 +1255,8 @@ DataWriterSupplier::sorted(
     const size_t bufferSize = tempBufferMemory > 0
         ? tempBufferMemory / (bufferCount * numThreads)
         : max((size_t) 16 * 1024 * 1024, ((size_t) (genome ? genome->getCountOfBases() : 0) / 3) / bufferCount);
-    DataWriter::FilterSupplier* filterSupplier =
-        new SortedDataFilterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, encoder);
-    return DataWriterSupplier::create(tempFileName, filterSupplier, NULL, bufferCount, bufferSize);
+    SortedDataFilterSupplier* filterSupplier =
+        new SortedDataFilterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, inMemoryBudget, numThreads,
+            markDuplicates, encoder);
+    return DataWriterSupplier::create(tempFileName, filterSupplier, NULL, bufferCount, bufferSize, filterSupplier->getTempFile());
 }
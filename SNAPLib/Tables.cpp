@@ -17,6 +17,7 @@ const unsigned *IS_LOWER_CASE_OR_DOT = tables.getIsLowerCaseOrDot();
 const char *TO_UPPER_CASE_DOT_TO_N = tables.getToUpperCaseDotToN();
 const char *PACKED_VALUE_BASE_RC = tables.getPackedValueBaseRC();
 const char *CIGAR_QUAL_TO_SAM = tables.getCigarQualToSam();
+const char *PACKED_GENOME_BYTE_BASES = tables.getPackedGenomeByteBases();
 
 
 Tables::Tables()
@@ -92,4 +93,11 @@ Tables::Tables()
     for (unsigned i = 0; i < 256; i++) {
         cigarQualToSam[i] = i > ('~' - '!') ? '!' : '!' + i;
     }
+
+    // packed genome bytes, low order bits first
+    for (unsigned i = 0; i < 256; i++) {
+        for (unsigned j = 0; j < 4; j++) {
+            packedGenomeByteBases[i * 4 + j] = valueBase[(i >> (2 * j)) & 3];
+        }
+    }
 }
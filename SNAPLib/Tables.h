@@ -29,6 +29,8 @@ class Tables
 
     char cigarQualToSam[256];
 
+    char packedGenomeByteBases[256 * 4];    // The four bases in a byte of a packed Genome, in order
+
 public:
     Tables();
 
@@ -46,6 +48,7 @@ public:
     const unsigned *getIsLowerCaseOrDot() const {return isLowerCaseOrDot; }
     const char *getToUpperCaseDotToN() const { return toUpperCaseDotToN; }
     const char *getCigarQualToSam() const { return cigarQualToSam; }
+    const char *getPackedGenomeByteBases() const { return packedGenomeByteBases; }
 };
 
 extern const char *COMPLEMENT;
@@ -61,4 +64,5 @@ extern const int  *BASE_VALUE_NO_N;
 extern const unsigned *IS_LOWER_CASE_OR_DOT;
 extern const char *TO_UPPER_CASE_DOT_TO_N;
 extern const char *CIGAR_QUAL_TO_SAM;
+extern const char *PACKED_GENOME_BYTE_BASES;
 
@@ -27,6 +27,50 @@ inline double ratio(double a, double b=1)
 //
 extern char *FormatUIntWithCommas(_uint64 val, char *outputBuffer, size_t outputBufferSize);
 
+//
+// Write the value in decimal and return the number of characters written.  There's no null terminator,
+// and no bounds check: the buffer needs room for FormatIntMaxChars.  This is a good deal cheaper than
+// sprintf, which matters when formatting every field of every output record.
+//
+const int FormatIntMaxChars = 20;   // 2^64 has 20 digits; 2^63 has 19 plus a sign
+
+    inline int
+FormatUInt(_uint64 val, char *outputBuffer)
+{
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    char digits[FormatIntMaxChars];
+    char *p = digits + FormatIntMaxChars;
+    while (val >= 100) {
+        unsigned pair = (unsigned)(val % 100) * 2;
+        val /= 100;
+        *--p = pairs[pair + 1];
+        *--p = pairs[pair];
+    }
+    if (val >= 10) {
+        *--p = pairs[val * 2 + 1];
+        *--p = pairs[val * 2];
+    } else {
+        *--p = (char)('0' + val);
+    }
+    int n = (int)(digits + FormatIntMaxChars - p);
+    memcpy(outputBuffer, p, n);
+    return n;
+}
+
+    inline int
+FormatInt(_int64 val, char *outputBuffer)
+{
+    if (val < 0) {
+        *outputBuffer = '-';
+        return 1 + FormatUInt(0 - (_uint64)val, outputBuffer + 1);
+    }
+    return FormatUInt((_uint64)val, outputBuffer);
+}
+
 const int MAXLINE = 1024;
 
 //
@@ -0,0 +1,5 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "GenomeIndex.h"
+double *GenomeIndex::hg19_biasTables[largestKeySize+1][largestBiasTable+1];
+double *GenomeIndex::hg19_biasTables_large[largestKeySize+1][largestBiasTable+1];
@@ -0,0 +1,75 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Genome.h"
+#include "Bam.h"
+
+// the bins BAI uses, as the SAM spec computes them
+static int SpecReg2Bin(int beg, int end)
+{
+    --end;
+    if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
+    if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
+    if (beg>>20 == end>>20) return ((1<<9)-1)/7 + (beg>>20);
+    if (beg>>23 == end>>23) return ((1<<6)-1)/7 + (beg>>23);
+    if (beg>>26 == end>>26) return ((1<<3)-1)/7 + (beg>>26);
+    return 0;
+}
+
+TEST("reg2bin matches the BAI bins") {
+    static const int regions[][2] = {
+        {-1, 0}, {0, 1}, {0, 16384}, {16383, 16385}, {100000, 100100}, {131071, 131073},
+        {1 << 20, (1 << 20) + 5000}, {(1 << 23) - 1, (1 << 23) + 1}, {1 << 26, (1 << 26) + 1}, {1000, 1 << 27},
+        {(1 << 29) - 100, 1 << 29}
+    };
+    for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        ASSERT_EQ(SpecReg2Bin(regions[i][0], regions[i][1]), BAMAlignment::reg2bin(regions[i][0], regions[i][1]));
+    }
+}
+
+TEST("reg2bin with a deeper CSI index") {
+    // the smallest bins are the same size, but there are 8^6 of them after the 1+8+...+8^5 in the levels above
+    int first = ((1 << 18) - 1) / 7;
+    ASSERT_EQ(first, BAMAlignment::reg2bin(0, 1, 14, 6));
+    ASSERT_EQ(first + (1 << 16), BAMAlignment::reg2bin(1 << 30, (1 << 30) + 100, 14, 6));
+    // the bins under the root each cover 2^29 bases, so spanning two of them only fits in the root
+    ASSERT_EQ(0, BAMAlignment::reg2bin((1 << 29) - 1, (1 << 29) + 1, 14, 6));
+    ASSERT_EQ(1, BAMAlignment::reg2bin(0, 1 << 29, 14, 6));
+    ASSERT_EQ(2, BAMAlignment::reg2bin(1 << 29, (1 << 29) + (1 << 28), 14, 6));
+}
+
+TEST("reg2bins lists a bin at each level") {
+    int list[BAMAlignment::MAX_BIN];
+    int n = BAMAlignment::reg2bins(100000, 100100, list);
+    ASSERT_EQ(6, n);
+    ASSERT_EQ(0, list[0]);
+    ASSERT_EQ(SpecReg2Bin(100000, 100100), list[n - 1]);
+    for (int i = 1; i < n; i++) {
+        // each is the parent of the next
+        ASSERT_EQ(list[i - 1], (list[i] - 1) >> 3);
+    }
+
+    n = BAMAlignment::reg2bins(0, 1 << 15, list);
+    ASSERT_EQ(1 + 1 + 1 + 1 + 1 + 2, n);
+    ASSERT_EQ(4681, list[5]);
+    ASSERT_EQ(4682, list[6]);
+}
+
+TEST("BAI depth for short contigs") {
+    Genome* genome = new Genome(20100, 20100, 0);
+    std::string bases(10000, 'A');
+    genome->startContig("chr1");
+    genome->addData(bases.c_str());
+    genome->startContig("chr2");
+    genome->addData(bases.c_str());
+    genome->fillInContigLengths();
+
+    ASSERT_EQ(BAMIndex::BAIDepth, BAMIndex::depthFor(genome));
+
+    BAMIndex index(genome->getNumContigs(), false, BAMIndex::BAIDepth);
+    ASSERT_EQ(BAMAlignment::BAM_EXTRA_BIN, index.getMetadataBin());
+    BAMIndex csi(genome->getNumContigs(), true, 7);
+    ASSERT_EQ((((1 << 24) - 1) / 7) + 1, (int) csi.getMetadataBin());
+
+    delete genome;
+}
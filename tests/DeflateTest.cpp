@@ -0,0 +1,260 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Deflate.h"
+#include "Bam.h"
+#include "zlib.h"
+#include "DataWriter.h"
+#include "GzipDataWriter.h"
+#include "AlignerOptions.h"
+
+//
+// Test fixture with data that compresses about as well as BAM records do: read names that mostly repeat, random
+// bases and qualities from a handful of values.
+//
+struct DeflateTest {
+    static const size_t dataSize = 4 * 1024 * 1024;
+    char *data;
+    char *compressed;
+    char *decompressed;
+
+    DeflateTest() {
+        data = new char[dataSize];
+        _uint64 random = 12345;
+        size_t i = 0;
+        for (int read = 0; i < dataSize; read++) {
+            i += snprintf(data + i, dataSize - i, "HWI-ST1234:8:1101:%d:%d", read / 1000, read % 1000) + 1;
+            for (int base = 0; base < 100 && i < dataSize; base++, i++) {
+                random = random * 6364136223846793005 + 1442695040888963407;
+                data[i] = "ACGT"[(random >> 33) % 4];
+            }
+            for (int base = 0; base < 100 && i < dataSize; base++, i++) {
+                random = random * 6364136223846793005 + 1442695040888963407;
+                data[i] = "#-7<AFJ"[(random >> 33) % 7 == 0 ? (random >> 40) % 7 : 6];
+            }
+        }
+        compressed = new char[BAM_BLOCK];
+        decompressed = new char[BAM_BLOCK];
+    }
+
+    ~DeflateTest() {
+        delete [] data;
+        delete [] compressed;
+        delete [] decompressed;
+    }
+
+    //
+    // What zlib itself makes of the input with its gzip encoding and a BGZF header, the way BAM blocks used to be
+    // compressed.
+    //
+    size_t zlibBgzfBlock(int level, char *output, const char *input, size_t inputSize) {
+        _uint8 extra[6] = {'B', 'C', 2, 0, 0, 0};
+        gz_header header;
+        memset(&header, 0, sizeof(header));
+        header.extra = extra;
+        header.extra_len = 6;
+        header.extra_max = 6;
+        header.done = true;
+        z_stream zstream;
+        memset(&zstream, 0, sizeof(zstream));
+        ASSERT_EQ(Z_OK, deflateInit2(&zstream, level, Z_DEFLATED, MAX_WBITS | 16, 8, Z_DEFAULT_STRATEGY));
+        ASSERT_EQ(Z_OK, deflateSetHeader(&zstream, &header));
+        zstream.next_in = (Bytef *)input;
+        zstream.avail_in = (uInt)inputSize;
+        zstream.next_out = (Bytef *)output;
+        zstream.avail_out = BAM_BLOCK;
+        ASSERT_EQ(Z_STREAM_END, deflate(&zstream, Z_FINISH));
+        size_t used = BAM_BLOCK - zstream.avail_out;
+        deflateEnd(&zstream);
+        *(_uint16 *)(output + 16) = (_uint16)(used - 1);
+        return used;
+    }
+};
+
+TEST_F(DeflateTest, "BGZF blocks round trip at every level and zlib reads them") {
+    GzipDecompressor *decompressor = GzipDecompressor::create();
+    const size_t sizes[] = {0, 1, 1000, BAM_BLOCK - 1000, BAM_BLOCK};
+    for (int level = 0; level <= GzipCompressor::MaxLevel; level++) {
+        GzipCompressor *compressor = GzipCompressor::create(level);
+        for (int s = 0; s < 5; s++) {
+            // at level 0 a whole block doesn't fit in one, so it's too big for BGZF
+            size_t inputSize = level == 0 ? __min(sizes[s], (size_t)BAM_BLOCK - 1000) : sizes[s];
+            const char *input = data + 4321 * s;
+            size_t size = compressor->compress(true, compressed, BAM_BLOCK, input, inputSize);
+            ASSERT(size > 0);
+            BgzfHeader *header = (BgzfHeader *)compressed;
+            ASSERT(header->validate(size, inputSize));
+            ASSERT_EQ(size - 1, header->BSIZE());
+            ASSERT_EQ(inputSize, header->ISIZE());
+
+            memset(decompressed, 0, BAM_BLOCK);
+            ASSERT(decompressor->decompress(compressed, size, decompressed, inputSize));
+            ASSERT(0 == memcmp(input, decompressed, inputSize));
+
+            memset(decompressed, 0, BAM_BLOCK);
+            z_stream zstream;
+            memset(&zstream, 0, sizeof(zstream));
+            ASSERT_EQ(Z_OK, inflateInit2(&zstream, MAX_WBITS | 16));
+            zstream.next_in = (Bytef *)compressed;
+            zstream.avail_in = (uInt)size;
+            zstream.next_out = (Bytef *)decompressed;
+            zstream.avail_out = BAM_BLOCK;
+            ASSERT_EQ(Z_STREAM_END, inflate(&zstream, Z_FINISH));
+            ASSERT_EQ(inputSize, (size_t)zstream.total_out);
+            inflateEnd(&zstream);
+            ASSERT(0 == memcmp(input, decompressed, inputSize));
+        }
+        delete compressor;
+    }
+    delete decompressor;
+}
+
+TEST_F(DeflateTest, "corrupt and truncated blocks are rejected") {
+    GzipCompressor *compressor = GzipCompressor::create();
+    GzipDecompressor *decompressor = GzipDecompressor::create();
+    size_t size = compressor->compress(true, compressed, BAM_BLOCK, data, 50000);
+    ASSERT(decompressor->decompress(compressed, size, decompressed, 50000));
+    ASSERT(! decompressor->decompress(compressed, size, decompressed, 49999));
+    ASSERT(! decompressor->decompress(compressed, size - 1, decompressed, 50000));
+    compressed[size - 6] ^= 1; // CRC
+    ASSERT(! decompressor->decompress(compressed, size, decompressed, 50000));
+    compressed[size - 6] ^= 1;
+    compressed[size / 2] ^= 0x10;
+    ASSERT(! decompressor->decompress(compressed, size, decompressed, 50000));
+
+    // too big to fit
+    ASSERT_EQ((size_t)0, compressor->compress(true, compressed, 1000, data, 50000));
+    delete compressor;
+    delete decompressor;
+}
+
+TEST_F(DeflateTest, "zlib blocks are bit for bit what zlib's own gzip encoding makes") {
+    char *expected = new char[BAM_BLOCK];
+    for (int level = 0; level <= GzipCompressor::MaxLevel; level++) {
+        GzipCompressor *compressor = GzipCompressor::create(level);
+        for (int block = 0; block < 3; block++) {
+            size_t inputSize = 30000 + 1000 * block;
+            size_t expectedSize = zlibBgzfBlock(level, expected, data + 77777 * block, inputSize);
+            size_t size = compressor->compress(true, compressed, BAM_BLOCK, data + 77777 * block, inputSize);
+            ASSERT_EQ(expectedSize, size);
+            ASSERT(0 == memcmp(expected, compressed, size));
+        }
+        delete compressor;
+    }
+    delete [] expected;
+}
+
+//
+// Write BAM-like data with a stretch of random bytes in it through the gzip writer, the way unsorted BAM output is
+// written, and check that every block is within BGZF's size limit and that zlib reads back what went in.
+//
+TEST_F(DeflateTest, "the BAM writer keeps blocks of incompressible data within BGZF's limit at every level") {
+    const char *fileName = "DeflateTest.tmp.bam";
+    const size_t writeSize = 512 * 1024;  // Enough for a few blocks either side of the random bytes, and quick at level 9
+    _uint64 random = 777;
+    for (size_t i = writeSize / 3; i < writeSize / 3 + 200000; i++) {
+        random = random * 6364136223846793005 + 1442695040888963407;
+        data[i] = (char)(random >> 56);
+    }
+    char *readBack = new char[writeSize];
+    for (int level = 1; level <= GzipCompressor::MaxLevel; level++) {
+        DataWriterSupplier *supplier = DataWriterSupplier::create(fileName,
+            DataWriterSupplier::gzip(true, BAM_BLOCK, 1, false, false, level), NULL, 4, 1024 * 1024);
+        DataWriter *writer = supplier->getWriter();
+        size_t written = 0;
+        for (int piece = 0; written < writeSize; piece++) {
+            size_t bytes = __min((size_t)(1000 + 997 * (piece % 50)), writeSize - written);
+            char *buffer;
+            size_t size;
+            ASSERT(writer->getBuffer(&buffer, &size));
+            if (size < bytes) {
+                ASSERT(writer->nextBatch());
+                ASSERT(writer->getBuffer(&buffer, &size) && size >= bytes);
+            }
+            memcpy(buffer, data + written, bytes);
+            writer->advance(bytes);
+            written += bytes;
+        }
+        writer->close();
+        delete writer;
+        supplier->close();
+        delete supplier;
+
+        FILE *file = fopen(fileName, "rb");
+        ASSERT(file != NULL);
+        size_t readBackUsed = 0;
+        bool eof = false;
+        while (! eof) {
+            const size_t headerSize = 18; // gzip header with just the BGZF extra field
+            ASSERT_EQ(headerSize, fread(compressed, 1, headerSize, file));
+            size_t size = ((BgzfHeader *)compressed)->BSIZE() + 1;
+            ASSERT(size > headerSize && size <= BAM_BLOCK);
+            ASSERT_EQ(size - headerSize, fread(compressed + headerSize, 1, size - headerSize, file));
+            size_t inputSize = ((BgzfHeader *)compressed)->ISIZE();
+            ASSERT(readBackUsed + inputSize <= writeSize);
+            eof = inputSize == 0;
+
+            z_stream zstream;
+            memset(&zstream, 0, sizeof(zstream));
+            ASSERT_EQ(Z_OK, inflateInit2(&zstream, MAX_WBITS | 16));
+            zstream.next_in = (Bytef *)compressed;
+            zstream.avail_in = (uInt)size;
+            zstream.next_out = (Bytef *)(readBack + readBackUsed);
+            zstream.avail_out = (uInt)inputSize;
+            ASSERT_EQ(Z_STREAM_END, inflate(&zstream, Z_FINISH));
+            ASSERT_EQ(inputSize, (size_t)zstream.total_out);
+            inflateEnd(&zstream);
+            readBackUsed += inputSize;
+        }
+        ASSERT(fgetc(file) == EOF);
+        fclose(file);
+        ASSERT_EQ(writeSize, readBackUsed);
+        ASSERT(0 == memcmp(data, readBack, writeSize));
+    }
+    delete [] readBack;
+    remove(fileName);
+}
+
+TEST("compression level 0 is rejected, since stored blocks grow in the write buffer") {
+    AlignerOptions options("test");
+    const char *argv[] = {"-cl", "0", "-cl", "1"};
+    bool done = false;
+    int n = 0;
+    ASSERT(! options.parse(argv, 4, n, &done));
+    n = 2;
+    ASSERT(options.parse(argv, 4, n, &done));
+    ASSERT_EQ(1, options.compressionLevel);
+}
+
+//
+// Times the fixture's data through the compressor one block at a time.  Run with "unit_tests -benchmarks Deflate".
+//
+BENCHMARK_F(DeflateTest, "MB/s compressing (decompressing) and ratio by level") {
+    //
+    // One thread, so these are per core.  Level 0 doesn't fit whole blocks, so all levels use a bit less.
+    //
+    const size_t blockSize = BAM_BLOCK - 1024;
+    const size_t nBlocks = dataSize / blockSize;
+    GzipDecompressor *decompressor = GzipDecompressor::create();
+    printf("%s:", GzipCompressor::Library);
+    for (int level = 0; level <= GzipCompressor::MaxLevel; level++) {
+        GzipCompressor *compressor = GzipCompressor::create(level);
+        size_t total = 0;
+        _int64 compressNanos = 0, decompressNanos = 0;
+        for (size_t i = 0; i < nBlocks; i++) {
+            _int64 start = timeInNanos();
+            size_t size = compressor->compress(true, compressed, BAM_BLOCK, data + i * blockSize, blockSize);
+            _int64 middle = timeInNanos();
+            ASSERT(decompressor->decompress(compressed, size, decompressed, blockSize));
+            decompressNanos += timeInNanos() - middle;
+            compressNanos += middle - start;
+            total += size;
+        }
+        double megabytes = (double)(nBlocks * blockSize) / (1024 * 1024);
+        printf(" %d: %.0f (%.0f) %.2f,", level, megabytes * 1e9 / __max(compressNanos, (_int64)1),
+            megabytes * 1e9 / __max(decompressNanos, (_int64)1), (double)(nBlocks * blockSize) / total);
+        delete compressor;
+    }
+    delete decompressor;
+    printf(" ");
+}
@@ -0,0 +1,214 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Genome.h"
+#include "Bam.h"
+
+//
+// Collects what a marker passes on.
+//
+class CollectingMarker : public BAMDuplicateMarker
+{
+public:
+    CollectingMarker(const Genome *genome, LongPairs *longPairs, bool defer) : BAMDuplicateMarker(genome, longPairs, defer) {}
+
+    std::vector<char> output;
+    std::vector<size_t> offsets;
+    std::vector<bool> deferred;
+
+protected:
+    virtual void emit(char *data, GenomeDistance length, bool i_deferred) {
+        offsets.push_back(output.size());
+        output.insert(output.end(), data, data + length);
+        deferred.push_back(i_deferred);
+    }
+};
+
+//
+// Test fixture with a two contig genome, and reads that are all 10 bases long with the same quality for every base.
+//
+struct DuplicateMarkerTest {
+    static const int contigLength = 60000;
+    Genome *genome;
+
+    struct TestRead {
+        GenomeLocation location; // for sorting, like BAMFormat::getSortInfo
+        std::vector<char> data;
+    };
+    std::vector<TestRead> reads;
+
+    DuplicateMarkerTest() {
+        std::string bases(contigLength, 'A');
+        genome = new Genome(2 * contigLength + 100, 2 * contigLength + 100, 0);
+        genome->startContig("chr1");
+        genome->addData(bases.c_str());
+        genome->startContig("chr2");
+        genome->addData(bases.c_str());
+        genome->fillInContigLengths();
+    }
+
+    ~DuplicateMarkerTest() {
+        delete genome;
+    }
+
+    void addRead(const char *name, unsigned flag, int refID, int pos, int nextRefID, int nextPos, int quality) {
+        const int l_seq = 10;
+        int l_read_name = (int)strlen(name) + 1;
+        TestRead read;
+        read.data.resize(BAMAlignment::size(l_read_name, 0, l_seq, 0));
+        BAMAlignment *bam = (BAMAlignment *)&read.data[0];
+        bam->block_size = (_int32)read.data.size() - 4;
+        bam->refID = refID;
+        bam->pos = pos;
+        bam->l_read_name = (_uint8)l_read_name;
+        bam->MAPQ = 60;
+        bam->bin = 0;
+        bam->n_cigar_op = 0;
+        bam->FLAG = (_uint16)flag;
+        bam->l_seq = l_seq;
+        bam->next_refID = nextRefID;
+        bam->next_pos = nextPos;
+        bam->tlen = 0;
+        strcpy(bam->read_name(), name);
+        memset(bam->qual(), quality, l_seq);
+        read.location = (flag & SAM_UNMAPPED) ? genome->getContigs()[nextRefID].beginningLocation + nextPos : bam->getLocation(genome);
+        reads.push_back(read);
+    }
+
+    // both ends of a pair; a negative mate position means the mate is unmapped
+    void addPair(const char *name, int refID, int pos, bool rc, int mateRefID, int matePos, bool mateRc, int quality, int mateQuality) {
+        unsigned flag = SAM_MULTI_SEGMENT | SAM_FIRST_SEGMENT | (rc ? SAM_REVERSE_COMPLEMENT : 0);
+        if (matePos < 0) {
+            addRead(name, flag | SAM_NEXT_UNMAPPED, refID, pos, refID, pos, quality);
+            addRead(name, SAM_MULTI_SEGMENT | SAM_LAST_SEGMENT | SAM_UNMAPPED | (rc ? SAM_NEXT_REVERSED : 0), -1, -1, refID, pos, mateQuality);
+            return;
+        }
+        addRead(name, flag | (mateRc ? SAM_NEXT_REVERSED : 0), refID, pos, mateRefID, matePos, quality);
+        addRead(name, SAM_MULTI_SEGMENT | SAM_LAST_SEGMENT | (mateRc ? SAM_REVERSE_COMPLEMENT : 0) | (rc ? SAM_NEXT_REVERSED : 0),
+            mateRefID, matePos, refID, pos, mateQuality);
+    }
+
+    static bool readComparator(const TestRead &a, const TestRead &b) {
+        return a.location < b.location;
+    }
+
+    void sortReads() {
+        std::stable_sort(reads.begin(), reads.end(), readComparator);
+    }
+
+    //
+    // Marks the reads in [begin,end), looking at the reads within a window either side, the way a merge partition
+    // does, and appends their flags.  The deferred ones are marked later, in order.
+    //
+    void markPartition(BAMDuplicateMarker::LongPairs *longPairs, GenomeLocation begin, GenomeLocation end, std::vector<TestRead> *o_marked) {
+        CollectingMarker marker(genome, longPairs, true);
+        for (size_t i = 0; i < reads.size(); i++) {
+            GenomeLocation location = reads[i].location;
+            if (location >= begin - BAMDuplicateMarker::Window && location < end + BAMDuplicateMarker::Window) {
+                marker.add(&reads[i].data[0], reads[i].data.size(), location, location < begin || location >= end);
+            }
+        }
+        marker.flush();
+        for (size_t i = 0; i < marker.offsets.size(); i++) {
+            size_t next = i + 1 < marker.offsets.size() ? marker.offsets[i + 1] : marker.output.size();
+            TestRead read;
+            read.data.assign(marker.output.begin() + marker.offsets[i], marker.output.begin() + next);
+            if (marker.deferred[i]) {
+                longPairs->mark((BAMAlignment *)&read.data[0], genome);
+            }
+            o_marked->push_back(read);
+        }
+    }
+
+    std::vector<TestRead> markAll() {
+        BAMDuplicateMarker::LongPairs longPairs;
+        CollectingMarker marker(genome, &longPairs, false);
+        for (size_t i = 0; i < reads.size(); i++) {
+            marker.add(&reads[i].data[0], reads[i].data.size(), reads[i].location, false);
+        }
+        marker.flush();
+        std::vector<TestRead> result;
+        for (size_t i = 0; i < marker.offsets.size(); i++) {
+            TestRead read;
+            read.data.assign(marker.output.begin() + marker.offsets[i], marker.output.begin() + marker.offsets[i] + reads[i].data.size());
+            result.push_back(read);
+        }
+        return result;
+    }
+
+    bool isDuplicate(std::vector<TestRead> &marked, size_t i) {
+        return (((BAMAlignment *)&marked[i].data[0])->FLAG & SAM_DUPLICATE) != 0;
+    }
+};
+
+TEST_F(DuplicateMarkerTest, "the fragment with the best total quality is kept") {
+    addPair("a", 0, 1000, false, 0, 1300, true, 30, 30);
+    addPair("b", 0, 1000, false, 0, 1300, true, 40, 10);
+    addPair("c", 0, 1000, false, 0, 1300, true, 35, 35);
+    addPair("d", 0, 1000, false, 0, 1300, true, 35, 35); // a tie goes to the one that ends first
+    addPair("e", 0, 1000, true, 0, 1300, true, 50, 50);  // different direction, so not a duplicate
+    addPair("f", 0, 1000, false, 0, 1301, true, 50, 50); // mate somewhere else
+    sortReads();
+    std::vector<TestRead> marked = markAll();
+    ASSERT_EQ(reads.size(), marked.size());
+    for (size_t i = 0; i < marked.size(); i++) {
+        const char *name = ((BAMAlignment *)&marked[i].data[0])->read_name();
+        ASSERT_EQ(0 == strcmp(name, "a") || 0 == strcmp(name, "b") || 0 == strcmp(name, "d"), isDuplicate(marked, i));
+    }
+}
+
+TEST_F(DuplicateMarkerTest, "marking in partitions gives the same flags as marking everything at once") {
+    //
+    // Sets of duplicates with mates nearby, a window or so away, on the other contig and unmapped, all scattered
+    // randomly so that partitions cut through them.
+    //
+    _uint64 random = 12345;
+    int nFragments = 0;
+    for (int set = 0; set < 3000; set++) {
+        random = random * 6364136223846793005 + 1442695040888963407;
+        int refID = (int)((random >> 33) % 2);
+        int pos = (int)((random >> 35) % (contigLength - 30000));
+        int kind = (int)((random >> 20) % 6);
+        int mateRefID = refID, matePos;
+        switch (kind) {
+        case 0: matePos = pos + (int)((random >> 40) % 500); break;
+        case 1: matePos = pos + (int)BAMDuplicateMarker::Window; break;
+        case 2: matePos = pos + (int)BAMDuplicateMarker::Window + 1; break;
+        case 3: matePos = pos + 25000; break;
+        case 4: mateRefID = 1 - refID; matePos = (int)((random >> 45) % contigLength); break;
+        default: matePos = -1; break;
+        }
+        bool rc = (random >> 50) & 1, mateRc = (random >> 51) & 1;
+        int copies = 1 + (int)((random >> 52) % 4);
+        for (int copy = 0; copy < copies; copy++) {
+            random = random * 6364136223846793005 + 1442695040888963407;
+            char name[20];
+            sprintf(name, "r%d", nFragments++);
+            addPair(name, refID, pos, rc, mateRefID, matePos, mateRc, 2 + (int)((random >> 33) % 5), 2 + (int)((random >> 40) % 5));
+        }
+    }
+    sortReads();
+    std::vector<TestRead> expected = markAll();
+
+    int nDuplicates = 0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        nDuplicates += isDuplicate(expected, i);
+    }
+    ASSERT(nDuplicates > 1000);
+
+    GenomeLocation end = genome->getCountOfBases() + 1;
+    const int partitionSizes[] = {7919, 3001, 30000};
+    for (int s = 0; s < 3; s++) {
+        BAMDuplicateMarker::LongPairs longPairs;
+        std::vector<TestRead> marked;
+        GenomeLocation begin = 0;
+        for (GenomeLocation split = partitionSizes[s]; begin < end; split += partitionSizes[s]) {
+            markPartition(&longPairs, begin, __min(split, end), &marked);
+            begin = split;
+        }
+        ASSERT_EQ(expected.size(), marked.size());
+        for (size_t i = 0; i < marked.size(); i++) {
+            ASSERT(expected[i].data == marked[i].data);
+        }
+    }
+}
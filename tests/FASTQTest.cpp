@@ -0,0 +1,138 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "FASTQ.h"
+#include "Util.h"
+
+TEST("the line scanner finds the same newlines as strnchr") {
+    //
+    // Mostly short lines, some long ones and a few NULs, looked for from every place and with lengths that end in all
+    // sorts of places.
+    //
+    const int bufferSize = 100000;
+    char *buffer = new char[bufferSize];
+    _uint64 random = 12345;
+    for (int i = 0; i < bufferSize; i++) {
+        random = random * 6364136223846793005 + 1442695040888963407;
+        unsigned r = (unsigned)(random >> 33);
+        if (i > bufferSize / 2 && i < bufferSize / 2 + 5000) {
+            buffer[i] = 'A';
+        } else if (0 == r % 50000) {
+            buffer[i] = '\0';
+        } else if (0 == r % 23) {
+            buffer[i] = '\n';
+        } else {
+            buffer[i] = "ACGT@+!~"[r % 8];
+        }
+    }
+
+    FASTQLineScanner scanner;
+    for (int start = 0; start < bufferSize; start += 1 + start % 7) {
+        size_t maxLen = (start * 31) % 2000 + (start % 3 == 0 ? bufferSize - start : 0);
+        maxLen = __min(maxLen, (size_t)(bufferSize - start));
+        ASSERT_EQ(util::strnchr(buffer + start, '\n', maxLen), scanner.findNewline(buffer + start, maxLen));
+    }
+
+    //
+    // And backing up.
+    //
+    for (int start = 1000; start >= 0; start -= 13) {
+        ASSERT_EQ(util::strnchr(buffer + start, '\n', 500), scanner.findNewline(buffer + start, 500));
+    }
+
+    delete[] buffer;
+}
+
+TEST("reads are upcased with dots turned into Ns") {
+    const char *bases = "ACGTacgtNn.ACGTACGTACGTACGTACGTAAcc.";
+    const char *expected = "ACGTACGTNNNACGTACGTACGTACGTACGTAACCN";
+    unsigned length = (unsigned)strlen(bases);
+    char quality[100];
+    memset(quality, 'I', sizeof(quality));
+
+    Read read;
+    for (unsigned prefix = 0; prefix <= length; prefix++) {
+        read.init("id", 2, bases, quality, prefix);
+        ASSERT_EQ(prefix, read.getDataLength());
+        ASSERT(0 == memcmp(expected, read.getData(), prefix));
+    }
+
+    //
+    // Reads that are already upper case are used in place.
+    //
+    read.init("id", 2, expected, quality, length);
+    ASSERT(expected == read.getData());
+}
+
+TEST("a copied read keeps its own upcased data after the original is reused") {
+    //
+    // An upcased read has its data in its local buffer and its quality outside of it; a copy has to pick those apart
+    // pointer by pointer, clipped and RCed or not.
+    //
+    const char *bases = "acgtACGT.CGTacgtACGTnCGTacgtACGTA";
+    const char *quality = "IIIIIIIIIIIIIIIIIIIIIIIIIIIII####";
+    const char *upcased = "ACGTACGTNCGTACGTACGTNCGTACGTACGTA";
+    const char *otherBases = "ttttttttttttttttttttttttttttttttt";
+    const char *otherQuality = "#################################";
+    unsigned length = (unsigned)strlen(bases);
+
+    for (int rc = 0; rc < 2; rc++) {
+        for (int clipping = NoClipping; clipping <= ClipFrontAndBack; clipping++) {
+            Read original;
+            original.init("id", 2, bases, quality, length);
+            original.clip((ReadClippingType)clipping);
+            if (rc) {
+                original.becomeRC();
+            }
+
+            Read copy;
+            copy = original;
+
+            unsigned dataLength = original.getDataLength();
+            char expectedData[100], expectedQuality[100];
+            memcpy(expectedData, original.getData(), dataLength);
+            memcpy(expectedQuality, original.getQuality(), dataLength);
+
+            original.init("id", 2, otherBases, otherQuality, length);
+
+            ASSERT_EQ(dataLength, copy.getDataLength());
+            ASSERT(0 == memcmp(expectedData, copy.getData(), dataLength));
+            ASSERT(0 == memcmp(expectedQuality, copy.getQuality(), dataLength));
+            if (!rc) {
+                ASSERT(0 == memcmp(upcased, copy.getUnclippedData(), length));
+                ASSERT(quality == copy.getUnclippedQuality());
+            }
+        }
+    }
+}
+
+TEST("a read with its own memory survives its input buffer being overwritten") {
+    const char *bases = "acgtACGT.CGTacgtACGTnCGTacgtACGTA";
+    const char *quality = "##IIIIIIIIIIIIIIIIIIIIIIIIIII####";
+    const char *upcased = "ACGTACGTNCGTACGTACGTNCGTACGTACGTA";
+    unsigned length = (unsigned)strlen(bases);
+    char inputBuffer[200];
+
+    for (int upper = 0; upper < 2; upper++) {
+        memcpy(inputBuffer, "read1", 5);
+        memcpy(inputBuffer + 5, upper ? upcased : bases, length);
+        memcpy(inputBuffer + 5 + length, quality, length);
+
+        Read original;
+        original.init(inputBuffer, 5, inputBuffer + 5, inputBuffer + 5 + length, length);
+        original.clip(ClipFrontAndBack);
+
+        ReadWithOwnMemory copy;
+        copy.set(original);
+        memset(inputBuffer, 'X', sizeof(inputBuffer));
+
+        ASSERT_EQ(5u, copy.getIdLength());
+        ASSERT(0 == memcmp("read1", copy.getId(), 5));
+        ASSERT_EQ(length - 6, copy.getDataLength());
+        ASSERT(0 == memcmp(upcased + 2, copy.getData(), length - 6));
+        ASSERT(0 == memcmp(quality + 2, copy.getQuality(), length - 6));
+        ASSERT(0 == memcmp(upcased, copy.getUnclippedData(), length));
+        ASSERT(0 == memcmp(quality, copy.getUnclippedQuality(), length));
+        copy.dispose();
+    }
+}
@@ -0,0 +1,86 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Genome.h"
+
+//
+// Test fixture for the packed genome tests.  It builds a small genome the same way FASTA.cpp does, with n padding
+// between the contigs and an N run inside one of them, and saves it in both formats.
+//
+struct GenomeTest {
+    static const unsigned padding = 20;
+    Genome *genome;
+    const char *unpackedFileName;
+    const char *packedFileName;
+
+    GenomeTest() : unpackedFileName("GenomeTest.unpacked.tmp"), packedFileName("GenomeTest.packed.tmp") {
+        char paddingBuffer[padding + 1];
+        memset(paddingBuffer, 'n', padding);
+        paddingBuffer[padding] = '\0';
+
+        genome = new Genome(1000, 1000, padding);
+        genome->addData(paddingBuffer);
+        genome->startContig("chr1");
+        genome->addData("ACGTACGTTTGACCANNNNNGATTACAGATTACAGGGC");
+        genome->addData(paddingBuffer);
+        genome->startContig("chr2");
+        genome->addData("TTTTTCCCCCAAAAAGGGGGACGTN");
+        genome->addData(paddingBuffer);
+        genome->fillInContigLengths();
+        genome->sortContigsByName();
+
+        genome->saveToFile(unpackedFileName, false);
+        genome->saveToFile(packedFileName, true);
+    }
+
+    ~GenomeTest() {
+        delete genome;
+        remove(unpackedFileName);
+        remove(packedFileName);
+    }
+
+    void checkSameBases(const Genome *other) {
+        ASSERT_EQ(genome->getCountOfBases(), other->getCountOfBases());
+        ASSERT_EQ(genome->getNumContigs(), other->getNumContigs());
+
+        char decodeBuffer[200];
+        for (GenomeLocation location = 0; location < genome->getCountOfBases(); location++) {
+            for (GenomeDistance length = 1; length < 40; length += 7) {
+                const char *expected = genome->getSubstring(location, length);
+                const char *actual = other->getSubstring(location, length, decodeBuffer, 5, 5);
+                ASSERT_EQ(expected == NULL, actual == NULL);
+                if (NULL != expected) {
+                    //
+                    // The source genome was allocated bigger than it needed to be, so it only has padding after the space it reserved.
+                    //
+                    GenomeDistance lengthToCompare = __min(length + 5, genome->getCountOfBases() - location);
+                    ASSERT(0 == memcmp(expected - 5, actual - 5, lengthToCompare + 5));
+                }
+            }
+        }
+    }
+};
+
+TEST_F(GenomeTest, "packed file unpacks on load") {
+    const Genome *loaded = Genome::loadFromFile(packedFileName, padding);
+    ASSERT(NULL != loaded);
+    ASSERT(!loaded->isPacked());
+    checkSameBases(loaded);
+    delete loaded;
+}
+
+TEST_F(GenomeTest, "packed file stays packed") {
+    const Genome *loaded = Genome::loadFromFile(packedFileName, padding, 0, 0, false, true);
+    ASSERT(NULL != loaded);
+    ASSERT(loaded->isPacked());
+    checkSameBases(loaded);
+    delete loaded;
+}
+
+TEST_F(GenomeTest, "unpacked file packs on load") {
+    const Genome *loaded = Genome::loadFromFile(unpackedFileName, padding, 0, 0, false, true);
+    ASSERT(NULL != loaded);
+    ASSERT(loaded->isPacked());
+    checkSameBases(loaded);
+    delete loaded;
+}
@@ -0,0 +1,201 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "DataReader.h"
+#include "zlib.h"
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <sys/utime.h>
+#define utime _utime
+#define utimbuf _utimbuf
+#else
+#include <utime.h>
+#endif
+
+//
+// Test fixture for reading plain gzip files.  It writes a file of two gzip members that's more than one batch long
+// even when compressed, with small checkpoint spacing so that every batch has a few checkpoints in it.
+//
+struct GzipDataReaderTest {
+    static const _int64 dataSize = 8 * 1024 * 1024;
+    const char *fileName;
+    const char *indexFileName;
+    char *data;
+    _int64 oldSpacing;
+    int oldThreadCount;
+    bool oldWriteGzipIndex;
+    const char *oldGzipIndexDirectory;
+
+    GzipDataReaderTest() : fileName("GzipDataReaderTest.tmp.gz"), indexFileName("GzipDataReaderTest.tmp.gz.snapgzi") {
+        oldSpacing = DataSupplier::GzipCheckpointSpacing;
+        oldThreadCount = DataSupplier::ThreadCount;
+        oldWriteGzipIndex = DataSupplier::WriteGzipIndex;
+        oldGzipIndexDirectory = DataSupplier::GzipIndexDirectory;
+        DataSupplier::GzipCheckpointSpacing = 64 * 1024;
+        DataSupplier::ThreadCount = 4;
+        DataSupplier::WriteGzipIndex = true;
+        DataSupplier::GzipIndexDirectory = NULL;
+
+        //
+        // Random enough that it doesn't compress much, so it takes a few batches of input.
+        //
+        data = new char[dataSize];
+        _uint64 random = 12345;
+        for (_int64 i = 0; i < dataSize; i++) {
+            random = random * 6364136223846793005 + 1442695040888963407;
+            data[i] = i % 100 == 99 ? '\n' : "ACGTNacgtn+-@:/#"[(random >> 33) % 16];
+        }
+
+        remove(indexFileName);
+        writeFile(6);
+    }
+
+    void writeFile(int level) {
+        for (int member = 0; member < 2; member++) {
+            char mode[4];
+            snprintf(mode, sizeof(mode), "%cb%d", member == 0 ? 'w' : 'a', level);
+            gzFile file = gzopen(fileName, mode);
+            gzwrite(file, data + member * (dataSize / 2), (unsigned)(dataSize / 2));
+            gzclose(file);
+        }
+    }
+
+    //
+    // The whole index file, so tests can tell whether it's been rewritten.
+    //
+    char *readIndexFile(_int64 *o_size) {
+        *o_size = QueryFileSize(indexFileName);
+        char *contents = new char[*o_size];
+        FILE *indexFile = fopen(indexFileName, "rb");
+        ASSERT(NULL != indexFile);
+        ASSERT_EQ((size_t)*o_size, fread(contents, 1, *o_size, indexFile));
+        fclose(indexFile);
+        return contents;
+    }
+
+    ~GzipDataReaderTest() {
+        DataSupplier::GzipCheckpointSpacing = oldSpacing;
+        DataSupplier::ThreadCount = oldThreadCount;
+        DataSupplier::WriteGzipIndex = oldWriteGzipIndex;
+        DataSupplier::GzipIndexDirectory = oldGzipIndexDirectory;
+        delete [] data;
+        remove(fileName);
+        remove(indexFileName);
+    }
+
+    //
+    // Reads the whole file the way the FASTQ reader does and checks that it matches what was written.
+    //
+    void readAndCheck() {
+        DataReader *reader = DataSupplier::GzipDefault->getDataReader(2, 1000, 0.0);
+        ASSERT(reader->init(fileName));
+        reader->reinit(0, QueryFileSize(fileName));
+
+        _int64 bytesRead = 0;
+        while (true) {
+            char *buffer;
+            _int64 validBytes, startBytes;
+            if (reader->getData(&buffer, &validBytes, &startBytes)) {
+                ASSERT(bytesRead + startBytes <= dataSize);
+                ASSERT(0 == memcmp(data + bytesRead, buffer, startBytes));
+                bytesRead += startBytes;
+                reader->advance(startBytes);
+            } else if (reader->isEOF()) {
+                break;
+            } else {
+                reader->nextBatch();
+            }
+        }
+        ASSERT_EQ(dataSize, bytesRead);
+        delete reader;
+    }
+};
+
+TEST_F(GzipDataReaderTest, "the first read builds an index and later reads decompress in parallel from it") {
+    FILE *indexFile = fopen(indexFileName, "rb");
+    ASSERT(NULL == indexFile);
+
+    readAndCheck();
+
+    indexFile = fopen(indexFileName, "rb");
+    ASSERT(NULL != indexFile);
+    fclose(indexFile);
+
+    readAndCheck();
+}
+
+TEST_F(GzipDataReaderTest, "an index for a different file is ignored") {
+    FILE *indexFile = fopen(indexFileName, "wb");
+    ASSERT(NULL != indexFile);
+    fprintf(indexFile, "not an index");
+    fclose(indexFile);
+
+    readAndCheck();
+}
+
+TEST_F(GzipDataReaderTest, "an index for an earlier version of the file is rebuilt") {
+    //
+    // Stored blocks, so that the new version is exactly the same size as the old one.  Give it the old modification
+    // time, too, which leaves only the contents to tell them apart.
+    //
+    writeFile(0);
+    readAndCheck();
+    _int64 oldIndexSize;
+    char *oldIndex = readIndexFile(&oldIndexSize);
+    _int64 oldFileSize = QueryFileSize(fileName);
+    struct stat oldStat;
+    ASSERT(0 == stat(fileName, &oldStat));
+
+    for (_int64 i = 0; i < dataSize; i++) {
+        data[i] = data[i] == 'A' ? 'C' : data[i] == 'C' ? 'A' : data[i];
+    }
+    writeFile(0);
+    struct utimbuf times;
+    times.actime = oldStat.st_atime;
+    times.modtime = oldStat.st_mtime;
+    ASSERT(0 == utime(fileName, &times));
+    ASSERT_EQ(oldFileSize, QueryFileSize(fileName));
+
+    readAndCheck();
+    _int64 newIndexSize;
+    char *newIndex = readIndexFile(&newIndexSize);
+    ASSERT(oldIndexSize != newIndexSize || 0 != memcmp(oldIndex, newIndex, oldIndexSize));
+    delete [] oldIndex;
+    delete [] newIndex;
+
+    readAndCheck();
+}
+
+TEST_F(GzipDataReaderTest, "without WriteGzipIndex no index is written, but one that's there is used") {
+    DataSupplier::WriteGzipIndex = false;
+    readAndCheck();
+    FILE *indexFile = fopen(indexFileName, "rb");
+    ASSERT(NULL == indexFile);
+
+    DataSupplier::WriteGzipIndex = true;
+    readAndCheck();
+    _int64 indexSize;
+    char *index = readIndexFile(&indexSize);
+
+    DataSupplier::WriteGzipIndex = false;
+    readAndCheck();
+    _int64 laterIndexSize;
+    char *laterIndex = readIndexFile(&laterIndexSize);
+    ASSERT(indexSize == laterIndexSize && 0 == memcmp(index, laterIndex, indexSize));
+    delete [] index;
+    delete [] laterIndex;
+}
+
+TEST_F(GzipDataReaderTest, "the index goes in GzipIndexDirectory, and reading still works when it can't be written") {
+    DataSupplier::GzipIndexDirectory = ".";
+    readAndCheck();
+    FILE *indexFile = fopen(indexFileName, "rb");
+    ASSERT(NULL != indexFile);
+    fclose(indexFile);
+    remove(indexFileName);
+
+    DataSupplier::GzipIndexDirectory = "GzipDataReaderTest.tmp.no.such.directory";
+    readAndCheck();
+    indexFile = fopen(indexFileName, "rb");
+    ASSERT(NULL == indexFile);
+}
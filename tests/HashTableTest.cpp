@@ -0,0 +1,209 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "HashTable.h"
+#include "GenericFile.h"
+#include "GenericFile_Blob.h"
+#include "BigAlloc.h"
+
+//
+// Test fixture for the hash table tests.  It fills two tables with the same contents, one with the flat layout and
+// one with cache line buckets, at the same load factor the index builder uses and with two values per key like a
+// large index.
+//
+struct HashTableTest {
+    static const unsigned nKeys = 10000;
+    static const unsigned valueCount = 2;
+    SNAPHashTable *table;
+    SNAPHashTable *bucketedTable;
+
+    HashTableTest() {
+        table = new SNAPHashTable((_int64)(nKeys / 0.7), 4, 4, valueCount, 0xffffffff);
+        bucketedTable = new SNAPHashTable((_int64)(nKeys / 0.7), 4, 4, valueCount, 0xffffffff, true);
+        for (unsigned i = 0; i < nKeys; i++) {
+            SNAPHashTable::ValueType values[valueCount] = {i, nKeys + i};
+            table->Insert(keyFor(i), values);
+            bucketedTable->Insert(keyFor(i), values);
+        }
+    }
+
+    ~HashTableTest() {
+        delete table;
+        delete bucketedTable;
+    }
+
+    static SNAPHashTable::KeyType keyFor(unsigned i) {
+        return ((SNAPHashTable::KeyType)i + 1) * 2654435761u % 0xfffffff0;   // Not 0, which the flat table doesn't count as used
+    }
+
+    //
+    // Checks that a table has exactly the keys the constructor inserted.
+    //
+    void checkContents(SNAPHashTable *tableToCheck) {
+        for (unsigned i = 0; i < 2 * nKeys; i++) {
+            SNAPHashTable::ValueType values[valueCount];
+            if (i < nKeys) {
+                ASSERT(tableToCheck->Lookup(keyFor(i), valueCount, values));
+                ASSERT_EQ(i, values[0]);
+                ASSERT_EQ(nKeys + i, values[1]);
+            } else {
+                ASSERT(!tableToCheck->Lookup(keyFor(i), valueCount, values));
+            }
+        }
+    }
+};
+
+TEST_F(HashTableTest, "batched lookups match single lookups") {
+    //
+    // Half of the keys are in the table and half aren't, and there are more of them than fit in one batch.
+    //
+    const unsigned nLookups = 1000;
+    SNAPHashTable::KeyType keys[nLookups];
+    SNAPHashTable::ValueType *results[nLookups];
+
+    for (unsigned i = 0; i < nLookups; i++) {
+        keys[i] = (i % 2 == 0) ? keyFor(i * 7) : keyFor(nKeys + i);
+    }
+
+    SNAPHashTable *tables[2] = {table, bucketedTable};
+    for (int whichTable = 0; whichTable < 2; whichTable++) {
+        tables[whichTable]->LookupBatch(keys, nLookups, results);
+
+        for (unsigned i = 0; i < nLookups; i++) {
+            ASSERT_EQ(tables[whichTable]->GetFirstValueForKey(keys[i]), results[i]);
+            if (i % 2 == 0) {
+                ASSERT(NULL != results[i]);
+                unsigned value = 0;
+                memcpy(&value, results[i], sizeof(value));
+                ASSERT_EQ(i * 7, value);
+            } else {
+                ASSERT(NULL == results[i]);
+            }
+        }
+    }
+}
+
+TEST_F(HashTableTest, "cache line buckets hold the same contents") {
+    ASSERT(bucketedTable->UsesCacheLineBuckets());
+    ASSERT_EQ(table->GetUsedElementCount(), bucketedTable->GetUsedElementCount());
+    ASSERT(bucketedTable->GetTableSize() >= table->GetTableSize());
+    checkContents(table);
+    checkContents(bucketedTable);
+}
+
+TEST_F(HashTableTest, "cache line buckets survive save and load") {
+    const char *fileName = "HashTableTest.tmp";
+    size_t bytesWritten;
+    ASSERT(bucketedTable->saveToFile(fileName, &bytesWritten));
+
+    GenericFile *file = GenericFile::open(fileName, GenericFile::ReadOnly);
+    ASSERT(NULL != file);
+    SNAPHashTable *loadedTable = SNAPHashTable::loadFromGenericFile(file);
+    file->close();
+    delete file;
+    remove(fileName);
+
+    ASSERT(loadedTable->UsesCacheLineBuckets());
+    ASSERT_EQ(bucketedTable->GetTableSize(), loadedTable->GetTableSize());
+    checkContents(loadedTable);
+    delete loadedTable;
+}
+
+TEST_F(HashTableTest, "cache line buckets stay aligned when the index file is read into memory") {
+    //
+    // Read the file into a BigAlloc'd blob and load the table from that, which is what loading an index does when it
+    // isn't mapped.
+    //
+    const char *fileName = "HashTableTest.tmp";
+    size_t bytesWritten;
+    ASSERT(bucketedTable->saveToFile(fileName, &bytesWritten));
+
+    GenericFile *file = GenericFile::open(fileName, GenericFile::ReadOnly);
+    ASSERT(NULL != file);
+    void *blob = BigAlloc(bytesWritten);
+    ASSERT_EQ(bytesWritten, file->read(blob, bytesWritten));
+    file->close();
+    delete file;
+    remove(fileName);
+
+    GenericFile_Blob *blobFile = GenericFile_Blob::open(blob, bytesWritten);
+    SNAPHashTable *loadedTable = SNAPHashTable::loadFromBlob(blobFile);
+    ASSERT(loadedTable->BucketsAreCacheLineAligned());
+    ASSERT(bucketedTable->BucketsAreCacheLineAligned());
+    checkContents(loadedTable);
+
+    delete loadedTable;
+    blobFile->close();
+    delete blobFile;
+    BigDealloc(blob);
+}
+
+//
+// Tables big enough not to fit in cache, so that lookups are dominated by cache misses the way they are in a real index.
+// Run with "unit_tests -benchmarks HashTable"; the correctness of batched lookups is checked by HashTableTest above.
+//
+struct HashTableBenchmark {
+    static const unsigned nKeys = 4 * 1024 * 1024;
+    static const unsigned nLookups = 1024 * 1024;
+    SNAPHashTable *tables[2];
+    SNAPHashTable::KeyType *keys;
+    SNAPHashTable::ValueType **results;
+
+    HashTableBenchmark() {
+        for (int bucketed = 0; bucketed < 2; bucketed++) {
+            tables[bucketed] = new SNAPHashTable((_int64)(nKeys / 0.7), 4, 4, 2, 0xffffffff, 0 != bucketed);
+            for (unsigned i = 0; i < nKeys; i++) {
+                SNAPHashTable::ValueType values[2] = {i, i};
+                tables[bucketed]->Insert(HashTableTest::keyFor(i), values);
+            }
+        }
+
+        //
+        // Mostly keys that are there, since that's what most seed lookups find.
+        //
+        keys = new SNAPHashTable::KeyType[nLookups];
+        results = new SNAPHashTable::ValueType *[nLookups];
+        _uint64 random = 12345;
+        for (unsigned i = 0; i < nLookups; i++) {
+            random = random * 6364136223846793005 + 1442695040888963407;
+            unsigned which = (unsigned)((random >> 33) % (nKeys + nKeys / 4));
+            keys[i] = HashTableTest::keyFor(which);
+        }
+    }
+
+    ~HashTableBenchmark() {
+        delete tables[0];
+        delete tables[1];
+        delete[] keys;
+        delete[] results;
+    }
+};
+
+BENCHMARK_F(HashTableBenchmark, "flat and cache line bucket tables, single and batched lookups") {
+    _int64 nFound[2][2] = {{0, 0}, {0, 0}};
+    _int64 nanos[2][2];
+    for (int bucketed = 0; bucketed < 2; bucketed++) {
+        _int64 start = timeInNanos();
+        for (unsigned i = 0; i < nLookups; i++) {
+            results[i] = tables[bucketed]->GetFirstValueForKey(keys[i]);
+        }
+        nanos[bucketed][0] = timeInNanos() - start;
+        for (unsigned i = 0; i < nLookups; i++) {
+            nFound[bucketed][0] += (NULL != results[i]);
+        }
+
+        start = timeInNanos();
+        tables[bucketed]->LookupBatch(keys, nLookups, results);
+        nanos[bucketed][1] = timeInNanos() - start;
+        for (unsigned i = 0; i < nLookups; i++) {
+            nFound[bucketed][1] += (NULL != results[i]);
+        }
+    }
+
+    ASSERT_EQ(nFound[0][0], nFound[0][1]);
+    ASSERT_EQ(nFound[0][0], nFound[1][0]);
+    ASSERT_EQ(nFound[0][0], nFound[1][1]);
+    printf("lookups/s flat %lld (batched %lld), cache line buckets %lld (batched %lld): ",
+        (_int64)nLookups * 1000000000 / __max(nanos[0][0], (_int64)1), (_int64)nLookups * 1000000000 / __max(nanos[0][1], (_int64)1),
+        (_int64)nLookups * 1000000000 / __max(nanos[1][0], (_int64)1), (_int64)nLookups * 1000000000 / __max(nanos[1][1], (_int64)1));
+}
@@ -0,0 +1,71 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "HitListSearch.h"
+
+//
+// Builds the layout for a descending list the way the index build does, and checks every answer against a linear scan.
+//
+template<class GL> static bool
+SearchMatchesScan(const std::vector<GL>& hits)
+{
+    _int64 nHits = (_int64)hits.size();
+    std::vector<GL> samples;
+    for (_int64 i = 0; i < nHits; i += HitListSearch<GL>::SampleInterval) {
+        samples.push_back(hits[i]);
+    }
+    if ((_int64)samples.size() != HitListSearch<GL>::SampleCount(nHits)) {
+        return false;
+    }
+    std::vector<GL> layout(HitListSearch<GL>::LayoutSize(samples.size()));
+    HitListSearch<GL>::Build(&samples[0], samples.size(), &layout[0]);
+
+    std::vector<GL> locations;
+    locations.push_back(0);
+    for (_int64 i = 0; i < nHits; i++) {
+        locations.push_back(hits[i]);
+        locations.push_back(hits[i] - 1);
+        locations.push_back(hits[i] + 1);
+    }
+    for (size_t j = 0; j < locations.size(); j++) {
+        _int64 expected = 0;
+        while (expected < nHits && hits[expected] > locations[j]) {
+            expected++;
+        }
+        if (HitListSearch<GL>::FirstAtOrBelow(&hits[0], nHits, &layout[0], locations[j]) != expected) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<class GL> static std::vector<GL>
+DescendingHits(_int64 nHits, unsigned seed, GL top)
+{
+    std::vector<GL> hits;
+    GL location = top;
+    for (_int64 i = 0; i < nHits; i++) {
+        seed = seed * 1103515245 + 12345;
+        location -= 1 + (seed >> 16) % 1000;
+        hits.push_back(location);
+    }
+    return hits;
+}
+
+TEST("search layouts find the same hit as a scan") {
+    static const _int64 lengths[] = {2, 3, 15, 16, 17, 31, 32, 33, 64, 100, 255, 256, 257, 1000, 4097};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        ASSERT(SearchMatchesScan(DescendingHits<unsigned>(lengths[i], (unsigned)i, 0xfffffff0)));
+        ASSERT(SearchMatchesScan(DescendingHits<_int64>(lengths[i], (unsigned)i, (_int64)1 << 40)));
+    }
+}
+
+TEST("search layouts are complete trees") {
+    ASSERT_EQ(2, HitListSearch<unsigned>::LayoutSize(1));
+    ASSERT_EQ(4, HitListSearch<unsigned>::LayoutSize(2));
+    ASSERT_EQ(4, HitListSearch<unsigned>::LayoutSize(3));
+    ASSERT_EQ(8, HitListSearch<unsigned>::LayoutSize(4));
+    ASSERT_EQ(16, HitListSearch<unsigned>::SampleInterval);
+    ASSERT_EQ(8, HitListSearch<_int64>::SampleInterval);
+    ASSERT_EQ(3, HitListSearch<_int64>::SampleCount(17));
+}
@@ -0,0 +1,122 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "DataReader.h"
+
+#ifdef __linux__
+
+//
+// Test fixture for the io_uring readers.  The file is a few buffers long and isn't a multiple of the O_DIRECT block
+// size, so that reads end in the middle of blocks.
+//
+struct IoUringTest {
+    static const _int64 dataSize = 13 * 1024 * 1024 + 1234;
+    const char *fileName;
+    char *data;
+
+    IoUringTest() : fileName("IoUringTest.tmp") {
+        data = new char[dataSize];
+        _uint64 random = 12345;
+        for (_int64 i = 0; i < dataSize; i++) {
+            random = random * 6364136223846793005 + 1442695040888963407;
+            data[i] = i % 100 == 99 ? '\n' : "ACGTN+-@"[(random >> 33) % 8];
+        }
+
+        FILE *file = fopen(fileName, "wb");
+        fwrite(data, 1, dataSize, file);
+        fclose(file);
+    }
+
+    ~IoUringTest() {
+        delete [] data;
+        remove(fileName);
+    }
+
+    //
+    // Reads a range of the file the way the FASTQ reader does and checks that it matches what was written.
+    //
+    void readAndCheck(DataSupplier *supplier, _int64 rangeStart, _int64 rangeLength) {
+        DataReader *reader = supplier->getDataReader(2, 1000, 0.0);
+        ASSERT(reader->init(fileName));
+        reader->reinit(rangeStart, rangeLength);
+
+        _int64 bytesRead = 0;
+        while (true) {
+            char *buffer;
+            _int64 validBytes, startBytes;
+            if (reader->getData(&buffer, &validBytes, &startBytes)) {
+                ASSERT(rangeStart + bytesRead + validBytes <= dataSize);
+                ASSERT(0 == memcmp(data + rangeStart + bytesRead, buffer, validBytes));
+                bytesRead += startBytes;
+                reader->advance(startBytes);
+            } else if (reader->isEOF()) {
+                break;
+            } else {
+                reader->nextBatch();
+            }
+        }
+        ASSERT_EQ(rangeLength, bytesRead);
+        delete reader;
+    }
+
+    //
+    // Writes the data to an async file and checks that it reads back the same.
+    //
+    void writeAndReadBackAsyncFile() {
+        const char *asyncFileName = "IoUringTest.async.tmp";
+        AsyncFile *file = AsyncFile::open(asyncFileName, true);
+        ASSERT(NULL != file);
+
+        //
+        // Write the data backwards in pieces, so the offsets matter.
+        //
+        const size_t pieceSize = 1024 * 1024;
+        AsyncFile::Writer *writer = file->getWriter();
+        for (_int64 offset = (dataSize - 1) / pieceSize * pieceSize; offset >= 0; offset -= pieceSize) {
+            size_t length = (size_t)__min((_int64)pieceSize, dataSize - offset);
+            size_t bytesWritten = 0;
+            ASSERT(writer->beginWrite(data + offset, length, offset, &bytesWritten));
+            ASSERT(writer->waitForCompletion());
+            ASSERT_EQ(length, bytesWritten);
+        }
+        ASSERT(writer->close());
+        delete writer;
+
+        char *readBack = new char[dataSize + pieceSize];
+        AsyncFile::Reader *reader = file->getReader();
+        for (_int64 offset = 0; offset < dataSize; offset += pieceSize) {
+            size_t bytesRead = 0;
+            ASSERT(reader->beginRead(readBack + offset, pieceSize, offset, &bytesRead));
+            ASSERT(reader->waitForCompletion());
+            ASSERT_EQ((size_t)__min((_int64)pieceSize, dataSize - offset), bytesRead);
+        }
+        ASSERT(reader->close());
+        delete reader;
+        ASSERT(file->close());
+        delete file;
+        remove(asyncFileName);
+
+        ASSERT(0 == memcmp(data, readBack, dataSize));
+        delete [] readBack;
+    }
+};
+
+TEST_F(IoUringTest, "io_uring readers read the whole file and ranges of it") {
+    DataSupplier *suppliers[2] = {DataSupplier::IoUringBuffered, DataSupplier::IoUringDirect};
+    for (int i = 0; i < 2; i++) {
+        readAndCheck(suppliers[i], 0, dataSize);
+        readAndCheck(suppliers[i], 4096 * 3 + 17, 5 * 1024 * 1024);
+        readAndCheck(suppliers[i], 7 * 1024 * 1024 + 1, dataSize - 7 * 1024 * 1024 - 1);
+    }
+}
+
+TEST_F(IoUringTest, "async files read back what they wrote, with and without io_uring") {
+    bool oldUseIoUring = AsyncFile::UseIoUring;
+    for (int useIoUring = 0; useIoUring < 2; useIoUring++) {
+        AsyncFile::UseIoUring = 0 != useIoUring;
+        writeAndReadBackAsyncFile();
+    }
+    AsyncFile::UseIoUring = oldUseIoUring;
+}
+
+#endif // __linux__
@@ -127,3 +127,149 @@ TEST_F(LandauVishkinTest, "CIGAR strings") {
     lvc.computeEditDistance("abc", 3, "abXde", 5, 3, cigarBuf, bufLen, true);
     ASSERT_STREQ("5M", cigarBuf);
 }
+
+//
+// Read/reference pairs for comparing the plain and vectorized (SSE2 compares plus the bit-vector filter) versions
+// of LandauVishkin.  The reference
+// is random bases with runs of n like the genome padding, and the reads are copied out of it (backward for the
+// reverse direction, the way BaseAligner runs from the seed toward the start of the read) with some substitutions,
+// indels and Ns thrown in.  Some reads are at locations they didn't come from, so there are plenty of misses, too.
+//
+struct LandauVishkinVectorTest {
+    static const int genomeSize = 1 << 20;
+    static const int readLength = 150;
+    static const int nPairs = 4000;
+
+    LandauVishkin<1> lv;
+    LandauVishkin<-1> reverseLV;
+    char *genome;
+    char *reads;
+    char *qualities;
+    int *locations;
+    int *limits;
+    _uint64 randomState;
+
+    LandauVishkinVectorTest() {
+        if (NULL == lv_phredToProbability) {
+            initializeLVProbabilitiesToPhredPlus33();
+        }
+
+        randomState = 1;
+        genome = new char[genomeSize];
+        for (int i = 0; i < genomeSize; i++) {
+            genome[i] = (i < 1024 || i >= genomeSize - 1024 || random(2000) == 0) ? 'n' : "ACGT"[random(4)];
+        }
+
+        reads = new char[nPairs * (readLength + 16)];    // Slop because LandauVishkin reads the pattern 8 bytes at a time
+        qualities = new char[nPairs * readLength];
+        locations = new int[nPairs];
+        limits = new int[nPairs];
+
+        for (int i = 0; i < nPairs; i++) {
+            char *read = reads + i * (readLength + 16);
+            int source = 2048 + random(genomeSize - 4096);
+            int direction = (i % 2 == 0) ? 1 : -1;
+            int readOffset = 0;
+            int genomeOffset = 0;
+            while (readOffset < readLength) {
+                char base = genome[source + direction * genomeOffset - (direction == 1 ? 0 : 1)];
+                int change = random(1000);
+                if (change < 2) {
+                    genomeOffset++;                     // Deletion
+                } else if (change < 4) {
+                    read[readOffset++] = "ACGT"[random(4)];    // Insertion
+                } else if (change < 20) {
+                    read[readOffset++] = "ACGT"[random(4)];    // Substitution (or not)
+                    genomeOffset++;
+                } else if (change < 23) {
+                    read[readOffset++] = 'N';
+                    genomeOffset++;
+                } else {
+                    read[readOffset++] = base;
+                    genomeOffset++;
+                }
+            }
+            memset(read + readLength, 'N', 16);
+
+            for (int j = 0; j < readLength; j++) {
+                qualities[i * readLength + j] = (char)(33 + 2 + random(39));
+            }
+
+            locations[i] = (random(4) == 0) ? 2048 + random(genomeSize - 4096) : source;
+            limits[i] = random(MAX_K);
+        }
+    }
+
+    ~LandauVishkinVectorTest() {
+        delete[] genome;
+        delete[] reads;
+        delete[] qualities;
+        delete[] locations;
+        delete[] limits;
+    }
+
+    int random(int n) {
+        randomState = randomState * 6364136223846793005ull + 1442695040888963407ull;
+        return (int)((randomState >> 33) % n);
+    }
+
+    int computePair(int i, int k, double *matchProbability, int *netIndel) {
+        const char *read = reads + i * (readLength + 16);
+        if (i % 2 == 0) {
+            return lv.computeEditDistance(genome + locations[i], readLength + MAX_K, read, qualities + i * readLength, readLength, k, matchProbability, netIndel);
+        } else {
+            return reverseLV.computeEditDistance(genome + locations[i], readLength + MAX_K, read, qualities + i * readLength, readLength, k, matchProbability, netIndel);
+        }
+    }
+
+    void setVectorized(bool vectorized) {
+        lv.setUseVectorCompares(vectorized);
+        reverseLV.setUseVectorCompares(vectorized);
+        lv.setUseBitVectorFilter(vectorized);
+        reverseLV.setUseBitVectorFilter(vectorized);
+    }
+};
+
+TEST_F(LandauVishkinVectorTest, "vectorized matches plain") {
+    int nFound = 0;
+    for (int i = 0; i < nPairs; i++) {
+        double plainProbability, vectorProbability;
+        int plainNetIndel, vectorNetIndel;
+
+        setVectorized(false);
+        int plainScore = computePair(i, limits[i], &plainProbability, &plainNetIndel);
+        setVectorized(true);
+        int vectorScore = computePair(i, limits[i], &vectorProbability, &vectorNetIndel);
+
+        ASSERT_EQ(plainScore, vectorScore);
+        if (-1 != plainScore) {
+            nFound++;
+            ASSERT_EQ(plainNetIndel, vectorNetIndel);
+            ASSERT_EQ(plainProbability, vectorProbability);
+        }
+    }
+    ASSERT(nFound > nPairs / 4);    // Make sure we tested something other than misses
+}
+
+TEST_F(LandauVishkinVectorTest, "benchmark") {
+    const int nRounds = 100;
+    const int k = 14;   // The aligner's default maxDist
+    _int64 totalScore[2] = {0, 0};
+    _int64 nanos[2];
+    for (int vectorized = 0; vectorized < 2; vectorized++) {
+        setVectorized(0 != vectorized);
+        _int64 start = timeInNanos();
+        for (int round = 0; round < nRounds; round++) {
+            for (int i = 0; i < nPairs; i++) {
+                double matchProbability;
+                int netIndel;
+                totalScore[vectorized] += computePair(i, k, &matchProbability, &netIndel);
+            }
+        }
+        nanos[vectorized] = timeInNanos() - start;
+    }
+
+    ASSERT_EQ(totalScore[0], totalScore[1]);
+    printf("%lld ns/pair plain, %lld ns/pair vectorized%s: ", nanos[0] / (nRounds * nPairs), nanos[1] / (nRounds * nPairs),
+        lv.getUseVectorCompares() ? "" : " (no SSE2 compares)");
+}
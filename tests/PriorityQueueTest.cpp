@@ -0,0 +1,72 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "PriorityQueue.h"
+
+typedef std::pair<_int64, int> KeyAndSource;
+
+static bool CompareKeys(const KeyAndSource& a, const KeyAndSource& b)
+{
+    return a.first < b.first;
+}
+
+//
+// Merges sorted runs of random keys with lots of ties, some of them empty, and checks that the result is what a
+// stable sort of everything gives, i.e., that ties come out in source order.
+//
+static void MergeAndCheck(int nSources, int maxRunLength, _uint64 seed)
+{
+    _uint64 random = seed;
+    VariableSizeVector<_int64>* runs = new VariableSizeVector<_int64>[nSources];
+    std::vector<KeyAndSource> expected;
+    for (int s = 0; s < nSources; s++) {
+        random = random * 6364136223846793005 + 1442695040888963407;
+        int runLength = (int)((random >> 33) % (maxRunLength + 1));
+        _int64 key = 0;
+        for (int i = 0; i < runLength; i++) {
+            random = random * 6364136223846793005 + 1442695040888963407;
+            key += (random >> 33) % 3;
+            runs[s].push_back(key);
+            expected.push_back(KeyAndSource(key, s));
+        }
+    }
+    std::stable_sort(expected.begin(), expected.end(), CompareKeys);
+
+    LoserTree<_int64> tree(nSources);
+    int* next = new int[nSources];
+    for (int s = 0; s < nSources; s++) {
+        next[s] = 0;
+        if (runs[s].size() > 0) {
+            tree.set(s, runs[s][0]);
+        }
+    }
+    tree.build();
+
+    size_t merged = 0;
+    while (! tree.empty()) {
+        int s = tree.winner();
+        ASSERT(merged < expected.size());
+        ASSERT_EQ(expected[merged].first, tree.winnerKey());
+        ASSERT_EQ(expected[merged].second, s);
+        merged++;
+        next[s]++;
+        if (next[s] < runs[s].size()) {
+            tree.replaceWinner(runs[s][next[s]]);
+        } else {
+            tree.removeWinner();
+        }
+    }
+    ASSERT_EQ(expected.size(), merged);
+
+    delete[] next;
+    delete[] runs;
+}
+
+TEST("the loser tree merges sorted runs stably") {
+    MergeAndCheck(1, 100, 1);
+    MergeAndCheck(2, 100, 2);
+    MergeAndCheck(3, 0, 3);
+    MergeAndCheck(7, 50, 4);
+    MergeAndCheck(16, 200, 5);
+    MergeAndCheck(37, 100, 6);
+}
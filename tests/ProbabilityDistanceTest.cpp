@@ -68,3 +68,90 @@ TEST_F(ProbabilityDistanceTest, "indels") {
     dist.compute("ACGTTTACGT", "ACGTACGT", "IIIIIIII", 8, 1, 2, &prob);
     ASSERT_NEAR(pow(0.9, 8) * 0.01 * 0.2, prob);
 }
+
+
+//
+// The dynamic program the way ProbabilityDistance used to do it, in double precision over the whole matrix, to
+// check the banded single precision version against.
+//
+static double
+FullMatrixLogProbability(const char *reference, const char *read, const char *quality, int readLen, int maxStartShift, int maxShift,
+                         double snpProb, double gapOpenProb, double gapExtensionProb)
+{
+    const double noProb = -1000000.0;
+    const int width = 2 * maxShift + 3;
+    std::vector<double> d((readLen + 1) * width * 3, noProb);
+#define D(r, s, g) d[((r) * width + (s) + maxShift + 1) * 3 + (g)]
+
+    for (int s = -maxStartShift; s <= maxStartShift; s++) {
+        D(0, s, 0) = 0.0;
+    }
+
+    for (int r = 1; r <= readLen; r++) {
+        double errorProb = pow(10.0, -(quality[r-1] - 33) / 10.0);
+        double matchProb = (1.0 - errorProb) * (1.0 - snpProb);
+        for (int s = -maxShift; s <= maxShift; s++) {
+            double thisBaseProb = log(read[r-1] == reference[r-1+s] ? matchProb : 1.0 - matchProb);
+            D(r, s, 0) = __max(__max(D(r-1, s, 0), D(r-1, s, 2)), D(r-1, s, 1)) + thisBaseProb;
+            D(r, s, 1) = __max(__max(D(r-1, s+1, 0) + log(gapOpenProb), D(r-1, s+1, 2) + log(gapOpenProb)), D(r-1, s+1, 1) + log(gapExtensionProb));
+            D(r, s, 2) = __max(__max(D(r, s-1, 0) + log(gapOpenProb), D(r, s-1, 2) + log(gapExtensionProb)), D(r, s-1, 1) + log(gapOpenProb));
+        }
+    }
+
+    double best = noProb;
+    for (int s = -maxShift; s <= maxShift; s++) {
+        for (int g = 0; g < 3; g++) {
+            best = __max(best, D(readLen, s, g));
+        }
+    }
+#undef D
+    return best;
+}
+
+TEST_F(ProbabilityDistanceTest, "banded computation matches the full matrix") {
+    unsigned seed = 4321;
+    std::string genome;
+    for (int i = 0; i < 2000; i++) {
+        seed = seed * 1103515245 + 12345;
+        genome += "ACGT"[(seed >> 16) & 3];
+    }
+
+    ProbabilityDistance masonDist(0.001, 0.001, 0.5);
+    for (int trial = 0; trial < 200; trial++) {
+        seed = seed * 1103515245 + 12345;
+        int readLen = 1 + (seed >> 16) % 150;
+        int maxShift = (trial % 4 == 0) ? 0 : 1 + trial % (ProbabilityDistance::MAX_SHIFT - 1);
+        int maxStartShift = trial % (maxShift + 1);
+        int start = 50 + trial * 7;
+
+        //
+        // Make a read out of the reference with some substitutions, insertions and deletions, and quality
+        // scores all over the place.
+        //
+        std::string read, quality;
+        for (int i = start; (int)read.size() < readLen; i++) {
+            seed = seed * 1103515245 + 12345;
+            int what = (seed >> 16) % 100;
+            if (what < 3) {
+                read += "ACGT"[(seed >> 8) & 3];   // substitution
+            } else if (what < 4) {
+                read += "ACGT"[(seed >> 8) & 3];   // insertion
+                i--;
+            } else if (what < 5) {
+                continue;                          // deletion
+            } else {
+                read += genome[i];
+            }
+            quality += (char)(33 + 2 + (seed >> 4) % 39);
+        }
+
+        const double snp[2] = {0.1, 0.001}, gapOpen[2] = {0.01, 0.001}, gapExtension[2] = {0.2, 0.5};
+        ProbabilityDistance *dists[2] = {&dist, &masonDist};
+        for (int model = 0; model < 2; model++) {
+            dists[model]->compute(genome.c_str() + start, read.c_str(), quality.c_str(), readLen, maxStartShift, maxShift, &prob);
+            double expected = FullMatrixLogProbability(genome.c_str() + start, read.c_str(), quality.c_str(), readLen, maxStartShift, maxShift,
+                                                       snp[model], gapOpen[model], gapExtension[model]);
+            ASSERT(fabs(log(prob) - expected) < 1e-3 * __max(1.0, fabs(expected)));
+        }
+    }
+}
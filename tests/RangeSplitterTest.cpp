@@ -0,0 +1,322 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "RangeSplitter.h"
+
+//
+// Test fixture for the range splitter tests.  It keeps track of which bytes of the range have been handed out, so that
+// the tests can check that every byte gets handed out exactly once no matter who takes it.
+//
+struct RangeSplitterTest {
+    static const _int64 rangeBegin = 1000;
+    static const _int64 rangeEnd = 1000000;
+    static const int nThreads = 4;
+    static const unsigned minRangeSize = 1000;
+    RangeSplitter *splitter;
+    unsigned char *timesHandedOut;
+
+    RangeSplitterTest() {
+        splitter = new RangeSplitter(rangeEnd, nThreads, rangeBegin, minRangeSize);
+        timesHandedOut = new unsigned char[rangeEnd];
+        memset(timesHandedOut, 0, rangeEnd);
+    }
+
+    ~RangeSplitterTest() {
+        delete splitter;
+        delete [] timesHandedOut;
+    }
+
+    void recordRange(_int64 rangeStart, _int64 rangeLength) {
+        for (_int64 i = rangeStart; i < rangeStart + rangeLength; i++) {
+            timesHandedOut[i]++;
+        }
+    }
+
+    void checkAllHandedOutOnce() {
+        for (_int64 i = 0; i < rangeEnd; i++) {
+            ASSERT_EQ(i < rangeBegin ? 0 : 1, (int)timesHandedOut[i]);
+        }
+    }
+};
+
+TEST_F(RangeSplitterTest, "each worker runs its own share in order when nobody steals") {
+    int workers[nThreads];
+    for (int i = 0; i < nThreads; i++) {
+        workers[i] = splitter->registerWorker();
+        ASSERT_EQ(i, workers[i]);
+    }
+
+    //
+    // Take turns, so everyone runs out at about the same time.  Only the last few ranges should be stolen.
+    //
+    _int64 lastRangeEnd[nThreads];
+    int nStolen = 0;
+    bool anyLeft = true;
+    for (int i = 0; i < nThreads; i++) {
+        lastRangeEnd[i] = -1;
+    }
+
+    while (anyLeft) {
+        anyLeft = false;
+        for (int i = 0; i < nThreads; i++) {
+            _int64 rangeStart, rangeLength;
+            bool stolen;
+            if (splitter->getNextRange(workers[i], &rangeStart, &rangeLength, &stolen)) {
+                anyLeft = true;
+                ASSERT(rangeLength >= minRangeSize);
+                recordRange(rangeStart, rangeLength);
+                if (stolen) {
+                    nStolen++;
+                } else {
+                    ASSERT(-1 == lastRangeEnd[i] || lastRangeEnd[i] == rangeStart);
+                    lastRangeEnd[i] = rangeStart + rangeLength;
+                }
+            }
+        }
+    }
+
+    ASSERT(nStolen < nThreads);
+    checkAllHandedOutOnce();
+}
+
+TEST_F(RangeSplitterTest, "an idle worker steals everything from a stalled one") {
+    int slowWorker = splitter->registerWorker();
+    int fastWorker = splitter->registerWorker();
+
+    _int64 rangeStart, rangeLength;
+    bool stolen;
+    ASSERT(splitter->getNextRange(slowWorker, &rangeStart, &rangeLength, &stolen));
+    ASSERT(!stolen);
+    recordRange(rangeStart, rangeLength);
+
+    //
+    // The fast worker drains its own queue, then the queues of the two workers that never showed up and then the rest
+    // of the slow worker's.
+    //
+    int nStolen = 0;
+    while (splitter->getNextRange(fastWorker, &rangeStart, &rangeLength, &stolen)) {
+        ASSERT(rangeLength >= minRangeSize);
+        recordRange(rangeStart, rangeLength);
+        nStolen += stolen ? 1 : 0;
+    }
+
+    ASSERT(nStolen >= nThreads - 1);
+    ASSERT(!splitter->getNextRange(slowWorker, &rangeStart, &rangeLength, &stolen));
+    checkAllHandedOutOnce();
+}
+
+TEST("a single thread gets the whole range at once") {
+    RangeSplitter splitter(5000000, 1, 100);
+    int worker = splitter.registerWorker();
+    _int64 rangeStart, rangeLength;
+    ASSERT(splitter.getNextRange(worker, &rangeStart, &rangeLength));
+    ASSERT_EQ(100, rangeStart);
+    ASSERT_EQ(5000000 - 100, rangeLength);
+    ASSERT(!splitter.getNextRange(worker, &rangeStart, &rangeLength));
+}
+
+TEST("no chunk is smaller than the minimum range size unless the whole range is") {
+    //
+    // A range that doesn't divide evenly into chunks, and one that's smaller than a single chunk.
+    //
+    const _int64 rangeSizes[2] = {1234567, 500};
+    for (int whichSize = 0; whichSize < 2; whichSize++) {
+        RangeSplitter splitter(rangeSizes[whichSize], 8, 0, 1000);
+        int worker = splitter.registerWorker();
+        _int64 rangeStart, rangeLength;
+        _int64 nextRangeStart = 0;
+        while (splitter.getNextRange(worker, &rangeStart, &rangeLength)) {
+            ASSERT(rangeLength >= 1000 || (0 == rangeStart && rangeSizes[whichSize] == rangeLength));
+            nextRangeStart = __max(nextRangeStart, rangeStart + rangeLength);
+        }
+        ASSERT_EQ(rangeSizes[whichSize], nextRangeStart);
+    }
+}
+
+TEST("every read of a FASTQ file split into many ranges is read exactly once") {
+    //
+    // Reads with lower case bases, 'n' and '.' in them, so that finding where a record starts in the middle of the
+    // file has to recognize those as bases too.
+    //
+    const char *fileName = "RangeSplitterTest.tmp.fq";
+    const int nReads = 20000;
+    const int nThreads = 4;
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    _uint64 random = 12345;
+    for (int i = 0; i < nReads; i++) {
+        char bases[101];
+        for (int j = 0; j < 100; j++) {
+            random = random * 6364136223846793005 + 1442695040888963407;
+            bases[j] = "ACGTACGTACGTacgtNn."[(random >> 33) % 19];
+        }
+        bases[100] = '\0';
+        fprintf(file, "@r%d\n%s\n+\n%s\n", i, bases, "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII");
+    }
+    fclose(file);
+
+    ReaderContext context;
+    memset(&context, 0, sizeof(context));
+    context.defaultReadGroup = "";
+    context.clipping = NoClipping;
+
+    RangeSplittingReadSupplierGenerator generator(fileName, false, nThreads, context);
+    ReadSupplier *suppliers[nThreads];
+    for (int i = 0; i < nThreads; i++) {
+        suppliers[i] = generator.generateNewReadSupplier();
+        ASSERT(NULL != suppliers[i]);
+    }
+
+    unsigned char *timesRead = new unsigned char[nReads];
+    memset(timesRead, 0, nReads);
+    bool anyLeft = true;
+    while (anyLeft) {
+        anyLeft = false;
+        for (int i = 0; i < nThreads; i++) {
+            Read *read = suppliers[i]->getNextRead();
+            if (NULL != read) {
+                anyLeft = true;
+                int readNumber = atoi(read->getId() + 1);
+                ASSERT(readNumber >= 0 && readNumber < nReads);
+                timesRead[readNumber]++;
+            }
+        }
+    }
+
+    for (int i = 0; i < nReads; i++) {
+        ASSERT_EQ(1, (int)timesRead[i]);
+    }
+
+    delete [] timesRead;
+    for (int i = 0; i < nThreads; i++) {
+        delete suppliers[i];
+    }
+    remove(fileName);
+}
+
+TEST("every pair of an interleaved FASTQ file split into many ranges is read exactly once") {
+    const char *fileName = "RangeSplitterTest.tmp.interleaved.fq";
+    const int nPairs = 20000;
+    const int nThreads = 4;
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    _uint64 random = 54321;
+    for (int i = 0; i < nPairs; i++) {
+        for (int whichRead = 1; whichRead <= 2; whichRead++) {
+            char bases[101];
+            for (int j = 0; j < 100; j++) {
+                random = random * 6364136223846793005 + 1442695040888963407;
+                bases[j] = "ACGTN"[(random >> 33) % 5];
+            }
+            bases[100] = '\0';
+            fprintf(file, "@r%d/%d\n%s\n+\n%s\n", i, whichRead, bases, "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII");
+        }
+    }
+    fclose(file);
+
+    ReaderContext context;
+    memset(&context, 0, sizeof(context));
+    context.defaultReadGroup = "";
+    context.clipping = NoClipping;
+
+    RangeSplittingPairedReadSupplierGenerator generator(fileName, NULL, InterleavedFASTQFile, nThreads, false, context);
+    PairedReadSupplier *suppliers[nThreads];
+    for (int i = 0; i < nThreads; i++) {
+        suppliers[i] = generator.generateNewPairedReadSupplier();
+        ASSERT(NULL != suppliers[i]);
+    }
+
+    unsigned char *timesRead = new unsigned char[nPairs];
+    memset(timesRead, 0, nPairs);
+    bool anyLeft = true;
+    while (anyLeft) {
+        anyLeft = false;
+        for (int i = 0; i < nThreads; i++) {
+            Read *read1, *read2;
+            if (suppliers[i]->getNextReadPair(&read1, &read2)) {
+                anyLeft = true;
+                int pairNumber = atoi(read1->getId() + 1);
+                ASSERT(pairNumber >= 0 && pairNumber < nPairs);
+                ASSERT_EQ(pairNumber, atoi(read2->getId() + 1));
+                timesRead[pairNumber]++;
+            }
+        }
+    }
+
+    for (int i = 0; i < nPairs; i++) {
+        ASSERT_EQ(1, (int)timesRead[i]);
+    }
+
+    delete [] timesRead;
+    for (int i = 0; i < nThreads; i++) {
+        delete suppliers[i];
+    }
+    remove(fileName);
+}
+
+TEST("reads handed out together stay intact until the next call, even across buffers") {
+    const char *fileName = "RangeSplitterTest.tmp.window.fq";
+    const int nReads = 20000;
+    const int nThreads = 2;
+    const unsigned windowSize = 16;
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    char (*allBases)[101] = new char[nReads][101];
+    _uint64 random = 24680;
+    for (int i = 0; i < nReads; i++) {
+        for (int j = 0; j < 100; j++) {
+            random = random * 6364136223846793005 + 1442695040888963407;
+            allBases[i][j] = "ACGT"[(random >> 33) % 4];
+        }
+        allBases[i][100] = '\0';
+        fprintf(file, "@r%d\n%s\n+\n%s\n", i, allBases[i], "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII");
+    }
+    fclose(file);
+
+    ReaderContext context;
+    memset(&context, 0, sizeof(context));
+    context.defaultReadGroup = "";
+    context.clipping = NoClipping;
+
+    RangeSplittingReadSupplierGenerator generator(fileName, false, nThreads, context);
+    ReadSupplier *suppliers[nThreads];
+    for (int i = 0; i < nThreads; i++) {
+        suppliers[i] = generator.generateNewReadSupplier();
+        ASSERT(NULL != suppliers[i]);
+    }
+
+    //
+    // Check every read of a window only once the whole window has been handed out, so that one that got overwritten
+    // or freed when a later read in the window came from a new buffer would show up.
+    //
+    unsigned char *timesRead = new unsigned char[nReads];
+    memset(timesRead, 0, nReads);
+    bool anyLeft = true;
+    while (anyLeft) {
+        anyLeft = false;
+        for (int i = 0; i < nThreads; i++) {
+            Read *reads[windowSize];
+            unsigned nReadsInWindow = suppliers[i]->getNextReads(reads, windowSize);
+            ASSERT(nReadsInWindow <= windowSize);
+            for (unsigned whichRead = 0; whichRead < nReadsInWindow; whichRead++) {
+                anyLeft = true;
+                int readNumber = atoi(reads[whichRead]->getId() + 1);
+                ASSERT(readNumber >= 0 && readNumber < nReads);
+                ASSERT_EQ(100, (int)reads[whichRead]->getDataLength());
+                ASSERT(0 == memcmp(allBases[readNumber], reads[whichRead]->getData(), 100));
+                timesRead[readNumber]++;
+            }
+        }
+    }
+
+    for (int i = 0; i < nReads; i++) {
+        ASSERT_EQ(1, (int)timesRead[i]);
+    }
+
+    delete [] timesRead;
+    delete [] allBases;
+    for (int i = 0; i < nThreads; i++) {
+        delete suppliers[i];
+    }
+    remove(fileName);
+}
@@ -0,0 +1,278 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Genome.h"
+#include "Bam.h"
+#include "RefCompressed.h"
+#include "MD5.h"
+
+//
+// Test fixture with a two contig genome of pseudo-random bases, and BAM data built up in a buffer.
+//
+struct RefCompressedTest {
+    static const int contigLength = 20000;
+    static const int padding = 100;
+    Genome *genome;
+    std::string contigs[2];
+    std::vector<char> data;
+
+    RefCompressedTest() {
+        unsigned seed = 12345;
+        for (int c = 0; c < 2; c++) {
+            for (int i = 0; i < contigLength; i++) {
+                seed = seed * 1103515245 + 12345;
+                contigs[c] += "ACGT"[(seed >> 16) & 3];
+            }
+        }
+        genome = makeGenome(contigs, 2);
+    }
+
+    ~RefCompressedTest() {
+        delete genome;
+    }
+
+    // padded between contigs as a genome built from a FASTA file is
+    static Genome *makeGenome(const std::string *bases, int nContigs) {
+        std::string pad(padding, 'n');
+        Genome *result = new Genome(nContigs * (contigLength + padding) + padding, nContigs * (contigLength + padding) + padding, padding);
+        for (int c = 0; c < nContigs; c++) {
+            result->addData(pad.c_str());
+            result->startContig(c == 0 ? "chr1" : "chr2");
+            result->addData(bases[c].c_str());
+        }
+        result->addData(pad.c_str());
+        result->fillInContigLengths();
+        return result;
+    }
+
+    void addHeader() {
+        const char *text = "@HD\tVN:1.4\tSO:coordinate\n@SQ\tSN:chr1\tLN:20000\n@SQ\tSN:chr2\tLN:20000\n";
+        int l_text = (int)strlen(text);
+        _uint32 magic = BAMHeader::BAM_MAGIC;
+        append(&magic, 4);
+        append(&l_text, 4);
+        append(text, l_text);
+        int n_ref = 2;
+        append(&n_ref, 4);
+        for (int c = 0; c < 2; c++) {
+            int l_name = 5, l_ref = contigLength;
+            append(&l_name, 4);
+            append(c == 0 ? "chr1" : "chr2", l_name);
+            append(&l_ref, 4);
+        }
+    }
+
+    // cigar is like "5S20M2I10M", with '=' and 'X' ops as well
+    void addRead(const char *name, int refID, int pos, const char *cigar, std::string seq, const char *aux = "") {
+        std::vector<_uint32> ops;
+        for (const char *p = cigar; *p != '\0'; ) {
+            int count = (int)strtol(p, (char **)&p, 10);
+            ops.push_back((count << 4) | BAMAlignment::CigarToCode[(_uint8)*p++]);
+        }
+        int l_read_name = (int)strlen(name) + 1, l_seq = (int)seq.size(), l_aux = (int)strlen(aux);
+        size_t offset = data.size();
+        data.resize(offset + BAMAlignment::size(l_read_name, (unsigned)ops.size(), l_seq, l_aux));
+        BAMAlignment *bam = (BAMAlignment *)&data[offset];
+        bam->block_size = (_int32)(data.size() - offset) - 4;
+        bam->refID = refID;
+        bam->pos = pos;
+        bam->l_read_name = (_uint8)l_read_name;
+        bam->MAPQ = 60;
+        bam->n_cigar_op = (_uint16)ops.size();
+        bam->FLAG = refID < 0 ? SAM_UNMAPPED : 0;
+        bam->l_seq = l_seq;
+        bam->next_refID = -1;
+        bam->next_pos = -1;
+        bam->tlen = 0;
+        strcpy(bam->read_name(), name);
+        if (ops.size() > 0) {
+            memcpy(bam->cigar(), &ops[0], ops.size() * sizeof(_uint32));
+        }
+        bam->bin = refID < 0 ? 4680 : BAMAlignment::reg2bin(pos, pos + bam->l_ref());
+        BAMAlignment::encodeSeq(bam->seq(), (char *)seq.c_str(), l_seq);
+        memset(bam->qual(), 30, l_seq);
+        memcpy(bam->firstAux(), aux, l_aux);
+    }
+
+    void append(const void *bytes, size_t count) {
+        data.insert(data.end(), (const char *)bytes, (const char *)bytes + count);
+    }
+
+    std::vector<char> encode(RefCompressedCodec *codec) {
+        std::vector<char> encoded(data.size() + 1024 * 1024);
+        size_t used = codec->encode(&data[0], data.size(), &encoded[0], encoded.size());
+        encoded.resize(used);
+        return encoded;
+    }
+
+    // decodes every container, or returns false
+    static bool decode(RefCompressedCodec *codec, std::vector<char> &encoded, std::vector<char> *o_decoded) {
+        o_decoded->clear();
+        size_t offset = 0;
+        while (offset < encoded.size()) {
+            size_t bytes = RefCompressedCodec::validate(&encoded[offset], encoded.size() - offset);
+            if (bytes == 0 || offset + bytes > encoded.size()) {
+                return false;
+            }
+            const RefCompressedContainer *container = (const RefCompressedContainer *)&encoded[offset];
+            std::vector<char> decoded(container->decodedBytes + 1);
+            if (! codec->decode(container, &decoded[0], container->decodedBytes)) {
+                return false;
+            }
+            o_decoded->insert(o_decoded->end(), decoded.begin(), decoded.begin() + container->decodedBytes);
+            offset += bytes;
+        }
+        return true;
+    }
+};
+
+TEST_F(RefCompressedTest, "aligned and unaligned records round trip") {
+    addHeader();
+    addRead("exact", 0, 100, "50M", contigs[0].substr(100, 50));
+    std::string mismatches = contigs[0].substr(1000, 51);
+    mismatches[0] = mismatches[0] == 'A' ? 'C' : 'A';
+    mismatches[17] = 'N';
+    mismatches[50] = mismatches[50] == 'G' ? 'T' : 'G';
+    addRead("mismatches", 0, 1000, "51M", mismatches, "NMC\x03");
+    addRead("indels", 1, 500, "3S10M2I10=1D5X", "GGG" + contigs[1].substr(500, 10) + "TT" + contigs[1].substr(510, 10) + contigs[1].substr(521, 5));
+    addRead("spliced", 1, 2000, "20M500N20M", contigs[1].substr(2000, 20) + contigs[1].substr(2520, 20));
+    addRead("end", 1, contigLength - 30, "30M", contigs[1].substr(contigLength - 30));
+    addRead("offend", 1, contigLength - 10, "30M", std::string(30, 'C'));
+    addRead("wronglength", 0, 300, "40M", contigs[0].substr(300, 35));
+    addRead("unmapped", -1, -1, "", "ACGTNACGTNACGTNACGTNA");
+    // bases that aren't ACGTN, and a bin that isn't the usual one
+    addRead("odd", 0, 5000, "7M", "RYKMSWB");
+    ((BAMAlignment *)&data[data.size() - BAMAlignment::size(4, 1, 7, 0)])->bin = 1234;
+
+    RefCompressedCodec codec(genome);
+    std::vector<char> encoded = encode(&codec);
+    ASSERT(encoded.size() > 0);
+
+    RefCompressedCodec decoder(genome);
+    std::vector<char> decoded;
+    ASSERT(decode(&decoder, encoded, &decoded));
+    ASSERT(decoded == data);
+}
+
+TEST_F(RefCompressedTest, "bases matching the reference take almost no space") {
+    for (int i = 0; i < 2000; i++) {
+        char name[20];
+        sprintf(name, "read%d", i);
+        int pos = (i * 37) % (contigLength - 100);
+        addRead(name, 0, pos, "100M", contigs[0].substr(pos, 100));
+    }
+    RefCompressedCodec codec(genome);
+    std::vector<char> encoded = encode(&codec);
+    // the sequence is a third of each record
+    ASSERT(encoded.size() > 0 && encoded.size() < data.size() / 10);
+
+    std::vector<char> decoded;
+    ASSERT(decode(&codec, encoded, &decoded));
+    ASSERT(decoded == data);
+}
+
+TEST_F(RefCompressedTest, "big batches are split into containers") {
+    addHeader();
+    size_t headerBytes = data.size();
+    for (int i = 0; data.size() < 3 * RefCompressedCodec::ContainerBytes; i++) {
+        int pos = (i * 101) % (contigLength - 200);
+        addRead("r", i & 1, pos, "150M", contigs[i & 1].substr(pos, 150));
+    }
+    RefCompressedCodec codec(genome);
+    std::vector<char> encoded = encode(&codec);
+    size_t end = encoded.size();
+    encoded.resize(end + sizeof(RefCompressedContainer));
+    ASSERT_EQ(sizeof(RefCompressedContainer), RefCompressedCodec::encodeEnd(&encoded[end], sizeof(RefCompressedContainer)));
+
+    int containers = 0;
+    for (size_t offset = 0; offset < encoded.size(); containers++) {
+        const RefCompressedContainer *container = (const RefCompressedContainer *)&encoded[offset];
+        ASSERT(container->decodedBytes <= RefCompressedCodec::ContainerBytes);
+        if (containers == 0) {
+            ASSERT_EQ(0u, container->records);
+            ASSERT_EQ(headerBytes, (size_t)container->decodedBytes);
+        }
+        offset += RefCompressedCodec::validate(&encoded[offset], encoded.size() - offset);
+        ASSERT_EQ(offset == encoded.size(), container->isEnd());
+    }
+    ASSERT(containers >= 5);
+
+    std::vector<char> decoded;
+    ASSERT(decode(&codec, encoded, &decoded));
+    ASSERT(decoded == data);
+}
+
+TEST_F(RefCompressedTest, "other genomes and corruption are caught") {
+    addRead("exact", 0, 100, "50M", contigs[0].substr(100, 50));
+    RefCompressedCodec codec(genome);
+    std::vector<char> encoded = encode(&codec);
+
+    Genome *other = makeGenome(contigs, 1);
+    RefCompressedCodec otherCodec(other);
+    std::vector<char> decoded;
+    ASSERT(! decode(&otherCodec, encoded, &decoded));
+    delete other;
+
+    // same contig names and lengths, but one base differs, far from the read
+    std::string changed[2] = {contigs[0], contigs[1]};
+    changed[1][12345] = changed[1][12345] == 'A' ? 'C' : 'A';
+    other = makeGenome(changed, 2);
+    RefCompressedCodec changedCodec(other);
+    ASSERT(! decode(&changedCodec, encoded, &decoded));
+    delete other;
+
+    // make the quality column something that doesn't match its CRC
+    const RefCompressedContainer *container = (const RefCompressedContainer *)&encoded[0];
+    ASSERT(container->columnBytes[RefCompressedContainer::QualitiesColumn] < container->columnRawBytes[RefCompressedContainer::QualitiesColumn]);
+    size_t qualities = sizeof(RefCompressedContainer);
+    for (int i = 0; i < RefCompressedContainer::QualitiesColumn; i++) {
+        qualities += container->columnBytes[i];
+    }
+    encoded[qualities + container->columnBytes[RefCompressedContainer::QualitiesColumn] - 6] ^= 0x55;
+    ASSERT(! decode(&codec, encoded, &decoded));
+
+    encoded[0] = 'X';
+    ASSERT_EQ(0u, RefCompressedCodec::validate(&encoded[0], encoded.size()));
+}
+
+TEST_F(RefCompressedTest, "data that isn't records is kept as is") {
+    for (int i = 0; i < 100000; i++) {
+        data.push_back((char)(i * 7919 >> 3));
+    }
+    RefCompressedCodec codec(genome);
+    std::vector<char> encoded = encode(&codec);
+    std::vector<char> decoded;
+    ASSERT(decode(&codec, encoded, &decoded));
+    ASSERT(decoded == data);
+}
+
+TEST("MD5 digests match RFC 1321's examples however the data is split up") {
+    const char *inputs[] = {"", "abc", "message digest",
+        "12345678901234567890123456789012345678901234567890123456789012345678901234567890"};
+    const char *expected[] = {"d41d8cd98f00b204e9800998ecf8427e", "900150983cd24fb0d6963f7d28e17f72",
+        "f96b697d7cb7938d525a2f31aaf161d0", "57edf4a22be3c955ac49da2e2107b67a"};
+    for (int i = 0; i < 4; i++) {
+        size_t length = strlen(inputs[i]);
+        for (size_t split = 0; split <= length; split += 7) {
+            MD5 md5;
+            md5.update(inputs[i], split);
+            md5.update(inputs[i] + split, length - split);
+            _uint8 digest[MD5::DigestBytes];
+            md5.final(digest);
+            char hex[2 * MD5::DigestBytes + 1];
+            MD5::toHex(digest, hex);
+            ASSERT(0 == strcmp(expected[i], hex));
+        }
+    }
+}
+
+TEST_F(RefCompressedTest, "a contig's MD5 is the MD5 of its bases") {
+    for (int c = 0; c < 2; c++) {
+        _uint8 digest[MD5::DigestBytes], expected[MD5::DigestBytes];
+        RefCompressedCodec::ContigMD5(genome, c, digest);
+        MD5 md5;
+        md5.update(contigs[c].c_str(), contigs[c].size());
+        md5.final(expected);
+        ASSERT(0 == memcmp(expected, digest, MD5::DigestBytes));
+    }
+}
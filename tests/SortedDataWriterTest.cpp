@@ -0,0 +1,116 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Genome.h"
+#include "FileFormat.h"
+#include "DataWriter.h"
+
+//
+// Test fixture for sorting SAM output.  Reads go to a one contig genome at only a few thousand different positions,
+// so lots of them tie, and they're written in several blocks the way an aligner thread's writer flushes them.
+//
+struct SortedDataWriterTest {
+    static const int contigLength = 10000;
+    static const int nBlocks = 6;
+    static const int readsPerBlock = 30000;
+    static const int nPositions = 2000;
+    Genome *genome;
+
+    struct TestRead {
+        GenomeLocation location;
+        std::string line;
+    };
+    std::vector<TestRead> reads;    // in the order they're written
+
+    static bool CompareLocations(const TestRead& a, const TestRead& b) {
+        return a.location < b.location;
+    }
+
+    SortedDataWriterTest() {
+        std::string bases(contigLength, 'A');
+        genome = new Genome(contigLength + 100, contigLength + 100, 0);
+        genome->startContig("chr1");
+        genome->addData(bases.c_str());
+        genome->fillInContigLengths();
+
+        _uint64 random = 12345;
+        for (int b = 0; b < nBlocks; b++) {
+            for (int i = 0; i < readsPerBlock; i++) {
+                random = random * 6364136223846793005 + 1442695040888963407;
+                char line[200];
+                int length = sprintf(line, "b%dr%d\t0\tchr1\t%d\t60\t10M\t*\t0\t0\tAAAAAAAAAA\tIIIIIIIIII\n", b, i, 1 + (int)((random >> 33) % nPositions));
+                TestRead read;
+                read.line = std::string(line, length);
+                GenomeDistance readBytes;
+                FileFormat::SAM[0]->getSortInfo(genome, line, length, &read.location, &readBytes);
+                ASSERT_EQ(length, readBytes);
+                reads.push_back(read);
+            }
+        }
+    }
+
+    ~SortedDataWriterTest() {
+        delete genome;
+    }
+
+    //
+    // Writes the reads through a sorted writer and checks that the sorted file has them in the order a stable sort
+    // by location gives, which is to say that reads at the same location come out in the order they were written.
+    //
+    void sortAndCheck(int numThreads, _int64 inMemoryBudget) {
+        const char *tempFileName = "SortedDataWriterTest.tmp.sam.tmp";
+        const char *sortedFileName = "SortedDataWriterTest.tmp.sam";
+        const char *header = "@HD\tVN:1.4\tSO:coordinate\n@SQ\tSN:chr1\tLN:10000\n";
+
+        DataWriterSupplier *supplier = DataWriterSupplier::sorted(FileFormat::SAM[0], genome, tempFileName, 3 * numThreads * 4 * 1024 * 1024,
+            inMemoryBudget, numThreads, false, sortedFileName, NULL);
+        DataWriter *writer = supplier->getWriter();
+        ASSERT(NULL != writer);
+
+        char *buffer;
+        size_t bytes;
+        writer->inHeader(true);
+        ASSERT(writer->getBuffer(&buffer, &bytes) && bytes >= strlen(header));
+        memcpy(buffer, header, strlen(header));
+        writer->advance(strlen(header), 0);
+        writer->nextBatch();
+        writer->inHeader(false);
+
+        for (size_t i = 0; i < reads.size(); i++) {
+            ASSERT(writer->getBuffer(&buffer, &bytes) && bytes >= reads[i].line.size());
+            memcpy(buffer, reads[i].line.data(), reads[i].line.size());
+            writer->advance(reads[i].line.size(), reads[i].location);
+            if ((i + 1) % readsPerBlock == 0) {
+                writer->nextBatch();
+            }
+        }
+        writer->close();
+        delete writer;
+        supplier->close();
+        delete supplier;
+
+        std::vector<TestRead> expected(reads);
+        std::stable_sort(expected.begin(), expected.end(), CompareLocations);
+
+        FILE *sortedFile = fopen(sortedFileName, "rb");
+        ASSERT(NULL != sortedFile);
+        char line[200];
+        ASSERT(NULL != fgets(line, sizeof(line), sortedFile) && 0 == memcmp(line, "@HD", 3));
+        ASSERT(NULL != fgets(line, sizeof(line), sortedFile) && 0 == memcmp(line, "@SQ", 3));
+        for (size_t i = 0; i < expected.size(); i++) {
+            ASSERT(NULL != fgets(line, sizeof(line), sortedFile));
+            ASSERT_EQ(expected[i].line, std::string(line));
+        }
+        ASSERT(NULL == fgets(line, sizeof(line), sortedFile));
+        fclose(sortedFile);
+        remove(sortedFileName);
+    }
+};
+
+TEST_F(SortedDataWriterTest, "ties come out in the order they were written when merging from the temp file") {
+    sortAndCheck(1, 0);
+}
+
+TEST_F(SortedDataWriterTest, "ties come out in the order they were written when merging partitions in parallel") {
+    sortAndCheck(4, 1024 * 1024 * 1024);
+}
@@ -6,7 +6,7 @@
 using namespace std;
 using namespace test;
 
-int test::runAllTests(char *filter) {
+int test::runAllTests(char *filter, bool benchmarks) {
     const std::vector<TestCase*> &testCases = TestCase::getCases();
     int tested = 0;
     int passed = 0;
@@ -14,6 +14,10 @@ int test::runAllTests(char *filter) {
 
     for (int i = 0; i < testCases.size(); i++) {
         TestCase *tc = testCases[i];
+        if (tc->benchmark != benchmarks) {
+            // Benchmarks and tests are run separately
+            continue;
+        }
         if (filter != NULL && strstr(tc->fixture, filter) == NULL && strstr(tc->name, filter) == NULL) {
             // Test name does not pass filter
             continue;
@@ -20,6 +20,9 @@
  *
  *    TEST_F(MyFixture, "description 2") { another body }
  *
+ * Timing benchmarks use BENCHMARK_F the same way.  They only run when asked for with "unit_tests -benchmarks [filter]",
+ * so that the correctness tests stay quick and their output stays free of timings.
+ *
  * In the body of a test, you can use the following macros and assertions:
  *
  *    ASSERT(expression)
@@ -44,8 +47,8 @@ struct TestCase;
 typedef void (*FunctionPtr)();
 
 struct TestCase {
-    TestCase(const char *fixture_, const char *name_, FunctionPtr func_)
-            : fixture(fixture_), name(name_), func(func_) {
+    TestCase(const char *fixture_, const char *name_, FunctionPtr func_, bool benchmark_ = false)
+            : fixture(fixture_), name(name_), func(func_), benchmark(benchmark_) {
         getCases().push_back(this);
     }
     
@@ -54,6 +57,7 @@ struct TestCase {
     const char *fixture;
     const char *name;
     FunctionPtr func;
+    bool benchmark;
 
     static std::vector<TestCase*>& getCases() {
         static std::vector<TestCase*> cases;
@@ -70,7 +74,7 @@ struct TestFailedException {
     std::string message;
 };
 
-int runAllTests(char *filter);
+int runAllTests(char *filter, bool benchmarks);
 
 }
 
@@ -91,6 +95,12 @@ int runAllTests(char *filter);
     static test::TestCase TEST_CASE(__LINE__) (#fixture, name, &TEST_FUNC(__LINE__)); \
     void TEST_CLASS(__LINE__)::_run() /* body follows */
 
+#define BENCHMARK_F(fixture, name) \
+    namespace { struct TEST_CLASS(__LINE__) : public fixture { void _run(); }; } \
+    static void TEST_FUNC(__LINE__) () { TEST_CLASS(__LINE__) cls; cls._run(); } \
+    static test::TestCase TEST_CASE(__LINE__) (#fixture, name, &TEST_FUNC(__LINE__), true); \
+    void TEST_CLASS(__LINE__)::_run() /* body follows */
+
 #define ASSERT(expr) \
     if (!(expr)) { \
         std::ostringstream oss; \
@@ -1,7 +1,11 @@
+#include <cstring>
+
 #include "TestLib.h"
 
 int main(int argc, char **argv) {
-    // Allow passing in a substring to search for in test names
-    char *filter = (argc == 2 ? argv[1] : NULL);
-    return test::runAllTests(filter);
+    // Allow asking for the benchmarks instead of the tests, and passing in a substring to search for in test names
+    bool benchmarks = (argc >= 2 && strcmp(argv[1], "-benchmarks") == 0);
+    int firstArg = benchmarks ? 2 : 1;
+    char *filter = (argc == firstArg + 1 ? argv[firstArg] : NULL);
+    return test::runAllTests(filter, benchmarks);
 }